@@ -1,18 +1,45 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "account_system.h"
+#include "change_log.h"
+#include "limits_engine.h"
+#include "shard_system.h"
 #include "sqlite3.h"
+#include "transaction_system.h"
 #include "utils_functions.h"
 
 // Display account management menu
 void display_account_menu() {
   printf("   1 Create New Account\n");
   printf("   2 View Account Details\n");
-  printf("   3 Update Customer Information\n");
-  printf("   4 Delete Account\n");
+  printf("   3 Change Account Type\n");
+  printf("   4 Close Account\n");
+  printf("   5 Close Accounts from File\n");
+  printf("   6 Change Account Types from File\n");
+}
+
+// Check whether accounts already has the closed_at column
+static int has_closed_at_column(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA table_info(accounts);", -1, &stmt,
+                         NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (strcmp((const char *)sqlite3_column_text(stmt, 1), "closed_at") == 0) {
+      found = 1;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return found;
 }
 
 // Create accounts table
@@ -24,6 +51,7 @@ int create_accounts_table(sqlite3 *db) {
         "customer_id TEXT, "
         "account_type TEXT CHECK(account_type IN ('savings', 'current')), "
         "balance REAL, "
+        "closed_at TEXT, "
         "FOREIGN KEY(customer_id) REFERENCES customers(customer_id));";
 
   // Execute sql
@@ -33,11 +61,29 @@ int create_accounts_table(sqlite3 *db) {
     return rc;
   }
 
+  // Databases created before accounts could be closed get the column
+  if (!has_closed_at_column(db)) {
+    rc = execute_sql(db, "ALTER TABLE accounts ADD COLUMN closed_at TEXT;");
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  // Customer screens and scatter queries look accounts up by customer
+  rc = execute_sql(db, "CREATE INDEX IF NOT EXISTS idx_accounts_customer "
+                       "ON accounts(customer_id);");
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
   return SQLITE_OK;
 }
 
-// Insert new accounts into table
-int insert_account(sqlite3 *db, struct Account *account) {
+// Insert a new account into the accounts table of the given schema: "main",
+// or an attached shard
+int insert_account_in(sqlite3 *db, const char *schema,
+                      struct Account *account) {
   sqlite3_stmt *stmt;
   int rc;
   // Validate account_type
@@ -48,14 +94,24 @@ int insert_account(sqlite3 *db, struct Account *account) {
   }
 
   // If user exists, execute command
-  const char *sql =
-      "INSERT INTO accounts (account_number, customer_id, account_type, "
-      "balance) VALUES (?, ?, ?, ?);";
+  char *sql = sqlite3_mprintf(
+      "INSERT INTO \"%w\".accounts (account_number, customer_id, "
+      "account_type, balance) VALUES (?, ?, ?, ?);",
+      schema);
+
+  // The account row and its opening ledger entry commit together
+  rc = execute_sql(db, "SAVEPOINT insert_account;");
+  if (rc != SQLITE_OK) {
+    sqlite3_free(sql);
+    return rc;
+  }
 
   // Prepare the SQL statement
   rc = sqlite3_prepare_v3(db, sql, -1, 0, &stmt, NULL);
+  sqlite3_free(sql);
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    execute_sql(db, "ROLLBACK TO insert_account; RELEASE insert_account;");
     return rc;
   }
 
@@ -69,15 +125,334 @@ int insert_account(sqlite3 *db, struct Account *account) {
   rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
-  } else {
+  }
+
+  // Finalize the statement
+  sqlite3_finalize(stmt);
+
+  rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+
+  if (rc == SQLITE_OK && cdc_enabled()) {
+    char balance_text[32];
+    snprintf(balance_text, sizeof(balance_text), "%.2f", account->balance);
+    const char *fields[4] = {account->account_number, account->customer_id,
+                             account->account_type, balance_text};
+    rc = cdc_stage(db, CDC_ACCOUNT_INSERT, 4, fields);
+  }
+
+  // Record the initial balance so the ledger always sums to the balance
+  if (rc == SQLITE_OK && account->balance != 0) {
+    rc = record_transaction_in(db, schema, account->account_number,
+                               account->balance, "opening");
+  }
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK TO insert_account; RELEASE insert_account;");
+    cdc_discard(db);
+    return rc;
+  }
+
+  rc = execute_sql(db, "RELEASE insert_account;");
+  if (rc == SQLITE_OK) {
+    cdc_commit(db);
     printf("Your account number is: %s", account->account_number);
     printf("Customer inserted successfully\n");
+  } else {
+    cdc_discard(db);
+  }
+
+  return rc;
+}
+
+// Insert new accounts into table
+int insert_account(sqlite3 *db, struct Account *account) {
+  return insert_account_in(db, "main", account);
+}
+
+// Print the details of an account held in the given schema. The customer's
+// name always comes from the main database.
+int get_account_details_in(sqlite3 *db, const char *schema,
+                           const char *account_number) {
+  sqlite3_stmt *stmt;
+
+  char *sql = sqlite3_mprintf(
+      "SELECT a.account_number, a.customer_id, c.name, a.account_type, "
+      "a.balance, a.closed_at FROM \"%w\".accounts a "
+      "LEFT JOIN main.customers c ON c.customer_id = a.customer_id "
+      "WHERE a.account_number = ?;",
+      schema);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    const unsigned char *name = sqlite3_column_text(stmt, 2);
+    const unsigned char *closed_at = sqlite3_column_text(stmt, 5);
+
+    printf("Account Details\n");
+    printf("---------------\n");
+    printf("Account Number: %s\n", sqlite3_column_text(stmt, 0));
+    printf("Customer ID: %s\n", sqlite3_column_text(stmt, 1));
+    printf("Customer Name: %s\n", name != NULL ? (const char *)name : "");
+    printf("Account Type: %s\n", sqlite3_column_text(stmt, 3));
+    printf("Balance: %.2f\n", sqlite3_column_double(stmt, 4));
+    if (closed_at != NULL) {
+      printf("Status: closed on %s\n", closed_at);
+    } else {
+      printf("Status: open\n");
+    }
+    printf("\n");
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    printf("Account does not exist.\n");
+    rc = SQLITE_NOTFOUND;
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
   }
 
-  // Finalize the statement
   sqlite3_finalize(stmt);
+  return rc;
+}
 
-  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+// Print an account's details
+int get_account_details(sqlite3 *db, const char *account_number) {
+  return get_account_details_in(db, "main", account_number);
+}
+
+// Run one account update for every account number inside a single
+// transaction. The statement is prepared once and rebound per account;
+// accounts it does not match are counted as skipped.
+static int run_account_batch(sqlite3 *db, const char *sql,
+                             const char *const *account_numbers, int count,
+                             const char *account_type,
+                             struct AccountBatchReport *report) {
+  sqlite3_stmt *stmt;
+  struct timespec start, end;
+
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, account_numbers[i], -1, SQLITE_STATIC);
+    if (account_type != NULL) {
+      sqlite3_bind_text(stmt, 2, account_type, -1, SQLITE_STATIC);
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+      report->changed++;
+      if (cdc_enabled()) {
+        const unsigned char *closed_at = sqlite3_column_text(stmt, 1);
+        const char *fields[3] = {
+            account_numbers[i], (const char *)sqlite3_column_text(stmt, 0),
+            closed_at != NULL ? (const char *)closed_at : ""};
+        if (cdc_stage(db, CDC_ACCOUNT_UPDATE, 3, fields) != SQLITE_OK) {
+          rc = SQLITE_ERROR;
+          break;
+        }
+      }
+      rc = sqlite3_step(stmt);
+    } else if (rc == SQLITE_DONE) {
+      report->skipped++;
+    }
+
+    if (rc != SQLITE_DONE) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    } else {
+      rc = SQLITE_OK;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    report->changed = 0;
+    report->skipped = 0;
+    return rc;
+  }
+  cdc_commit(db);
+
+  // Limits depend on the account type, and closed accounts take no debits
+  for (int i = 0; i < count; i++) {
+    limits_invalidate(account_numbers[i]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return SQLITE_OK;
+}
+
+// Close accounts with a zero balance in one transaction. Missing, already
+// closed and funded accounts are skipped.
+int close_accounts(sqlite3 *db, const char *const *account_numbers, int count,
+                   struct AccountBatchReport *report) {
+  return run_account_batch(
+      db,
+      "UPDATE accounts SET closed_at = strftime('%Y-%m-%d %H:%M:%S', 'now') "
+      "WHERE account_number = ?1 AND closed_at IS NULL "
+      "AND abs(balance) < 0.005 RETURNING account_type, closed_at;",
+      account_numbers, count, NULL, report);
+}
+
+// Change the type of open accounts in one transaction. Missing, closed and
+// already matching accounts are skipped.
+int change_account_types(sqlite3 *db, const char *const *account_numbers,
+                         int count, const char *account_type,
+                         struct AccountBatchReport *report) {
+  if (strcmp(account_type, "savings") != 0 &&
+      strcmp(account_type, "current") != 0) {
+    printf("Invalid account type. Must be 'savings' or 'current'.\n");
+    return SQLITE_MISUSE;
+  }
+
+  return run_account_batch(
+      db,
+      "UPDATE accounts SET account_type = ?2 WHERE account_number = ?1 "
+      "AND closed_at IS NULL AND account_type IS NOT ?2 "
+      "RETURNING account_type, closed_at;",
+      account_numbers, count, account_type, report);
+}
+
+// Explain why a single-account change matched nothing
+static void print_skip_reason(sqlite3 *db, const char *account_number) {
+  sqlite3_stmt *stmt;
+
+  if (sqlite3_prepare_v2(db,
+                         "SELECT closed_at, balance FROM accounts "
+                         "WHERE account_number = ?;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    printf("Account %s does not exist.\n", account_number);
+  } else if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    printf("Account %s is closed.\n", account_number);
+  } else if (fabs(sqlite3_column_double(stmt, 1)) >= 0.005) {
+    printf("Account %s still has a balance of %.2f.\n", account_number,
+           sqlite3_column_double(stmt, 1));
+  } else {
+    printf("Account %s is unchanged.\n", account_number);
+  }
+
+  sqlite3_finalize(stmt);
+}
+
+// Close an account with a zero balance
+int close_account(sqlite3 *db, const char *account_number) {
+  struct AccountBatchReport report;
+
+  int rc = close_accounts(db, &account_number, 1, &report);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (report.changed == 0) {
+    print_skip_reason(db, account_number);
+    return SQLITE_CONSTRAINT;
+  }
+
+  printf("Account %s closed successfully\n", account_number);
+  return SQLITE_OK;
+}
+
+// Change an open account's type
+int change_account_type(sqlite3 *db, const char *account_number,
+                        const char *account_type) {
+  struct AccountBatchReport report;
+
+  int rc = change_account_types(db, &account_number, 1, account_type, &report);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (report.changed == 0) {
+    print_skip_reason(db, account_number);
+    return SQLITE_CONSTRAINT;
+  }
+
+  printf("Account %s is now a %s account\n", account_number, account_type);
+  return SQLITE_OK;
+}
+
+// Read whitespace-separated account numbers from a file. The numbers point
+// into *buffer; free both when done.
+static int read_account_list(const char *path, char **buffer,
+                             const char ***account_numbers, int *count) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Can't open %s\n", path);
+    return SQLITE_CANTOPEN;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  *buffer = malloc(size + 1);
+  // A number takes at least two bytes with its separator
+  *account_numbers = malloc((size / 2 + 1) * sizeof(char *));
+  if (*buffer == NULL || *account_numbers == NULL ||
+      fread(*buffer, 1, size, file) != (size_t)size) {
+    fclose(file);
+    free(*buffer);
+    free(*account_numbers);
+    return SQLITE_NOMEM;
+  }
+  fclose(file);
+  (*buffer)[size] = '\0';
+
+  *count = 0;
+  for (char *token = strtok(*buffer, " \t\r\n,"); token != NULL;
+       token = strtok(NULL, " \t\r\n,")) {
+    (*account_numbers)[(*count)++] = token;
+  }
+
+  return SQLITE_OK;
+}
+
+// Show an account from its shard when the menus are routed to a shard set,
+// from db otherwise
+static int show_account(sqlite3 *db, const char *account_number) {
+  if (routed_shards() != NULL) {
+    return shard_get_account_details(routed_shards(), account_number);
+  }
+  return get_account_details(db, account_number);
+}
+
+static void print_batch_report(const char *action,
+                               const struct AccountBatchReport *report) {
+  printf("%s %lld account(s), skipped %lld in %.3f s\n", action,
+         (long long)report->changed, (long long)report->skipped,
+         report->seconds);
 }
 
 // Account management menu logic
@@ -120,13 +495,130 @@ void print_account_management_system(sqlite3 *db) {
 
     printf("\n");
 
-    generate_account_number(db, account.account_number);
-    insert_account(db, &account);
+    if (routed_shards() != NULL) {
+      shard_create_account(routed_shards(), &account);
+    } else {
+      generate_account_number(db, account.account_number);
+      insert_account(db, &account);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 2:
+    clear_screen();
+    printf("Account Number? ");
+    if (scanf("%10s", account.account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+
+    printf("\n");
+    show_account(db, account.account_number);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 3:
+    clear_screen();
+    printf("Account Number? ");
+    if (scanf("%10s", account.account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+
+    if (show_account(db, account.account_number) == SQLITE_OK) {
+      printf("New Account Type (savings or current)? ");
+      if (scanf("%7s", account.account_type) != 1) {
+        printf("Invalid input for Account Type.\n");
+        clear_input_buffer();
+        break;
+      }
+      clear_input_buffer();
+      if (routed_shards() != NULL) {
+        shard_change_account_type(routed_shards(), account.account_number,
+                                  account.account_type);
+      } else {
+        change_account_type(db, account.account_number,
+                            account.account_type);
+      }
+    }
     printf("Press Enter to return to main menu...");
     getchar(); // Wait for user to press Enter
     break;
   case 4:
-    exit(0);
+    clear_screen();
+    char answer[8];
+    printf("Account Number? ");
+    if (scanf("%10s", account.account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+
+    if (show_account(db, account.account_number) == SQLITE_OK) {
+      printf("Close this account (y/n)? ");
+      fgets(answer, sizeof(answer), stdin);
+      if (answer[0] == 'y' || answer[0] == 'Y') {
+        if (routed_shards() != NULL) {
+          shard_close_account(routed_shards(), account.account_number);
+        } else {
+          close_account(db, account.account_number);
+        }
+      }
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 5:
+  case 6:
+    clear_screen();
+    char path[256];
+    char *buffer;
+    const char **account_numbers;
+    int count;
+    struct AccountBatchReport report;
+
+    printf("File with one account number per line? ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+
+    if (choice == 6) {
+      printf("New Account Type (savings or current)? ");
+      if (scanf("%7s", account.account_type) != 1) {
+        printf("Invalid input for Account Type.\n");
+        clear_input_buffer();
+        break;
+      }
+      clear_input_buffer();
+    }
+
+    if (read_account_list(path, &buffer, &account_numbers, &count) ==
+        SQLITE_OK) {
+      struct ShardSet *set = routed_shards();
+      int rc;
+      if (choice == 5 && set != NULL) {
+        rc = shard_close_accounts(set, account_numbers, count, &report);
+      } else if (choice == 5) {
+        rc = close_accounts(db, account_numbers, count, &report);
+      } else if (set != NULL) {
+        rc = shard_change_account_types(set, account_numbers, count,
+                                        account.account_type, &report);
+      } else {
+        rc = change_account_types(db, account_numbers, count,
+                                  account.account_type, &report);
+      }
+      if (rc == SQLITE_OK) {
+        print_batch_report(choice == 5 ? "Closed" : "Changed", &report);
+      }
+      free(account_numbers);
+      free(buffer);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
     break;
   }
 }
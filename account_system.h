@@ -2,18 +2,39 @@
 #ifndef ACCOUNT_SYSTEM_H
 #define ACCOUNT_SYSTEM_H
 
+#include <stdint.h>
+
 #include "gen_account_number.h"
 #include "sqlite3.h"
 
 struct Account {
-  char account_number[ACCOUNT_NUMBER_LENGTH];
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
   char customer_id[37];
   char account_type[8];
   double balance;
 };
 
+struct AccountBatchReport {
+  int64_t changed;
+  int64_t skipped; // missing, closed or otherwise not eligible
+  double seconds;
+};
+
 int create_accounts_table(sqlite3 *db);
 int insert_account(sqlite3 *db, struct Account *account);
+int insert_account_in(sqlite3 *db, const char *schema,
+                      struct Account *account);
+int get_account_details(sqlite3 *db, const char *account_number);
+int get_account_details_in(sqlite3 *db, const char *schema,
+                           const char *account_number);
+int close_account(sqlite3 *db, const char *account_number);
+int change_account_type(sqlite3 *db, const char *account_number,
+                        const char *account_type);
+int close_accounts(sqlite3 *db, const char *const *account_numbers, int count,
+                   struct AccountBatchReport *report);
+int change_account_types(sqlite3 *db, const char *const *account_numbers,
+                         int count, const char *account_type,
+                         struct AccountBatchReport *report);
 void print_account_management_system(sqlite3 *db);
 
 #endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate_reports.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Check whether a table exists
+static int aggregate_table_exists(sqlite3 *db, const char *name) {
+  sqlite3_stmt *stmt;
+  int exists = 0;
+
+  const char *sql = "SELECT 1 FROM sqlite_master WHERE type = 'table' AND "
+                    "name = ?;";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  exists = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  return exists;
+}
+
+// Create the summary tables and the triggers that keep them current. Every
+// statement that changes accounts or appends a deposit updates the totals in
+// the same transaction. Amounts are kept in integer cents so the running
+// totals do not drift.
+int create_aggregate_tables(sqlite3 *db) {
+  int is_new = !aggregate_table_exists(db, "account_type_totals");
+
+  char *sql =
+      "CREATE TABLE IF NOT EXISTS account_type_totals ("
+      "account_type TEXT PRIMARY KEY, "
+      "account_count INTEGER NOT NULL DEFAULT 0, "
+      "balance_cents INTEGER NOT NULL DEFAULT 0, "
+      "deposit_cents INTEGER NOT NULL DEFAULT 0);"
+      "CREATE TABLE IF NOT EXISTS customer_totals ("
+      "customer_id TEXT PRIMARY KEY, "
+      "account_count INTEGER NOT NULL DEFAULT 0, "
+      "balance_cents INTEGER NOT NULL DEFAULT 0);"
+
+      "CREATE TRIGGER IF NOT EXISTS accounts_totals_ai AFTER INSERT ON "
+      "accounts BEGIN "
+      "INSERT INTO account_type_totals (account_type, account_count, "
+      "balance_cents) VALUES (new.account_type, 1, "
+      "CAST(round(new.balance * 100) AS INTEGER)) "
+      "ON CONFLICT(account_type) DO UPDATE SET "
+      "account_count = account_count + 1, "
+      "balance_cents = balance_cents + excluded.balance_cents; "
+      "INSERT INTO customer_totals (customer_id, account_count, "
+      "balance_cents) VALUES (new.customer_id, 1, "
+      "CAST(round(new.balance * 100) AS INTEGER)) "
+      "ON CONFLICT(customer_id) DO UPDATE SET "
+      "account_count = account_count + 1, "
+      "balance_cents = balance_cents + excluded.balance_cents; "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS accounts_totals_ad AFTER DELETE ON "
+      "accounts BEGIN "
+      "UPDATE account_type_totals SET account_count = account_count - 1, "
+      "balance_cents = balance_cents - "
+      "CAST(round(old.balance * 100) AS INTEGER) "
+      "WHERE account_type = old.account_type; "
+      "UPDATE customer_totals SET account_count = account_count - 1, "
+      "balance_cents = balance_cents - "
+      "CAST(round(old.balance * 100) AS INTEGER) "
+      "WHERE customer_id = old.customer_id; "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS accounts_totals_au AFTER UPDATE OF "
+      "balance, account_type, customer_id ON accounts BEGIN "
+      "UPDATE account_type_totals SET account_count = account_count - 1, "
+      "balance_cents = balance_cents - "
+      "CAST(round(old.balance * 100) AS INTEGER) "
+      "WHERE account_type = old.account_type; "
+      "INSERT INTO account_type_totals (account_type, account_count, "
+      "balance_cents) VALUES (new.account_type, 1, "
+      "CAST(round(new.balance * 100) AS INTEGER)) "
+      "ON CONFLICT(account_type) DO UPDATE SET "
+      "account_count = account_count + 1, "
+      "balance_cents = balance_cents + excluded.balance_cents; "
+      "UPDATE customer_totals SET account_count = account_count - 1, "
+      "balance_cents = balance_cents - "
+      "CAST(round(old.balance * 100) AS INTEGER) "
+      "WHERE customer_id = old.customer_id; "
+      "INSERT INTO customer_totals (customer_id, account_count, "
+      "balance_cents) VALUES (new.customer_id, 1, "
+      "CAST(round(new.balance * 100) AS INTEGER)) "
+      "ON CONFLICT(customer_id) DO UPDATE SET "
+      "account_count = account_count + 1, "
+      "balance_cents = balance_cents + excluded.balance_cents; "
+      "END;"
+
+      // Deposits count toward the account's current type, so they follow
+      // the account when its type changes or it is deleted
+      "CREATE TRIGGER IF NOT EXISTS accounts_deposits_type_au AFTER UPDATE "
+      "OF account_type ON accounts "
+      "WHEN old.account_type IS NOT new.account_type BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents - "
+      "(SELECT IFNULL(SUM(CAST(round(amount * 100) AS INTEGER)), 0) "
+      "FROM transactions WHERE account_number = old.account_number "
+      "AND type = 'deposit') WHERE account_type = old.account_type; "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents + "
+      "(SELECT IFNULL(SUM(CAST(round(amount * 100) AS INTEGER)), 0) "
+      "FROM transactions WHERE account_number = new.account_number "
+      "AND type = 'deposit') WHERE account_type = new.account_type; "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS accounts_deposits_ad AFTER DELETE ON "
+      "accounts BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents - "
+      "(SELECT IFNULL(SUM(CAST(round(amount * 100) AS INTEGER)), 0) "
+      "FROM transactions WHERE account_number = old.account_number "
+      "AND type = 'deposit') WHERE account_type = old.account_type; "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS transactions_totals_ai AFTER INSERT ON "
+      "transactions WHEN new.type = 'deposit' BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents + "
+      "CAST(round(new.amount * 100) AS INTEGER) "
+      "WHERE account_type = (SELECT account_type FROM accounts "
+      "WHERE account_number = new.account_number); "
+      "END;"
+
+      // History removed ahead of its account leaves the deposit total too
+      "CREATE TRIGGER IF NOT EXISTS transactions_totals_ad AFTER DELETE ON "
+      "transactions WHEN old.type = 'deposit' BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents - "
+      "CAST(round(old.amount * 100) AS INTEGER) "
+      "WHERE account_type = (SELECT account_type FROM accounts "
+      "WHERE account_number = old.account_number); "
+      "END;";
+
+  int rc = execute_sql(db, sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Seed the totals from data that existed before the tables did
+  if (is_new) {
+    int differences;
+    return rebuild_aggregates(db, &differences);
+  }
+
+  return SQLITE_OK;
+}
+
+// Recompute every total from the base tables and replace the maintained
+// ones. Deposits the archiver moved out of the hot table count through
+// their carried totals. differences receives how many maintained rows
+// disagreed with the recomputation, which should be zero.
+int rebuild_aggregates(sqlite3 *db, int *differences) {
+  sqlite3_stmt *stmt;
+
+  *differences = 0;
+
+  // The carried totals are created after these tables on a new database
+  char *recompute = sqlite3_mprintf(
+      "CREATE TEMP TABLE fresh_type_totals AS "
+      "SELECT a.account_type AS account_type, COUNT(*) AS account_count, "
+      "SUM(CAST(round(a.balance * 100) AS INTEGER)) AS balance_cents, "
+      "IFNULL((SELECT SUM(CAST(round(t.amount * 100) AS INTEGER)) "
+      "FROM transactions t JOIN accounts d "
+      "ON d.account_number = t.account_number "
+      "WHERE t.type = 'deposit' AND d.account_type = a.account_type), 0)%s "
+      "AS deposit_cents FROM accounts a GROUP BY a.account_type;"
+      "CREATE TEMP TABLE fresh_customer_totals AS "
+      "SELECT customer_id, COUNT(*) AS account_count, "
+      "SUM(CAST(round(balance * 100) AS INTEGER)) AS balance_cents "
+      "FROM accounts GROUP BY customer_id;",
+      aggregate_table_exists(db, "ledger_carry")
+          ? " + IFNULL((SELECT SUM(c.deposit_cents) FROM ledger_carry c "
+            "JOIN accounts d ON d.account_number = c.account_number "
+            "WHERE d.account_type = a.account_type), 0)"
+          : "");
+  if (recompute == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  int rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    sqlite3_free(recompute);
+    return rc;
+  }
+
+  rc = execute_sql(db, recompute);
+  sqlite3_free(recompute);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  // Keys whose row differs or exists on only one side, ignoring emptied
+  // groups the triggers leave behind
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT (SELECT COUNT(*) FROM ("
+      "SELECT account_type FROM (SELECT * FROM account_type_totals "
+      "WHERE account_count != 0 EXCEPT SELECT * FROM temp.fresh_type_totals) "
+      "UNION SELECT account_type FROM (SELECT * FROM temp.fresh_type_totals "
+      "EXCEPT SELECT * FROM account_type_totals))) + "
+      "(SELECT COUNT(*) FROM ("
+      "SELECT customer_id FROM (SELECT * FROM customer_totals "
+      "WHERE account_count != 0 "
+      "EXCEPT SELECT * FROM temp.fresh_customer_totals) "
+      "UNION SELECT customer_id FROM (SELECT * FROM "
+      "temp.fresh_customer_totals EXCEPT SELECT * FROM customer_totals)));",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    *differences = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  rc = execute_sql(db, "DELETE FROM account_type_totals;"
+                       "INSERT INTO account_type_totals "
+                       "SELECT * FROM temp.fresh_type_totals;"
+                       "DELETE FROM customer_totals;"
+                       "INSERT INTO customer_totals "
+                       "SELECT * FROM temp.fresh_customer_totals;");
+
+done:
+  execute_sql(db, "DROP TABLE IF EXISTS temp.fresh_type_totals;"
+                  "DROP TABLE IF EXISTS temp.fresh_customer_totals;");
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    return rc;
+  }
+
+  return execute_sql(db, "COMMIT;");
+}
+
+// Print totals by account type
+int print_account_type_totals(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+
+  const char *sql = "SELECT account_type, account_count, balance_cents, "
+                    "deposit_cents FROM account_type_totals "
+                    "ORDER BY account_type;";
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  printf("Totals by Account Type\n");
+  printf("----------------------\n");
+  printf("%-10s %10s %16s %16s\n", "Type", "Accounts", "Balance", "Deposits");
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    printf("%-10s %10lld %16.2f %16.2f\n", sqlite3_column_text(stmt, 0),
+           (long long)sqlite3_column_int64(stmt, 1),
+           sqlite3_column_int64(stmt, 2) / 100.0,
+           sqlite3_column_int64(stmt, 3) / 100.0);
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Print one customer's account count and total balance
+int print_customer_totals(sqlite3 *db, const char *customer_id) {
+  sqlite3_stmt *stmt;
+
+  const char *sql = "SELECT account_count, balance_cents FROM customer_totals "
+                    "WHERE customer_id = ?;";
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    printf("Customer ID: %s\n", customer_id);
+    printf("Accounts: %lld\n", (long long)sqlite3_column_int64(stmt, 0));
+    printf("Total Balance: %.2f\n", sqlite3_column_int64(stmt, 1) / 100.0);
+    rc = SQLITE_DONE;
+  } else if (rc == SQLITE_DONE) {
+    printf("Customer %s has no accounts.\n", customer_id);
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
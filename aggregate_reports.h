@@ -0,0 +1,11 @@
+#ifndef AGGREGATE_REPORTS_H
+#define AGGREGATE_REPORTS_H
+
+#include "sqlite3.h"
+
+int create_aggregate_tables(sqlite3 *db);
+int rebuild_aggregates(sqlite3 *db, int *differences);
+int print_account_type_totals(sqlite3 *db);
+int print_customer_totals(sqlite3 *db, const char *customer_id);
+
+#endif
@@ -0,0 +1,800 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aggregate_reports.h"
+#include "backup_system.h"
+#include "change_log.h"
+#include "customer_search.h"
+#include "db_config.h"
+#include "interest_engine.h"
+#include "reconciliation.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Tables carried by a dump, parents before children
+static const char *dump_tables[] = {"customers", "accounts", "transactions"};
+#define DUMP_TABLE_COUNT 3
+
+// Growable byte buffer used to assemble one record
+struct DumpBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static int buffer_reserve(struct DumpBuffer *buffer, size_t extra) {
+  if (buffer->length + extra <= buffer->capacity) {
+    return 1;
+  }
+
+  size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+  while (capacity < buffer->length + extra) {
+    capacity *= 2;
+  }
+
+  unsigned char *grown = realloc(buffer->data, capacity);
+  if (grown == NULL) {
+    return 0;
+  }
+
+  buffer->data = grown;
+  buffer->capacity = capacity;
+  return 1;
+}
+
+static void put_u32(unsigned char *out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static void put_u64(unsigned char *out, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static int write_u32(FILE *file, uint32_t value) {
+  unsigned char bytes[4];
+  put_u32(bytes, value);
+  return fwrite(bytes, 1, 4, file) == 4;
+}
+
+static int write_string(FILE *file, const char *text) {
+  uint32_t length = (uint32_t)strlen(text);
+  return write_u32(file, length) && fwrite(text, 1, length, file) == length;
+}
+
+static int read_u32(FILE *file, uint32_t *value) {
+  unsigned char bytes[4];
+  if (fread(bytes, 1, 4, file) != 4) {
+    return 0;
+  }
+  *value = get_u32(bytes);
+  return 1;
+}
+
+// Read a length-prefixed string into a malloc'd, NUL-terminated buffer
+static char *read_string(FILE *file) {
+  uint32_t length;
+  if (!read_u32(file, &length) || length > 4096) {
+    return NULL;
+  }
+
+  char *text = malloc(length + 1);
+  if (text == NULL) {
+    return NULL;
+  }
+  if (fread(text, 1, length, file) != length) {
+    free(text);
+    return NULL;
+  }
+  text[length] = '\0';
+  return text;
+}
+
+// Copy the live database to path with the online backup API. Each step
+// copies pages_per_step pages and then releases the source lock for
+// sleep_ms, so writers keep going while the copy runs.
+int snapshot_database(sqlite3 *db, const char *path, int pages_per_step,
+                      int sleep_ms) {
+  sqlite3 *dest;
+  int rc = sqlite3_open(path, &dest);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open snapshot file: %s\n", sqlite3_errmsg(dest));
+    sqlite3_close(dest);
+    return rc;
+  }
+
+  sqlite3_backup *backup = sqlite3_backup_init(dest, "main", db, "main");
+  if (backup == NULL) {
+    fprintf(stderr, "Failed to start snapshot: %s\n", sqlite3_errmsg(dest));
+    sqlite3_close(dest);
+    return SQLITE_ERROR;
+  }
+
+  do {
+    rc = sqlite3_backup_step(backup, pages_per_step);
+    if (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+      sqlite3_sleep(sleep_ms);
+    }
+  } while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+
+  printf("Snapshot copied %d pages to %s\n", sqlite3_backup_pagecount(backup),
+         path);
+
+  sqlite3_backup_finish(backup);
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  } else {
+    fprintf(stderr, "Snapshot failed: %s\n", sqlite3_errstr(rc));
+  }
+
+  sqlite3_close(dest);
+  return rc;
+}
+
+// Append one column value to a record
+static int encode_value(struct DumpBuffer *record, sqlite3_stmt *stmt,
+                        int column) {
+  int type = sqlite3_column_type(stmt, column);
+
+  if (!buffer_reserve(record, 13)) {
+    return 0;
+  }
+
+  switch (type) {
+  case SQLITE_INTEGER:
+    record->data[record->length++] = 1;
+    put_u64(record->data + record->length,
+            (uint64_t)sqlite3_column_int64(stmt, column));
+    record->length += 8;
+    break;
+  case SQLITE_FLOAT: {
+    double value = sqlite3_column_double(stmt, column);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    record->data[record->length++] = 2;
+    put_u64(record->data + record->length, bits);
+    record->length += 8;
+    break;
+  }
+  case SQLITE_TEXT:
+  case SQLITE_BLOB: {
+    const void *bytes = type == SQLITE_TEXT
+                            ? (const void *)sqlite3_column_text(stmt, column)
+                            : sqlite3_column_blob(stmt, column);
+    uint32_t length = (uint32_t)sqlite3_column_bytes(stmt, column);
+    record->data[record->length++] = type == SQLITE_TEXT ? 3 : 4;
+    put_u32(record->data + record->length, length);
+    record->length += 4;
+    if (!buffer_reserve(record, length)) {
+      return 0;
+    }
+    memcpy(record->data + record->length, bytes, length);
+    record->length += length;
+    break;
+  }
+  default:
+    record->data[record->length++] = 0;
+    break;
+  }
+
+  return 1;
+}
+
+// Stream one table into the dump, each row with its rowid
+static int dump_table(sqlite3 *db, FILE *file, const char *table,
+                      struct DumpBuffer *record) {
+  sqlite3_stmt *stmt;
+  uint64_t rows = 0;
+  unsigned char count_bytes[8];
+
+  char *sql = sqlite3_mprintf("SELECT rowid, * FROM \"%w\";", table);
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  int columns = sqlite3_column_count(stmt);
+  int ok = fputc('T', file) != EOF && write_string(file, table) &&
+           write_u32(file, (uint32_t)columns);
+  for (int i = 0; ok && i < columns; i++) {
+    ok = write_string(file, sqlite3_column_name(stmt, i));
+  }
+
+  while (ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    record->length = 0;
+    for (int i = 0; ok && i < columns; i++) {
+      ok = encode_value(record, stmt, i);
+    }
+    ok = ok && fputc('R', file) != EOF &&
+         write_u32(file, (uint32_t)record->length) &&
+         fwrite(record->data, 1, record->length, file) == record->length;
+    rows++;
+  }
+
+  sqlite3_finalize(stmt);
+
+  put_u64(count_bytes, rows);
+  ok = ok && fputc('E', file) != EOF &&
+       fwrite(count_bytes, 1, 8, file) == 8;
+
+  if (!ok) {
+    fprintf(stderr, "Failed to write dump of %s\n", table);
+    return SQLITE_IOERR;
+  }
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  printf("Dumped %llu rows from %s\n", (unsigned long long)rows, table);
+  return SQLITE_OK;
+}
+
+// Write customers, accounts and transactions to a binary dump, read inside
+// one transaction so the tables are mutually consistent
+int dump_database(sqlite3 *db, const char *path) {
+  struct DumpBuffer record = {NULL, 0, 0};
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL) {
+    perror("Can't open dump file");
+    return SQLITE_CANTOPEN;
+  }
+
+  int rc = execute_sql(db, "BEGIN;");
+  if (rc == SQLITE_OK) {
+    if (fwrite(DUMP_MAGIC, 1, 8, file) != 8 ||
+        !write_u32(file, DUMP_VERSION)) {
+      rc = SQLITE_IOERR;
+    }
+    for (int i = 0; rc == SQLITE_OK && i < DUMP_TABLE_COUNT; i++) {
+      rc = dump_table(db, file, dump_tables[i], &record);
+    }
+    if (rc == SQLITE_OK && fputc('Z', file) == EOF) {
+      rc = SQLITE_IOERR;
+    }
+    execute_sql(db, "COMMIT;");
+  }
+
+  free(record.data);
+  if (fclose(file) != 0 && rc == SQLITE_OK) {
+    rc = SQLITE_IOERR;
+  }
+  return rc;
+}
+
+// Bind every field of one record to the insert statement
+static int bind_record(sqlite3_stmt *stmt, const unsigned char *record,
+                       uint32_t length, int columns) {
+  uint32_t offset = 0;
+
+  for (int i = 0; i < columns; i++) {
+    if (offset >= length) {
+      return SQLITE_CORRUPT;
+    }
+
+    unsigned char type = record[offset++];
+    if (type == 1 || type == 2) {
+      if (offset + 8 > length) {
+        return SQLITE_CORRUPT;
+      }
+      uint64_t bits = get_u64(record + offset);
+      offset += 8;
+      if (type == 1) {
+        sqlite3_bind_int64(stmt, i + 1, (sqlite3_int64)bits);
+      } else {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        sqlite3_bind_double(stmt, i + 1, value);
+      }
+    } else if (type == 3 || type == 4) {
+      if (offset + 4 > length) {
+        return SQLITE_CORRUPT;
+      }
+      uint32_t size = get_u32(record + offset);
+      offset += 4;
+      if (size > length - offset) {
+        return SQLITE_CORRUPT;
+      }
+      if (type == 3) {
+        sqlite3_bind_text(stmt, i + 1, (const char *)record + offset, size,
+                          SQLITE_STATIC);
+      } else {
+        sqlite3_bind_blob(stmt, i + 1, record + offset, size, SQLITE_STATIC);
+      }
+      offset += size;
+    } else {
+      sqlite3_bind_null(stmt, i + 1);
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+// Load one table section of the dump through a single prepared insert
+static int restore_table(sqlite3 *db, FILE *file,
+                         struct DumpBuffer *record) {
+  sqlite3_stmt *stmt = NULL;
+  uint32_t columns;
+  uint64_t rows = 0;
+  int rc = SQLITE_CORRUPT;
+
+  char *table = read_string(file);
+  if (table == NULL || !read_u32(file, &columns) || columns == 0 ||
+      columns > 64) {
+    free(table);
+    return SQLITE_CORRUPT;
+  }
+
+  // The name comes from the file, so only the dumped tables are accepted
+  int known = 0;
+  for (int i = 0; i < DUMP_TABLE_COUNT; i++) {
+    known = known || strcmp(table, dump_tables[i]) == 0;
+  }
+  if (!known) {
+    fprintf(stderr, "Dump file names unknown table %s\n", table);
+    free(table);
+    return SQLITE_CORRUPT;
+  }
+
+  char *column_list = sqlite3_mprintf("");
+  char *placeholders = sqlite3_mprintf("");
+  for (uint32_t i = 0; i < columns; i++) {
+    char *name = read_string(file);
+    if (name == NULL) {
+      sqlite3_free(column_list);
+      sqlite3_free(placeholders);
+      free(table);
+      return SQLITE_CORRUPT;
+    }
+    char *next_columns = sqlite3_mprintf("%s%s\"%w\"", column_list,
+                                         i ? ", " : "", name);
+    char *next_placeholders =
+        sqlite3_mprintf("%s%s?", placeholders, i ? ", " : "");
+    sqlite3_free(column_list);
+    sqlite3_free(placeholders);
+    column_list = next_columns;
+    placeholders = next_placeholders;
+    free(name);
+  }
+
+  char *sql = sqlite3_mprintf("INSERT INTO \"%w\" (%s) VALUES (%s);",
+                              table, column_list, placeholders);
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_free(column_list);
+  sqlite3_free(placeholders);
+
+  while (rc == SQLITE_OK) {
+    int tag = fgetc(file);
+    uint32_t length;
+
+    if (tag == 'E') {
+      unsigned char count_bytes[8];
+      if (fread(count_bytes, 1, 8, file) != 8 ||
+          get_u64(count_bytes) != rows) {
+        rc = SQLITE_CORRUPT;
+      }
+      break;
+    }
+
+    if (tag != 'R' || !read_u32(file, &length) ||
+        !buffer_reserve(record, length) ||
+        fread(record->data, 1, length, file) != length) {
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+
+    rc = bind_record(stmt, record->data, length, (int)columns);
+    if (rc == SQLITE_OK) {
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+      sqlite3_reset(stmt);
+    }
+    if (rc == SQLITE_ERROR) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    }
+    rows++;
+  }
+
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK) {
+    printf("Restored %llu rows into %s\n", (unsigned long long)rows, table);
+  } else if (rc == SQLITE_CORRUPT) {
+    fprintf(stderr, "Dump file is truncated or corrupt in %s\n", table);
+  }
+
+  free(table);
+  return rc;
+}
+
+// Count archived months and carried totals. Restoring the hot ledger under
+// them would count history the dump also holds twice, or lose what it
+// lacks.
+static int count_archived(sqlite3 *db, int *archived) {
+  sqlite3_stmt *stmt;
+
+  *archived = 0;
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT (SELECT COUNT(*) FROM ledger_partitions) "
+                              "+ (SELECT COUNT(*) FROM ledger_carry);",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    *archived = sqlite3_column_int(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return SQLITE_OK;
+}
+
+// Reset what was derived from the replaced ledger, inside the restore's
+// transaction: reconciliation starts over with a full run, interest
+// checkpoints go, and each account's last accrual date is read back from
+// its restored interest postings
+static int reset_ledger_state(sqlite3 *db) {
+  int rc = reset_reconciliation(db);
+  if (rc == SQLITE_OK) {
+    rc = create_interest_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "DELETE FROM interest_checkpoints;"
+                         "DELETE FROM interest_accruals;"
+                         "INSERT INTO interest_accruals (account_number, "
+                         "run_date) SELECT account_number, "
+                         "MAX(date(date, 'localtime')) FROM transactions "
+                         "WHERE type = 'interest' "
+                         "AND account_number IS NOT NULL "
+                         "GROUP BY account_number;");
+  }
+  return rc;
+}
+
+// Index or trigger definition saved across a restore
+struct SavedSchemaObject {
+  char *type;
+  char *name;
+  char *sql;
+};
+
+// Replace customers, accounts and transactions with the contents of a dump.
+// Indexes and triggers on those tables are dropped for the bulk load and
+// recreated once at the end, then the search index and aggregate totals the
+// triggers would have maintained are rebuilt. Rows keep the rowids they were
+// dumped with. The restore is refused while months are archived, and is
+// published to the change log so replicas bootstrap again.
+int restore_database(sqlite3 *db, const char *path) {
+  sqlite3_stmt *stmt;
+  struct SavedSchemaObject *saved = NULL;
+  struct DumpBuffer record = {NULL, 0, 0};
+  int saved_count = 0;
+  char magic[8];
+  uint32_t version;
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror("Can't open dump file");
+    return SQLITE_CANTOPEN;
+  }
+
+  if (fread(magic, 1, 8, file) != 8 || memcmp(magic, DUMP_MAGIC, 8) != 0 ||
+      !read_u32(file, &version) || version < 1 || version > DUMP_VERSION) {
+    fprintf(stderr, "%s is not a bank dump file\n", path);
+    fclose(file);
+    return SQLITE_NOTADB;
+  }
+
+  // A dump is loaded as it was taken, so foreign keys are off while the
+  // tables are replaced; rows whose parent is missing are reported after
+  int foreign_keys = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA foreign_keys;", -1, &stmt, NULL) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      foreign_keys = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  int rc = execute_sql(db, "PRAGMA foreign_keys = OFF;");
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  }
+  if (rc != SQLITE_OK) {
+    if (foreign_keys) {
+      execute_sql(db, "PRAGMA foreign_keys = ON;");
+    }
+    fclose(file);
+    return rc;
+  }
+
+  int archived = 0;
+  rc = count_archived(db, &archived);
+  if (rc == SQLITE_OK && archived > 0) {
+    printf("Archived ledger months exist; a restore would count their "
+           "history twice or lose it.\n");
+    rc = SQLITE_CONSTRAINT;
+  }
+
+  // Remember every index and trigger on the dumped tables
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+      db,
+      "SELECT type, name, sql FROM sqlite_master WHERE sql IS NOT NULL AND "
+      "type IN ('index', 'trigger') AND tbl_name IN ('customers', "
+      "'accounts', 'transactions');",
+      -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(db));
+    }
+  }
+  if (rc == SQLITE_OK) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      struct SavedSchemaObject *grown =
+          realloc(saved, (saved_count + 1) * sizeof(*saved));
+      if (grown == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      saved = grown;
+      saved[saved_count].type =
+          sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+      saved[saved_count].name =
+          sqlite3_mprintf("%s", sqlite3_column_text(stmt, 1));
+      saved[saved_count].sql =
+          sqlite3_mprintf("%s", sqlite3_column_text(stmt, 2));
+      saved_count++;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  for (int i = 0; rc == SQLITE_OK && i < saved_count; i++) {
+    char *drop = sqlite3_mprintf("DROP %s IF EXISTS \"%w\";", saved[i].type,
+                                 saved[i].name);
+    rc = execute_sql(db, drop);
+    sqlite3_free(drop);
+  }
+
+  // Empty every dumped table before loading, children first
+  for (int i = DUMP_TABLE_COUNT - 1; rc == SQLITE_OK && i >= 0; i--) {
+    char *sql = sqlite3_mprintf("DELETE FROM \"%w\";", dump_tables[i]);
+    rc = execute_sql(db, sql);
+    sqlite3_free(sql);
+  }
+
+  // Load each table section
+  while (rc == SQLITE_OK) {
+    int tag = fgetc(file);
+    if (tag == 'Z') {
+      break;
+    }
+    if (tag != 'T') {
+      fprintf(stderr, "Dump file is truncated or corrupt\n");
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+    rc = restore_table(db, file, &record);
+  }
+
+  // Rebuild indexes once, after all rows are in
+  for (int i = 0; rc == SQLITE_OK && i < saved_count; i++) {
+    rc = execute_sql(db, saved[i].sql);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = reset_ledger_state(db);
+  }
+  if (rc == SQLITE_OK) {
+    const char *fields[1] = {path};
+    rc = cdc_stage(db, CDC_DATABASE_RESTORE, 1, fields);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  } else {
+    execute_sql(db, "ROLLBACK;");
+  }
+  if (rc == SQLITE_OK) {
+    cdc_commit(db);
+  } else {
+    cdc_discard(db);
+  }
+
+  if (rc == SQLITE_OK &&
+      sqlite3_prepare_v2(db, "PRAGMA foreign_key_check;", -1, &stmt,
+                         NULL) == SQLITE_OK) {
+    int orphans = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      orphans++;
+    }
+    sqlite3_finalize(stmt);
+    if (orphans > 0) {
+      printf("Warning: %d restored row(s) reference a missing parent\n",
+             orphans);
+    }
+  }
+  if (foreign_keys) {
+    execute_sql(db, "PRAGMA foreign_keys = ON;");
+  }
+
+  if (rc == SQLITE_OK) {
+    int differences;
+    rc = rebuild_customer_search_index(db);
+    if (rc == SQLITE_OK) {
+      rc = rebuild_aggregates(db, &differences);
+    }
+  }
+
+  for (int i = 0; i < saved_count; i++) {
+    sqlite3_free(saved[i].type);
+    sqlite3_free(saved[i].name);
+    sqlite3_free(saved[i].sql);
+  }
+  free(saved);
+  free(record.data);
+  fclose(file);
+  return rc;
+}
+
+// Read a whole database file into memory from sqlite3_malloc64, which
+// sqlite3_deserialize can take ownership of
+static unsigned char *read_image(const char *path, sqlite3_int64 *size) {
+  FILE *file = fopen(path, "rb");
+  unsigned char *image = NULL;
+  long length;
+
+  if (file == NULL) {
+    perror("Can't open database image");
+    return NULL;
+  }
+  if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 &&
+      fseek(file, 0, SEEK_SET) == 0) {
+    image = sqlite3_malloc64((sqlite3_uint64)length);
+    if (image != NULL && fread(image, 1, length, file) != (size_t)length) {
+      sqlite3_free(image);
+      image = NULL;
+    }
+    *size = length;
+  }
+  fclose(file);
+
+  if (image == NULL) {
+    fprintf(stderr, "Can't read database image %s\n", path);
+  }
+  return image;
+}
+
+// Replace db's in-memory main database with the database file at path. A
+// private database takes the image over without another copy. A shared
+// memdb database receives it through the backup API, so its other
+// connections see it too. File-backed databases are refused.
+int load_database_image(sqlite3 *db, const char *path) {
+  sqlite3_int64 size = 0;
+  unsigned char *image;
+  char uri[1024];
+  int rc;
+
+  if (!database_in_memory(db)) {
+    fprintf(stderr, "Images load only into in-memory databases\n");
+    return SQLITE_MISUSE;
+  }
+  if ((image = read_image(path, &size)) == NULL) {
+    return SQLITE_IOERR;
+  }
+
+  // memdb has no WAL, so a WAL file's header is switched back to rollback
+  // journal mode
+  if (size >= 20 && image[18] == 2 && image[19] == 2) {
+    image[18] = 1;
+    image[19] = 1;
+  }
+
+  unsigned flags =
+      SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE;
+  if (shared_database_uri(db, uri, sizeof(uri)) != SQLITE_OK) {
+    rc = sqlite3_deserialize(db, "main", image, size, size, flags);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Can't load database image: %s\n", sqlite3_errstr(rc));
+    }
+    return rc;
+  }
+
+  sqlite3 *source;
+  rc = sqlite3_open(":memory:", &source);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_deserialize(source, "main", image, size, size, flags);
+  } else {
+    sqlite3_free(image);
+  }
+
+  if (rc == SQLITE_OK) {
+    sqlite3_backup *backup = sqlite3_backup_init(db, "main", source, "main");
+    if (backup == NULL) {
+      rc = sqlite3_errcode(db);
+    } else {
+      rc = sqlite3_backup_step(backup, -1);
+      sqlite3_backup_finish(backup);
+      rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't load database image: %s\n", sqlite3_errstr(rc));
+  }
+  sqlite3_close(source);
+  return rc;
+}
+
+// Write db's main database to path as a plain database file. It goes to a
+// temporary file first, so an interrupted save keeps the previous image.
+int save_database_image(sqlite3 *db, const char *path, sqlite3_int64 *size) {
+  char temp_path[1100];
+  char uri[1024];
+  int rc = SQLITE_OK;
+
+  // A private in-memory database is only touched by this connection, so
+  // its pages are written straight from memory
+  unsigned char *copy = NULL;
+  unsigned char *image = NULL;
+  if (database_in_memory(db) &&
+      shared_database_uri(db, uri, sizeof(uri)) != SQLITE_OK) {
+    image = sqlite3_serialize(db, "main", size, SQLITE_SERIALIZE_NOCOPY);
+  }
+  if (image == NULL) {
+    image = copy = sqlite3_serialize(db, "main", size, 0);
+  }
+  if (image == NULL) {
+    fprintf(stderr, "Can't serialize database: %s\n", sqlite3_errmsg(db));
+    return SQLITE_NOMEM;
+  }
+
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  FILE *file = fopen(temp_path, "wb");
+  if (file == NULL) {
+    perror("Can't open database image");
+    sqlite3_free(copy);
+    return SQLITE_CANTOPEN;
+  }
+
+  int ok = fwrite(image, 1, (size_t)*size, file) == (size_t)*size &&
+           fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp_path, path) != 0) {
+    perror("Can't write database image");
+    unlink(temp_path);
+    rc = SQLITE_IOERR;
+  }
+
+  sqlite3_free(copy);
+  return rc;
+}
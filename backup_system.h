@@ -0,0 +1,32 @@
+#ifndef BACKUP_SYSTEM_H
+#define BACKUP_SYSTEM_H
+
+#include "sqlite3.h"
+
+// Binary dump file layout, all integers little-endian:
+//   "BNKDUMP1" u32 version
+//   per table: 'T' u32 name_len name u32 column_count
+//              (u32 name_len name) x column_count
+//              ('R' u32 record_len record) x rows
+//              'E' u64 row_count
+//   'Z'
+// A record holds one field per column: a type byte (0 null, 1 int64,
+// 2 double, 3 text, 4 blob) followed by 8 bytes for numbers or u32 length
+// and bytes for text and blobs. Since version 2 the first column is the
+// row's rowid, so rowid high-water marks survive a restore.
+#define DUMP_MAGIC "BNKDUMP1"
+#define DUMP_VERSION 2
+
+// Database images are plain SQLite files, written with sqlite3_serialize
+// and loaded with sqlite3_deserialize. BANK_DB_IMAGE names the image an
+// in-memory database starts from.
+#define DEFAULT_IMAGE_PATH "bank-image.db"
+
+int snapshot_database(sqlite3 *db, const char *path, int pages_per_step,
+                      int sleep_ms);
+int dump_database(sqlite3 *db, const char *path);
+int restore_database(sqlite3 *db, const char *path);
+int load_database_image(sqlite3 *db, const char *path);
+int save_database_image(sqlite3 *db, const char *path, sqlite3_int64 *size);
+
+#endif
@@ -0,0 +1,857 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "change_log.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Records are staged in a cdc_outbox table inside the transaction that
+// makes the change, so they commit or roll back with it. The bank database
+// and every shard have an outbox of their own. Writers to one file are
+// serialized, so an outbox's AUTOINCREMENT keys follow its commit order.
+// After a commit the new rows are appended to the log in key order and
+// synced, each numbered from the one sequence all outboxes share. The next
+// staging transaction prunes rows the log holds and saves, in
+// cdc_outbox_state, the last key appended and the number it got.
+static pthread_mutex_t cdc_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *cdc_file;
+static char cdc_dir[256];
+static int cdc_segment;
+static long cdc_segment_size;
+static uint64_t cdc_logged_seq;
+
+// An outbox, known by its database file, and how far the log got in it
+struct CdcOutbox {
+  char path[512];
+  sqlite3_int64 appended_key;
+  uint64_t appended_seq;
+};
+
+static struct CdcOutbox cdc_outboxes[CDC_MAX_OUTBOXES];
+static int cdc_outbox_count;
+
+static uint32_t crc_table[256];
+static int crc_table_ready;
+
+static void put_le(unsigned char *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_le(const unsigned char *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+// CRC-32 (IEEE), table driven
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data,
+                             size_t length) {
+  if (!crc_table_ready) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      crc_table[i] = c;
+    }
+    crc_table_ready = 1;
+  }
+
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void segment_path(char *out, size_t size, const char *dir,
+                         int segment) {
+  snprintf(out, size, "%s/cdc-%08d.log", dir, segment);
+}
+
+static int segment_exists(const char *dir, int segment) {
+  char path[300];
+  segment_path(path, sizeof(path), dir, segment);
+  return access(path, F_OK) == 0;
+}
+
+// Lowest and highest segment numbers present in dir, 0 if none
+static void find_segments(const char *dir, int *lowest, int *highest) {
+  DIR *handle = opendir(dir);
+  struct dirent *entry;
+
+  *lowest = 0;
+  *highest = 0;
+  if (handle == NULL) {
+    return;
+  }
+
+  while ((entry = readdir(handle)) != NULL) {
+    int segment;
+    if (sscanf(entry->d_name, "cdc-%d.log", &segment) == 1 && segment > 0) {
+      if (*lowest == 0 || segment < *lowest) {
+        *lowest = segment;
+      }
+      if (segment > *highest) {
+        *highest = segment;
+      }
+    }
+  }
+
+  closedir(handle);
+}
+
+// Read one record at the file position. Returns 1 on success, 0 at a clean
+// or torn end of file, -1 on a checksum mismatch.
+static int read_record(FILE *file, uint64_t *seq, int *op,
+                       unsigned char **payload, size_t *capacity,
+                       uint32_t *payload_length) {
+  unsigned char head[13];
+  unsigned char tail[4];
+
+  if (fread(head, 1, 4, file) != 4) {
+    return 0;
+  }
+
+  uint32_t length = (uint32_t)get_le(head, 4);
+  if (fread(head + 4, 1, 9, file) != 9) {
+    return 0;
+  }
+
+  if (length > *capacity) {
+    unsigned char *grown = realloc(*payload, length);
+    if (grown == NULL) {
+      return -1;
+    }
+    *payload = grown;
+    *capacity = length;
+  }
+
+  if (fread(*payload, 1, length, file) != length ||
+      fread(tail, 1, 4, file) != 4) {
+    return 0;
+  }
+
+  uint32_t crc = crc32_update(0, head + 4, 9);
+  crc = crc32_update(crc, *payload, length);
+  if (crc != (uint32_t)get_le(tail, 4)) {
+    return -1;
+  }
+
+  *seq = get_le(head + 4, 8);
+  *op = head[12];
+  *payload_length = length;
+  return 1;
+}
+
+// Walk a segment to find its last good sequence number and where the good
+// records end
+static int scan_segment(const char *path, uint64_t *last_seq,
+                        long *valid_end) {
+  unsigned char *payload = NULL;
+  size_t capacity = 0;
+  uint32_t length;
+  uint64_t seq;
+  int op;
+  int records = 0;
+
+  FILE *file = fopen(path, "rb");
+  *valid_end = 0;
+  if (file == NULL) {
+    return 0;
+  }
+
+  while (read_record(file, &seq, &op, &payload, &capacity, &length) == 1) {
+    *last_seq = seq;
+    *valid_end = ftell(file);
+    records++;
+  }
+
+  free(payload);
+  fclose(file);
+  return records;
+}
+
+// Open a segment for appending
+static int open_segment(int segment) {
+  char path[300];
+
+  segment_path(path, sizeof(path), cdc_dir, segment);
+  cdc_file = fopen(path, "ab");
+  if (cdc_file == NULL) {
+    fprintf(stderr, "Can't open change log %s: %s\n", path, strerror(errno));
+    return SQLITE_CANTOPEN;
+  }
+
+  cdc_segment = segment;
+  fseek(cdc_file, 0, SEEK_END);
+  cdc_segment_size = ftell(cdc_file);
+  return SQLITE_OK;
+}
+
+// Start logging into dir, continuing the sequence of any existing segments.
+// A torn record left at the end by a crash is cut off.
+int cdc_open(const char *dir) {
+  int lowest, highest;
+  uint64_t last_seq = 0;
+  long valid_end = 0;
+  char path[300];
+
+  pthread_mutex_lock(&cdc_lock);
+
+  if (cdc_file != NULL) {
+    pthread_mutex_unlock(&cdc_lock);
+    return SQLITE_OK;
+  }
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Can't create change log directory %s\n", dir);
+    pthread_mutex_unlock(&cdc_lock);
+    return SQLITE_CANTOPEN;
+  }
+
+  snprintf(cdc_dir, sizeof(cdc_dir), "%s", dir);
+  find_segments(dir, &lowest, &highest);
+
+  if (highest == 0) {
+    highest = 1;
+  } else {
+    segment_path(path, sizeof(path), dir, highest);
+    scan_segment(path, &last_seq, &valid_end);
+    if (truncate(path, valid_end) != 0) {
+      fprintf(stderr, "Can't trim change log %s\n", path);
+    }
+
+    // A crash right after rotation leaves an empty newest segment
+    for (int s = highest - 1; last_seq == 0 && s >= lowest && s > 0; s--) {
+      long ignored;
+      segment_path(path, sizeof(path), dir, s);
+      scan_segment(path, &last_seq, &ignored);
+    }
+  }
+
+  cdc_logged_seq = last_seq;
+  int rc = open_segment(highest);
+
+  pthread_mutex_unlock(&cdc_lock);
+  return rc;
+}
+
+void cdc_close(void) {
+  pthread_mutex_lock(&cdc_lock);
+  if (cdc_file != NULL) {
+    fclose(cdc_file);
+    cdc_file = NULL;
+  }
+  pthread_mutex_unlock(&cdc_lock);
+}
+
+int cdc_enabled(void) { return cdc_file != NULL; }
+
+// Outbox of db's main database file, NULL before cdc_recover() found it.
+// Called with the lock held.
+static struct CdcOutbox *find_outbox(sqlite3 *db) {
+  const char *path = sqlite3_db_filename(db, "main");
+
+  for (int i = 0; i < cdc_outbox_count; i++) {
+    if (strcmp(cdc_outboxes[i].path, path != NULL ? path : "") == 0) {
+      return &cdc_outboxes[i];
+    }
+  }
+  return NULL;
+}
+
+// Delete outbox rows the log holds and save how far it got, inside db's
+// open transaction
+static int prune_outbox(sqlite3 *db, const struct CdcOutbox *progress) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(db, "DELETE FROM cdc_outbox WHERE seq <= ?;",
+                              -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, progress->appended_key);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db,
+                            "INSERT OR REPLACE INTO cdc_outbox_state "
+                            "(id, appended_key, appended_seq) "
+                            "VALUES (1, ?, ?);",
+                            -1, &stmt, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(stmt, 1, progress->appended_key);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)progress->appended_seq);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+  }
+  return rc;
+}
+
+// Stage a change made inside db's open transaction. It reaches the log on
+// cdc_commit() once the transaction has committed, and goes away with it
+// if it rolls back. A change that could not be staged fails the caller's
+// transaction, so nothing commits without its record.
+int cdc_stage(sqlite3 *db, int op, int field_count, const char **fields) {
+  unsigned char *payload;
+  sqlite3_stmt *stmt;
+  size_t payload_length = 0;
+
+  if (!cdc_enabled()) {
+    return SQLITE_OK;
+  }
+
+  for (int i = 0; i < field_count; i++) {
+    size_t length = strlen(fields[i] != NULL ? fields[i] : "");
+    payload_length += 2 + (length > 0xffff ? 0xffff : length);
+  }
+
+  payload = malloc(payload_length > 0 ? payload_length : 1);
+  if (payload == NULL) {
+    fprintf(stderr, "Change log: out of memory staging a change\n");
+    return SQLITE_NOMEM;
+  }
+
+  unsigned char *out = payload;
+  for (int i = 0; i < field_count; i++) {
+    const char *field = fields[i] != NULL ? fields[i] : "";
+    size_t length = strlen(field);
+    if (length > 0xffff) {
+      length = 0xffff;
+    }
+    put_le(out, length, 2);
+    memcpy(out + 2, field, length);
+    out += 2 + length;
+  }
+
+  pthread_mutex_lock(&cdc_lock);
+  struct CdcOutbox *outbox = find_outbox(db);
+  struct CdcOutbox progress;
+  if (outbox != NULL) {
+    progress = *outbox;
+  }
+  pthread_mutex_unlock(&cdc_lock);
+
+  if (outbox == NULL) {
+    fprintf(stderr, "Change log: %s has no recovered outbox\n",
+            sqlite3_db_filename(db, "main"));
+    free(payload);
+    return SQLITE_ERROR;
+  }
+
+  // Drop rows the log already holds, then stage this one
+  int rc = prune_outbox(db, &progress);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(db,
+                            "INSERT INTO cdc_outbox (op, payload) "
+                            "VALUES (?, ?);",
+                            -1, &stmt, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int(stmt, 1, op);
+    sqlite3_bind_blob(stmt, 2, payload, (int)payload_length, SQLITE_STATIC);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Change log: can't stage a change: %s\n",
+            sqlite3_errmsg(db));
+  }
+
+  free(payload);
+  return rc;
+}
+
+// Write one framed record. Called with the lock held.
+static int append_record(uint64_t seq, int op, const unsigned char *payload,
+                         uint32_t length) {
+  unsigned char head[13];
+  unsigned char tail[4];
+
+  if (cdc_segment_size >= CDC_SEGMENT_BYTES) {
+    fclose(cdc_file);
+    cdc_file = NULL;
+    if (open_segment(cdc_segment + 1) != SQLITE_OK) {
+      return SQLITE_IOERR;
+    }
+  }
+
+  put_le(head, length, 4);
+  put_le(head + 4, seq, 8);
+  head[12] = (unsigned char)op;
+
+  uint32_t crc = crc32_update(0, head + 4, 9);
+  crc = crc32_update(crc, payload, length);
+  put_le(tail, crc, 4);
+
+  if (fwrite(head, 1, 13, cdc_file) != 13 ||
+      fwrite(payload, 1, length, cdc_file) != length ||
+      fwrite(tail, 1, 4, cdc_file) != 4) {
+    return SQLITE_IOERR;
+  }
+
+  cdc_segment_size += 17 + length;
+  return SQLITE_OK;
+}
+
+// Append every committed row of an outbox the log does not hold yet, in
+// key order, and sync the segment. Called with the lock held.
+static int flush_outbox(sqlite3 *db, struct CdcOutbox *outbox) {
+  sqlite3_stmt *stmt;
+  int appended = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT seq, op, payload FROM cdc_outbox "
+                              "WHERE seq > ? ORDER BY seq;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int64(stmt, 1, outbox->appended_key);
+  while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = append_record(cdc_logged_seq + 1, sqlite3_column_int(stmt, 1),
+                       sqlite3_column_blob(stmt, 2),
+                       (uint32_t)sqlite3_column_bytes(stmt, 2));
+    if (rc == SQLITE_OK) {
+      cdc_logged_seq++;
+      outbox->appended_key = sqlite3_column_int64(stmt, 0);
+      outbox->appended_seq = cdc_logged_seq;
+      appended++;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  // Consumers tail the file, so make the records visible right away, and
+  // durable before the outbox lets go of them
+  if (appended > 0 &&
+      (fflush(cdc_file) != 0 || fsync(fileno(cdc_file)) != 0)) {
+    rc = SQLITE_IOERR;
+  }
+  return rc;
+}
+
+// Append what db's transaction staged, once it committed. Inside an outer
+// transaction nothing is flushed yet: the rows are still uncommitted, and
+// the next commit on the same file, or the next start, picks them up.
+int cdc_commit(sqlite3 *db) {
+  int rc = SQLITE_OK;
+
+  if (!cdc_enabled() || !sqlite3_get_autocommit(db)) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&cdc_lock);
+  struct CdcOutbox *outbox = find_outbox(db);
+  if (cdc_file != NULL && outbox != NULL) {
+    rc = flush_outbox(db, outbox);
+  }
+  pthread_mutex_unlock(&cdc_lock);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to append to change log\n");
+  }
+  return rc;
+}
+
+// Changes staged by a transaction that rolled back left the outbox with it;
+// nothing is held outside the database
+void cdc_discard(sqlite3 *db) { (void)db; }
+
+// Read where the log got to in db's outbox. An outbox older than
+// cdc_outbox_state used the sequence number as its key, and held nothing
+// the log had, so its progress is the log's end.
+static int read_outbox_state(sqlite3 *db, struct CdcOutbox *outbox) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT appended_key, appended_seq FROM cdc_outbox_state "
+      "UNION ALL SELECT k, k FROM (SELECT min(?, COALESCE((SELECT seq "
+      "FROM sqlite_sequence WHERE name = 'cdc_outbox'), 0)) AS k) LIMIT 1;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int64(stmt, 1, (sqlite3_int64)cdc_logged_seq);
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    outbox->appended_key = sqlite3_column_int64(stmt, 0);
+    outbox->appended_seq = (uint64_t)sqlite3_column_int64(stmt, 1);
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Compare an outbox payload with a record read back from the log
+static int payload_matches(const unsigned char *payload, int length,
+                           const struct CdcRecord *record) {
+  int in = 0;
+
+  for (int i = 0; i < record->field_count; i++) {
+    size_t size = strlen(record->fields[i]);
+    if (in + 2 > length || (size_t)get_le(payload + in, 2) != size ||
+        in + 2 + (int)size > length ||
+        memcmp(payload + in + 2, record->fields[i], size) != 0) {
+      return 0;
+    }
+    in += 2 + (int)size;
+  }
+  return in == length;
+}
+
+// A crash between the append and the next staging transaction leaves rows
+// past the saved key that the log already holds. Match them, in key order,
+// against the records logged after the saved sequence number and move the
+// outbox past those found. Called with the lock held.
+static int skip_logged_rows(sqlite3 *db, struct CdcOutbox *outbox) {
+  struct CdcCursor cursor;
+  struct CdcRecord record;
+  sqlite3_stmt *stmt;
+
+  if (outbox->appended_seq >= cdc_logged_seq) {
+    return SQLITE_OK;
+  }
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT seq, op, payload FROM cdc_outbox "
+                              "WHERE seq > ? ORDER BY seq;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  memset(&record, 0, sizeof(record));
+  sqlite3_bind_int64(stmt, 1, outbox->appended_key);
+  cdc_cursor_open(&cursor, cdc_dir, outbox->appended_seq);
+
+  int pending = sqlite3_step(stmt) == SQLITE_ROW;
+  while (pending && (rc = cdc_cursor_next(&cursor, &record)) == SQLITE_ROW) {
+    if (record.op == sqlite3_column_int(stmt, 1) &&
+        payload_matches(sqlite3_column_blob(stmt, 2),
+                        sqlite3_column_bytes(stmt, 2), &record)) {
+      outbox->appended_key = sqlite3_column_int64(stmt, 0);
+      outbox->appended_seq = record.seq;
+      pending = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+  }
+
+  cdc_cursor_close(&cursor);
+  cdc_record_free(&record);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_CORRUPT ? rc : SQLITE_OK;
+}
+
+// Prune what the log holds from an outbox and save its progress in a
+// transaction of its own. Called with the lock held.
+static int save_outbox_state(sqlite3 *db, const struct CdcOutbox *outbox) {
+  int rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = prune_outbox(db, outbox);
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    execute_sql(db, "ROLLBACK;");
+  }
+  return rc;
+}
+
+// Create db's outbox and append whatever it holds past the end of the log:
+// records of transactions that committed before a crash reached the log.
+// Every database that stages changes, the bank database and each shard,
+// is recovered once before its first change.
+int cdc_recover(sqlite3 *db) {
+  struct CdcOutbox outbox;
+
+  if (!cdc_enabled()) {
+    return SQLITE_OK;
+  }
+
+  int rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS cdc_outbox ("
+                           "seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+                           "op INTEGER NOT NULL, "
+                           "payload BLOB NOT NULL);"
+                           "CREATE TABLE IF NOT EXISTS cdc_outbox_state ("
+                           "id INTEGER PRIMARY KEY CHECK (id = 1), "
+                           "appended_key INTEGER NOT NULL, "
+                           "appended_seq INTEGER NOT NULL);");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  pthread_mutex_lock(&cdc_lock);
+  if (find_outbox(db) != NULL) {
+    pthread_mutex_unlock(&cdc_lock);
+    return SQLITE_OK;
+  }
+
+  if (cdc_outbox_count == CDC_MAX_OUTBOXES) {
+    fprintf(stderr, "Change log: too many outboxes\n");
+    pthread_mutex_unlock(&cdc_lock);
+    return SQLITE_FULL;
+  }
+
+  memset(&outbox, 0, sizeof(outbox));
+  const char *path = sqlite3_db_filename(db, "main");
+  snprintf(outbox.path, sizeof(outbox.path), "%s", path != NULL ? path : "");
+
+  rc = read_outbox_state(db, &outbox);
+  if (rc == SQLITE_OK) {
+    rc = skip_logged_rows(db, &outbox);
+  }
+  if (rc == SQLITE_OK) {
+    rc = flush_outbox(db, &outbox);
+  }
+  if (rc == SQLITE_OK) {
+    rc = save_outbox_state(db, &outbox);
+  }
+  if (rc == SQLITE_OK) {
+    cdc_outboxes[cdc_outbox_count++] = outbox;
+  }
+  pthread_mutex_unlock(&cdc_lock);
+  return rc;
+}
+
+// Prune db's outbox and save its progress, so the next start has nothing
+// to look for in the log. Called when a session ends.
+int cdc_checkpoint(sqlite3 *db) {
+  int rc = SQLITE_OK;
+
+  if (!cdc_enabled()) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&cdc_lock);
+  struct CdcOutbox *outbox = find_outbox(db);
+  if (outbox != NULL) {
+    rc = save_outbox_state(db, outbox);
+  }
+  pthread_mutex_unlock(&cdc_lock);
+  return rc;
+}
+
+// Highest complete sequence number in dir, 0 for an empty log
+uint64_t cdc_last_sequence(const char *dir) {
+  int lowest, highest;
+  uint64_t last_seq = 0;
+  char path[300];
+
+  find_segments(dir, &lowest, &highest);
+  for (int s = highest; last_seq == 0 && s >= lowest && s > 0; s--) {
+    long valid_end;
+    segment_path(path, sizeof(path), dir, s);
+    scan_segment(path, &last_seq, &valid_end);
+  }
+
+  return last_seq;
+}
+
+// Position a consumer cursor on the first record after after_seq
+int cdc_cursor_open(struct CdcCursor *cursor, const char *dir,
+                    uint64_t after_seq) {
+  int lowest, highest;
+
+  memset(cursor, 0, sizeof(*cursor));
+  snprintf(cursor->dir, sizeof(cursor->dir), "%s", dir);
+  cursor->last_seq = after_seq;
+
+  find_segments(dir, &lowest, &highest);
+  if (lowest == 0) {
+    // Nothing written yet: wait for the first segment
+    cursor->segment = 1;
+    return SQLITE_OK;
+  }
+
+  // Start from the last segment whose first record is not past after_seq;
+  // cdc_cursor_next() skips whatever in it was already consumed
+  cursor->segment = lowest;
+  for (int s = highest; s > lowest; s--) {
+    char path[300];
+    unsigned char head[12];
+    segment_path(path, sizeof(path), dir, s);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+      continue;
+    }
+    int found = fread(head, 1, 12, file) == 12 &&
+                get_le(head + 4, 8) <= after_seq + 1;
+    fclose(file);
+    if (found) {
+      cursor->segment = s;
+      break;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+// Return the next record. SQLITE_DONE means the reader caught up with the
+// writer; call again later to keep tailing. A torn record at the end of the
+// newest segment is treated as not yet written.
+int cdc_cursor_next(struct CdcCursor *cursor, struct CdcRecord *record) {
+  unsigned char *payload = NULL;
+  size_t capacity = 0;
+  uint32_t length;
+  uint64_t seq;
+  int op;
+
+  for (;;) {
+    if (cursor->file == NULL) {
+      char path[300];
+      segment_path(path, sizeof(path), cursor->dir, cursor->segment);
+      cursor->file = fopen(path, "rb");
+      if (cursor->file == NULL) {
+        return SQLITE_DONE;
+      }
+      fseek(cursor->file, cursor->offset, SEEK_SET);
+    }
+
+    int status = read_record(cursor->file, &seq, &op, &payload, &capacity,
+                             &length);
+    if (status == 1) {
+      cursor->offset = ftell(cursor->file);
+      if (seq <= cursor->last_seq) {
+        continue;
+      }
+      break;
+    }
+
+    // Only a finished segment, one with a successor, may be left behind
+    if (status == 0 && segment_exists(cursor->dir, cursor->segment + 1)) {
+      fclose(cursor->file);
+      cursor->file = NULL;
+      cursor->segment++;
+      cursor->offset = 0;
+      continue;
+    }
+
+    fseek(cursor->file, cursor->offset, SEEK_SET);
+    clearerr(cursor->file);
+    free(payload);
+    return status == 0 ? SQLITE_DONE : SQLITE_CORRUPT;
+  }
+
+  cursor->last_seq = seq;
+
+  // Unpack fields into NUL-terminated strings in the record's buffer
+  if (record->buffer_capacity < (size_t)length + CDC_MAX_FIELDS) {
+    char *grown = realloc(record->buffer, length + CDC_MAX_FIELDS);
+    if (grown == NULL) {
+      free(payload);
+      return SQLITE_NOMEM;
+    }
+    record->buffer = grown;
+    record->buffer_capacity = length + CDC_MAX_FIELDS;
+  }
+
+  record->seq = seq;
+  record->op = op;
+  record->field_count = 0;
+
+  size_t in = 0, out = 0;
+  while (in + 2 <= length && record->field_count < CDC_MAX_FIELDS) {
+    size_t size = (size_t)get_le(payload + in, 2);
+    in += 2;
+    if (in + size > length) {
+      break;
+    }
+    memcpy(record->buffer + out, payload + in, size);
+    record->buffer[out + size] = '\0';
+    record->fields[record->field_count++] = record->buffer + out;
+    in += size;
+    out += size + 1;
+  }
+
+  free(payload);
+  return SQLITE_ROW;
+}
+
+void cdc_cursor_close(struct CdcCursor *cursor) {
+  if (cursor->file != NULL) {
+    fclose(cursor->file);
+    cursor->file = NULL;
+  }
+}
+
+void cdc_record_free(struct CdcRecord *record) {
+  free(record->buffer);
+  record->buffer = NULL;
+  record->buffer_capacity = 0;
+}
+
+const char *cdc_operation_name(int op) {
+  switch (op) {
+  case CDC_CUSTOMER_INSERT:
+    return "customer_insert";
+  case CDC_CUSTOMER_UPDATE:
+    return "customer_update";
+  case CDC_CUSTOMER_DELETE:
+    return "customer_delete";
+  case CDC_ACCOUNT_INSERT:
+    return "account_insert";
+  case CDC_TRANSACTION_POST:
+    return "transaction_post";
+  case CDC_ACCOUNT_UPDATE:
+    return "account_update";
+  case CDC_ACCOUNT_DELETE:
+    return "account_delete";
+  case CDC_DATABASE_RESTORE:
+    return "database_restore";
+  default:
+    return "unknown";
+  }
+}
+
+// Print up to limit records following after_seq
+int print_change_log(const char *dir, uint64_t after_seq, int limit) {
+  struct CdcCursor cursor;
+  struct CdcRecord record = {0};
+  int shown = 0;
+  int rc = SQLITE_DONE;
+
+  cdc_cursor_open(&cursor, dir, after_seq);
+
+  while (shown < limit && (rc = cdc_cursor_next(&cursor, &record)) ==
+                              SQLITE_ROW) {
+    printf("%8llu %-17s", (unsigned long long)record.seq,
+           cdc_operation_name(record.op));
+    for (int i = 0; i < record.field_count; i++) {
+      printf(" %s", record.fields[i]);
+    }
+    printf("\n");
+    shown++;
+  }
+
+  if (shown < limit && rc == SQLITE_CORRUPT) {
+    fprintf(stderr, "Change log record after seq %llu is corrupt\n",
+            (unsigned long long)cursor.last_seq);
+  }
+
+  printf("%d record(s) shown, last seq %llu\n", shown,
+         (unsigned long long)cursor.last_seq);
+
+  cdc_record_free(&record);
+  cdc_cursor_close(&cursor);
+  return shown < limit && rc == SQLITE_CORRUPT ? SQLITE_CORRUPT : SQLITE_OK;
+}
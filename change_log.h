@@ -0,0 +1,68 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sqlite3.h"
+
+// Append-only change log for downstream consumers. Records live in segment
+// files <dir>/cdc-<n>.log, a new segment starting once the current one
+// passes CDC_SEGMENT_BYTES. Record layout, integers little-endian:
+//   u32 payload_length, u64 seq, u8 op, payload, u32 crc32(seq..payload)
+// The payload is a list of fields, each u16 length + bytes of text.
+// Changes are staged in the cdc_outbox table of the database they change,
+// the bank database or a shard, and appended and synced once they commit.
+#define CDC_SEGMENT_BYTES (16 * 1024 * 1024)
+#define CDC_MAX_FIELDS 8
+#define CDC_MAX_OUTBOXES 32
+
+enum CdcOperation {
+  CDC_CUSTOMER_INSERT = 1, // customer_id, name, address, contact
+  CDC_CUSTOMER_UPDATE = 2, // customer_id, name, address, contact
+  CDC_CUSTOMER_DELETE = 3, // customer_id
+  CDC_ACCOUNT_INSERT = 4,  // account_number, customer_id, type, balance
+  CDC_TRANSACTION_POST = 5, // transaction_id, account_number, date, amount,
+                            // type, balance after the entry
+  CDC_ACCOUNT_UPDATE = 6,   // account_number, type, closed_at ("" if open)
+  CDC_ACCOUNT_DELETE = 7,   // account_number, with all of its transactions
+  CDC_DATABASE_RESTORE = 8  // dump path; customers, accounts and
+                            // transactions were replaced as a whole
+};
+
+struct CdcRecord {
+  uint64_t seq;
+  int op;
+  int field_count;
+  const char *fields[CDC_MAX_FIELDS];
+  char *buffer;
+  size_t buffer_capacity;
+};
+
+struct CdcCursor {
+  char dir[256];
+  int segment;
+  long offset;
+  uint64_t last_seq;
+  FILE *file;
+};
+
+int cdc_open(const char *dir);
+void cdc_close(void);
+int cdc_enabled(void);
+int cdc_stage(sqlite3 *db, int op, int field_count, const char **fields);
+int cdc_commit(sqlite3 *db);
+void cdc_discard(sqlite3 *db);
+int cdc_recover(sqlite3 *db);
+int cdc_checkpoint(sqlite3 *db);
+
+uint64_t cdc_last_sequence(const char *dir);
+int cdc_cursor_open(struct CdcCursor *cursor, const char *dir,
+                    uint64_t after_seq);
+int cdc_cursor_next(struct CdcCursor *cursor, struct CdcRecord *record);
+void cdc_cursor_close(struct CdcCursor *cursor);
+void cdc_record_free(struct CdcRecord *record);
+const char *cdc_operation_name(int op);
+int print_change_log(const char *dir, uint64_t after_seq, int limit);
+
+#endif
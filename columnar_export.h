@@ -0,0 +1,39 @@
+#ifndef COLUMNAR_EXPORT_H
+#define COLUMNAR_EXPORT_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Columnar transaction file layout, integers little-endian:
+//   "BNKCOL01" u32 block_rows
+//   per block: u32 row_count, then for each column in order:
+//     u8 column_id, i64 min, i64 max, u32 byte_length, payload
+//   u32 0 terminates the file
+// Payloads are zigzag varints. Account numbers and timestamps are stored as
+// deltas from the previous row in the block; amounts are in cents.
+#define COLUMNAR_MAGIC "BNKCOL01"
+#define COLUMNAR_BLOCK_ROWS 4096
+
+enum ColumnarColumn {
+  COLUMN_ACCOUNT_NUMBER = 0,
+  COLUMN_AMOUNT_CENTS = 1,
+  COLUMN_TIMESTAMP = 2,
+  COLUMNAR_COLUMN_COUNT = 3
+};
+
+struct ColumnarScanResult {
+  int64_t rows_scanned;
+  int64_t rows_matched;
+  int64_t sum;
+  int blocks_read;
+  int blocks_skipped;
+};
+
+int export_transactions_columnar(sqlite3 *db, const char *path,
+                                 int64_t *rows);
+int columnar_scan_sum(const char *path, enum ColumnarColumn column,
+                      int64_t min_value, int64_t max_value,
+                      struct ColumnarScanResult *result);
+
+#endif
@@ -0,0 +1,1013 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "account_system.h"
+#include "aggregate_reports.h"
+#include "customer_deletion.h"
+#include "customer_system.h"
+#include "idempotency.h"
+#include "ledger_partitions.h"
+#include "limits_engine.h"
+#include "sqlite3.h"
+#include "transaction_system.h"
+#include "utils_functions.h"
+
+// Crash-consistency harness. The bank's own posting paths run against a
+// database held in an in-memory VFS that remembers which writes have been
+// synced. At a random write, sync, truncate or delete the "machine" loses
+// power. Every write since its file's last sync is then dropped, kept or
+// torn at a sector boundary, and the database is reopened to check the
+// invariants:
+//   - total money moved only by postings that reported success, plus
+//     possibly the one that was in flight
+//   - each account's balance minus its ledger sum is unchanged
+//   - the per-type aggregate totals still match the balances
+//   - PRAGMA integrity_check is ok and the database takes a new posting
+// Syncs can also fail with SQLITE_IOERR_FSYNC and silently lose their
+// writes, the way Linux drops dirty pages after a failed fsync.
+//
+// Usage: crash_harness [-n iterations] [-s seed] [-p postings]
+//                      [-f lost_fsync_percent] [-d bank.db] [-v]
+
+#define CRASH_VFS_NAME "crashvfs"
+#define CRASH_DB_NAME "bank.db"
+#define CRASH_SECTOR_SIZE 512
+#define CRASH_MAX_FILES 16
+#define CRASH_SEED_ACCOUNTS 24
+#define CRASH_MAX_ACCOUNTS 64
+
+// A write or truncate not yet made durable by a sync
+struct PendingWrite {
+  sqlite3_int64 offset;
+  int length; // -1 for a truncate to offset
+  unsigned char *data;
+};
+
+// One file as the process sees it and as it would survive a power loss
+struct MemFile {
+  char name[512];
+  int exists;
+  unsigned char *data;
+  sqlite3_int64 size;
+  sqlite3_int64 capacity;
+  unsigned char *durable;
+  sqlite3_int64 durable_size;
+  sqlite3_int64 durable_capacity;
+  struct PendingWrite *pending;
+  int pending_count;
+  int pending_capacity;
+  // State every iteration starts from
+  unsigned char *baseline;
+  sqlite3_int64 baseline_size;
+  int baseline_exists;
+};
+
+struct CrashFile {
+  sqlite3_file base;
+  struct MemFile *file;
+  int temporary; // private to the handle, freed on close
+};
+
+static struct {
+  struct MemFile *files[CRASH_MAX_FILES];
+  int file_count;
+  int64_t io_count;
+  int64_t crash_at; // 0 never crashes
+  int crashed;
+  int lost_fsync_percent;
+  uint64_t rng;
+  int64_t writes_applied;
+  int64_t writes_dropped;
+  int64_t writes_torn;
+  int64_t syncs_lost;
+} vfs;
+
+static sqlite3_vfs *base_vfs;
+
+static uint64_t next_random(void) {
+  // xorshift64*
+  vfs.rng ^= vfs.rng >> 12;
+  vfs.rng ^= vfs.rng << 25;
+  vfs.rng ^= vfs.rng >> 27;
+  return vfs.rng * 2685821657736338717ULL;
+}
+
+static int grow(unsigned char **data, sqlite3_int64 *capacity,
+                sqlite3_int64 size) {
+  if (size <= *capacity) {
+    return 1;
+  }
+  sqlite3_int64 next = *capacity == 0 ? 65536 : *capacity;
+  while (next < size) {
+    next *= 2;
+  }
+  unsigned char *grown = realloc(*data, next);
+  if (grown == NULL) {
+    return 0;
+  }
+  memset(grown + *capacity, 0, next - *capacity);
+  *data = grown;
+  *capacity = next;
+  return 1;
+}
+
+// Write into a buffer, zero-filling any gap past its end
+static int put_bytes(unsigned char **data, sqlite3_int64 *size,
+                     sqlite3_int64 *capacity, sqlite3_int64 offset,
+                     const void *bytes, int length) {
+  if (!grow(data, capacity, offset + length)) {
+    return 0;
+  }
+  if (offset > *size) {
+    memset(*data + *size, 0, offset - *size);
+  }
+  memcpy(*data + offset, bytes, length);
+  if (offset + length > *size) {
+    *size = offset + length;
+  }
+  return 1;
+}
+
+static void clear_pending(struct MemFile *file) {
+  for (int i = 0; i < file->pending_count; i++) {
+    free(file->pending[i].data);
+  }
+  file->pending_count = 0;
+}
+
+static int add_pending(struct MemFile *file, sqlite3_int64 offset,
+                       const void *bytes, int length) {
+  if (file->pending_count == file->pending_capacity) {
+    int capacity = file->pending_capacity == 0 ? 64 : file->pending_capacity * 2;
+    struct PendingWrite *grown =
+        realloc(file->pending, capacity * sizeof(struct PendingWrite));
+    if (grown == NULL) {
+      return 0;
+    }
+    file->pending = grown;
+    file->pending_capacity = capacity;
+  }
+
+  struct PendingWrite *write = &file->pending[file->pending_count];
+  write->offset = offset;
+  write->length = length;
+  write->data = NULL;
+  if (length > 0) {
+    write->data = malloc(length);
+    if (write->data == NULL) {
+      return 0;
+    }
+    memcpy(write->data, bytes, length);
+  }
+  file->pending_count++;
+  return 1;
+}
+
+// Apply a pending write to the durable image, or only its first sectors
+static void persist(struct MemFile *file, const struct PendingWrite *write,
+                    int length) {
+  if (write->length < 0) {
+    if (write->offset < file->durable_size) {
+      file->durable_size = write->offset;
+    }
+    return;
+  }
+  if (length > 0) {
+    put_bytes(&file->durable, &file->durable_size, &file->durable_capacity,
+              write->offset, write->data, length);
+  }
+}
+
+// Count one state-changing operation; returns 1 once power has been lost
+static int power_lost(void) {
+  if (vfs.crashed) {
+    return 1;
+  }
+  vfs.io_count++;
+  if (vfs.crash_at != 0 && vfs.io_count >= vfs.crash_at) {
+    vfs.crashed = 1;
+  }
+  return vfs.crashed;
+}
+
+static struct MemFile *find_file(const char *name) {
+  for (int i = 0; i < vfs.file_count; i++) {
+    if (strcmp(vfs.files[i]->name, name) == 0) {
+      return vfs.files[i];
+    }
+  }
+  return NULL;
+}
+
+static int crash_close(sqlite3_file *handle) {
+  struct CrashFile *crash_file = (struct CrashFile *)handle;
+  if (crash_file->temporary) {
+    free(crash_file->file->data);
+    free(crash_file->file);
+  }
+  return SQLITE_OK;
+}
+
+static int crash_read(sqlite3_file *handle, void *buffer, int amount,
+                      sqlite3_int64 offset) {
+  struct MemFile *file = ((struct CrashFile *)handle)->file;
+
+  if (vfs.crashed) {
+    return SQLITE_IOERR_READ;
+  }
+  if (offset >= file->size) {
+    memset(buffer, 0, amount);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  if (offset + amount > file->size) {
+    int available = (int)(file->size - offset);
+    memcpy(buffer, file->data + offset, available);
+    memset((char *)buffer + available, 0, amount - available);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  memcpy(buffer, file->data + offset, amount);
+  return SQLITE_OK;
+}
+
+static int crash_write(sqlite3_file *handle, const void *buffer, int amount,
+                       sqlite3_int64 offset) {
+  struct CrashFile *crash_file = (struct CrashFile *)handle;
+  struct MemFile *file = crash_file->file;
+
+  if (!crash_file->temporary && power_lost()) {
+    return SQLITE_IOERR_WRITE;
+  }
+  if (!put_bytes(&file->data, &file->size, &file->capacity, offset, buffer,
+                 amount) ||
+      (!crash_file->temporary && !add_pending(file, offset, buffer, amount))) {
+    return SQLITE_IOERR_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+static int crash_truncate(sqlite3_file *handle, sqlite3_int64 size) {
+  struct CrashFile *crash_file = (struct CrashFile *)handle;
+  struct MemFile *file = crash_file->file;
+
+  if (!crash_file->temporary && power_lost()) {
+    return SQLITE_IOERR_TRUNCATE;
+  }
+  if (size < file->size) {
+    file->size = size;
+  }
+  if (!crash_file->temporary && !add_pending(file, size, NULL, -1)) {
+    return SQLITE_IOERR_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+// Make the file's pending writes durable, unless this sync is one that
+// fails: then its writes stay visible but will never reach the disk.
+// Syncs only fail in runs heading for a crash, never during recovery
+static int crash_sync(sqlite3_file *handle, int flags) {
+  struct CrashFile *crash_file = (struct CrashFile *)handle;
+  struct MemFile *file = crash_file->file;
+  (void)flags;
+
+  if (crash_file->temporary) {
+    return SQLITE_OK;
+  }
+  if (power_lost()) {
+    return SQLITE_IOERR_FSYNC;
+  }
+  if (vfs.crash_at != 0 && vfs.lost_fsync_percent > 0 &&
+      (int)(next_random() % 100) < vfs.lost_fsync_percent) {
+    clear_pending(file);
+    vfs.syncs_lost++;
+    return SQLITE_IOERR_FSYNC;
+  }
+  for (int i = 0; i < file->pending_count; i++) {
+    persist(file, &file->pending[i], file->pending[i].length);
+  }
+  clear_pending(file);
+  return SQLITE_OK;
+}
+
+static int crash_file_size(sqlite3_file *handle, sqlite3_int64 *size) {
+  if (vfs.crashed) {
+    return SQLITE_IOERR_FSTAT;
+  }
+  *size = ((struct CrashFile *)handle)->file->size;
+  return SQLITE_OK;
+}
+
+// One process, one connection: locks always succeed
+static int crash_lock(sqlite3_file *handle, int level) {
+  (void)handle;
+  (void)level;
+  return SQLITE_OK;
+}
+
+static int crash_check_reserved_lock(sqlite3_file *handle, int *reserved) {
+  (void)handle;
+  *reserved = 0;
+  return SQLITE_OK;
+}
+
+static int crash_file_control(sqlite3_file *handle, int op, void *arg) {
+  (void)handle;
+  (void)op;
+  (void)arg;
+  return SQLITE_NOTFOUND;
+}
+
+static int crash_sector_size(sqlite3_file *handle) {
+  (void)handle;
+  return CRASH_SECTOR_SIZE;
+}
+
+// Promise nothing, so SQLite takes every precaution it has
+static int crash_device_characteristics(sqlite3_file *handle) {
+  (void)handle;
+  return 0;
+}
+
+static const sqlite3_io_methods crash_io_methods = {
+    1,
+    crash_close,
+    crash_read,
+    crash_write,
+    crash_truncate,
+    crash_sync,
+    crash_file_size,
+    crash_lock,
+    crash_lock,
+    crash_check_reserved_lock,
+    crash_file_control,
+    crash_sector_size,
+    crash_device_characteristics,
+    // Version 2 and 3 methods: no shared memory (so no WAL) and no mmap
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL};
+
+// Creating and deleting files are treated as durable at once, as on a
+// filesystem that journals its metadata; file contents are not
+static int crash_open(sqlite3_vfs *self, const char *name,
+                      sqlite3_file *handle, int flags, int *out_flags) {
+  struct CrashFile *crash_file = (struct CrashFile *)handle;
+  (void)self;
+
+  crash_file->base.pMethods = NULL;
+  if (name == NULL) {
+    crash_file->file = calloc(1, sizeof(struct MemFile));
+    if (crash_file->file == NULL) {
+      return SQLITE_NOMEM;
+    }
+    crash_file->file->exists = 1;
+    crash_file->temporary = 1;
+  } else {
+    if (vfs.crashed) {
+      return SQLITE_CANTOPEN;
+    }
+    struct MemFile *file = find_file(name);
+    if (file == NULL && vfs.file_count < CRASH_MAX_FILES) {
+      file = calloc(1, sizeof(struct MemFile));
+      if (file == NULL) {
+        return SQLITE_NOMEM;
+      }
+      snprintf(file->name, sizeof(file->name), "%s", name);
+      vfs.files[vfs.file_count++] = file;
+    }
+    if (file == NULL || (!file->exists && !(flags & SQLITE_OPEN_CREATE))) {
+      return SQLITE_CANTOPEN;
+    }
+    if (!file->exists) {
+      file->exists = 1;
+      file->size = 0;
+      file->durable_size = 0;
+      clear_pending(file);
+    }
+    crash_file->file = file;
+    crash_file->temporary = 0;
+  }
+
+  if (out_flags != NULL) {
+    *out_flags = flags;
+  }
+  crash_file->base.pMethods = &crash_io_methods;
+  return SQLITE_OK;
+}
+
+static int crash_delete(sqlite3_vfs *self, const char *name, int sync_dir) {
+  (void)self;
+  (void)sync_dir;
+
+  if (power_lost()) {
+    return SQLITE_IOERR_DELETE;
+  }
+  struct MemFile *file = find_file(name);
+  if (file == NULL || !file->exists) {
+    return SQLITE_IOERR_DELETE_NOENT;
+  }
+  file->exists = 0;
+  file->size = 0;
+  file->durable_size = 0;
+  clear_pending(file);
+  return SQLITE_OK;
+}
+
+static int crash_access(sqlite3_vfs *self, const char *name, int flags,
+                        int *result) {
+  (void)self;
+  (void)flags;
+
+  if (vfs.crashed) {
+    return SQLITE_IOERR_ACCESS;
+  }
+  struct MemFile *file = find_file(name);
+  *result = file != NULL && file->exists;
+  return SQLITE_OK;
+}
+
+static int crash_full_pathname(sqlite3_vfs *self, const char *name, int size,
+                               char *out) {
+  (void)self;
+  snprintf(out, size, "%s", name);
+  return SQLITE_OK;
+}
+
+static void *crash_dl_open(sqlite3_vfs *self, const char *name) {
+  (void)self;
+  return base_vfs->xDlOpen(base_vfs, name);
+}
+
+static void crash_dl_error(sqlite3_vfs *self, int size, char *message) {
+  (void)self;
+  base_vfs->xDlError(base_vfs, size, message);
+}
+
+static void (*crash_dl_sym(sqlite3_vfs *self, void *library,
+                           const char *symbol))(void) {
+  (void)self;
+  return base_vfs->xDlSym(base_vfs, library, symbol);
+}
+
+static void crash_dl_close(sqlite3_vfs *self, void *library) {
+  (void)self;
+  base_vfs->xDlClose(base_vfs, library);
+}
+
+static int crash_randomness(sqlite3_vfs *self, int size, char *out) {
+  (void)self;
+  return base_vfs->xRandomness(base_vfs, size, out);
+}
+
+static int crash_sleep(sqlite3_vfs *self, int microseconds) {
+  (void)self;
+  return base_vfs->xSleep(base_vfs, microseconds);
+}
+
+static int crash_current_time(sqlite3_vfs *self, double *now) {
+  (void)self;
+  return base_vfs->xCurrentTime(base_vfs, now);
+}
+
+static int crash_get_last_error(sqlite3_vfs *self, int size, char *out) {
+  (void)self;
+  (void)size;
+  (void)out;
+  return 0;
+}
+
+static sqlite3_vfs crash_vfs = {
+    1,
+    sizeof(struct CrashFile),
+    512,
+    NULL,
+    CRASH_VFS_NAME,
+    NULL,
+    crash_open,
+    crash_delete,
+    crash_access,
+    crash_full_pathname,
+    crash_dl_open,
+    crash_dl_error,
+    crash_dl_sym,
+    crash_dl_close,
+    crash_randomness,
+    crash_sleep,
+    crash_current_time,
+    crash_get_last_error,
+    // Version 2 and 3 methods
+    NULL,
+    NULL,
+    NULL,
+    NULL};
+
+// Power comes back: each file keeps its durable image plus, for every
+// unsynced write in order, nothing, all of it or its first few sectors
+static void reboot(void) {
+  for (int i = 0; i < vfs.file_count; i++) {
+    struct MemFile *file = vfs.files[i];
+
+    for (int w = 0; w < file->pending_count; w++) {
+      struct PendingWrite *write = &file->pending[w];
+      int sectors = write->length > 0
+                        ? (write->length + CRASH_SECTOR_SIZE - 1) /
+                              CRASH_SECTOR_SIZE
+                        : 1;
+
+      switch (next_random() % 3) {
+      case 0:
+        vfs.writes_dropped++;
+        break;
+      case 1:
+        persist(file, write, write->length);
+        vfs.writes_applied++;
+        break;
+      default:
+        if (write->length <= 0 || sectors == 1) {
+          vfs.writes_dropped++;
+          break;
+        }
+        persist(file, write,
+                (int)(next_random() % sectors) * CRASH_SECTOR_SIZE);
+        vfs.writes_torn++;
+        break;
+      }
+    }
+    clear_pending(file);
+
+    file->size = 0;
+    if (file->exists) {
+      put_bytes(&file->data, &file->size, &file->capacity, 0, file->durable,
+                (int)file->durable_size);
+    }
+  }
+  vfs.crashed = 0;
+  vfs.crash_at = 0;
+}
+
+// Remember the current files as the state each iteration starts from
+static int save_baseline(void) {
+  for (int i = 0; i < vfs.file_count; i++) {
+    struct MemFile *file = vfs.files[i];
+    free(file->baseline);
+    file->baseline = NULL;
+    file->baseline_size = file->size;
+    file->baseline_exists = file->exists;
+    if (file->exists && file->size > 0) {
+      file->baseline = malloc(file->size);
+      if (file->baseline == NULL) {
+        return 0;
+      }
+      memcpy(file->baseline, file->data, file->size);
+    }
+  }
+  return 1;
+}
+
+static void restore_baseline(void) {
+  for (int i = 0; i < vfs.file_count; i++) {
+    struct MemFile *file = vfs.files[i];
+    clear_pending(file);
+    file->exists = file->baseline_exists;
+    file->size = 0;
+    file->durable_size = 0;
+    if (file->exists && file->baseline_size > 0) {
+      put_bytes(&file->data, &file->size, &file->capacity, 0, file->baseline,
+                (int)file->baseline_size);
+      put_bytes(&file->durable, &file->durable_size, &file->durable_capacity,
+                0, file->baseline, (int)file->baseline_size);
+    }
+  }
+  vfs.crashed = 0;
+  vfs.crash_at = 0;
+  vfs.io_count = 0;
+}
+
+// Load a database file from disk as the starting image
+static int load_database_file(const char *path) {
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    perror("Can't open database");
+    return 0;
+  }
+
+  struct MemFile *file = calloc(1, sizeof(struct MemFile));
+  if (file == NULL) {
+    fclose(in);
+    return 0;
+  }
+  snprintf(file->name, sizeof(file->name), "%s", CRASH_DB_NAME);
+  file->exists = 1;
+  vfs.files[vfs.file_count++] = file;
+
+  unsigned char chunk[65536];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    put_bytes(&file->data, &file->size, &file->capacity, file->size, chunk,
+              (int)length);
+  }
+  fclose(in);
+  put_bytes(&file->durable, &file->durable_size, &file->durable_capacity, 0,
+            file->data, (int)file->size);
+  return 1;
+}
+
+static int open_bank(sqlite3 **db) {
+  int rc = sqlite3_open_v2(CRASH_DB_NAME, db,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                           CRASH_VFS_NAME);
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(*db, "PRAGMA foreign_keys = ON;");
+  }
+  if (rc == SQLITE_OK) {
+    rc = load_account_limits(*db);
+  }
+  return rc;
+}
+
+// The schema the posting paths need, as the application creates it
+static int create_schema(sqlite3 *db) {
+  int rc = create_customers_table(db);
+  if (rc == SQLITE_OK) {
+    rc = create_accounts_table(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_transactions_table(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_aggregate_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_idempotency_table(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_limits_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_partition_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_deletion_tables(db);
+  }
+  return rc;
+}
+
+// Fresh database: customers with funded accounts, every balance backed by
+// its opening deposit
+static int seed_bank(sqlite3 *db) {
+  int rc = execute_sql(
+      db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+          "WHERE i < 24) "
+          "INSERT OR IGNORE INTO customers (customer_id, name, address, "
+          "contact) SELECT 'crash-' || i, 'Customer ' || i, 'Street ' || i, "
+          "'0800' || i FROM n;"
+          "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+          "WHERE i < 24) "
+          "INSERT OR IGNORE INTO accounts (account_number, customer_id, "
+          "account_type, balance) SELECT printf('9%09d', i), 'crash-' || i, "
+          "CASE WHEN i % 2 THEN 'savings' ELSE 'current' END, 0 FROM n;");
+  for (int i = 1; rc == SQLITE_OK && i <= CRASH_SEED_ACCOUNTS; i++) {
+    char account_number[16];
+    snprintf(account_number, sizeof(account_number), "9%09d", i);
+    rc = deposit_money(db, NULL, account_number, 5000.00);
+  }
+  return rc;
+}
+
+// What the invariants are measured against
+struct BankState {
+  int64_t total_cents;
+  int64_t aggregate_drift; // type totals minus the balances they cover
+  int account_count;
+  char accounts[CRASH_MAX_ACCOUNTS][16];
+  int64_t ledger_drift[CRASH_MAX_ACCOUNTS]; // balance minus ledger sum
+};
+
+static int read_state(sqlite3 *db, struct BankState *state) {
+  sqlite3_stmt *stmt;
+
+  memset(state, 0, sizeof(*state));
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT a.account_number, CAST(round(a.balance * 100) AS INTEGER) - "
+      "IFNULL((SELECT SUM(CAST(round(t.amount * 100) AS INTEGER)) "
+      "FROM transactions t WHERE t.account_number = a.account_number), 0) "
+      "FROM accounts a WHERE a.closed_at IS NULL "
+      "ORDER BY a.account_number LIMIT ?;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_bind_int(stmt, 1, CRASH_MAX_ACCOUNTS);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int i = state->account_count++;
+    snprintf(state->accounts[i], sizeof(state->accounts[i]), "%s",
+             sqlite3_column_text(stmt, 0));
+    state->ledger_drift[i] = sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT IFNULL(SUM(CAST(round(balance * 100) AS INTEGER)), 0), "
+      "(SELECT IFNULL(SUM(balance_cents), 0) FROM account_type_totals) "
+      "FROM accounts;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    state->total_cents = sqlite3_column_int64(stmt, 0);
+    state->aggregate_drift = sqlite3_column_int64(stmt, 1) - state->total_cents;
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static int integrity_ok(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int ok = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA integrity_check;", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    return 0;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    ok = strcmp((const char *)sqlite3_column_text(stmt, 0), "ok") == 0 &&
+         sqlite3_step(stmt) == SQLITE_DONE;
+  }
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+// Run up to count random postings; returns how many completed and sets the
+// money they added and what the interrupted one would have added
+static int run_postings(sqlite3 *db, const struct BankState *baseline,
+                        int count, int64_t *committed, int64_t *in_flight) {
+  int done = 0;
+
+  *committed = 0;
+  *in_flight = 0;
+  for (; done < count && !vfs.crashed; done++) {
+    // Transfers always go between two different accounts
+    int first = (int)(next_random() % baseline->account_count);
+    int second = (first + 1 +
+                  (int)(next_random() % (baseline->account_count - 1))) %
+                 baseline->account_count;
+    const char *from = baseline->accounts[first];
+    const char *to = baseline->accounts[second];
+    int64_t cents = (int64_t)(next_random() % 50000) + 1;
+    int64_t delta;
+    int rc;
+
+    switch (next_random() % 4) {
+    case 0:
+      delta = cents;
+      rc = deposit_money(db, NULL, to, cents / 100.0);
+      break;
+    case 1:
+      delta = -cents;
+      rc = withdraw_money(db, NULL, from, cents / 100.0);
+      break;
+    default:
+      delta = 0;
+      rc = transfer_money(db, NULL, from, to, cents / 100.0);
+      break;
+    }
+
+    if (rc == SQLITE_OK) {
+      *committed += delta;
+    } else if (vfs.crashed) {
+      *in_flight = delta;
+    }
+  }
+  return done;
+}
+
+// Compare the recovered database with the baseline and what was posted
+static int check_invariants(sqlite3 *db, const struct BankState *baseline,
+                            int64_t committed, int64_t in_flight,
+                            char *problem, int size) {
+  struct BankState state;
+
+  if (!integrity_ok(db)) {
+    snprintf(problem, size, "integrity_check failed");
+    return 0;
+  }
+  if (read_state(db, &state) != SQLITE_OK) {
+    snprintf(problem, size, "can't read state: %s", sqlite3_errmsg(db));
+    return 0;
+  }
+  if (state.total_cents != baseline->total_cents + committed &&
+      state.total_cents != baseline->total_cents + committed + in_flight) {
+    snprintf(problem, size,
+             "money not conserved: total %lld, expected %lld or %lld",
+             (long long)state.total_cents,
+             (long long)(baseline->total_cents + committed),
+             (long long)(baseline->total_cents + committed + in_flight));
+    return 0;
+  }
+  if (state.account_count != baseline->account_count) {
+    snprintf(problem, size, "%d open accounts, expected %d",
+             state.account_count, baseline->account_count);
+    return 0;
+  }
+  for (int i = 0; i < state.account_count; i++) {
+    if (strcmp(state.accounts[i], baseline->accounts[i]) != 0 ||
+        state.ledger_drift[i] != baseline->ledger_drift[i]) {
+      snprintf(problem, size, "account %s balance differs from its ledger",
+               state.accounts[i]);
+      return 0;
+    }
+  }
+  if (state.aggregate_drift != baseline->aggregate_drift) {
+    snprintf(problem, size, "account type totals off by %lld cents",
+             (long long)(state.aggregate_drift - baseline->aggregate_drift));
+    return 0;
+  }
+  if (deposit_money(db, NULL, baseline->accounts[0], 1.00) != SQLITE_OK) {
+    snprintf(problem, size, "database refuses a posting after recovery");
+    return 0;
+  }
+  return 1;
+}
+
+static double elapsed_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  long iterations = 2000;
+  int postings = 8;
+  uint64_t seed = (uint64_t)time(NULL);
+  const char *source = NULL;
+  int verbose = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:p:f:d:v")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'p':
+      postings = atoi(optarg);
+      break;
+    case 'f':
+      vfs.lost_fsync_percent = atoi(optarg);
+      break;
+    case 'd':
+      source = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n iterations] [-s seed] [-p postings] "
+              "[-f lost_fsync_percent] [-d bank.db] [-v]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  vfs.rng = seed != 0 ? seed : 1;
+  base_vfs = sqlite3_vfs_find(NULL);
+  crash_vfs.mxPathname = base_vfs->mxPathname;
+  sqlite3_vfs_register(&crash_vfs, 0);
+
+  if (source != NULL && !load_database_file(source)) {
+    return 1;
+  }
+
+  // Build the starting image with faults off
+  sqlite3 *db;
+  int lost_fsync_percent = vfs.lost_fsync_percent;
+  vfs.lost_fsync_percent = 0;
+  int rc = sqlite3_open_v2(CRASH_DB_NAME, &db,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                           CRASH_VFS_NAME);
+  if (rc == SQLITE_OK) {
+    rc = create_schema(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = load_account_limits(db);
+  }
+
+  // A loaded database too small to transfer between gets the seed
+  // accounts as well; only the in-memory image is changed
+  struct BankState baseline;
+  if (rc == SQLITE_OK && source != NULL) {
+    rc = read_state(db, &baseline);
+  }
+  if (rc == SQLITE_OK && (source == NULL || baseline.account_count < 2)) {
+    rc = seed_bank(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = read_state(db, &baseline);
+  }
+  if (rc != SQLITE_OK || baseline.account_count < 2) {
+    fprintf(stderr, "Can't prepare the starting database: %s\n",
+            sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_close(db);
+  if (!save_baseline()) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  // A run without a crash sizes the range crash points are drawn from
+  int64_t committed, in_flight;
+  restore_baseline();
+  if (open_bank(&db) != SQLITE_OK) {
+    fprintf(stderr, "Can't open the starting database: %s\n",
+            sqlite3_errmsg(db));
+    return 1;
+  }
+  run_postings(db, &baseline, postings, &committed, &in_flight);
+  sqlite3_close(db);
+  int64_t io_per_run = vfs.io_count > 0 ? vfs.io_count : 1;
+  vfs.lost_fsync_percent = lost_fsync_percent;
+
+  printf("Crash harness: seed %llu, %ld iteration(s), %d posting(s) each, "
+         "%lld I/O operation(s) per run, %d%% lost fsyncs\n",
+         (unsigned long long)seed, iterations, postings,
+         (long long)io_per_run, lost_fsync_percent);
+
+  // Postings report every injected failure on stderr
+  int saved_stderr = dup(STDERR_FILENO);
+  if (!verbose) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDERR_FILENO);
+      close(null_fd);
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long violations = 0;
+  int64_t completed = 0;
+
+  for (long iteration = 1; iteration <= iterations; iteration++) {
+    char problem[256];
+
+    restore_baseline();
+    vfs.crash_at = 1 + (int64_t)(next_random() % (uint64_t)io_per_run);
+
+    if (open_bank(&db) == SQLITE_OK) {
+      completed += run_postings(db, &baseline, postings, &committed,
+                                &in_flight);
+    }
+    sqlite3_close_v2(db);
+
+    reboot();
+
+    rc = open_bank(&db);
+    int ok = rc == SQLITE_OK &&
+             check_invariants(db, &baseline, committed, in_flight, problem,
+                              sizeof(problem));
+    if (rc != SQLITE_OK) {
+      snprintf(problem, sizeof(problem), "reopen failed: %s",
+               sqlite3_errmsg(db));
+    }
+    sqlite3_close_v2(db);
+
+    if (!ok) {
+      violations++;
+      dprintf(saved_stderr, "Iteration %ld (crash at I/O %lld): %s\n",
+              iteration, (long long)vfs.io_count, problem);
+    }
+  }
+
+  double seconds = elapsed_since(&start);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+
+  printf("%ld crash(es), %lld posting(s) attempted, %ld violation(s)\n",
+         iterations, (long long)completed, violations);
+  printf("Unsynced writes at crash: %lld applied, %lld torn, %lld dropped; "
+         "%lld lost fsync(s)\n",
+         (long long)vfs.writes_applied, (long long)vfs.writes_torn,
+         (long long)vfs.writes_dropped, (long long)vfs.syncs_lost);
+  printf("%.2f s, %.0f iterations/minute\n", seconds,
+         seconds > 0 ? iterations * 60.0 / seconds : 0.0);
+  return violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,769 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "change_log.h"
+#include "customer_deletion.h"
+#include "db_config.h"
+#include "gen_account_number.h"
+#include "ledger_archive.h"
+#include "ledger_partitions.h"
+#include "limits_engine.h"
+#include "reconciliation.h"
+#include "shard_system.h"
+#include "sqlite3.h"
+#include "sync_system.h"
+#include "utils_functions.h"
+
+enum PurgeStatement {
+  PURGE_ARCHIVE_HISTORY,
+  PURGE_DELETE_HISTORY,
+  PURGE_PROGRESS,
+  PURGE_ARCHIVE_ACCOUNT,
+  PURGE_DELETE_LIMITS,
+  PURGE_DELETE_COUNTERS,
+  PURGE_DELETE_CARRY,
+  PURGE_DELETE_ACCOUNT,
+  PURGE_KEEP_HIGH_WATER,
+  PURGE_ARCHIVE_CUSTOMER,
+  PURGE_DELETE_CUSTOMER,
+  PURGE_COMPLETE,
+  PURGE_STATEMENT_COUNT
+};
+
+// History is taken oldest first in (date, rowid) order. The archive copy and
+// the delete pick the same rows because they run in the same transaction.
+// Once a chunk leaves the newest ledger row below the last reconciliation's
+// rowid high-water mark, SQLite may hand the freed rowids out again, so the
+// lowest such newest row is kept in ledger_high_water for the next run.
+static const char *purge_sql[PURGE_STATEMENT_COUNT] = {
+    "INSERT INTO archived_transactions (transaction_id, account_number, "
+    "date, amount, type, archived_at) "
+    "SELECT transaction_id, account_number, date, amount, type, "
+    "strftime('%Y-%m-%d %H:%M:%S', 'now') FROM transactions "
+    "WHERE account_number = ?1 ORDER BY date, rowid LIMIT ?2;",
+    "DELETE FROM transactions WHERE rowid IN (SELECT rowid FROM transactions "
+    "WHERE account_number = ?1 ORDER BY date, rowid LIMIT ?2);",
+    "UPDATE customer_deletions SET "
+    "transactions_removed = transactions_removed + ?2, "
+    "accounts_removed = accounts_removed + ?3 WHERE customer_id = ?1;",
+    "INSERT INTO archived_accounts (account_number, customer_id, "
+    "account_type, balance, closed_at, archived_at) "
+    "SELECT account_number, customer_id, account_type, balance, closed_at, "
+    "strftime('%Y-%m-%d %H:%M:%S', 'now') FROM accounts "
+    "WHERE account_number = ?1;",
+    "DELETE FROM account_limits WHERE account_number = ?1;",
+    "DELETE FROM limit_counters WHERE account_number = ?1;",
+    "DELETE FROM ledger_carry WHERE account_number = ?1;",
+    "DELETE FROM accounts WHERE account_number = ?1;",
+    "INSERT INTO ledger_high_water (id, reissued_above) SELECT 1, high "
+    "FROM (SELECT IFNULL(MAX(rowid), 0) AS high FROM transactions) "
+    "WHERE high < (SELECT last_transaction_rowid FROM reconciliation_runs "
+    "ORDER BY snapshot_id DESC LIMIT 1) "
+    "ON CONFLICT(id) DO UPDATE SET "
+    "reissued_above = MIN(reissued_above, excluded.reissued_above);",
+    "INSERT INTO archived_customers (customer_id, name, address, contact, "
+    "archived_at) SELECT customer_id, name, address, contact, "
+    "strftime('%Y-%m-%d %H:%M:%S', 'now') FROM customers "
+    "WHERE customer_id = ?1;",
+    "DELETE FROM customers WHERE customer_id = ?1;",
+    "UPDATE customer_deletions SET "
+    "completed_at = strftime('%Y-%m-%d %H:%M:%S', 'now') "
+    "WHERE customer_id = ?1;"};
+
+// Background purger: one thread with its own connection working through
+// pending deletions
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  char db_uri[1024];
+  int running;
+  int stop;
+  int woken;
+} purger = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .wake = PTHREAD_COND_INITIALIZER};
+
+// Create the deletion queue and the archive tables. Purges record where
+// reconciliation has to read from, so its tables are created too. Purges used
+// to keep empty 'purged' rows with no account at the top of the ledger
+// instead; they are removed here.
+int create_deletion_tables(sqlite3 *db) {
+  int rc = create_reconciliation_tables(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = execute_sql(
+      db, "CREATE TABLE IF NOT EXISTS customer_deletions ("
+          "customer_id TEXT PRIMARY KEY, "
+          "mode INTEGER NOT NULL, "
+          "requested_at TEXT NOT NULL, "
+          "accounts_removed INTEGER NOT NULL DEFAULT 0, "
+          "transactions_removed INTEGER NOT NULL DEFAULT 0, "
+          "completed_at TEXT);"
+          "CREATE TABLE IF NOT EXISTS archived_customers ("
+          "customer_id TEXT PRIMARY KEY, "
+          "name TEXT, "
+          "address TEXT, "
+          "contact TEXT, "
+          "archived_at TEXT);"
+          "CREATE TABLE IF NOT EXISTS archived_accounts ("
+          "account_number TEXT PRIMARY KEY, "
+          "customer_id TEXT, "
+          "account_type TEXT, "
+          "balance REAL, "
+          "closed_at TEXT, "
+          "archived_at TEXT);"
+          "CREATE TABLE IF NOT EXISTS archived_transactions ("
+          "transaction_id TEXT PRIMARY KEY, "
+          "account_number TEXT, "
+          "date TEXT, "
+          "amount REAL, "
+          "type TEXT, "
+          "archived_at TEXT);"
+          "CREATE INDEX IF NOT EXISTS idx_archived_transactions_account "
+          "ON archived_transactions(account_number, date);");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char *sql = sqlite3_mprintf("BEGIN IMMEDIATE;"
+                              "DELETE FROM transactions "
+                              "WHERE account_number IS NULL "
+                              "AND type = 'purged';"
+                              "%s"
+                              "COMMIT;",
+                              purge_sql[PURGE_KEEP_HIGH_WATER]);
+  rc = execute_sql(db, sql);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+  }
+  return rc;
+}
+
+static int purger_stopping(void) {
+  pthread_mutex_lock(&purger.lock);
+  int stop = purger.stop;
+  pthread_mutex_unlock(&purger.lock);
+  return stop;
+}
+
+// Step a statement to completion and reset it for the next binding
+static int run_statement(sqlite3 *db, sqlite3_stmt *stmt) {
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  return SQLITE_OK;
+}
+
+// Remove one account's history chunk by chunk, then the account itself
+static int purge_account(sqlite3 *db, sqlite3_stmt **stmts,
+                         const char *customer_id, const char *account_number,
+                         int archive, int background,
+                         struct DeletionReport *report) {
+  int removed;
+  int rc;
+
+  for (int i = PURGE_ARCHIVE_HISTORY; i <= PURGE_DELETE_ACCOUNT; i++) {
+    sqlite3_bind_text(stmts[i], 1, account_number, -1, SQLITE_TRANSIENT);
+  }
+  sqlite3_bind_int(stmts[PURGE_ARCHIVE_HISTORY], 2, DELETION_CHUNK_ROWS);
+  sqlite3_bind_int(stmts[PURGE_DELETE_HISTORY], 2, DELETION_CHUNK_ROWS);
+  sqlite3_bind_text(stmts[PURGE_PROGRESS], 1, customer_id, -1, SQLITE_STATIC);
+
+  do {
+    struct timespec start, end;
+
+    if (background && purger_stopping()) {
+      return SQLITE_INTERRUPT;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = execute_sql(db, "BEGIN IMMEDIATE;");
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+
+    if (archive) {
+      rc = run_statement(db, stmts[PURGE_ARCHIVE_HISTORY]);
+    }
+    if (rc == SQLITE_OK) {
+      rc = run_statement(db, stmts[PURGE_DELETE_HISTORY]);
+    }
+    removed = rc == SQLITE_OK ? sqlite3_changes(db) : 0;
+    if (rc == SQLITE_OK) {
+      rc = run_statement(db, stmts[PURGE_KEEP_HIGH_WATER]);
+    }
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_int(stmts[PURGE_PROGRESS], 2, removed);
+      sqlite3_bind_int(stmts[PURGE_PROGRESS], 3, 0);
+      rc = run_statement(db, stmts[PURGE_PROGRESS]);
+    }
+    if (rc == SQLITE_OK) {
+      rc = execute_sql(db, "COMMIT;");
+    }
+    if (rc != SQLITE_OK) {
+      execute_sql(db, "ROLLBACK;");
+      return rc;
+    }
+
+    report->transactions += removed;
+    if (background) {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      long held_us = (end.tv_sec - start.tv_sec) * 1000000L +
+                     (end.tv_nsec - start.tv_nsec) / 1000;
+      usleep(held_us > DELETION_PAUSE_MS * 1000 ? held_us
+                                                 : DELETION_PAUSE_MS * 1000);
+    }
+  } while (removed == DELETION_CHUNK_ROWS);
+
+  // History already moved to month partitions or ledger archives goes too
+  int64_t cold = 0;
+  rc = purge_partitioned_account(db, account_number, archive, &cold);
+  if (rc == SQLITE_OK) {
+    rc = purge_archived_account(db, account_number, archive, &cold);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (archive) {
+    rc = run_statement(db, stmts[PURGE_ARCHIVE_ACCOUNT]);
+  }
+  for (int i = PURGE_DELETE_LIMITS; rc == SQLITE_OK && i <= PURGE_DELETE_ACCOUNT;
+       i++) {
+    rc = run_statement(db, stmts[i]);
+  }
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_int64(stmts[PURGE_PROGRESS], 2, cold);
+    sqlite3_bind_int(stmts[PURGE_PROGRESS], 3, 1);
+    rc = run_statement(db, stmts[PURGE_PROGRESS]);
+  }
+  if (rc == SQLITE_OK) {
+    rc = cdc_stage(db, CDC_ACCOUNT_DELETE, 1, &account_number);
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    return rc;
+  }
+
+  cdc_commit(db);
+  limits_invalidate(account_number);
+  report->transactions += cold;
+  report->accounts++;
+  return SQLITE_OK;
+}
+
+// List the account numbers still owned by a customer
+static int list_accounts(sqlite3 *db, const char *customer_id,
+                         char (**accounts)[ACCOUNT_NUMBER_LENGTH + 1],
+                         int *count) {
+  sqlite3_stmt *stmt;
+  int capacity = 0;
+
+  *accounts = NULL;
+  *count = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT account_number FROM accounts "
+                              "WHERE customer_id = ? ORDER BY account_number;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (*count == capacity) {
+      capacity = capacity == 0 ? 8 : capacity * 2;
+      void *grown = realloc(*accounts, capacity * sizeof(**accounts));
+      if (grown == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      *accounts = grown;
+    }
+    snprintf((*accounts)[(*count)++], sizeof(**accounts), "%s",
+             sqlite3_column_text(stmt, 0));
+  }
+
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    free(*accounts);
+    *accounts = NULL;
+    return rc;
+  }
+  return SQLITE_OK;
+}
+
+// Work through one queued deletion. Every chunk commits on its own with its
+// progress, so an interrupted purge picks up where it stopped.
+static int purge_job(sqlite3 *db, const char *customer_id, int background,
+                     struct DeletionReport *report) {
+  sqlite3_stmt *stmts[PURGE_STATEMENT_COUNT] = {NULL};
+  sqlite3_stmt *job;
+  char(*accounts)[ACCOUNT_NUMBER_LENGTH + 1] = NULL;
+  int account_count = 0;
+  int archive = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT mode FROM customer_deletions "
+                              "WHERE customer_id = ? AND completed_at IS NULL;",
+                              -1, &job, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(job, 1, customer_id, -1, SQLITE_STATIC);
+  rc = sqlite3_step(job);
+  if (rc == SQLITE_ROW) {
+    archive = sqlite3_column_int(job, 0) == DELETION_ARCHIVE;
+  }
+  sqlite3_finalize(job);
+
+  if (rc != SQLITE_ROW) {
+    return rc == SQLITE_DONE ? SQLITE_NOTFOUND : rc;
+  }
+
+  rc = SQLITE_OK;
+  for (int i = 0; i < PURGE_STATEMENT_COUNT && rc == SQLITE_OK; i++) {
+    rc = sqlite3_prepare_v2(db, purge_sql[i], -1, &stmts[i], NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = list_accounts(db, customer_id, &accounts, &account_count);
+  }
+
+  for (int i = 0; i < account_count && rc == SQLITE_OK; i++) {
+    rc = purge_account(db, stmts, customer_id, accounts[i], archive,
+                       background, report);
+  }
+
+  // With the accounts gone the customer row can go
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "BEGIN IMMEDIATE;");
+    if (rc == SQLITE_OK) {
+      for (int i = PURGE_ARCHIVE_CUSTOMER; i <= PURGE_COMPLETE; i++) {
+        sqlite3_bind_text(stmts[i], 1, customer_id, -1, SQLITE_STATIC);
+      }
+      if (archive) {
+        rc = run_statement(db, stmts[PURGE_ARCHIVE_CUSTOMER]);
+      }
+      if (rc == SQLITE_OK) {
+        rc = run_statement(db, stmts[PURGE_DELETE_CUSTOMER]);
+      }
+      if (rc == SQLITE_OK) {
+        rc = run_statement(db, stmts[PURGE_COMPLETE]);
+      }
+      if (rc == SQLITE_OK) {
+        rc = cdc_stage(db, CDC_CUSTOMER_DELETE, 1, &customer_id);
+      }
+      if (rc == SQLITE_OK) {
+        rc = execute_sql(db, "COMMIT;");
+      }
+      if (rc != SQLITE_OK) {
+        execute_sql(db, "ROLLBACK;");
+        cdc_discard(db);
+      } else {
+        cdc_commit(db);
+      }
+    }
+  }
+
+  free(accounts);
+  for (int i = 0; i < PURGE_STATEMENT_COUNT; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  return rc;
+}
+
+// Finish a queued deletion on this connection
+int purge_customer(sqlite3 *db, const char *customer_id,
+                   struct DeletionReport *report) {
+  memset(report, 0, sizeof(*report));
+  return purge_job(db, customer_id, 0, report);
+}
+
+// Close the customer's accounts and queue the deletion, all in one write
+// transaction so no posting can slip in after the balance check
+static int queue_deletion(sqlite3 *db, const char *customer_id,
+                          enum DeletionMode mode, int *history_rows) {
+  struct ShardSet *set = routed_shards();
+  sqlite3_stmt *stmt;
+  int sharded = 0;
+
+  // The purger only removes what bank.db holds, so accounts on shards keep
+  // the customer. Shards open no new accounts for a customer being deleted.
+  if (set != NULL) {
+    struct Account *accounts;
+    int rc = shard_get_customer_accounts(set, customer_id, &accounts,
+                                         &sharded);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    free(accounts);
+  }
+
+  int rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT (SELECT COUNT(*) FROM customers WHERE customer_id = ?1), "
+      "(SELECT COUNT(*) FROM accounts WHERE customer_id = ?1 "
+      "AND abs(balance) >= 0.005), "
+      "(SELECT COUNT(*) FROM customer_deletions WHERE customer_id = ?1 "
+      "AND completed_at IS NULL), "
+      "(SELECT COUNT(*) FROM (SELECT 1 FROM transactions "
+      "WHERE account_number IN (SELECT account_number FROM accounts "
+      "WHERE customer_id = ?1) LIMIT ?2));",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    execute_sql(db, "ROLLBACK;");
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, DELETION_INLINE_ROWS + 1);
+
+  int exists = 0, funded = 0, pending = 0;
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    exists = sqlite3_column_int(stmt, 0);
+    funded = sqlite3_column_int(stmt, 1);
+    pending = sqlite3_column_int(stmt, 2);
+    *history_rows = sqlite3_column_int(stmt, 3);
+    rc = SQLITE_OK;
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK && !exists) {
+    printf("Customer with ID %s does not exist.\n", customer_id);
+    rc = SQLITE_NOTFOUND;
+  } else if (rc == SQLITE_OK && pending) {
+    printf("Customer %s is already being deleted.\n", customer_id);
+    rc = SQLITE_CONSTRAINT;
+  } else if (rc == SQLITE_OK && sharded) {
+    printf("Customer %s still has %d account(s) on account shards, which "
+           "deletion does not remove.\n",
+           customer_id, sharded);
+    rc = SQLITE_CONSTRAINT;
+  } else if (rc == SQLITE_OK && funded) {
+    printf("Customer %s still has %d account(s) with a balance. Withdraw or "
+           "transfer the funds first.\n",
+           customer_id, funded);
+    rc = SQLITE_CONSTRAINT;
+  }
+
+  // Closed accounts take no further postings while history is removed
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "UPDATE accounts SET closed_at = "
+        "strftime('%Y-%m-%d %H:%M:%S', 'now') "
+        "WHERE customer_id = ? AND closed_at IS NULL "
+        "RETURNING account_number, account_type, closed_at;",
+        -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    } else {
+      sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+      while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *fields[3] = {(const char *)sqlite3_column_text(stmt, 0),
+                                 (const char *)sqlite3_column_text(stmt, 1),
+                                 (const char *)sqlite3_column_text(stmt, 2)};
+        if (cdc_stage(db, CDC_ACCOUNT_UPDATE, 3, fields) != SQLITE_OK) {
+          rc = SQLITE_ERROR;
+          break;
+        }
+        limits_invalidate(fields[0]);
+      }
+      if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+      } else {
+        rc = SQLITE_OK;
+      }
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "INSERT OR REPLACE INTO customer_deletions (customer_id, mode, "
+        "requested_at) VALUES (?, ?, strftime('%Y-%m-%d %H:%M:%S', 'now'));",
+        -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    } else {
+      sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+      sqlite3_bind_int(stmt, 2, mode);
+      rc = run_statement(db, stmt);
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    return rc;
+  }
+
+  cdc_commit(db);
+  return SQLITE_OK;
+}
+
+// Delete a customer with their accounts and transaction history, or move
+// them to the archive tables. Small histories are removed before returning;
+// larger ones are queued for the background purger.
+int delete_customer_cascade(sqlite3 *db, const char *customer_id,
+                            enum DeletionMode mode,
+                            struct DeletionReport *report) {
+  struct timespec start, end;
+  int history_rows = 0;
+
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int rc = queue_deletion(db, customer_id, mode, &history_rows);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // A private in-memory database can't be opened by the purger, so its
+  // deletions always run inline
+  if (history_rows > DELETION_INLINE_ROWS &&
+      start_deletion_purger(db) == SQLITE_OK) {
+    report->queued = 1;
+  } else {
+    rc = purge_job(db, customer_id, 0, report);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return rc;
+}
+
+// Oldest pending deletion, SQLITE_DONE when there is none
+static int next_pending(sqlite3 *db, char *customer_id, size_t size) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT customer_id FROM customer_deletions "
+                              "WHERE completed_at IS NULL "
+                              "ORDER BY requested_at LIMIT 1;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    snprintf(customer_id, size, "%s", sqlite3_column_text(stmt, 0));
+    rc = SQLITE_OK;
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+static void *purger_main(void *arg) {
+  sqlite3 *db;
+  sqlite3_session *session = NULL;
+  char customer_id[64];
+  (void)arg;
+
+  int rc = open_database(purger.db_uri, &db);
+  if (rc == SQLITE_OK) {
+    sqlite3_busy_timeout(db, 30000);
+    rc = execute_sql(db, "PRAGMA foreign_keys = ON;");
+  }
+  if (rc == SQLITE_OK) {
+    rc = capture_connection(db, &session);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Deletion purger failed to start: %s\n",
+            sqlite3_errmsg(db));
+  }
+
+  while (rc == SQLITE_OK && !purger_stopping()) {
+    struct DeletionReport report;
+    memset(&report, 0, sizeof(report));
+
+    int found = next_pending(db, customer_id, sizeof(customer_id));
+    if (found == SQLITE_OK) {
+      int purged = purge_job(db, customer_id, 1, &report);
+      if (purged == SQLITE_OK || purged == SQLITE_INTERRUPT) {
+        continue;
+      }
+      fprintf(stderr, "Deletion of customer %s stopped: %s\n", customer_id,
+              sqlite3_errstr(purged));
+    }
+
+    // Nothing to do, or a job keeps failing: wait for the next request
+    pthread_mutex_lock(&purger.lock);
+    while (!purger.stop && !purger.woken) {
+      pthread_cond_wait(&purger.wake, &purger.lock);
+    }
+    purger.woken = 0;
+    pthread_mutex_unlock(&purger.lock);
+  }
+
+  release_connection_capture(db, session);
+  sqlite3_close(db);
+  return NULL;
+}
+
+// Start the background purger on its own connection, or wake it if it is
+// already running
+int start_deletion_purger(sqlite3 *db) {
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&purger.lock);
+  if (purger.running) {
+    purger.woken = 1;
+    pthread_cond_signal(&purger.wake);
+    pthread_mutex_unlock(&purger.lock);
+    return SQLITE_OK;
+  }
+
+  rc = shared_database_uri(db, purger.db_uri, sizeof(purger.db_uri));
+  if (rc != SQLITE_OK) {
+    pthread_mutex_unlock(&purger.lock);
+    return rc;
+  }
+
+  purger.stop = 0;
+  purger.woken = 0;
+  if (pthread_create(&purger.thread, NULL, purger_main, NULL) == 0) {
+    purger.running = 1;
+  } else {
+    rc = SQLITE_ERROR;
+  }
+  pthread_mutex_unlock(&purger.lock);
+  return rc;
+}
+
+// Restart the purger if deletions were left unfinished. A loaded image of
+// a private in-memory database finishes them inline instead.
+int resume_customer_deletions(sqlite3 *db) {
+  char customer_id[64];
+
+  int rc = next_pending(db, customer_id, sizeof(customer_id));
+  if (rc == SQLITE_DONE) {
+    return SQLITE_OK;
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = start_deletion_purger(db);
+  if (rc != SQLITE_MISUSE) {
+    return rc;
+  }
+
+  do {
+    struct DeletionReport report;
+    memset(&report, 0, sizeof(report));
+    rc = purge_job(db, customer_id, 0, &report);
+  } while (rc == SQLITE_OK && (rc = next_pending(db, customer_id,
+                                                 sizeof(customer_id))) ==
+                                  SQLITE_OK);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Stop the purger after its current chunk; unfinished work resumes on the
+// next start
+void stop_deletion_purger(void) {
+  pthread_mutex_lock(&purger.lock);
+  if (!purger.running) {
+    pthread_mutex_unlock(&purger.lock);
+    return;
+  }
+  purger.stop = 1;
+  pthread_cond_signal(&purger.wake);
+  pthread_mutex_unlock(&purger.lock);
+
+  pthread_join(purger.thread, NULL);
+
+  pthread_mutex_lock(&purger.lock);
+  purger.running = 0;
+  pthread_mutex_unlock(&purger.lock);
+}
+
+// Print the most recent customer deletions and their progress
+int print_customer_deletions(sqlite3 *db, int limit) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT customer_id, mode, requested_at, accounts_removed, "
+      "transactions_removed, completed_at FROM customer_deletions "
+      "ORDER BY requested_at DESC LIMIT ?;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int(stmt, 1, limit);
+
+  int count = 0;
+  printf("%-36s %-8s %-19s %8s %12s  %s\n", "Customer", "Mode", "Requested",
+         "Accounts", "Transactions", "Status");
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const unsigned char *completed_at = sqlite3_column_text(stmt, 5);
+    printf("%-36s %-8s %-19s %8lld %12lld  %s\n", sqlite3_column_text(stmt, 0),
+           sqlite3_column_int(stmt, 1) == DELETION_ARCHIVE ? "archive"
+                                                           : "purge",
+           sqlite3_column_text(stmt, 2),
+           (long long)sqlite3_column_int64(stmt, 3),
+           (long long)sqlite3_column_int64(stmt, 4),
+           completed_at != NULL ? (const char *)completed_at : "pending");
+    count++;
+  }
+
+  if (count == 0) {
+    printf("No customer deletions.\n");
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
@@ -0,0 +1,38 @@
+#ifndef CUSTOMER_DELETION_H
+#define CUSTOMER_DELETION_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Transactions removed per write transaction, so the write lock is only held
+// briefly at a time
+#define DELETION_CHUNK_ROWS 500
+// Customers with more history than this are left to the background purger
+#define DELETION_INLINE_ROWS 20000
+// Shortest pause between the purger's chunks. It also waits at least as long
+// as the last chunk held the lock, so writers get the lock half of the time.
+#define DELETION_PAUSE_MS 5
+
+// Removed rows are either dropped or moved to the archived_* tables
+enum DeletionMode { DELETION_PURGE = 0, DELETION_ARCHIVE = 1 };
+
+struct DeletionReport {
+  int64_t accounts;
+  int64_t transactions;
+  int queued; // left to the background purger
+  double seconds;
+};
+
+int create_deletion_tables(sqlite3 *db);
+int delete_customer_cascade(sqlite3 *db, const char *customer_id,
+                            enum DeletionMode mode,
+                            struct DeletionReport *report);
+int purge_customer(sqlite3 *db, const char *customer_id,
+                   struct DeletionReport *report);
+int start_deletion_purger(sqlite3 *db);
+int resume_customer_deletions(sqlite3 *db);
+void stop_deletion_purger(void);
+int print_customer_deletions(sqlite3 *db, int limit);
+
+#endif
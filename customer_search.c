@@ -0,0 +1,248 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "customer_search.h"
+#include "customer_system.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Check whether a table or virtual table exists
+static int search_table_exists(sqlite3 *db, const char *name) {
+  sqlite3_stmt *stmt;
+  int exists = 0;
+
+  const char *sql = "SELECT 1 FROM sqlite_master WHERE type = 'table' AND "
+                    "name = ?;";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  exists = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_finalize(stmt);
+  return exists;
+}
+
+// Create the FTS5 indexes over customers and the triggers that keep them in
+// sync. customers_fts serves word, prefix and ranked search; customers_trigram
+// serves substring search.
+int create_customer_search_index(sqlite3 *db) {
+  int is_new = !search_table_exists(db, "customers_fts");
+
+  char *sql =
+      "CREATE VIRTUAL TABLE IF NOT EXISTS customers_fts USING fts5("
+      "name, address, contact, content='customers', content_rowid='rowid', "
+      "prefix='2 3');"
+      "CREATE VIRTUAL TABLE IF NOT EXISTS customers_trigram USING fts5("
+      "name, address, contact, content='customers', content_rowid='rowid', "
+      "tokenize='trigram');"
+      "CREATE TRIGGER IF NOT EXISTS customers_search_ai AFTER INSERT ON "
+      "customers BEGIN "
+      "INSERT INTO customers_fts(rowid, name, address, contact) "
+      "VALUES (new.rowid, new.name, new.address, new.contact); "
+      "INSERT INTO customers_trigram(rowid, name, address, contact) "
+      "VALUES (new.rowid, new.name, new.address, new.contact); "
+      "END;"
+      "CREATE TRIGGER IF NOT EXISTS customers_search_ad AFTER DELETE ON "
+      "customers BEGIN "
+      "INSERT INTO customers_fts(customers_fts, rowid, name, address, "
+      "contact) VALUES ('delete', old.rowid, old.name, old.address, "
+      "old.contact); "
+      "INSERT INTO customers_trigram(customers_trigram, rowid, name, address, "
+      "contact) VALUES ('delete', old.rowid, old.name, old.address, "
+      "old.contact); "
+      "END;"
+      "CREATE TRIGGER IF NOT EXISTS customers_search_au AFTER UPDATE ON "
+      "customers BEGIN "
+      "INSERT INTO customers_fts(customers_fts, rowid, name, address, "
+      "contact) VALUES ('delete', old.rowid, old.name, old.address, "
+      "old.contact); "
+      "INSERT INTO customers_trigram(customers_trigram, rowid, name, address, "
+      "contact) VALUES ('delete', old.rowid, old.name, old.address, "
+      "old.contact); "
+      "INSERT INTO customers_fts(rowid, name, address, contact) "
+      "VALUES (new.rowid, new.name, new.address, new.contact); "
+      "INSERT INTO customers_trigram(rowid, name, address, contact) "
+      "VALUES (new.rowid, new.name, new.address, new.contact); "
+      "END;";
+
+  int rc = execute_sql(db, sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Index customers that were added before the search tables existed
+  if (is_new) {
+    return rebuild_customer_search_index(db);
+  }
+
+  return SQLITE_OK;
+}
+
+// Re-read every customer into the search indexes. Needed after VACUUM,
+// which may renumber the customers rowids the indexes point at.
+int rebuild_customer_search_index(sqlite3 *db) {
+  if (!search_table_exists(db, "customers_fts")) {
+    return SQLITE_OK;
+  }
+
+  return execute_sql(
+      db, "INSERT INTO customers_fts(customers_fts) VALUES ('rebuild');"
+          "INSERT INTO customers_trigram(customers_trigram) "
+          "VALUES ('rebuild');");
+}
+
+// Turn free text into an FTS5 query: every whitespace-separated word becomes
+// a quoted phrase, optionally with a prefix marker. Returns NULL when the
+// term has no words.
+static char *build_match_query(const char *term, int prefix) {
+  size_t capacity = strlen(term) * 3 + 3;
+  char *query = malloc(capacity);
+  size_t length = 0;
+  int words = 0;
+
+  if (query == NULL) {
+    return NULL;
+  }
+
+  const char *p = term;
+  while (*p != '\0') {
+    while (isspace((unsigned char)*p)) {
+      p++;
+    }
+    if (*p == '\0') {
+      break;
+    }
+
+    if (words++ > 0) {
+      query[length++] = ' ';
+    }
+    query[length++] = '"';
+    while (*p != '\0' && !isspace((unsigned char)*p)) {
+      if (*p == '"') {
+        query[length++] = '"';
+      }
+      query[length++] = *p++;
+    }
+    query[length++] = '"';
+    if (prefix) {
+      query[length++] = '*';
+    }
+  }
+
+  query[length] = '\0';
+
+  if (words == 0) {
+    free(query);
+    return NULL;
+  }
+
+  return query;
+}
+
+// Search customers and copy up to limit matches into results
+int search_customers(sqlite3 *db, const char *term,
+                     enum CustomerSearchMode mode, int limit,
+                     struct Customer *results, int *count) {
+  sqlite3_stmt *stmt;
+  const char *sql;
+  char *query;
+
+  *count = 0;
+
+  if (limit <= 0 || limit > MAX_SEARCH_RESULTS) {
+    limit = MAX_SEARCH_RESULTS;
+  }
+
+  switch (mode) {
+  case SEARCH_SUBSTRING:
+    // The trigram tokenizer needs at least three characters to use its index
+    if (strlen(term) < 3) {
+      printf("Substring search needs at least 3 characters.\n");
+      return SQLITE_MISUSE;
+    }
+    query = build_match_query(term, 0);
+    sql = "SELECT c.customer_id, c.name, c.address, c.contact "
+          "FROM customers_trigram f JOIN customers c ON c.rowid = f.rowid "
+          "WHERE customers_trigram MATCH ? ORDER BY rank LIMIT ?;";
+    break;
+  case SEARCH_PREFIX:
+    query = build_match_query(term, 1);
+    sql = "SELECT c.customer_id, c.name, c.address, c.contact "
+          "FROM customers_fts f JOIN customers c ON c.rowid = f.rowid "
+          "WHERE customers_fts MATCH ? "
+          "ORDER BY bm25(customers_fts, 10.0, 2.0, 1.0) LIMIT ?;";
+    break;
+  default:
+    query = build_match_query(term, 0);
+    sql = "SELECT c.customer_id, c.name, c.address, c.contact "
+          "FROM customers_fts f JOIN customers c ON c.rowid = f.rowid "
+          "WHERE customers_fts MATCH ? "
+          "ORDER BY bm25(customers_fts, 10.0, 2.0, 1.0) LIMIT ?;";
+    break;
+  }
+
+  if (query == NULL) {
+    return SQLITE_OK;
+  }
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    free(query);
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, limit);
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    struct Customer *customer = &results[(*count)++];
+    snprintf(customer->customer_id, sizeof(customer->customer_id), "%s",
+             sqlite3_column_text(stmt, 0));
+    snprintf(customer->name, sizeof(customer->name), "%s",
+             sqlite3_column_text(stmt, 1));
+    snprintf(customer->address, sizeof(customer->address), "%s",
+             sqlite3_column_text(stmt, 2));
+    snprintf(customer->contact, sizeof(customer->contact), "%s",
+             sqlite3_column_text(stmt, 3));
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  free(query);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Search customers and print the matches
+int print_customer_search(sqlite3 *db, const char *term,
+                          enum CustomerSearchMode mode, int limit) {
+  struct Customer results[MAX_SEARCH_RESULTS];
+  int count;
+
+  int rc = search_customers(db, term, mode, limit, results, &count);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (count == 0) {
+    printf("No matching customers found.\n");
+    return SQLITE_OK;
+  }
+
+  for (int i = 0; i < count; i++) {
+    printf("Customer ID: %s\n", results[i].customer_id);
+    printf("Name: %s\n", results[i].name);
+    printf("Address: %s\n", results[i].address);
+    printf("Contact: %s\n", results[i].contact);
+    printf("\n");
+  }
+
+  printf("Matches: %d\n", count);
+  return SQLITE_OK;
+}
@@ -0,0 +1,24 @@
+#ifndef CUSTOMER_SEARCH_H
+#define CUSTOMER_SEARCH_H
+
+#include "customer_system.h"
+#include "sqlite3.h"
+
+// Upper bound on rows returned by one search
+#define MAX_SEARCH_RESULTS 50
+
+enum CustomerSearchMode {
+  SEARCH_PREFIX,    // every word is a prefix of a word in any field
+  SEARCH_SUBSTRING, // the text appears anywhere in any field
+  SEARCH_RANKED     // whole words, best name matches first
+};
+
+int create_customer_search_index(sqlite3 *db);
+int rebuild_customer_search_index(sqlite3 *db);
+int search_customers(sqlite3 *db, const char *term,
+                     enum CustomerSearchMode mode, int limit,
+                     struct Customer *results, int *count);
+int print_customer_search(sqlite3 *db, const char *term,
+                          enum CustomerSearchMode mode, int limit);
+
+#endif
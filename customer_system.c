@@ -5,10 +5,86 @@
 #include <string.h>
 #include <time.h>
 
+#include "change_log.h"
+#include "customer_deletion.h"
+#include "customer_search.h"
 #include "customer_system.h"
+#include "customer_view.h"
 #include "utils_functions.h"
 #include "uuid/uuid4.h"
 
+// Reduce a free-text phone number to digits with a country prefix so equal
+// numbers written differently share one key. "+234 803..." and "0803..."
+// both become "234803...". Numbers without a recognizable prefix keep their
+// digits as entered.
+void normalize_contact(const char *contact, char *key, size_t key_size) {
+  char digits[64];
+  size_t n = 0;
+  int international = 0;
+  const char *p = contact;
+
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p == '+') {
+    international = 1;
+  }
+
+  for (; *p != '\0' && n < sizeof(digits) - 1; p++) {
+    if (*p >= '0' && *p <= '9') {
+      digits[n++] = *p;
+    }
+  }
+  digits[n] = '\0';
+
+  if (!international && n > 2 && digits[0] == '0' && digits[1] == '0') {
+    // 00 international dialing prefix
+    snprintf(key, key_size, "%s", digits + 2);
+  } else if (!international && n > 1 && digits[0] == '0') {
+    // National trunk prefix
+    snprintf(key, key_size, "%s%s", DEFAULT_COUNTRY_CODE, digits + 1);
+  } else {
+    snprintf(key, key_size, "%s", digits);
+  }
+}
+
+// normalize_contact() exposed to SQL for backfilling existing rows
+static void sql_normalize_contact(sqlite3_context *context, int argc,
+                                  sqlite3_value **argv) {
+  char key[64];
+  const unsigned char *contact = sqlite3_value_text(argv[0]);
+  (void)argc; // registered with exactly one argument
+
+  if (contact == NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+
+  normalize_contact((const char *)contact, key, sizeof(key));
+  sqlite3_result_text(context, key, -1, SQLITE_TRANSIENT);
+}
+
+// Check whether customers already has the contact_key column
+static int has_contact_key_column(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA table_info(customers);", -1, &stmt,
+                         NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (strcmp((const char *)sqlite3_column_text(stmt, 1), "contact_key") ==
+        0) {
+      found = 1;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return found;
+}
+
 // Create customers table
 int create_customers_table(sqlite3 *db) {
   char *sql;
@@ -17,7 +93,8 @@ int create_customers_table(sqlite3 *db) {
         "customer_id TEXT PRIMARY KEY, "
         "name TEXT NOT NULL, "
         "address TEXT, "
-        "contact TEXT);";
+        "contact TEXT, "
+        "contact_key TEXT);";
 
   int rc = execute_sql(db, sql);
 
@@ -25,6 +102,49 @@ int create_customers_table(sqlite3 *db) {
     return rc;
   }
 
+  rc = sqlite3_create_function(db, "normalize_contact", 1,
+                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                               sql_normalize_contact, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to register normalize_contact: %s\n",
+            sqlite3_errmsg(db));
+    return rc;
+  }
+
+  // Databases created before contact keys existed get the column backfilled
+  if (!has_contact_key_column(db)) {
+    rc = execute_sql(db, "ALTER TABLE customers ADD COLUMN contact_key TEXT;"
+                         "UPDATE customers SET contact_key = "
+                         "normalize_contact(contact);");
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  rc = execute_sql(db, "CREATE INDEX IF NOT EXISTS idx_customers_contact_key "
+                       "ON customers(contact_key);");
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+// Commit a customer change and its staged change-log record, or roll both
+// back. rc is the outcome of the change: SQLITE_DONE or SQLITE_OK on
+// success.
+static int finish_customer_change(sqlite3 *db, int rc) {
+  if (rc == SQLITE_DONE || rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    return rc;
+  }
+
+  cdc_commit(db);
   return SQLITE_OK;
 }
 
@@ -32,8 +152,10 @@ int create_customers_table(sqlite3 *db) {
 int insert_customer(sqlite3 *db, struct Customer *customer) {
   sqlite3_stmt *stmt;
 
+  char contact_key[64];
+
   const char *sql = "INSERT INTO customers (customer_id, name, address, "
-                    "contact) VALUES (?, ?, ?, ?);";
+                    "contact, contact_key) VALUES (?, ?, ?, ?, ?);";
 
   // Prepare the SQL statement
   int rc = sqlite3_prepare_v3(db, sql, -1, 0, &stmt, NULL);
@@ -42,24 +164,39 @@ int insert_customer(sqlite3 *db, struct Customer *customer) {
     return rc;
   }
 
+  // The row and its change-log record commit together
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
   // Bind parameters to the statement
   sqlite3_bind_text(stmt, 1, customer->customer_id, -1, NULL);
   sqlite3_bind_text(stmt, 2, customer->name, -1, NULL);
   sqlite3_bind_text(stmt, 3, customer->address, -1, NULL);
   sqlite3_bind_text(stmt, 4, customer->contact, -1, NULL);
+  normalize_contact(customer->contact, contact_key, sizeof(contact_key));
+  sqlite3_bind_text(stmt, 5, contact_key, -1, SQLITE_STATIC);
 
   // Execute the statement
   rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
   } else {
-    printf("Customer inserted successfully\n");
+    const char *fields[4] = {customer->customer_id, customer->name,
+                             customer->address, customer->contact};
+    rc = cdc_stage(db, CDC_CUSTOMER_INSERT, 4, fields);
   }
 
   // Finalize the statement
   sqlite3_finalize(stmt);
 
-  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+  rc = finish_customer_change(db, rc);
+  if (rc == SQLITE_OK) {
+    printf("Customer inserted successfully\n");
+  }
+  return rc;
 }
 
 // Get a customer details
@@ -203,8 +340,9 @@ int update_customer_details(sqlite3 *db, const char *customer_id,
   }
 
   // Customer exists, proceed with update
-  const char *sql = "UPDATE customers SET name = ?, address = ?, contact = ? "
-                    "WHERE customer_id = ?;";
+  char contact_key[64];
+  const char *sql = "UPDATE customers SET name = ?, address = ?, contact = ?, "
+                    "contact_key = ? WHERE customer_id = ?;";
   rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Failed to prepare update statement: %s\n",
@@ -212,22 +350,37 @@ int update_customer_details(sqlite3 *db, const char *customer_id,
     return rc;
   }
 
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
   // Bind parameters to the statement
   sqlite3_bind_text(stmt, 1, customer->name, -1, SQLITE_STATIC);
   sqlite3_bind_text(stmt, 2, customer->address, -1, SQLITE_STATIC);
   sqlite3_bind_text(stmt, 3, customer->contact, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 4, customer_id, -1, SQLITE_STATIC);
+  normalize_contact(customer->contact, contact_key, sizeof(contact_key));
+  sqlite3_bind_text(stmt, 4, contact_key, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 5, customer_id, -1, SQLITE_STATIC);
 
   // Execute the statement
   rc = sqlite3_step(stmt);
   if (rc != SQLITE_DONE) {
     fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
   } else {
-    printf("Customer updated successfully\n");
+    const char *fields[4] = {customer_id, customer->name, customer->address,
+                             customer->contact};
+    rc = cdc_stage(db, CDC_CUSTOMER_UPDATE, 4, fields);
   }
 
   sqlite3_finalize(stmt);
-  return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+
+  rc = finish_customer_change(db, rc);
+  if (rc == SQLITE_OK) {
+    printf("Customer updated successfully\n");
+  }
+  return rc;
 }
 
 // Delete customer
@@ -269,6 +422,12 @@ int delete_customer(sqlite3 *db, const char *customer_id) {
     return rc;
   }
 
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
   sqlite3_bind_text(stmt, 1, customer_id, -1,
                     SQLITE_STATIC); // Corrected: bind to parameter 1, not 4
 
@@ -277,10 +436,116 @@ int delete_customer(sqlite3 *db, const char *customer_id) {
   if (rc != SQLITE_DONE) {
     fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
   } else {
-    printf("Customer deleted successfully\n");
+    rc = cdc_stage(db, CDC_CUSTOMER_DELETE, 1, &customer_id);
   }
 
   // Finalize the statement
+  sqlite3_finalize(stmt);
+
+  rc = finish_customer_change(db, rc);
+  if (rc == SQLITE_OK) {
+    printf("Customer deleted successfully\n");
+  }
+  return rc;
+}
+
+// Find customers by phone number, in any formatting
+int get_customers_by_contact(sqlite3 *db, const char *contact) {
+  sqlite3_stmt *stmt;
+  char contact_key[64];
+
+  normalize_contact(contact, contact_key, sizeof(contact_key));
+  if (contact_key[0] == '\0') {
+    printf("Contact must contain digits.\n");
+    return SQLITE_MISUSE;
+  }
+
+  const char *sql = "SELECT customer_id, name, address, contact FROM customers "
+                    "WHERE contact_key = ?;";
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, contact_key, -1, SQLITE_STATIC);
+
+  int customer_count = 0;
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    customer_count++;
+    printf("Customer ID: %s\n", sqlite3_column_text(stmt, 0));
+    printf("Name: %s\n", sqlite3_column_text(stmt, 1));
+    printf("Address: %s\n", sqlite3_column_text(stmt, 2));
+    printf("Contact: %s\n", sqlite3_column_text(stmt, 3));
+    printf("\n");
+  }
+
+  if (customer_count == 0) {
+    printf("No customer with contact %s.\n", contact_key);
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// List customers sharing a contact key. Rows come back in index order, so
+// duplicates are adjacent and one merge pass finds every group.
+int print_duplicate_contacts_report(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  char previous_key[64] = "";
+  char previous_id[38] = "";
+  char previous_name[50] = "";
+  int group_size = 0;
+  int group_count = 0;
+
+  const char *sql = "SELECT contact_key, customer_id, name FROM customers "
+                    "WHERE contact_key > '' ORDER BY contact_key;";
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  printf("Duplicate Contacts\n");
+  printf("------------------\n");
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    const char *id = (const char *)sqlite3_column_text(stmt, 1);
+    const char *name = (const char *)sqlite3_column_text(stmt, 2);
+
+    if (strcmp(key, previous_key) == 0) {
+      if (group_size == 1) {
+        group_count++;
+        printf("%s\n", key);
+        printf("  %s  %s\n", previous_id, previous_name);
+      }
+      printf("  %s  %s\n", id, name);
+      group_size++;
+    } else {
+      snprintf(previous_key, sizeof(previous_key), "%s", key);
+      group_size = 1;
+    }
+
+    snprintf(previous_id, sizeof(previous_id), "%s", id);
+    snprintf(previous_name, sizeof(previous_name), "%s", name);
+  }
+
+  if (group_count == 0) {
+    printf("No duplicate contacts found.\n");
+  } else {
+    printf("\nDuplicate groups: %d\n", group_count);
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
   sqlite3_finalize(stmt);
   return rc == SQLITE_DONE ? SQLITE_OK : rc;
 }
@@ -291,6 +556,10 @@ void display_customer_menu() {
   printf("   2 View Customers Details\n");
   printf("   3 Update Customer Information\n");
   printf("   4 Delete Customer\n");
+  printf("   5 Search Customers\n");
+  printf("   6 Find Customer by Contact\n");
+  printf("   7 Duplicate Contacts Report\n");
+  printf("   8 Customer Overview\n");
 }
 
 // Update customer details menu
@@ -378,10 +647,89 @@ void print_customer_management_system(sqlite3 *db) {
     break;
   case 4:
     clear_screen();
+    struct DeletionReport deletion;
+    char answer[8];
     printf("Customer ID? ");
     scanf("%36s", customer_id);
     clear_input_buffer();
-    delete_customer(db, customer_id);
+
+    printf("Keep the accounts and history in the archive tables (y/n)? ");
+    fgets(answer, sizeof(answer), stdin);
+
+    if (delete_customer_cascade(db, customer_id,
+                                answer[0] == 'y' || answer[0] == 'Y'
+                                    ? DELETION_ARCHIVE
+                                    : DELETION_PURGE,
+                                &deletion) == SQLITE_OK) {
+      if (deletion.queued) {
+        printf("Customer %s has a long history; it is being removed in the "
+               "background.\n",
+               customer_id);
+      } else {
+        printf("Customer deleted with %lld account(s) and %lld "
+               "transaction(s) in %.3f s\n",
+               (long long)deletion.accounts, (long long)deletion.transactions,
+               deletion.seconds);
+      }
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 5:
+    clear_screen();
+    char term[50];
+    int mode;
+    printf("Search for? ");
+    fgets(term, sizeof(term), stdin);
+    term[strcspn(term, "\n")] = '\0'; // Remove newline character
+
+    printf("Search type (1 prefix, 2 substring, 3 ranked words)? ");
+    if (scanf("%d", &mode) != 1 || mode < 1 || mode > 3) {
+      mode = 1;
+    }
+    clear_input_buffer();
+
+    printf("\n");
+    print_customer_search(db, term,
+                          mode == 2   ? SEARCH_SUBSTRING
+                          : mode == 3 ? SEARCH_RANKED
+                                      : SEARCH_PREFIX,
+                          20);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 6:
+    clear_screen();
+    printf("Contact? ");
+    fgets(customer.contact, sizeof(customer.contact), stdin);
+    customer.contact[strcspn(customer.contact, "\n")] = '\0';
+
+    printf("\n");
+    get_customers_by_contact(db, customer.contact);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 7:
+    clear_screen();
+    print_duplicate_contacts_report(db);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 8:
+    clear_screen();
+    struct CustomerView *view;
+    printf("Customer ID? ");
+    scanf("%36s", customer_id);
+    clear_input_buffer();
+
+    printf("\n");
+    int rc = get_customer_view(db, customer_id, CUSTOMER_VIEW_RECENT, &view);
+    if (rc == SQLITE_OK) {
+      print_customer_view(view);
+      free_customer_view(view);
+    } else if (rc == SQLITE_NOTFOUND) {
+      printf("Customer does not exist.\n");
+    }
     printf("Press Enter to return to main menu...");
     getchar(); // Wait for user to press Enter
     break;
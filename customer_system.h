@@ -3,6 +3,10 @@
 #define CUSTOMER_SYSTEM_H
 
 #include "sqlite3.h"
+#include <stddef.h>
+
+// Country calling code assumed for national numbers with a leading 0
+#define DEFAULT_COUNTRY_CODE "234"
 
 struct Customer {
   char customer_id[38];
@@ -11,12 +15,16 @@ struct Customer {
   char contact[50];
 };
 
+int create_customers_table(sqlite3 *db);
+void normalize_contact(const char *contact, char *key, size_t key_size);
 int insert_customer(sqlite3 *db, struct Customer *customer);
 int get_customer_details(sqlite3 *db, const char *customer_id);
 int select_customers_details(sqlite3 *db);
 int update_customer_details(sqlite3 *db, const char *customer_id,
                             struct Customer *customer);
 int delete_customer(sqlite3 *db, const char *customer_id);
+int get_customers_by_contact(sqlite3 *db, const char *contact);
+int print_duplicate_contacts_report(sqlite3 *db);
 void display_customer_menu();
 void update_customer_menu(sqlite3 *db, char *customer_id,
                           struct Customer *customer);
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "customer_view.h"
+#include "ledger_archive.h"
+#include "ledger_partitions.h"
+#include "sqlite3.h"
+
+// Copy text into a fixed buffer, cutting it short if it does not fit
+static void copy_text(char *buffer, size_t size, const char *text) {
+  snprintf(buffer, size, "%.*s", (int)size - 1, text != NULL ? text : "");
+}
+
+static void copy_column(sqlite3_stmt *stmt, int column, char *buffer,
+                        size_t size) {
+  copy_text(buffer, size, (const char *)sqlite3_column_text(stmt, column));
+}
+
+// Read the customer row and their account count
+static int load_customer(sqlite3 *db, const char *customer_id,
+                         struct Customer *customer, int *account_count) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT customer_id, name, address, contact, "
+      "(SELECT count(*) FROM accounts a WHERE a.customer_id = c.customer_id) "
+      "FROM customers c WHERE customer_id = ?;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    copy_column(stmt, 0, customer->customer_id, sizeof(customer->customer_id));
+    copy_column(stmt, 1, customer->name, sizeof(customer->name));
+    copy_column(stmt, 2, customer->address, sizeof(customer->address));
+    copy_column(stmt, 3, customer->contact, sizeof(customer->contact));
+    *account_count = sqlite3_column_int(stmt, 4);
+    rc = SQLITE_OK;
+  } else if (rc == SQLITE_DONE) {
+    rc = SQLITE_NOTFOUND;
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Fill in the accounts, in account number order. Accounts opened since the
+// count was taken are left out rather than overflowing the arena.
+static int load_accounts(sqlite3 *db, struct CustomerView *view,
+                         int capacity) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT account_number, customer_id, "
+                              "account_type, balance FROM accounts "
+                              "WHERE customer_id = ? ORDER BY account_number;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, view->customer.customer_id, -1, SQLITE_STATIC);
+
+  while (view->account_count < capacity &&
+         (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    struct Account *account = &view->accounts[view->account_count++].account;
+    copy_column(stmt, 0, account->account_number,
+                sizeof(account->account_number));
+    copy_column(stmt, 1, account->customer_id, sizeof(account->customer_id));
+    copy_column(stmt, 2, account->account_type, sizeof(account->account_type));
+    account->balance = sqlite3_column_double(stmt, 3);
+  }
+
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  } else {
+    rc = SQLITE_OK;
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Fill in the latest transactions of every account with one query. In the
+// hot table each account's rows come from a LIMIT walk down
+// idx_transactions_account. Once months are archived the rows are read
+// through the all_transactions view, which has no rowids to walk, so each
+// account's rows are ranked by date instead.
+static int load_recent_transactions(sqlite3 *db, struct CustomerView *view,
+                                    int recent) {
+  sqlite3_stmt *stmt;
+  const char *sql;
+
+  int rc = open_ledger_history(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (strcmp(ledger_history_source(db), "transactions") == 0) {
+    sql = "SELECT a.account_number, t.transaction_id, t.date, t.amount, "
+          "t.type "
+          "FROM accounts a JOIN transactions t ON t.rowid IN ("
+          "SELECT rowid FROM transactions "
+          "WHERE account_number = a.account_number "
+          "ORDER BY date DESC LIMIT ?2) "
+          "WHERE a.customer_id = ?1 "
+          "ORDER BY a.account_number, t.date DESC, t.rowid DESC;";
+  } else {
+    sql = "SELECT account_number, transaction_id, date, amount, type "
+          "FROM (SELECT t.account_number, t.transaction_id, t.date, "
+          "t.amount, t.type, row_number() OVER ("
+          "PARTITION BY t.account_number ORDER BY t.date DESC) AS position "
+          "FROM all_transactions t WHERE t.account_number IN ("
+          "SELECT account_number FROM accounts WHERE customer_id = ?1)) "
+          "WHERE position <= ?2 "
+          "ORDER BY account_number, date DESC;";
+  }
+
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, view->customer.customer_id, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, recent);
+
+  // Rows arrive in the same account order as view->accounts
+  int index = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *account_number = (const char *)sqlite3_column_text(stmt, 0);
+
+    while (index < view->account_count &&
+           strcmp(view->accounts[index].account.account_number,
+                  account_number) < 0) {
+      index++;
+    }
+    if (index == view->account_count) {
+      break;
+    }
+
+    struct CustomerViewAccount *entry = &view->accounts[index];
+    if (strcmp(entry->account.account_number, account_number) != 0 ||
+        entry->transaction_count == recent) {
+      continue;
+    }
+
+    struct Transaction *transaction =
+        &entry->transactions[entry->transaction_count++];
+    snprintf(transaction->account_number,
+             sizeof(transaction->account_number), "%s", account_number);
+    copy_column(stmt, 1, transaction->transaction_id,
+                sizeof(transaction->transaction_id));
+    copy_column(stmt, 2, transaction->date, sizeof(transaction->date));
+    transaction->amount = sqlite3_column_double(stmt, 3);
+    copy_column(stmt, 4, transaction->type, sizeof(transaction->type));
+  }
+
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  } else {
+    rc = SQLITE_OK;
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Merge an account's newest compressed entries into its latest
+// transactions, keeping the newest recent of both. Only the newest
+// compressed months needed for recent entries are decoded.
+static int merge_compressed(sqlite3 *db, struct CustomerViewAccount *entry,
+                            int recent) {
+  struct LedgerArchiveEntry *archived;
+  int archived_count;
+
+  int rc = read_recent_archived_history(db, entry->account.account_number,
+                                        recent, &archived, &archived_count);
+  if (rc != SQLITE_OK || archived_count == 0) {
+    free(archived);
+    return rc;
+  }
+
+  struct Transaction *merged = malloc(recent * sizeof(struct Transaction));
+  if (merged == NULL) {
+    free(archived);
+    return SQLITE_NOMEM;
+  }
+
+  // Latest transactions are newest first, archived entries oldest first
+  int next = 0, next_archived = archived_count - 1, count = 0;
+  while (count < recent &&
+         (next < entry->transaction_count || next_archived >= 0)) {
+    if (next_archived < 0 ||
+        (next < entry->transaction_count &&
+         strcmp(entry->transactions[next].date,
+                archived[next_archived].date) >= 0)) {
+      merged[count++] = entry->transactions[next++];
+      continue;
+    }
+
+    const struct LedgerArchiveEntry *source = &archived[next_archived--];
+    struct Transaction *transaction = &merged[count++];
+    copy_text(transaction->transaction_id,
+              sizeof(transaction->transaction_id), source->transaction_id);
+    copy_text(transaction->account_number,
+              sizeof(transaction->account_number),
+              entry->account.account_number);
+    copy_text(transaction->date, sizeof(transaction->date), source->date);
+    transaction->amount = source->cents / 100.0;
+    copy_text(transaction->type, sizeof(transaction->type), source->type);
+  }
+
+  memcpy(entry->transactions, merged, count * sizeof(struct Transaction));
+  entry->transaction_count = count;
+
+  free(merged);
+  free(archived);
+  return SQLITE_OK;
+}
+
+// Merge in entries from compressed months, which only the ledger archive
+// holds. Nothing is read when no month is compressed, or for an account
+// whose recent entries all come after the last compressed month.
+static int load_compressed_transactions(sqlite3 *db,
+                                        struct CustomerView *view,
+                                        int recent) {
+  char compressed[8];
+
+  int rc = last_compressed_month(db, compressed, sizeof(compressed));
+  if (rc != SQLITE_OK || compressed[0] == '\0') {
+    return rc;
+  }
+
+  for (int i = 0; rc == SQLITE_OK && i < view->account_count; i++) {
+    struct CustomerViewAccount *entry = &view->accounts[i];
+    if (entry->transaction_count == recent &&
+        strncmp(entry->transactions[recent - 1].date, compressed, 7) > 0) {
+      continue;
+    }
+    rc = merge_compressed(db, entry, recent);
+  }
+  return rc;
+}
+
+// Load a customer, their accounts and each account's latest transactions,
+// archived months included. The hot table and attached months take three
+// indexed queries; compressed months are decoded newest first, and only
+// while an account still lacks recent entries. Returns SQLITE_NOTFOUND for
+// an unknown customer.
+int get_customer_view(sqlite3 *db, const char *customer_id, int recent,
+                      struct CustomerView **view) {
+  struct Customer customer;
+  int account_count = 0;
+
+  *view = NULL;
+  if (recent < 0) {
+    recent = 0;
+  }
+
+  int rc = load_customer(db, customer_id, &customer, &account_count);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // One arena: the view, then the accounts, then every transaction slot
+  size_t size = sizeof(struct CustomerView) +
+                account_count * sizeof(struct CustomerViewAccount) +
+                (size_t)account_count * recent * sizeof(struct Transaction);
+  char *arena = calloc(1, size);
+  if (arena == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  struct CustomerView *result = (struct CustomerView *)arena;
+  result->customer = customer;
+  result->accounts =
+      (struct CustomerViewAccount *)(arena + sizeof(struct CustomerView));
+
+  struct Transaction *slots =
+      (struct Transaction *)(result->accounts + account_count);
+  for (int i = 0; i < account_count; i++) {
+    result->accounts[i].transactions = slots + (size_t)i * recent;
+  }
+
+  rc = load_accounts(db, result, account_count);
+  if (rc == SQLITE_OK && recent > 0 && result->account_count > 0) {
+    rc = load_recent_transactions(db, result, recent);
+  }
+  if (rc == SQLITE_OK && recent > 0) {
+    rc = load_compressed_transactions(db, result, recent);
+  }
+
+  if (rc != SQLITE_OK) {
+    free(arena);
+    return rc;
+  }
+
+  *view = result;
+  return SQLITE_OK;
+}
+
+void free_customer_view(struct CustomerView *view) { free(view); }
+
+// Print the customer overview
+void print_customer_view(const struct CustomerView *view) {
+  double total = 0;
+
+  printf("Customer Overview\n");
+  printf("-----------------\n");
+  printf("Customer ID: %s\n", view->customer.customer_id);
+  printf("Name: %s\n", view->customer.name);
+  printf("Address: %s\n", view->customer.address);
+  printf("Contact: %s\n", view->customer.contact);
+
+  for (int i = 0; i < view->account_count; i++) {
+    const struct CustomerViewAccount *entry = &view->accounts[i];
+    total += entry->account.balance;
+
+    printf("\nAccount %s (%s)  Balance: %.2f\n", entry->account.account_number,
+           entry->account.account_type, entry->account.balance);
+    if (entry->transaction_count == 0) {
+      printf("  No transactions.\n");
+    }
+    for (int j = 0; j < entry->transaction_count; j++) {
+      const struct Transaction *transaction = &entry->transactions[j];
+      printf("  %-20s %-13s %12.2f\n", transaction->date, transaction->type,
+             transaction->amount);
+    }
+  }
+
+  printf("\n%d account(s), total balance: %.2f\n\n", view->account_count,
+         total);
+}
@@ -0,0 +1,31 @@
+#ifndef CUSTOMER_VIEW_H
+#define CUSTOMER_VIEW_H
+
+#include "account_system.h"
+#include "customer_system.h"
+#include "sqlite3.h"
+#include "transaction_system.h"
+
+// Transactions shown per account on the customer overview
+#define CUSTOMER_VIEW_RECENT 5
+
+struct CustomerViewAccount {
+  struct Account account;
+  int transaction_count;
+  struct Transaction *transactions; // newest first
+};
+
+// A customer, their accounts and each account's latest transactions. The
+// whole graph lives in one allocation; release it with free_customer_view().
+struct CustomerView {
+  struct Customer customer;
+  int account_count;
+  struct CustomerViewAccount *accounts;
+};
+
+int get_customer_view(sqlite3 *db, const char *customer_id, int recent,
+                      struct CustomerView **view);
+void free_customer_view(struct CustomerView *view);
+void print_customer_view(const struct CustomerView *view);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "customer_search.h"
+#include "db_config.h"
+#include "interest_engine.h"
+#include "reconciliation.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// BANK_DB, or the bank.db file in the working directory
+const char *database_uri_from_env(void) {
+  const char *uri = getenv("BANK_DB");
+  return uri != NULL && uri[0] != '\0' ? uri : DEFAULT_DB_URI;
+}
+
+// Open a connection to a path or URI, creating the database if needed
+int open_database(const char *uri, sqlite3 **db) {
+  return sqlite3_open_v2(uri, db,
+                         SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                             SQLITE_OPEN_URI,
+                         NULL);
+}
+
+// Name of the VFS holding db's main database
+static const char *main_vfs_name(sqlite3 *db) {
+  sqlite3_vfs *vfs = NULL;
+  sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs);
+  return vfs != NULL ? vfs->zName : "";
+}
+
+// Write the URI another connection opens to reach db's main database.
+// SQLITE_MISUSE when the database is private to db, as :memory: and
+// deserialized images are; memdb databases are shared only when their
+// name starts with '/'.
+int shared_database_uri(sqlite3 *db, char *uri, size_t size) {
+  const char *path = sqlite3_db_filename(db, "main");
+  int length;
+
+  if (path == NULL || path[0] == '\0') {
+    return SQLITE_MISUSE;
+  }
+  if (strcmp(main_vfs_name(db), "memdb") == 0) {
+    if (path[0] != '/') {
+      return SQLITE_MISUSE;
+    }
+    length = snprintf(uri, size, "file:%s?vfs=memdb", path);
+  } else {
+    length = snprintf(uri, size, "%s", path);
+  }
+  return length >= 0 && (size_t)length < size ? SQLITE_OK : SQLITE_TOOBIG;
+}
+
+// Nonzero when db's main database lives in memory rather than in a file
+int database_in_memory(sqlite3 *db) {
+  const char *path = sqlite3_db_filename(db, "main");
+  return path == NULL || path[0] == '\0' ||
+         strcmp(main_vfs_name(db), "memdb") == 0;
+}
+
+// Defaults sized for a bank.db that fits in RAM
+void default_db_config(struct DbConfig *config) {
+  config->mmap_size = 256LL * 1024 * 1024;
+  config->cache_size = -64 * 1024;
+  config->page_size = 0;
+  config->temp_store = 2;
+  config->cache_spill = 1;
+}
+
+// Override defaults from BANK_MMAP_SIZE, BANK_CACHE_SIZE, BANK_PAGE_SIZE,
+// BANK_TEMP_STORE and BANK_CACHE_SPILL
+void load_db_config_from_env(struct DbConfig *config) {
+  const char *value;
+
+  if ((value = getenv("BANK_MMAP_SIZE")) != NULL) {
+    config->mmap_size = strtoll(value, NULL, 10);
+  }
+  if ((value = getenv("BANK_CACHE_SIZE")) != NULL) {
+    config->cache_size = atoi(value);
+  }
+  if ((value = getenv("BANK_PAGE_SIZE")) != NULL) {
+    config->page_size = atoi(value);
+  }
+  if ((value = getenv("BANK_TEMP_STORE")) != NULL) {
+    config->temp_store = atoi(value);
+  }
+  if ((value = getenv("BANK_CACHE_SPILL")) != NULL) {
+    config->cache_spill = atoi(value);
+  }
+}
+
+// Read a single integer pragma
+static int query_pragma_int(sqlite3 *db, const char *sql,
+                            sqlite3_int64 *value) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *value = sqlite3_column_int64(stmt, 0);
+    rc = SQLITE_OK;
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Apply the tuning pragmas to an open connection
+int apply_db_config(sqlite3 *db, const struct DbConfig *config) {
+  char sql[128];
+  sqlite3_int64 mmap_size = 0;
+  int rc;
+
+  snprintf(sql, sizeof(sql), "PRAGMA cache_size = %d;", config->cache_size);
+  if ((rc = execute_sql(db, sql)) != SQLITE_OK) {
+    return rc;
+  }
+
+  snprintf(sql, sizeof(sql), "PRAGMA temp_store = %d;", config->temp_store);
+  if ((rc = execute_sql(db, sql)) != SQLITE_OK) {
+    return rc;
+  }
+
+  snprintf(sql, sizeof(sql), "PRAGMA cache_spill = %d;", config->cache_spill);
+  if ((rc = execute_sql(db, sql)) != SQLITE_OK) {
+    return rc;
+  }
+
+  // mmap_size answers with the value actually granted, which the library's
+  // compile-time SQLITE_MAX_MMAP_SIZE may cap. An in-memory database has
+  // no file to map and gives no answer.
+  if (!database_in_memory(db)) {
+    snprintf(sql, sizeof(sql), "PRAGMA mmap_size = %lld;",
+             (long long)config->mmap_size);
+    if ((rc = query_pragma_int(db, sql, &mmap_size)) != SQLITE_OK) {
+      return rc;
+    }
+
+    if (mmap_size < config->mmap_size) {
+      fprintf(stderr, "mmap_size capped at %lld bytes\n",
+              (long long)mmap_size);
+    }
+  }
+
+  if (config->page_size != 0) {
+    return migrate_page_size(db, config->page_size);
+  }
+
+  return SQLITE_OK;
+}
+
+// Forget every position kept as a rowid before VACUUM can renumber them.
+// Reconciliation and the archive bound wait for a full run, and interest
+// runs fall back on each account's last accrual date.
+static int forget_rowid_marks(sqlite3 *db) {
+  int rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = reset_reconciliation(db);
+  if (rc == SQLITE_OK) {
+    rc = create_interest_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "DELETE FROM interest_checkpoints;");
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  } else {
+    execute_sql(db, "ROLLBACK;");
+  }
+  return rc;
+}
+
+// Rewrite the database with a new page size. Only VACUUM rebuilds existing
+// pages, and it cannot change the page size of a WAL database.
+int migrate_page_size(sqlite3 *db, int page_size) {
+  char sql[64];
+  sqlite3_int64 current = 0;
+  int rc;
+
+  if (page_size < 512 || page_size > 65536 ||
+      (page_size & (page_size - 1)) != 0) {
+    fprintf(stderr, "Page size must be a power of two from 512 to 65536\n");
+    return SQLITE_MISUSE;
+  }
+
+  if ((rc = query_pragma_int(db, "PRAGMA page_size;", &current)) !=
+      SQLITE_OK) {
+    return rc;
+  }
+
+  if (current == page_size) {
+    return SQLITE_OK;
+  }
+
+  // Refuse up front rather than forget the rowid marks for nothing
+  sqlite3_stmt *stmt;
+  int wal = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &stmt, NULL) ==
+      SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      wal = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0),
+                            "wal") == 0;
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (wal) {
+    fprintf(stderr, "Page size is still %lld (WAL databases keep theirs)\n",
+            (long long)current);
+    return SQLITE_ERROR;
+  }
+
+  snprintf(sql, sizeof(sql), "PRAGMA page_size = %d;", page_size);
+  if ((rc = execute_sql(db, sql)) != SQLITE_OK) {
+    return rc;
+  }
+
+  if ((rc = forget_rowid_marks(db)) != SQLITE_OK) {
+    return rc;
+  }
+
+  if ((rc = execute_sql(db, "VACUUM;")) != SQLITE_OK) {
+    return rc;
+  }
+
+  // VACUUM may renumber customers rowids, which the search index follows
+  if ((rc = rebuild_customer_search_index(db)) != SQLITE_OK) {
+    return rc;
+  }
+
+  if ((rc = query_pragma_int(db, "PRAGMA page_size;", &current)) !=
+      SQLITE_OK) {
+    return rc;
+  }
+
+  if (current != page_size) {
+    fprintf(stderr, "Page size is still %lld (WAL databases keep theirs)\n",
+            (long long)current);
+    return SQLITE_ERROR;
+  }
+
+  printf("Page size migrated to %d bytes\n", page_size);
+  return SQLITE_OK;
+}
+
+// Report page cache counters for this connection
+int print_page_cache_stats(sqlite3 *db) {
+  int hit = 0, miss = 0, write = 0, spill = 0, used = 0, highwater = 0;
+  sqlite3_int64 page_size = 0, page_count = 0, mmap_size = 0;
+
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &hit, &highwater, 0);
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &miss, &highwater, 0);
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_WRITE, &write, &highwater, 0);
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_SPILL, &spill, &highwater, 0);
+  sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_USED, &used, &highwater, 0);
+
+  query_pragma_int(db, "PRAGMA page_size;", &page_size);
+  query_pragma_int(db, "PRAGMA page_count;", &page_count);
+  if (!database_in_memory(db)) {
+    query_pragma_int(db, "PRAGMA mmap_size;", &mmap_size);
+  }
+
+  printf("Page Cache Statistics\n");
+  printf("---------------------\n");
+  printf("Page size: %lld bytes\n", (long long)page_size);
+  printf("Database size: %lld pages\n", (long long)page_count);
+  printf("Memory-mapped: %lld bytes\n", (long long)mmap_size);
+  printf("Cache memory used: %d bytes\n", used);
+  printf("Cache hits: %d\n", hit);
+  printf("Cache misses: %d\n", miss);
+  if (hit + miss > 0) {
+    printf("Hit ratio: %.2f%%\n", 100.0 * hit / (hit + miss));
+  }
+  printf("Pages written: %d\n", write);
+  printf("Pages spilled: %d\n", spill);
+  printf("\n");
+
+  return SQLITE_OK;
+}
@@ -0,0 +1,34 @@
+#ifndef DB_CONFIG_H
+#define DB_CONFIG_H
+
+#include <stddef.h>
+
+#include "sqlite3.h"
+
+// The database opened at startup: BANK_DB if set, otherwise bank.db. Any
+// SQLite URI works, such as file::memory:?cache=shared, or
+// file:/bank?vfs=memdb for an in-memory database that other connections in
+// the process can open too.
+#define DEFAULT_DB_URI "bank.db"
+
+// Page cache and I/O tuning applied to every connection after it is opened.
+// A zero page_size keeps whatever page size the file already has.
+struct DbConfig {
+  sqlite3_int64 mmap_size; // bytes of the file to memory-map
+  int cache_size;          // pages if positive, KiB if negative
+  int page_size;           // bytes, power of two 512..65536
+  int temp_store;          // 0 default, 1 file, 2 memory
+  int cache_spill;         // 0 keeps dirty pages in cache until commit
+};
+
+const char *database_uri_from_env(void);
+int open_database(const char *uri, sqlite3 **db);
+int shared_database_uri(sqlite3 *db, char *uri, size_t size);
+int database_in_memory(sqlite3 *db);
+void default_db_config(struct DbConfig *config);
+void load_db_config_from_env(struct DbConfig *config);
+int apply_db_config(sqlite3 *db, const struct DbConfig *config);
+int migrate_page_size(sqlite3 *db, int page_size);
+int print_page_cache_stats(sqlite3 *db);
+
+#endif
@@ -0,0 +1,542 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fraud_detector.h"
+#include "ledger_partitions.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Detector fed by postings on the application connection
+static struct FraudDetector live_detector;
+static sqlite3 *live_db;
+
+// Ledgers whose recent entries prime the live windows before the first
+// posting, see start_fraud_monitoring()
+static pthread_mutex_t unprimed_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3 *unprimed_dbs[FRAUD_MAX_LEDGERS];
+static int unprimed_count;
+
+void default_fraud_rules(struct FraudRules *rules) {
+  rules->window_seconds = 3600;
+  rules->max_debits = 10;
+  rules->max_debit_cents = 100000000;   // 1,000,000.00
+  rules->large_amount_cents = 50000000; // 500,000.00
+  rules->spike_multiplier = 10;
+}
+
+// Override rules from BANK_FRAUD_* environment variables; amounts are in
+// currency units
+void load_fraud_rules_from_env(struct FraudRules *rules) {
+  const char *value;
+
+  if ((value = getenv("BANK_FRAUD_WINDOW")) != NULL) {
+    rules->window_seconds = atoi(value);
+  }
+  if ((value = getenv("BANK_FRAUD_MAX_DEBITS")) != NULL) {
+    rules->max_debits = atoi(value);
+  }
+  if ((value = getenv("BANK_FRAUD_MAX_DEBIT_TOTAL")) != NULL) {
+    rules->max_debit_cents = llround(atof(value) * 100.0);
+  }
+  if ((value = getenv("BANK_FRAUD_LARGE_AMOUNT")) != NULL) {
+    rules->large_amount_cents = llround(atof(value) * 100.0);
+  }
+  if ((value = getenv("BANK_FRAUD_SPIKE")) != NULL) {
+    rules->spike_multiplier = atoi(value);
+  }
+}
+
+const char *fraud_rule_name(enum FraudRule rule) {
+  switch (rule) {
+  case FRAUD_VELOCITY:
+    return "velocity";
+  case FRAUD_WINDOW_TOTAL:
+    return "window_total";
+  case FRAUD_LARGE_AMOUNT:
+    return "large_amount";
+  case FRAUD_SPIKE:
+    return "spike";
+  }
+  return "unknown";
+}
+
+int fraud_detector_init(struct FraudDetector *detector,
+                        const struct FraudRules *rules) {
+  memset(detector, 0, sizeof(*detector));
+  detector->rules = *rules;
+
+  // The ring holds FRAUD_RING_SIZE debits, so more can never be counted
+  if (detector->rules.max_debits >= FRAUD_RING_SIZE) {
+    detector->rules.max_debits = FRAUD_RING_SIZE - 1;
+  }
+
+  detector->capacity = 1024;
+  detector->windows = calloc(detector->capacity, sizeof(struct AccountWindow));
+  if (detector->windows == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  pthread_mutex_init(&detector->lock, NULL);
+  return SQLITE_OK;
+}
+
+void fraud_detector_free(struct FraudDetector *detector) {
+  free(detector->windows);
+  detector->windows = NULL;
+  pthread_mutex_destroy(&detector->lock);
+}
+
+static uint32_t hash_account(const char *account_number) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)account_number; *p;
+       p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct AccountWindow *find_window(struct AccountWindow *windows,
+                                         uint32_t capacity,
+                                         const char *account_number) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = hash_account(account_number) & mask;
+
+  while (windows[index].used &&
+         strcmp(windows[index].account_number, account_number) != 0) {
+    index = (index + 1) & mask;
+  }
+  return &windows[index];
+}
+
+// The account's window, created on first use; NULL if out of memory
+static struct AccountWindow *window_for(struct FraudDetector *detector,
+                                        const char *account_number) {
+  struct AccountWindow *window =
+      find_window(detector->windows, detector->capacity, account_number);
+  if (window->used) {
+    return window;
+  }
+
+  // Keep the table at most half full
+  if ((detector->count + 1) * 2 > detector->capacity) {
+    uint32_t capacity = detector->capacity * 2;
+    struct AccountWindow *windows =
+        calloc(capacity, sizeof(struct AccountWindow));
+    if (windows == NULL) {
+      return NULL;
+    }
+    for (uint32_t i = 0; i < detector->capacity; i++) {
+      if (detector->windows[i].used) {
+        *find_window(windows, capacity, detector->windows[i].account_number) =
+            detector->windows[i];
+      }
+    }
+    free(detector->windows);
+    detector->windows = windows;
+    detector->capacity = capacity;
+    window = find_window(windows, capacity, account_number);
+  }
+
+  memset(window, 0, sizeof(*window));
+  snprintf(window->account_number, sizeof(window->account_number), "%s",
+           account_number);
+  window->used = 1;
+  detector->count++;
+  return window;
+}
+
+static void raise_alert(struct FraudDetector *detector,
+                        struct FraudAlert *alerts, int *count,
+                        enum FraudRule rule, const char *account_number,
+                        int64_t cents, int64_t time,
+                        const struct AccountWindow *window) {
+  struct FraudAlert *alert = &alerts[(*count)++];
+
+  snprintf(alert->account_number, sizeof(alert->account_number), "%s",
+           account_number);
+  alert->rule = rule;
+  alert->amount_cents = cents;
+  alert->time = time;
+  alert->window_debits = window != NULL ? window->count : 0;
+  alert->window_debit_cents = window != NULL ? window->debit_cents : 0;
+  detector->alerts[rule]++;
+}
+
+// Feed one posting (signed cents, debits negative) at the given Unix time.
+// Fills alerts, which must hold FRAUD_MAX_ALERTS, and returns how many were
+// raised. Not locked: callers sharing a detector hold its lock.
+int fraud_observe(struct FraudDetector *detector, const char *account_number,
+                  int64_t cents, int64_t time, struct FraudAlert *alerts) {
+  const struct FraudRules *rules = &detector->rules;
+  int count = 0;
+
+  detector->events++;
+
+  if (rules->large_amount_cents > 0 &&
+      llabs(cents) >= rules->large_amount_cents) {
+    raise_alert(detector, alerts, &count, FRAUD_LARGE_AMOUNT, account_number,
+                cents, time, NULL);
+  }
+
+  if (cents >= 0) {
+    return count;
+  }
+
+  struct AccountWindow *window = window_for(detector, account_number);
+  if (window == NULL) {
+    return count;
+  }
+
+  // Slide the window: drop debits that are too old
+  int64_t debit = -cents;
+  while (window->count > 0 &&
+         window->events[window->head].time <= time - rules->window_seconds) {
+    window->debit_cents -= window->events[window->head].cents;
+    window->head = (window->head + 1) % FRAUD_RING_SIZE;
+    window->count--;
+  }
+
+  // Compare with the average of the debits before this one
+  if (rules->spike_multiplier > 0 && window->count >= 3 &&
+      debit * window->count > rules->spike_multiplier * window->debit_cents) {
+    raise_alert(detector, alerts, &count, FRAUD_SPIKE, account_number, cents,
+                time, window);
+  }
+
+  if (window->count == FRAUD_RING_SIZE) {
+    window->debit_cents -= window->events[window->head].cents;
+    window->head = (window->head + 1) % FRAUD_RING_SIZE;
+    window->count--;
+  }
+
+  struct FraudEvent *event =
+      &window->events[(window->head + window->count) % FRAUD_RING_SIZE];
+  event->time = time;
+  event->cents = debit;
+  window->count++;
+  window->debit_cents += debit;
+
+  if (rules->max_debits > 0 && window->count > rules->max_debits) {
+    raise_alert(detector, alerts, &count, FRAUD_VELOCITY, account_number,
+                cents, time, window);
+  }
+  if (rules->max_debit_cents > 0 &&
+      window->debit_cents > rules->max_debit_cents) {
+    raise_alert(detector, alerts, &count, FRAUD_WINDOW_TOTAL, account_number,
+                cents, time, window);
+  }
+
+  return count;
+}
+
+// Days from 1970-01-01 to a civil date
+static int64_t days_from_civil(int year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+// Parse a 'YYYY-MM-DD HH:MM:SS' ledger date as UTC
+static int64_t parse_ledger_time(const unsigned char *text) {
+  if (text == NULL || strlen((const char *)text) < 19) {
+    return 0;
+  }
+
+#define DIGITS2(p) (((p)[0] - '0') * 10 + ((p)[1] - '0'))
+  int year = DIGITS2(text) * 100 + DIGITS2(text + 2);
+  int64_t days = days_from_civil(year, DIGITS2(text + 5), DIGITS2(text + 8));
+  return days * 86400 + DIGITS2(text + 11) * 3600 + DIGITS2(text + 14) * 60 +
+         DIGITS2(text + 17);
+#undef DIGITS2
+}
+
+// Read a ledger account number. Copies made before the column became TEXT,
+// such as older replicas, store it as an integer without the leading zeros.
+static const char *column_account(sqlite3_stmt *stmt, int column,
+                                  char *buffer, int size) {
+  if (sqlite3_column_type(stmt, column) == SQLITE_INTEGER &&
+      size > ACCOUNT_NUMBER_LENGTH) {
+    // Zero-padded by hand: snprintf would dominate a replay
+    sqlite3_int64 value = sqlite3_column_int64(stmt, column);
+    for (int i = ACCOUNT_NUMBER_LENGTH - 1; i >= 0; i--) {
+      buffer[i] = (char)('0' + value % 10);
+      value /= 10;
+    }
+    buffer[ACCOUNT_NUMBER_LENGTH] = '\0';
+    return buffer;
+  }
+  return (const char *)sqlite3_column_text(stmt, column);
+}
+
+// Create the alerts table
+int create_fraud_tables(sqlite3 *db) {
+  return execute_sql(db, "CREATE TABLE IF NOT EXISTS fraud_alerts ("
+                         "alert_id INTEGER PRIMARY KEY, "
+                         "account_number TEXT NOT NULL, "
+                         "rule TEXT NOT NULL, "
+                         "amount REAL, "
+                         "window_debits INTEGER, "
+                         "window_debit_total REAL, "
+                         "created_at TEXT DEFAULT "
+                         "(strftime('%Y-%m-%d %H:%M:%S', 'now')));");
+}
+
+// Feed the live windows the last window's worth of db's ledger entries,
+// without raising alerts
+static int prime_live_windows(sqlite3 *db) {
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  sqlite3_stmt *stmt;
+  struct FraudAlert alerts[FRAUD_MAX_ALERTS];
+
+  // Ledger rowids grow with time, so walk back from the newest entry until
+  // the window is covered
+  sqlite3_int64 first_rowid = INT64_MAX;
+  int64_t cutoff = (int64_t)time(NULL) - live_detector.rules.window_seconds;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT rowid, date FROM transactions "
+                              "ORDER BY rowid DESC;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW &&
+         parse_ledger_time(sqlite3_column_text(stmt, 1)) > cutoff) {
+    first_rowid = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT account_number, amount, date FROM "
+                          "transactions WHERE rowid >= ? ORDER BY rowid;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int64(stmt, 1, first_rowid);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    fraud_observe(&live_detector,
+                  column_account(stmt, 0, account_number,
+                                 sizeof(account_number)),
+                  llround(sqlite3_column_double(stmt, 1) * 100.0),
+                  parse_ledger_time(sqlite3_column_text(stmt, 2)), alerts);
+  }
+  sqlite3_finalize(stmt);
+
+  memset(live_detector.alerts, 0, sizeof(live_detector.alerts));
+  live_detector.events = 0;
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Start watching postings, storing alerts in db. The windows are primed
+// with db's recent ledger entries before the first posting, not here, so
+// sessions that never post don't read them.
+int start_fraud_monitoring(sqlite3 *db, const struct FraudRules *rules) {
+  int rc = fraud_detector_init(&live_detector, rules);
+  if (rc == SQLITE_OK) {
+    live_db = db;
+    rc = fraud_add_ledger(db);
+  }
+  return rc;
+}
+
+// Prime the live windows with another ledger's recent entries too, a
+// shard's, whose accounts are posted to on their own connection. Priming
+// waits for the first posting while there is room to remember the ledger.
+int fraud_add_ledger(sqlite3 *db) {
+  int rc = SQLITE_OK;
+
+  if (live_db == NULL) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&unprimed_lock);
+  if (unprimed_count < FRAUD_MAX_LEDGERS) {
+    unprimed_dbs[unprimed_count++] = db;
+  } else {
+    pthread_mutex_lock(&live_detector.lock);
+    rc = prime_live_windows(db);
+    pthread_mutex_unlock(&live_detector.lock);
+  }
+  pthread_mutex_unlock(&unprimed_lock);
+  return rc;
+}
+
+// Prime the live windows from every ledger not yet read, once. Called
+// before a posting opens its transaction, so the posting itself is
+// observed but not primed.
+void fraud_prime_ledgers(void) {
+  pthread_mutex_lock(&unprimed_lock);
+  if (unprimed_count > 0) {
+    pthread_mutex_lock(&live_detector.lock);
+    for (int i = 0; i < unprimed_count; i++) {
+      if (prime_live_windows(unprimed_dbs[i]) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prime fraud windows\n");
+      }
+    }
+    unprimed_count = 0;
+    pthread_mutex_unlock(&live_detector.lock);
+  }
+  pthread_mutex_unlock(&unprimed_lock);
+}
+
+// Feed a committed posting, made on any connection, to the live detector
+// and store any alerts in the bank database
+void fraud_observe_posting(const char *account_number, double amount) {
+  struct FraudAlert alerts[FRAUD_MAX_ALERTS];
+  sqlite3_stmt *stmt;
+  sqlite3 *db = live_db;
+
+  if (db == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&live_detector.lock);
+  int count = fraud_observe(&live_detector, account_number,
+                            llround(amount * 100.0), (int64_t)time(NULL),
+                            alerts);
+  pthread_mutex_unlock(&live_detector.lock);
+
+  if (count == 0) {
+    return;
+  }
+
+  const char *sql = "INSERT INTO fraud_alerts (account_number, rule, amount, "
+                    "window_debits, window_debit_total) "
+                    "VALUES (?, ?, ?, ?, ?);";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    printf("Fraud alert: %s on account %s\n", fraud_rule_name(alerts[i].rule),
+           alerts[i].account_number);
+
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, alerts[i].account_number, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, fraud_rule_name(alerts[i].rule), -1,
+                      SQLITE_STATIC);
+    sqlite3_bind_double(stmt, 3, alerts[i].amount_cents / 100.0);
+    sqlite3_bind_int(stmt, 4, alerts[i].window_debits);
+    sqlite3_bind_double(stmt, 5, alerts[i].window_debit_cents / 100.0);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+// Run rules over the whole ledger in posting order with a fresh detector,
+// to see what they would have flagged. Attached partitions are included;
+// their view has no rowids, so it is replayed in date order. Nothing is
+// written.
+int replay_fraud_rules(sqlite3 *db, const struct FraudRules *rules,
+                       struct FraudReplayReport *report) {
+  struct FraudDetector detector;
+  struct FraudAlert alerts[FRAUD_MAX_ALERTS];
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  struct timespec start, end;
+  sqlite3_stmt *stmt;
+  int shown = 0;
+
+  memset(report, 0, sizeof(*report));
+
+  int rc = open_ledger_history(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  const char *source = ledger_history_source(db);
+  char *sql = sqlite3_mprintf("SELECT account_number, amount, date FROM %s "
+                              "WHERE account_number IS NOT NULL ORDER BY %s;",
+                              source,
+                              strcmp(source, "transactions") == 0 ? "rowid"
+                                                                  : "date");
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  rc = fraud_detector_init(&detector, rules);
+  if (rc != SQLITE_OK) {
+    sqlite3_finalize(stmt);
+    return rc;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int count = fraud_observe(
+        &detector,
+        column_account(stmt, 0, account_number, sizeof(account_number)),
+        llround(sqlite3_column_double(stmt, 1) * 100.0),
+        parse_ledger_time(sqlite3_column_text(stmt, 2)), alerts);
+
+    // Show the first few so the rules can be judged, not just counted
+    for (int i = 0; i < count && shown < 10; i++, shown++) {
+      printf("%-12s account %s amount %.2f (%d debits, %.2f in window)\n",
+             fraud_rule_name(alerts[i].rule), alerts[i].account_number,
+             alerts[i].amount_cents / 100.0, alerts[i].window_debits,
+             alerts[i].window_debit_cents / 100.0);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sqlite3_finalize(stmt);
+
+  report->events = detector.events;
+  report->accounts = detector.count;
+  memcpy(report->alerts, detector.alerts, sizeof(report->alerts));
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  fraud_detector_free(&detector);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Print the most recent alerts
+int print_fraud_alerts(sqlite3 *db, int limit) {
+  sqlite3_stmt *stmt;
+
+  const char *sql = "SELECT created_at, account_number, rule, amount, "
+                    "window_debits, window_debit_total FROM fraud_alerts "
+                    "ORDER BY alert_id DESC LIMIT ?;";
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int(stmt, 1, limit);
+
+  printf("Recent Fraud Alerts\n");
+  printf("-------------------\n");
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    printf("%s  %-10s %-12s %12.2f  %d debits, %.2f in window\n",
+           sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1),
+           sqlite3_column_text(stmt, 2), sqlite3_column_double(stmt, 3),
+           sqlite3_column_int(stmt, 4), sqlite3_column_double(stmt, 5));
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
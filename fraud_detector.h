@@ -0,0 +1,93 @@
+#ifndef FRAUD_DETECTOR_H
+#define FRAUD_DETECTOR_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "gen_account_number.h"
+#include "sqlite3.h"
+
+// Debits remembered per account; velocity rules cannot count past this
+#define FRAUD_RING_SIZE 16
+// Alerts one event can raise, one per rule
+#define FRAUD_MAX_ALERTS 4
+// Ledgers, the bank database and its shards, remembered until the first
+// posting primes the windows from them
+#define FRAUD_MAX_LEDGERS 32
+
+// Sliding-window rules. Amounts are in cents; 0 disables a rule.
+struct FraudRules {
+  int window_seconds;       // length of the sliding window
+  int max_debits;           // debits allowed inside the window
+  int64_t max_debit_cents;  // total debits allowed inside the window
+  int64_t large_amount_cents; // any single posting at or above this
+  int spike_multiplier;     // debit this many times the window's average
+};
+
+enum FraudRule {
+  FRAUD_VELOCITY,
+  FRAUD_WINDOW_TOTAL,
+  FRAUD_LARGE_AMOUNT,
+  FRAUD_SPIKE
+};
+
+struct FraudAlert {
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  enum FraudRule rule;
+  int64_t amount_cents;
+  int64_t time;
+  int window_debits;
+  int64_t window_debit_cents;
+};
+
+struct FraudEvent {
+  int64_t time;
+  int64_t cents;
+};
+
+// Recent debits of one account, oldest at head
+struct AccountWindow {
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  unsigned char used;
+  unsigned char head;
+  unsigned char count;
+  int64_t debit_cents; // sum of the debits in the ring
+  struct FraudEvent events[FRAUD_RING_SIZE];
+};
+
+struct FraudDetector {
+  struct FraudRules rules;
+  struct AccountWindow *windows; // open addressing by account number
+  uint32_t capacity;
+  uint32_t count;
+  int64_t events;
+  int64_t alerts[4]; // per enum FraudRule
+  pthread_mutex_t lock;
+};
+
+struct FraudReplayReport {
+  int64_t events;
+  int64_t alerts[4];
+  int64_t accounts;
+  double seconds;
+};
+
+void default_fraud_rules(struct FraudRules *rules);
+void load_fraud_rules_from_env(struct FraudRules *rules);
+int fraud_detector_init(struct FraudDetector *detector,
+                        const struct FraudRules *rules);
+void fraud_detector_free(struct FraudDetector *detector);
+int fraud_observe(struct FraudDetector *detector, const char *account_number,
+                  int64_t cents, int64_t time, struct FraudAlert *alerts);
+const char *fraud_rule_name(enum FraudRule rule);
+
+int create_fraud_tables(sqlite3 *db);
+int start_fraud_monitoring(sqlite3 *db, const struct FraudRules *rules);
+int fraud_add_ledger(sqlite3 *db);
+void fraud_prime_ledgers(void);
+void fraud_observe_posting(const char *account_number, double amount);
+int replay_fraud_rules(sqlite3 *db, const struct FraudRules *rules,
+                       struct FraudReplayReport *report);
+int print_fraud_alerts(sqlite3 *db, int limit);
+
+#endif
@@ -0,0 +1,398 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "idempotency.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Durable rows are pruned once every this many recorded keys
+#define IDEMPOTENCY_PRUNE_INTERVAL 1024
+
+// Entries are chained per bucket and also linked oldest to newest, so
+// expiring the window only ever looks at the front of the list
+struct IdempotencyEntry {
+  struct IdempotencyEntry *next;
+  struct IdempotencyEntry *older;
+  struct IdempotencyEntry *newer;
+  uint64_t hash;
+  int64_t created;
+  char key[IDEMPOTENCY_KEY_MAX + 1];
+};
+
+struct IdempotencyShard {
+  pthread_mutex_t lock;
+  struct IdempotencyEntry **buckets;
+  uint64_t bucket_count;
+  int64_t count;
+  struct IdempotencyEntry *oldest;
+  struct IdempotencyEntry *newest;
+  struct IdempotencyStats stats;
+};
+
+static struct IdempotencyShard shards[IDEMPOTENCY_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t prune_lock = PTHREAD_MUTEX_INITIALIZER;
+static int records_since_prune;
+
+// Connections whose keys are loaded on first use, see
+// defer_idempotency_keys()
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3 *deferred_dbs[IDEMPOTENCY_MAX_STORES];
+static int deferred_count;
+
+static void init_shards(void) {
+  for (int i = 0; i < IDEMPOTENCY_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    shards[i].bucket_count = 256;
+    shards[i].buckets = calloc(256, sizeof(struct IdempotencyEntry *));
+  }
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static struct IdempotencyShard *shard_for(uint64_t hash) {
+  pthread_once(&shards_once, init_shards);
+  return &shards[hash % IDEMPOTENCY_SHARDS];
+}
+
+static struct IdempotencyEntry **bucket_for(struct IdempotencyShard *shard,
+                                            uint64_t hash) {
+  return &shard->buckets[(hash / IDEMPOTENCY_SHARDS) &
+                         (shard->bucket_count - 1)];
+}
+
+// Find a key in a shard. Called with the shard locked.
+static struct IdempotencyEntry *find_entry(struct IdempotencyShard *shard,
+                                           uint64_t hash, const char *key) {
+  for (struct IdempotencyEntry *entry = *bucket_for(shard, hash);
+       entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Unlink and free an entry. Called with the shard locked.
+static void remove_entry(struct IdempotencyShard *shard,
+                         struct IdempotencyEntry *entry) {
+  struct IdempotencyEntry **link = bucket_for(shard, entry->hash);
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  if (entry->older != NULL) {
+    entry->older->newer = entry->newer;
+  } else {
+    shard->oldest = entry->newer;
+  }
+  if (entry->newer != NULL) {
+    entry->newer->older = entry->older;
+  } else {
+    shard->newest = entry->older;
+  }
+
+  shard->count--;
+  free(entry);
+}
+
+// Drop keys that left the window. Called with the shard locked.
+static void expire_entries(struct IdempotencyShard *shard, int64_t now) {
+  while (shard->oldest != NULL &&
+         shard->oldest->created <= now - IDEMPOTENCY_WINDOW_SECONDS) {
+    remove_entry(shard, shard->oldest);
+    shard->stats.expired++;
+  }
+}
+
+// Double the bucket array once chains average two entries. Called with the
+// shard locked.
+static void grow_buckets(struct IdempotencyShard *shard) {
+  uint64_t old_count = shard->bucket_count;
+  struct IdempotencyEntry **old_buckets = shard->buckets;
+  struct IdempotencyEntry **buckets =
+      calloc(old_count * 2, sizeof(struct IdempotencyEntry *));
+
+  if (buckets == NULL) {
+    return;
+  }
+
+  shard->buckets = buckets;
+  shard->bucket_count = old_count * 2;
+  for (uint64_t i = 0; i < old_count; i++) {
+    struct IdempotencyEntry *entry = old_buckets[i];
+    while (entry != NULL) {
+      struct IdempotencyEntry *next = entry->next;
+      struct IdempotencyEntry **bucket = bucket_for(shard, entry->hash);
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+  free(old_buckets);
+}
+
+// Add a key unless it is already present. Called with the shard locked.
+static int add_entry(struct IdempotencyShard *shard, uint64_t hash,
+                     const char *key, int64_t created) {
+  if (find_entry(shard, hash, key) != NULL) {
+    return SQLITE_CONSTRAINT;
+  }
+
+  struct IdempotencyEntry *entry = malloc(sizeof(struct IdempotencyEntry));
+  if (entry == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  if ((uint64_t)shard->count >= shard->bucket_count * 2) {
+    grow_buckets(shard);
+  }
+
+  entry->hash = hash;
+  entry->created = created;
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+
+  struct IdempotencyEntry **bucket = bucket_for(shard, hash);
+  entry->next = *bucket;
+  *bucket = entry;
+
+  entry->older = shard->newest;
+  entry->newer = NULL;
+  if (shard->newest != NULL) {
+    shard->newest->newer = entry;
+  } else {
+    shard->oldest = entry;
+  }
+  shard->newest = entry;
+  shard->count++;
+  return SQLITE_OK;
+}
+
+// Create the durable key table
+int create_idempotency_table(sqlite3 *db) {
+  int rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS idempotency_keys ("
+                           "request_key TEXT PRIMARY KEY, "
+                           "created_at INTEGER NOT NULL) WITHOUT ROWID;");
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Pruning and loading walk keys by age
+  return execute_sql(db, "CREATE INDEX IF NOT EXISTS idx_idempotency_created "
+                         "ON idempotency_keys(created_at);");
+}
+
+// Delete durable keys that left the window
+static int prune_idempotency_keys(sqlite3 *db, int64_t now) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(
+      db, "DELETE FROM idempotency_keys WHERE created_at <= ?;", -1, &stmt,
+      NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_int64(stmt, 1, now - IDEMPOTENCY_WINDOW_SECONDS);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Prune expired keys and load the rest into memory, oldest first
+int load_idempotency_keys(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int64_t now = (int64_t)time(NULL);
+
+  int rc = prune_idempotency_keys(db, now);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT request_key, created_at FROM "
+                          "idempotency_keys ORDER BY created_at;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *key = (const char *)sqlite3_column_text(stmt, 0);
+    uint64_t hash = hash_key(key);
+    struct IdempotencyShard *shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    add_entry(shard, hash, key, sqlite3_column_int64(stmt, 1));
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Load db's keys on the first claim instead of at startup. Sessions that
+// never post with a request key don't read them; retries from an earlier
+// session are still caught, by idempotency_record() at worst. The bank
+// database and each shard keep the keys of the postings they commit.
+void defer_idempotency_keys(sqlite3 *db) {
+  pthread_mutex_lock(&deferred_lock);
+  if (deferred_count < IDEMPOTENCY_MAX_STORES) {
+    deferred_dbs[deferred_count++] = db;
+  } else if (load_idempotency_keys(db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to load idempotency keys\n");
+  }
+  pthread_mutex_unlock(&deferred_lock);
+}
+
+// Load deferred keys, once
+static void load_deferred_keys(void) {
+  pthread_mutex_lock(&deferred_lock);
+  for (int i = 0; i < deferred_count; i++) {
+    if (load_idempotency_keys(deferred_dbs[i]) != SQLITE_OK) {
+      fprintf(stderr, "Failed to load idempotency keys\n");
+    }
+  }
+  deferred_count = 0;
+  pthread_mutex_unlock(&deferred_lock);
+}
+
+// Reserve a request key before posting. Returns SQLITE_CONSTRAINT for a key
+// seen inside the window, without touching the database.
+int idempotency_claim(const char *request_key) {
+  size_t length = strlen(request_key);
+  if (length == 0 || length > IDEMPOTENCY_KEY_MAX) {
+    printf("Request key must be 1 to %d characters.\n", IDEMPOTENCY_KEY_MAX);
+    return SQLITE_MISUSE;
+  }
+
+  load_deferred_keys();
+
+  uint64_t hash = hash_key(request_key);
+  struct IdempotencyShard *shard = shard_for(hash);
+  int64_t now = (int64_t)time(NULL);
+
+  pthread_mutex_lock(&shard->lock);
+  expire_entries(shard, now);
+  int rc = add_entry(shard, hash, request_key, now);
+  if (rc == SQLITE_OK) {
+    shard->stats.accepted++;
+  } else if (rc == SQLITE_CONSTRAINT) {
+    shard->stats.rejected++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (rc == SQLITE_CONSTRAINT) {
+    printf("Request %s was already processed.\n", request_key);
+  }
+  return rc;
+}
+
+// Forget a claimed key whose posting failed, so it can be retried
+void idempotency_release(const char *request_key) {
+  uint64_t hash = hash_key(request_key);
+  struct IdempotencyShard *shard = shard_for(hash);
+
+  pthread_mutex_lock(&shard->lock);
+  struct IdempotencyEntry *entry = find_entry(shard, hash, request_key);
+  if (entry != NULL) {
+    remove_entry(shard, entry);
+    shard->stats.accepted--;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Persist a claimed key inside the posting's transaction. A key recorded by
+// another process within the window makes this return SQLITE_CONSTRAINT.
+int idempotency_record(sqlite3 *db, const char *request_key) {
+  sqlite3_stmt *stmt;
+  int64_t now = (int64_t)time(NULL);
+
+  const char *sql =
+      "INSERT INTO idempotency_keys (request_key, created_at) VALUES (?1, ?2) "
+      "ON CONFLICT(request_key) DO UPDATE SET created_at = excluded.created_at "
+      "WHERE created_at <= ?3;";
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, request_key, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, now);
+  sqlite3_bind_int64(stmt, 3, now - IDEMPOTENCY_WINDOW_SECONDS);
+
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  if (sqlite3_changes(db) == 0) {
+    // Claimed here but posted by another process; keep the key so later
+    // retries are rejected in memory
+    struct IdempotencyShard *shard = shard_for(hash_key(request_key));
+    pthread_mutex_lock(&shard->lock);
+    shard->stats.accepted--;
+    shard->stats.rejected++;
+    pthread_mutex_unlock(&shard->lock);
+
+    printf("Request %s was already processed.\n", request_key);
+    return SQLITE_CONSTRAINT;
+  }
+
+  pthread_mutex_lock(&prune_lock);
+  int prune = ++records_since_prune >= IDEMPOTENCY_PRUNE_INTERVAL;
+  if (prune) {
+    records_since_prune = 0;
+  }
+  pthread_mutex_unlock(&prune_lock);
+
+  return prune ? prune_idempotency_keys(db, now) : SQLITE_OK;
+}
+
+// Sum the counters of every shard
+void get_idempotency_stats(struct IdempotencyStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  load_deferred_keys();
+
+  for (int i = 0; i < IDEMPOTENCY_SHARDS; i++) {
+    struct IdempotencyShard *shard = shard_for(i);
+    pthread_mutex_lock(&shard->lock);
+    stats->keys += shard->count;
+    stats->accepted += shard->stats.accepted;
+    stats->rejected += shard->stats.rejected;
+    stats->expired += shard->stats.expired;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+// Print key counts for the current window
+void print_idempotency_stats() {
+  struct IdempotencyStats stats;
+  get_idempotency_stats(&stats);
+
+  printf("Request keys in window: %lld\n", (long long)stats.keys);
+  printf("Accepted: %lld\n", (long long)stats.accepted);
+  printf("Rejected as duplicates: %lld\n", (long long)stats.rejected);
+  printf("Expired: %lld\n", (long long)stats.expired);
+}
@@ -0,0 +1,34 @@
+#ifndef IDEMPOTENCY_H
+#define IDEMPOTENCY_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Request keys are remembered for this long; a retry inside the window is
+// rejected, one after it is treated as a new request
+#define IDEMPOTENCY_WINDOW_SECONDS (24 * 60 * 60)
+#define IDEMPOTENCY_KEY_MAX 64
+#define IDEMPOTENCY_SHARDS 16
+
+// Databases whose keys can wait for the first claim: the bank database and
+// its shards
+#define IDEMPOTENCY_MAX_STORES 32
+
+struct IdempotencyStats {
+  int64_t keys;
+  int64_t accepted;
+  int64_t rejected;
+  int64_t expired;
+};
+
+int create_idempotency_table(sqlite3 *db);
+int load_idempotency_keys(sqlite3 *db);
+void defer_idempotency_keys(sqlite3 *db);
+int idempotency_claim(const char *request_key);
+void idempotency_release(const char *request_key);
+int idempotency_record(sqlite3 *db, const char *request_key);
+void get_idempotency_stats(struct IdempotencyStats *stats);
+void print_idempotency_stats();
+
+#endif
@@ -0,0 +1,451 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "change_log.h"
+#include "db_config.h"
+#include "interest_engine.h"
+#include "sqlite3.h"
+#include "sync_system.h"
+#include "utils_functions.h"
+#include "uuid/uuid4.h"
+
+struct InterestRange {
+  sqlite3_int64 first_rowid;
+  sqlite3_int64 last_rowid;
+};
+
+// State shared by the worker threads
+struct InterestRun {
+  const struct InterestJob *job;
+  char db_uri[1024];
+  struct InterestRange *ranges;
+  int range_count;
+  int next_range;
+  pthread_mutex_t lock;
+  struct InterestReport report;
+  int rc;
+};
+
+struct InterestEntry {
+  sqlite3_int64 rowid;
+  char account_number[16];
+  sqlite3_int64 interest_cents;
+};
+
+// Create the run checkpoint table and each account's last accrual date.
+// Checkpoints only let a rerun skip whole ranges; the accrual date, written
+// with the posting, is what stops an account being paid twice for a date.
+int create_interest_tables(sqlite3 *db) {
+  char *sql;
+
+  sql = "CREATE TABLE IF NOT EXISTS interest_checkpoints ("
+        "run_date TEXT, "
+        "first_rowid INTEGER, "
+        "last_rowid INTEGER, "
+        "accounts INTEGER, "
+        "interest_cents INTEGER, "
+        "PRIMARY KEY(run_date, first_rowid));"
+        "CREATE TABLE IF NOT EXISTS interest_accruals ("
+        "account_number TEXT PRIMARY KEY, "
+        "run_date TEXT NOT NULL) WITHOUT ROWID;";
+
+  int rc = execute_sql(db, sql);
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+void default_interest_job(struct InterestJob *job) {
+  time_t now = time(NULL);
+
+  strftime(job->run_date, sizeof(job->run_date), "%Y-%m-%d", localtime(&now));
+  job->annual_rate_bp = 250;
+  job->workers = 4;
+  job->chunk_size = 10000;
+}
+
+// Daily interest in cents, rounded half away from zero
+static sqlite3_int64 daily_interest_cents(sqlite3_int64 balance_cents,
+                                          int annual_rate_bp) {
+  const sqlite3_int64 divisor = 10000LL * 365;
+  sqlite3_int64 numerator = balance_cents * annual_rate_bp;
+
+  return (numerator + divisor / 2) / divisor;
+}
+
+// Take the next unprocessed range, or return -1 when none are left
+static int claim_range(struct InterestRun *run) {
+  pthread_mutex_lock(&run->lock);
+  int index = run->rc == SQLITE_OK && run->next_range < run->range_count
+                  ? run->next_range++
+                  : -1;
+  pthread_mutex_unlock(&run->lock);
+  return index;
+}
+
+// Read and compute one range, then apply it in a single transaction together
+// with its checkpoint row. Each posting also moves the account's accrual
+// date to the run date, and an account already there is left alone, so a
+// restart whose ranges no longer line up with the first attempt's never
+// pays interest twice.
+static int process_range(sqlite3 *db, struct InterestRun *run,
+                         const struct InterestRange *range,
+                         struct InterestEntry **entries, int *capacity,
+                         sqlite3_stmt **stmts, int *skipped) {
+  sqlite3_stmt *select = stmts[0];
+  sqlite3_stmt *accrue = stmts[1];
+  sqlite3_stmt *update = stmts[2];
+  sqlite3_stmt *ledger = stmts[3];
+  sqlite3_stmt *checkpoint = stmts[4];
+  int count = 0;
+  int paid = 0;
+  sqlite3_int64 total_cents = 0;
+  int rc;
+
+  // Compute outside the write lock so workers overlap on the read side
+  sqlite3_reset(select);
+  sqlite3_bind_int64(select, 1, range->first_rowid);
+  sqlite3_bind_int64(select, 2, range->last_rowid);
+  sqlite3_bind_text(select, 3, run->job->run_date, -1, SQLITE_STATIC);
+
+  while ((rc = sqlite3_step(select)) == SQLITE_ROW) {
+    sqlite3_int64 cents = llround(sqlite3_column_double(select, 2) * 100.0);
+    sqlite3_int64 interest = daily_interest_cents(cents, run->job->annual_rate_bp);
+
+    if (interest <= 0) {
+      continue;
+    }
+
+    if (count == *capacity) {
+      int grown_capacity = *capacity == 0 ? 256 : *capacity * 2;
+      struct InterestEntry *grown =
+          realloc(*entries, grown_capacity * sizeof(struct InterestEntry));
+      if (grown == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      *entries = grown;
+      *capacity = grown_capacity;
+    }
+
+    struct InterestEntry *entry = &(*entries)[count++];
+    entry->rowid = sqlite3_column_int64(select, 0);
+    snprintf(entry->account_number, sizeof(entry->account_number), "%s",
+             sqlite3_column_text(select, 1));
+    entry->interest_cents = interest;
+  }
+
+  sqlite3_reset(select);
+
+  if (rc != SQLITE_DONE) {
+    return rc == SQLITE_NOMEM ? rc : SQLITE_ERROR;
+  }
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    char transaction_id[UUID4_STR_BUFFER_SIZE];
+    double amount = (*entries)[i].interest_cents / 100.0;
+
+    sqlite3_reset(accrue);
+    sqlite3_bind_text(accrue, 1, (*entries)[i].account_number, -1,
+                      SQLITE_STATIC);
+    sqlite3_bind_text(accrue, 2, run->job->run_date, -1, SQLITE_STATIC);
+    if (sqlite3_step(accrue) != SQLITE_DONE) {
+      rc = SQLITE_ERROR;
+      break;
+    }
+    sqlite3_reset(accrue);
+    if (sqlite3_changes(db) == 0) {
+      // Paid for this date since the range was read
+      continue;
+    }
+
+    sqlite3_reset(update);
+    sqlite3_bind_double(update, 1, amount);
+    sqlite3_bind_int64(update, 2, (*entries)[i].rowid);
+    if (sqlite3_step(update) != SQLITE_ROW) {
+      rc = SQLITE_ERROR;
+      break;
+    }
+    double balance = sqlite3_column_double(update, 0);
+    sqlite3_reset(update);
+
+    generate_uuid_string(transaction_id, sizeof(transaction_id));
+    sqlite3_reset(ledger);
+    sqlite3_bind_text(ledger, 1, transaction_id, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(ledger, 2, (*entries)[i].account_number, -1,
+                      SQLITE_STATIC);
+    sqlite3_bind_double(ledger, 3, amount);
+    if (sqlite3_step(ledger) != SQLITE_ROW) {
+      rc = SQLITE_ERROR;
+      break;
+    }
+
+    if (cdc_enabled()) {
+      char amount_text[32], balance_text[32];
+      snprintf(amount_text, sizeof(amount_text), "%.2f", amount);
+      snprintf(balance_text, sizeof(balance_text), "%.2f", balance);
+      const char *fields[6] = {transaction_id,
+                               (*entries)[i].account_number,
+                               (const char *)sqlite3_column_text(ledger, 0),
+                               amount_text,
+                               "interest",
+                               balance_text};
+      rc = cdc_stage(db, CDC_TRANSACTION_POST, 6, fields);
+    }
+    sqlite3_reset(ledger);
+    if (rc != SQLITE_OK) {
+      break;
+    }
+
+    total_cents += (*entries)[i].interest_cents;
+    paid++;
+  }
+
+  if (rc == SQLITE_OK) {
+    sqlite3_reset(checkpoint);
+    sqlite3_bind_text(checkpoint, 1, run->job->run_date, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(checkpoint, 2, range->first_rowid);
+    sqlite3_bind_int64(checkpoint, 3, range->last_rowid);
+    sqlite3_bind_int(checkpoint, 4, paid);
+    sqlite3_bind_int64(checkpoint, 5, total_cents);
+    rc = sqlite3_step(checkpoint);
+    if (rc == SQLITE_CONSTRAINT) {
+      // Another process checkpointed this range since the plan was made:
+      // discard this attempt
+      *skipped = 1;
+      execute_sql(db, "ROLLBACK;");
+      cdc_discard(db);
+      return SQLITE_OK;
+    }
+    rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Interest range %lld-%lld failed: %s\n",
+            (long long)range->first_rowid, (long long)range->last_rowid,
+            sqlite3_errmsg(db));
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    return rc;
+  }
+
+  rc = execute_sql(db, "COMMIT;");
+  if (rc != SQLITE_OK) {
+    cdc_discard(db);
+  } else {
+    cdc_commit(db);
+    pthread_mutex_lock(&run->lock);
+    run->report.accounts += paid;
+    run->report.interest_cents += total_cents;
+    run->report.ranges_done++;
+    pthread_mutex_unlock(&run->lock);
+  }
+
+  return rc;
+}
+
+// Worker thread: its own connection and statements, reused for every range
+static void *interest_worker(void *arg) {
+  struct InterestRun *run = arg;
+  struct InterestEntry *entries = NULL;
+  int capacity = 0;
+  sqlite3 *db;
+  sqlite3_session *session = NULL;
+  sqlite3_stmt *stmts[5] = {NULL, NULL, NULL, NULL, NULL};
+  int rc;
+
+  const char *sql[5] = {
+      "SELECT a.rowid, a.account_number, a.balance FROM accounts a "
+      "LEFT JOIN interest_accruals i ON i.account_number = a.account_number "
+      "WHERE a.rowid BETWEEN ? AND ? AND a.account_type = 'savings' "
+      "AND a.closed_at IS NULL AND (i.run_date IS NULL OR i.run_date < ?3);",
+      "INSERT INTO interest_accruals (account_number, run_date) "
+      "VALUES (?, ?) ON CONFLICT(account_number) DO UPDATE SET "
+      "run_date = excluded.run_date WHERE run_date < excluded.run_date;",
+      "UPDATE accounts SET balance = balance + ? WHERE rowid = ? "
+      "RETURNING balance;",
+      "INSERT INTO transactions (transaction_id, account_number, date, "
+      "amount, type) VALUES (?, ?, strftime('%Y-%m-%d %H:%M:%S', 'now'), ?, "
+      "'interest') RETURNING date;",
+      "INSERT INTO interest_checkpoints (run_date, first_rowid, last_rowid, "
+      "accounts, interest_cents) VALUES (?, ?, ?, ?, ?);"};
+
+  rc = open_database(run->db_uri, &db);
+  if (rc == SQLITE_OK) {
+    sqlite3_busy_timeout(db, 30000);
+    for (int i = 0; i < 5 && rc == SQLITE_OK; i++) {
+      rc = sqlite3_prepare_v2(db, sql[i], -1, &stmts[i], NULL);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = capture_connection(db, &session);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Interest worker failed to start: %s\n",
+            sqlite3_errmsg(db));
+  }
+
+  int index;
+  while (rc == SQLITE_OK && (index = claim_range(run)) >= 0) {
+    int skipped = 0;
+    rc = process_range(db, run, &run->ranges[index], &entries, &capacity,
+                       stmts, &skipped);
+    if (skipped) {
+      pthread_mutex_lock(&run->lock);
+      run->report.ranges_skipped++;
+      pthread_mutex_unlock(&run->lock);
+    }
+  }
+
+  if (rc != SQLITE_OK) {
+    pthread_mutex_lock(&run->lock);
+    run->rc = rc;
+    pthread_mutex_unlock(&run->lock);
+  }
+
+  for (int i = 0; i < 5; i++) {
+    sqlite3_finalize(stmts[i]);
+  }
+  release_connection_capture(db, session);
+  sqlite3_close(db);
+  free(entries);
+  return NULL;
+}
+
+// Split the accounts rowid space into ranges, dropping ranges the run has
+// already checkpointed. A restart after accounts were deleted or with a new
+// chunk size plans different ranges; the accrual dates skip the accounts
+// those ranges already paid.
+static int plan_ranges(sqlite3 *db, struct InterestRun *run) {
+  sqlite3_stmt *stmt;
+  sqlite3_int64 min_rowid = 0, max_rowid = -1;
+  int chunk = run->job->chunk_size;
+
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT MIN(rowid), MAX(rowid) FROM accounts;", -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW &&
+      sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    min_rowid = sqlite3_column_int64(stmt, 0);
+    max_rowid = sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+
+  if (max_rowid < min_rowid) {
+    return SQLITE_OK;
+  }
+
+  sqlite3_int64 total = (max_rowid - min_rowid) / chunk + 1;
+  run->ranges = malloc(total * sizeof(struct InterestRange));
+  if (run->ranges == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT 1 FROM interest_checkpoints "
+                          "WHERE run_date = ? AND first_rowid = ?;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  for (sqlite3_int64 first = min_rowid; first <= max_rowid; first += chunk) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, run->job->run_date, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, first);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      run->report.ranges_skipped++;
+      continue;
+    }
+
+    struct InterestRange *range = &run->ranges[run->range_count++];
+    range->first_rowid = first;
+    range->last_rowid = first + chunk - 1;
+  }
+
+  sqlite3_finalize(stmt);
+  return SQLITE_OK;
+}
+
+// Accrue one day of interest on every savings account. Ranges completed by
+// an earlier, interrupted run with the same run_date are skipped.
+int run_interest_accrual(sqlite3 *db, const struct InterestJob *job,
+                         struct InterestReport *report) {
+  struct InterestRun run;
+  pthread_t threads[INTEREST_MAX_WORKERS];
+  struct timespec start, end;
+  int workers = job->workers;
+
+  if (job->chunk_size <= 0 || job->annual_rate_bp < 0) {
+    fprintf(stderr, "Invalid interest job parameters\n");
+    return SQLITE_MISUSE;
+  }
+
+  memset(&run, 0, sizeof(run));
+  if (shared_database_uri(db, run.db_uri, sizeof(run.db_uri)) != SQLITE_OK) {
+    fprintf(stderr, "Interest accrual needs a database its workers can "
+                    "open\n");
+    return SQLITE_MISUSE;
+  }
+
+  run.job = job;
+  pthread_mutex_init(&run.lock, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int rc = create_interest_tables(db);
+  if (rc == SQLITE_OK) {
+    rc = plan_ranges(db, &run);
+  }
+
+  if (rc == SQLITE_OK && run.range_count > 0) {
+    if (workers < 1) {
+      workers = 1;
+    }
+    if (workers > INTEREST_MAX_WORKERS) {
+      workers = INTEREST_MAX_WORKERS;
+    }
+    if (workers > run.range_count) {
+      workers = run.range_count;
+    }
+
+    int started = 0;
+    for (; started < workers; started++) {
+      if (pthread_create(&threads[started], NULL, interest_worker, &run) !=
+          0) {
+        break;
+      }
+    }
+    for (int i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+
+    rc = started == 0 ? SQLITE_ERROR : run.rc;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  run.report.seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  *report = run.report;
+  free(run.ranges);
+  pthread_mutex_destroy(&run.lock);
+  return rc;
+}
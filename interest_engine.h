@@ -0,0 +1,30 @@
+#ifndef INTEREST_ENGINE_H
+#define INTEREST_ENGINE_H
+
+#include "sqlite3.h"
+
+#define INTEREST_MAX_WORKERS 16
+
+// One nightly accrual over the savings accounts. Interest is computed in
+// integer cents: balance_cents * annual_rate_bp / (10000 * 365), rounded.
+struct InterestJob {
+  char run_date[11];  // YYYY-MM-DD, identifies the run for restarts
+  int annual_rate_bp; // annual rate in basis points (250 = 2.50%)
+  int workers;        // worker threads
+  int chunk_size;     // accounts rowids per range and per commit
+};
+
+struct InterestReport {
+  sqlite3_int64 accounts;
+  sqlite3_int64 interest_cents;
+  int ranges_done;
+  int ranges_skipped;
+  double seconds;
+};
+
+int create_interest_tables(sqlite3 *db);
+void default_interest_job(struct InterestJob *job);
+int run_interest_accrual(sqlite3 *db, const struct InterestJob *job,
+                         struct InterestReport *report);
+
+#endif
@@ -0,0 +1,955 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ledger_archive.h"
+#include "ledger_partitions.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+#include "varint.h"
+
+#define HEADER_BYTES 20
+#define INDEX_ENTRY_BYTES (LEDGER_ARCHIVE_KEY_BYTES + 24)
+
+enum LedgerEntryFlag { ENTRY_RAW_DATE = 1, ENTRY_RAW_ID = 2 };
+
+// Type codes stored in the entry flags; anything else is stored as text
+static const char *ledger_types[] = {"deposit", "withdrawal", "transfer_in",
+                                     "transfer_out"};
+#define LEDGER_TYPE_OTHER 4
+
+// A growable output buffer for one block
+struct BlockBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+};
+
+struct IndexEntry {
+  char account[LEDGER_ARCHIVE_KEY_BYTES];
+  uint64_t offset;
+  uint32_t length;
+  uint32_t rows;
+  int64_t cents;
+};
+
+static void put_le(unsigned char *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_le(const unsigned char *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Pack a lowercase 8-4-4-4-12 UUID into 16 bytes; other ids are kept as text
+static int pack_uuid(const char *id, unsigned char *out) {
+  if (strlen(id) != 36) {
+    return 0;
+  }
+  for (int i = 0, byte = 0; i < 36; i++) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      if (id[i] != '-') {
+        return 0;
+      }
+      continue;
+    }
+    int high = hex_value(id[i]);
+    int low = hex_value(id[i + 1]);
+    if (high < 0 || low < 0) {
+      return 0;
+    }
+    out[byte++] = (unsigned char)(high << 4 | low);
+    i++;
+  }
+  return 1;
+}
+
+static void unpack_uuid(const unsigned char *in, char *id) {
+  static const char hex[] = "0123456789abcdef";
+
+  for (int byte = 0; byte < 16; byte++) {
+    if (byte == 4 || byte == 6 || byte == 8 || byte == 10) {
+      *id++ = '-';
+    }
+    *id++ = hex[in[byte] >> 4];
+    *id++ = hex[in[byte] & 0xf];
+  }
+  *id = '\0';
+}
+
+static int buffer_reserve(struct BlockBuffer *buffer, size_t extra) {
+  if (buffer->length + extra <= buffer->capacity) {
+    return 1;
+  }
+  size_t capacity = buffer->capacity == 0 ? 16384 : buffer->capacity;
+  while (buffer->length + extra > capacity) {
+    capacity *= 2;
+  }
+  unsigned char *data = realloc(buffer->data, capacity);
+  if (data == NULL) {
+    return 0;
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return 1;
+}
+
+static void put_varint(struct BlockBuffer *buffer, uint64_t value) {
+  buffer->length += varint_encode(value, buffer->data + buffer->length);
+}
+
+static void put_text(struct BlockBuffer *buffer, const char *text) {
+  size_t length = strlen(text);
+  put_varint(buffer, length);
+  memcpy(buffer->data + buffer->length, text, length);
+  buffer->length += length;
+}
+
+// Append one ledger row to the block. Columns: date, epoch seconds, whether
+// the date is in canonical form, cents, type, transaction id.
+static int encode_entry(struct BlockBuffer *buffer, sqlite3_stmt *stmt,
+                        int64_t *previous_seconds) {
+  const char *date = (const char *)sqlite3_column_text(stmt, 1);
+  const char *type = (const char *)sqlite3_column_text(stmt, 5);
+  const char *id = (const char *)sqlite3_column_text(stmt, 6);
+  unsigned char packed[16];
+  int flags = 0;
+  int type_code = LEDGER_TYPE_OTHER;
+
+  date = date != NULL ? date : "";
+  type = type != NULL ? type : "";
+  id = id != NULL ? id : "";
+
+  if (sqlite3_column_type(stmt, 2) == SQLITE_NULL ||
+      !sqlite3_column_int(stmt, 3)) {
+    flags |= ENTRY_RAW_DATE;
+  }
+  if (!pack_uuid(id, packed)) {
+    flags |= ENTRY_RAW_ID;
+  }
+  for (int i = 0; i < LEDGER_TYPE_OTHER; i++) {
+    if (strcmp(type, ledger_types[i]) == 0) {
+      type_code = i;
+    }
+  }
+
+  if (!buffer_reserve(buffer, 5 * VARINT_MAX_BYTES + strlen(date) +
+                                  strlen(type) + strlen(id) + 16)) {
+    return 0;
+  }
+
+  put_varint(buffer, (uint64_t)(type_code << 2 | flags));
+  if (flags & ENTRY_RAW_DATE) {
+    put_text(buffer, date);
+  } else {
+    int64_t seconds = sqlite3_column_int64(stmt, 2);
+    put_varint(buffer, zigzag_encode(seconds - *previous_seconds));
+    *previous_seconds = seconds;
+  }
+  put_varint(buffer, zigzag_encode(sqlite3_column_int64(stmt, 4)));
+  if (flags & ENTRY_RAW_ID) {
+    put_text(buffer, id);
+  } else {
+    memcpy(buffer->data + buffer->length, packed, 16);
+    buffer->length += 16;
+  }
+  if (type_code == LEDGER_TYPE_OTHER) {
+    put_text(buffer, type);
+  }
+  return 1;
+}
+
+static size_t get_text(const unsigned char *in, size_t available, char *out,
+                       int size) {
+  uint64_t length;
+  size_t used = varint_decode(in, available, &length);
+
+  if (used == 0 || length > available - used) {
+    return 0;
+  }
+  snprintf(out, size, "%.*s", (int)length, (const char *)in + used);
+  return used + length;
+}
+
+// Decode one block into entries; returns 0 if the block is damaged
+static int decode_block(const unsigned char *in, size_t length, uint32_t rows,
+                        struct LedgerArchiveEntry *entries) {
+  int64_t seconds = 0;
+  size_t at = 0;
+
+  for (uint32_t row = 0; row < rows; row++) {
+    struct LedgerArchiveEntry *entry = &entries[row];
+    uint64_t flags, value;
+    size_t used;
+
+    if ((used = varint_decode(in + at, length - at, &flags)) == 0) {
+      return 0;
+    }
+    at += used;
+
+    if (flags & ENTRY_RAW_DATE) {
+      used = get_text(in + at, length - at, entry->date, sizeof(entry->date));
+    } else if ((used = varint_decode(in + at, length - at, &value)) != 0) {
+      struct tm tm;
+      seconds += zigzag_decode(value);
+      time_t when = (time_t)seconds;
+      gmtime_r(&when, &tm);
+      strftime(entry->date, sizeof(entry->date), "%Y-%m-%d %H:%M:%S", &tm);
+    }
+    if (used == 0) {
+      return 0;
+    }
+    at += used;
+
+    if ((used = varint_decode(in + at, length - at, &value)) == 0) {
+      return 0;
+    }
+    entry->cents = zigzag_decode(value);
+    at += used;
+
+    if (flags & ENTRY_RAW_ID) {
+      used = get_text(in + at, length - at, entry->transaction_id,
+                      sizeof(entry->transaction_id));
+    } else if (length - at >= 16) {
+      unpack_uuid(in + at, entry->transaction_id);
+      used = 16;
+    } else {
+      used = 0;
+    }
+    if (used == 0) {
+      return 0;
+    }
+    at += used;
+
+    uint64_t type_code = flags >> 2;
+    if (type_code < LEDGER_TYPE_OTHER) {
+      snprintf(entry->type, sizeof(entry->type), "%s",
+               ledger_types[type_code]);
+    } else {
+      used = get_text(in + at, length - at, entry->type, sizeof(entry->type));
+      if (used == 0) {
+        return 0;
+      }
+      at += used;
+    }
+  }
+  return at == length;
+}
+
+// Close the current block and record it in the index
+static int flush_block(FILE *file, struct BlockBuffer *buffer,
+                       struct IndexEntry **index, int64_t *index_count,
+                       int64_t *index_capacity, const char *account,
+                       uint64_t *offset, uint32_t rows, int64_t cents) {
+  if (*index_count == *index_capacity) {
+    int64_t capacity = *index_capacity == 0 ? 1024 : *index_capacity * 2;
+    struct IndexEntry *grown = realloc(*index, capacity * sizeof(**index));
+    if (grown == NULL) {
+      return 0;
+    }
+    *index = grown;
+    *index_capacity = capacity;
+  }
+
+  struct IndexEntry *entry = &(*index)[(*index_count)++];
+  memset(entry->account, 0, sizeof(entry->account));
+  memcpy(entry->account, account, strnlen(account, sizeof(entry->account)));
+  entry->offset = *offset;
+  entry->length = (uint32_t)buffer->length;
+  entry->rows = rows;
+  entry->cents = cents;
+
+  if (fwrite(buffer->data, 1, buffer->length, file) != buffer->length) {
+    return 0;
+  }
+  *offset += buffer->length;
+  buffer->length = 0;
+  return 1;
+}
+
+// Write the index and patch the header to point at it
+static int write_index(FILE *file, const struct IndexEntry *index,
+                       int64_t count, uint64_t offset) {
+  unsigned char bytes[INDEX_ENTRY_BYTES];
+  unsigned char header[HEADER_BYTES];
+
+  for (int64_t i = 0; i < count; i++) {
+    memcpy(bytes, index[i].account, LEDGER_ARCHIVE_KEY_BYTES);
+    put_le(bytes + LEDGER_ARCHIVE_KEY_BYTES, index[i].offset, 8);
+    put_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 8, index[i].length, 4);
+    put_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 12, index[i].rows, 4);
+    put_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 16, (uint64_t)index[i].cents, 8);
+    if (fwrite(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+      return 0;
+    }
+  }
+
+  memcpy(header, LEDGER_ARCHIVE_MAGIC, 8);
+  put_le(header + 8, (uint64_t)count, 4);
+  put_le(header + 12, offset, 8);
+  return fseek(file, 0, SEEK_SET) == 0 &&
+         fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+// Read the header and the whole index of an archive
+static FILE *open_archive(const char *path, struct IndexEntry **index,
+                          int64_t *count) {
+  unsigned char header[HEADER_BYTES];
+  unsigned char bytes[INDEX_ENTRY_BYTES];
+
+  *index = NULL;
+  *count = 0;
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, LEDGER_ARCHIVE_MAGIC, 8) != 0 ||
+      fseek(file, (long)get_le(header + 12, 8), SEEK_SET) != 0) {
+    fclose(file);
+    return NULL;
+  }
+
+  int64_t entries = (int64_t)get_le(header + 8, 4);
+  *index = calloc(entries > 0 ? entries : 1, sizeof(**index));
+  if (*index == NULL) {
+    fclose(file);
+    return NULL;
+  }
+
+  for (int64_t i = 0; i < entries; i++) {
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+      free(*index);
+      *index = NULL;
+      fclose(file);
+      return NULL;
+    }
+    struct IndexEntry *entry = &(*index)[i];
+    memcpy(entry->account, bytes, LEDGER_ARCHIVE_KEY_BYTES);
+    entry->offset = get_le(bytes + LEDGER_ARCHIVE_KEY_BYTES, 8);
+    entry->length = (uint32_t)get_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 8, 4);
+    entry->rows = (uint32_t)get_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 12, 4);
+    entry->cents = (int64_t)get_le(bytes + LEDGER_ARCHIVE_KEY_BYTES + 16, 8);
+  }
+  *count = entries;
+  return file;
+}
+
+// Read one block from its recorded offset and decode it after entries
+static int read_block(FILE *file, const struct IndexEntry *block,
+                      struct LedgerArchiveEntry *entries) {
+  unsigned char *data = malloc(block->length > 0 ? block->length : 1);
+  int ok = data != NULL && fseek(file, (long)block->offset, SEEK_SET) == 0 &&
+           fread(data, 1, block->length, file) == block->length &&
+           decode_block(data, block->length, block->rows, entries);
+  free(data);
+  return ok;
+}
+
+// Decode every block and check its rows and cents against the index and
+// the totals the writer saw
+static int verify_archive(const char *path, int64_t rows, int64_t cents) {
+  struct IndexEntry *index;
+  struct LedgerArchiveEntry *entries;
+  int64_t count;
+  int ok;
+
+  FILE *file = open_archive(path, &index, &count);
+  if (file == NULL) {
+    return 0;
+  }
+
+  entries = malloc(LEDGER_ARCHIVE_BLOCK_ROWS * sizeof(*entries));
+  ok = entries != NULL;
+  for (int64_t i = 0; ok && i < count; i++) {
+    int64_t block_cents = 0;
+    ok = index[i].rows <= LEDGER_ARCHIVE_BLOCK_ROWS &&
+         read_block(file, &index[i], entries);
+    for (uint32_t row = 0; ok && row < index[i].rows; row++) {
+      block_cents += entries[row].cents;
+    }
+    ok = ok && block_cents == index[i].cents;
+    rows -= index[i].rows;
+    cents -= index[i].cents;
+  }
+
+  free(entries);
+  free(index);
+  fclose(file);
+  return ok && rows == 0 && cents == 0;
+}
+
+static int64_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (int64_t)st.st_size : 0;
+}
+
+// Pack an archived month's partition into a compressed archive next to it.
+// The archive is written under a temporary name, read back and checked,
+// then renamed into place; only then does the catalog point at it and the
+// partition database go away. Months holding amounts finer than a cent
+// are refused, since the archive keeps whole cents.
+int compress_partition(sqlite3 *db, const char *month,
+                       struct LedgerArchiveReport *report) {
+  sqlite3 *source = NULL;
+  sqlite3_stmt *stmt;
+  struct BlockBuffer buffer = {NULL, 0, 0};
+  struct IndexEntry *index = NULL;
+  int64_t index_count = 0, index_capacity = 0;
+  int64_t total_cents = 0;
+  struct timespec start, end;
+  char path[1024], archive_path[1040], temp_path[1048];
+  int compressed = -1;
+  FILE *file = NULL;
+  int ok = 1;
+
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT path, compressed FROM ledger_partitions WHERE month = ?;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, month, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    snprintf(path, sizeof(path), "%s", sqlite3_column_text(stmt, 0));
+    compressed = sqlite3_column_int(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+
+  if (compressed < 0) {
+    printf("No partition for %s.\n", month);
+    return SQLITE_NOTFOUND;
+  }
+  if (compressed) {
+    printf("Partition %s is already compressed.\n", month);
+    return SQLITE_OK;
+  }
+
+  snprintf(archive_path, sizeof(archive_path), "%.*s.lga",
+           (int)(strlen(path) > 3 && strcmp(path + strlen(path) - 3, ".db") == 0
+                     ? strlen(path) - 3
+                     : strlen(path)),
+           path);
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", archive_path);
+  report->source_bytes = file_size(path);
+
+  rc = sqlite3_open_v2(path, &source, SQLITE_OPEN_READONLY, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open partition: %s\n", sqlite3_errmsg(source));
+    sqlite3_close(source);
+    return rc;
+  }
+
+  // One walk of the partition's account index gives each account's
+  // entries in date order
+  rc = sqlite3_prepare_v2(
+      source,
+      "SELECT account_number, date, CAST(strftime('%s', date) AS INTEGER), "
+      "strftime('%Y-%m-%d %H:%M:%S', date) IS date, "
+      "CAST(round(amount * 100) AS INTEGER), type, transaction_id, "
+      "CAST(round(amount * 100) AS INTEGER) / 100.0 = amount "
+      "FROM transactions INDEXED BY idx_transactions_account "
+      "ORDER BY account_number, date;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n",
+            sqlite3_errmsg(source));
+    sqlite3_close(source);
+    return rc;
+  }
+
+  file = fopen(temp_path, "wb");
+  if (file == NULL) {
+    perror("Can't open archive file");
+    sqlite3_finalize(stmt);
+    sqlite3_close(source);
+    return SQLITE_CANTOPEN;
+  }
+
+  unsigned char header[HEADER_BYTES] = {0};
+  uint64_t offset = HEADER_BYTES;
+  char account[LEDGER_ARCHIVE_KEY_BYTES + 1] = "";
+  struct LedgerArchiveEntry entry;
+  int64_t previous_seconds = 0, block_cents = 0;
+  uint32_t block_rows = 0;
+
+  ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  while (ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *row_account = (const char *)sqlite3_column_text(stmt, 0);
+    row_account = row_account != NULL ? row_account : "";
+
+    // Text that wouldn't fit a decoded entry is refused rather than cut
+    if (strlen(row_account) > LEDGER_ARCHIVE_KEY_BYTES ||
+        !sqlite3_column_int(stmt, 7) ||
+        sqlite3_column_bytes(stmt, 1) >= (int)sizeof(entry.date) ||
+        sqlite3_column_bytes(stmt, 5) >= (int)sizeof(entry.type) ||
+        sqlite3_column_bytes(stmt, 6) >= (int)sizeof(entry.transaction_id)) {
+      fprintf(stderr, "Transaction %s can't be archived without loss\n",
+              sqlite3_column_text(stmt, 6));
+      ok = 0;
+      break;
+    }
+
+    int new_account = strcmp(row_account, account) != 0;
+    if (block_rows > 0 &&
+        (new_account || block_rows == LEDGER_ARCHIVE_BLOCK_ROWS)) {
+      ok = flush_block(file, &buffer, &index, &index_count, &index_capacity,
+                       account, &offset, block_rows, block_cents);
+      block_rows = 0;
+      block_cents = 0;
+    }
+    if (block_rows == 0) {
+      previous_seconds = 0;
+    }
+    if (new_account) {
+      snprintf(account, sizeof(account), "%s", row_account);
+      report->accounts++;
+    }
+
+    ok = ok && encode_entry(&buffer, stmt, &previous_seconds);
+    block_rows++;
+    block_cents += sqlite3_column_int64(stmt, 4);
+    total_cents += sqlite3_column_int64(stmt, 4);
+    report->rows++;
+  }
+
+  if (ok && rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(source));
+    ok = 0;
+  }
+  if (ok && block_rows > 0) {
+    ok = flush_block(file, &buffer, &index, &index_count, &index_capacity,
+                     account, &offset, block_rows, block_cents);
+  }
+  ok = ok && write_index(file, index, index_count, offset) &&
+       fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  report->blocks = index_count;
+
+  sqlite3_finalize(stmt);
+  sqlite3_close(source);
+  free(buffer.data);
+  free(index);
+
+  if (ok && !verify_archive(temp_path, report->rows, total_cents)) {
+    fprintf(stderr, "Archive %s failed verification\n", temp_path);
+    ok = 0;
+  }
+  if (!ok || rename(temp_path, archive_path) != 0) {
+    unlink(temp_path);
+    return ok ? SQLITE_IOERR : SQLITE_ERROR;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "UPDATE ledger_partitions SET path = ?, "
+                          "compressed = 1 WHERE month = ?;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, archive_path, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, month, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // The month leaves the view before its database file is removed
+  rc = attach_partitions(db);
+  unlink(path);
+
+  report->archive_bytes = file_size(archive_path);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return rc;
+}
+
+// Read one account's entries from an archive. Only the blocks the index
+// lists for the account are read and decoded.
+int read_archived_account(const char *path, const char *account_number,
+                          struct LedgerArchiveEntry **entries, int *count,
+                          int *blocks_read) {
+  struct IndexEntry *index;
+  char key[LEDGER_ARCHIVE_KEY_BYTES] = {0};
+  int64_t index_count;
+
+  memcpy(key, account_number, strnlen(account_number, sizeof(key)));
+  if (blocks_read != NULL) {
+    *blocks_read = 0;
+  }
+
+  FILE *file = open_archive(path, &index, &index_count);
+  if (file == NULL) {
+    fprintf(stderr, "Can't read ledger archive %s\n", path);
+    return SQLITE_CANTOPEN;
+  }
+
+  // Blocks are in account order, so the account's blocks are one run
+  int64_t low = 0, high = index_count;
+  while (low < high) {
+    int64_t middle = low + (high - low) / 2;
+    if (memcmp(index[middle].account, key, sizeof(key)) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  int rc = SQLITE_OK;
+  for (int64_t i = low; i < index_count &&
+                        memcmp(index[i].account, key, sizeof(key)) == 0;
+       i++) {
+    if (index[i].rows > LEDGER_ARCHIVE_BLOCK_ROWS) {
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+    struct LedgerArchiveEntry *grown =
+        realloc(*entries, (*count + index[i].rows) * sizeof(**entries));
+    if (grown == NULL) {
+      rc = SQLITE_NOMEM;
+      break;
+    }
+    *entries = grown;
+    if (!read_block(file, &index[i], *entries + *count)) {
+      rc = SQLITE_CORRUPT;
+      break;
+    }
+    *count += index[i].rows;
+    if (blocks_read != NULL) {
+      (*blocks_read)++;
+    }
+  }
+
+  if (rc == SQLITE_CORRUPT) {
+    fprintf(stderr, "Ledger archive %s is damaged\n", path);
+  }
+  free(index);
+  fclose(file);
+  return rc;
+}
+
+// Collect an account's entries from every compressed month, oldest first.
+// The caller frees *entries.
+int read_archived_history(sqlite3 *db, const char *account_number,
+                          struct LedgerArchiveEntry **entries, int *count) {
+  sqlite3_stmt *stmt;
+
+  *entries = NULL;
+  *count = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT path FROM ledger_partitions "
+                              "WHERE compressed = 1 ORDER BY month;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    rc = read_archived_account((const char *)sqlite3_column_text(stmt, 0),
+                               account_number, entries, count, NULL);
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_OK) {
+    free(*entries);
+    *entries = NULL;
+    *count = 0;
+  }
+  return rc;
+}
+
+// Collect an account's newest entries from compressed months, at most limit
+// of them, oldest first. Months are read newest first and reading stops
+// once limit entries are found. The caller frees *entries.
+int read_recent_archived_history(sqlite3 *db, const char *account_number,
+                                 int limit,
+                                 struct LedgerArchiveEntry **entries,
+                                 int *count) {
+  sqlite3_stmt *stmt;
+
+  *entries = NULL;
+  *count = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT path FROM ledger_partitions "
+                              "WHERE compressed = 1 ORDER BY month DESC;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  while (rc == SQLITE_OK && *count < limit &&
+         sqlite3_step(stmt) == SQLITE_ROW) {
+    struct LedgerArchiveEntry *month_entries = NULL;
+    int month_count = 0;
+
+    rc = read_archived_account((const char *)sqlite3_column_text(stmt, 0),
+                               account_number, &month_entries, &month_count,
+                               NULL);
+
+    // The month is older than every entry kept so far, so its newest
+    // entries go in front
+    int take = month_count < limit - *count ? month_count : limit - *count;
+    if (rc == SQLITE_OK && take > 0) {
+      struct LedgerArchiveEntry *grown =
+          realloc(*entries, (*count + take) * sizeof(**entries));
+      if (grown == NULL) {
+        rc = SQLITE_NOMEM;
+      } else {
+        memmove(grown + take, grown, *count * sizeof(*grown));
+        memcpy(grown, month_entries + month_count - take,
+               take * sizeof(*grown));
+        *entries = grown;
+        *count += take;
+      }
+    }
+    free(month_entries);
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_OK) {
+    free(*entries);
+    *entries = NULL;
+    *count = 0;
+  }
+  return rc;
+}
+
+// Write a copy of an archive without the blocks of one account. The copy
+// is read back and checked against the totals of the blocks kept.
+static int rewrite_without_account(const char *path, const char *temp_path,
+                                   const char *key, int64_t *kept_rows) {
+  struct IndexEntry *index;
+  struct IndexEntry *kept = NULL;
+  int64_t count, kept_count = 0, kept_cents = 0;
+  uint64_t offset = HEADER_BYTES;
+  unsigned char header[HEADER_BYTES] = {0};
+  unsigned char *data = NULL;
+  int ok;
+
+  *kept_rows = 0;
+  FILE *source = open_archive(path, &index, &count);
+  if (source == NULL) {
+    fprintf(stderr, "Can't read ledger archive %s\n", path);
+    return 0;
+  }
+  FILE *file = fopen(temp_path, "wb");
+  ok = file != NULL &&
+       fwrite(header, 1, sizeof(header), file) == sizeof(header);
+  kept = calloc(count > 0 ? count : 1, sizeof(*kept));
+  ok = ok && kept != NULL;
+
+  for (int64_t i = 0; ok && i < count; i++) {
+    if (memcmp(index[i].account, key, LEDGER_ARCHIVE_KEY_BYTES) == 0) {
+      continue;
+    }
+    unsigned char *grown = realloc(data, index[i].length + 1);
+    ok = grown != NULL;
+    if (ok) {
+      data = grown;
+      ok = fseek(source, (long)index[i].offset, SEEK_SET) == 0 &&
+           fread(data, 1, index[i].length, source) == index[i].length &&
+           fwrite(data, 1, index[i].length, file) == index[i].length;
+    }
+    kept[kept_count] = index[i];
+    kept[kept_count++].offset = offset;
+    offset += index[i].length;
+    *kept_rows += index[i].rows;
+    kept_cents += index[i].cents;
+  }
+
+  ok = ok && write_index(file, kept, kept_count, offset) &&
+       fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if (file != NULL) {
+    ok = fclose(file) == 0 && ok;
+  }
+  fclose(source);
+  free(index);
+  free(kept);
+  free(data);
+
+  if (ok && !verify_archive(temp_path, *kept_rows, kept_cents)) {
+    fprintf(stderr, "Archive %s failed verification\n", temp_path);
+    ok = 0;
+  }
+  if (!ok) {
+    unlink(temp_path);
+  }
+  return ok;
+}
+
+// Remove one account's entries from a compressed month. In archive mode
+// they are copied to archived_transactions first. The catalog commits
+// before the rewritten file replaces the old one; a purge resumed between
+// the two finds the entries again, and the copy ignores rows it holds.
+static int purge_archive_month(sqlite3 *db, const char *month,
+                               const char *path, const char *account_number,
+                               int archive, int64_t *removed) {
+  struct LedgerArchiveEntry *entries = NULL;
+  char key[LEDGER_ARCHIVE_KEY_BYTES] = {0};
+  char temp_path[1048];
+  int64_t kept_rows;
+  int count = 0;
+  sqlite3_stmt *stmt = NULL;
+
+  int rc = read_archived_account(path, account_number, &entries, &count, NULL);
+  if (rc != SQLITE_OK || count == 0) {
+    free(entries);
+    return rc;
+  }
+
+  memcpy(key, account_number, strnlen(account_number, sizeof(key)));
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  if (!rewrite_without_account(path, temp_path, key, &kept_rows)) {
+    free(entries);
+    return SQLITE_IOERR;
+  }
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc == SQLITE_OK && archive) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "INSERT OR IGNORE INTO archived_transactions (transaction_id, "
+        "account_number, date, amount, type, archived_at) VALUES "
+        "(?, ?, ?, ? / 100.0, ?, strftime('%Y-%m-%d %H:%M:%S', 'now'));",
+        -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(db));
+    }
+    for (int i = 0; rc == SQLITE_OK && i < count; i++) {
+      sqlite3_bind_text(stmt, 1, entries[i].transaction_id, -1,
+                        SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, account_number, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 3, entries[i].date, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 4, entries[i].cents);
+      sqlite3_bind_text(stmt, 5, entries[i].type, -1, SQLITE_STATIC);
+      if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+        rc = SQLITE_ERROR;
+      }
+      sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        db, "UPDATE ledger_partitions SET rows = ? WHERE month = ?;", -1,
+        &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(db));
+    } else {
+      sqlite3_bind_int64(stmt, 1, kept_rows);
+      sqlite3_bind_text(stmt, 2, month, -1, SQLITE_STATIC);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+      if (rc != SQLITE_OK) {
+        fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+      }
+      sqlite3_finalize(stmt);
+    }
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  free(entries);
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    unlink(temp_path);
+    return rc;
+  }
+  if (rename(temp_path, path) != 0) {
+    perror("Can't replace ledger archive");
+    unlink(temp_path);
+    return SQLITE_IOERR;
+  }
+  *removed += count;
+  return SQLITE_OK;
+}
+
+// Remove a deleted account's entries from every compressed month
+int purge_archived_account(sqlite3 *db, const char *account_number,
+                           int archive, int64_t *removed) {
+  sqlite3_stmt *stmt;
+  char (*months)[8] = NULL;
+  char (*paths)[1024] = NULL;
+  int count = 0, capacity = 0;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT month, path FROM ledger_partitions "
+                              "WHERE compressed = 1 ORDER BY month;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (count == capacity) {
+      capacity = capacity == 0 ? 16 : capacity * 2;
+      void *grown_months = realloc(months, capacity * sizeof(*months));
+      if (grown_months != NULL) {
+        months = grown_months;
+      }
+      void *grown_paths = realloc(paths, capacity * sizeof(*paths));
+      if (grown_paths != NULL) {
+        paths = grown_paths;
+      }
+      if (grown_months == NULL || grown_paths == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    snprintf(months[count], sizeof(months[0]), "%s",
+             sqlite3_column_text(stmt, 0));
+    snprintf(paths[count], sizeof(paths[0]), "%s",
+             sqlite3_column_text(stmt, 1));
+    count++;
+  }
+  sqlite3_finalize(stmt);
+  rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+
+  // The catalog is read in full first, since each month commits on its own
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    rc = purge_archive_month(db, months[i], paths[i], account_number, archive,
+                             removed);
+  }
+
+  free(months);
+  free(paths);
+  return rc;
+}
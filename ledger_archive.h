@@ -0,0 +1,54 @@
+#ifndef LEDGER_ARCHIVE_H
+#define LEDGER_ARCHIVE_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Compressed ledger archive layout, integers little-endian:
+//   "BNKLGA01" u32 block_count u64 index_offset
+//   blocks, each holding up to LEDGER_ARCHIVE_BLOCK_ROWS entries of one
+//   account in date order
+//   index at index_offset, one entry per block in account order:
+//     char account[16] (NUL padded), u64 offset, u32 byte_length,
+//     u32 row_count, i64 total_cents
+// Every entry in a block starts with a varint of flags: bit 0 raw date,
+// bit 1 raw id, and the type code from bit 2. Then come the date as a
+// zigzag delta of epoch seconds from the previous entry in the block, the
+// amount in zigzag cents, the id as the 16 bytes of a lowercase UUID and,
+// for type code 4, the type text. Raw fields are a varint length and text.
+#define LEDGER_ARCHIVE_MAGIC "BNKLGA01"
+#define LEDGER_ARCHIVE_BLOCK_ROWS 256
+#define LEDGER_ARCHIVE_KEY_BYTES 16
+
+struct LedgerArchiveEntry {
+  char transaction_id[64];
+  char date[32];
+  char type[32];
+  int64_t cents;
+};
+
+struct LedgerArchiveReport {
+  int64_t rows;
+  int64_t accounts;
+  int64_t blocks;
+  int64_t source_bytes;  // partition database file
+  int64_t archive_bytes; // compressed file
+  double seconds;
+};
+
+int compress_partition(sqlite3 *db, const char *month,
+                       struct LedgerArchiveReport *report);
+int read_archived_account(const char *path, const char *account_number,
+                          struct LedgerArchiveEntry **entries, int *count,
+                          int *blocks_read);
+int read_archived_history(sqlite3 *db, const char *account_number,
+                          struct LedgerArchiveEntry **entries, int *count);
+int read_recent_archived_history(sqlite3 *db, const char *account_number,
+                                 int limit,
+                                 struct LedgerArchiveEntry **entries,
+                                 int *count);
+int purge_archived_account(sqlite3 *db, const char *account_number,
+                           int archive, int64_t *removed);
+
+#endif
@@ -0,0 +1,980 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db_config.h"
+#include "ledger_partitions.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// Largest number of months archived in one batch before its write
+// transaction commits
+#define PARTITION_BATCH_MONTHS 16
+
+// Connection whose all_transactions view is current
+static sqlite3 *history_db;
+
+// Connection whose partitions are attached on its first history read, see
+// defer_partitions()
+static sqlite3 *deferred_db;
+
+// Tables written by older versions lack later columns: the catalog its
+// compressed flag, the carried totals their deposits
+static int has_column(sqlite3 *db, const char *table, const char *column) {
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?) "
+                             "WHERE name = ?;",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+  found = sqlite3_step(stmt) == SQLITE_ROW;
+
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Create the partition catalog and the per-account archived totals. A
+// compressed month's path names its ledger archive instead of a database.
+// Archived deposits stay in account_type_totals: the triggers on
+// ledger_carry add back what transactions_totals_ad takes off as the hot
+// rows go, take it off when a purge drops the carry, and move it with the
+// account when its type changes.
+int create_partition_tables(sqlite3 *db) {
+  int rc = execute_sql(
+      db, "CREATE TABLE IF NOT EXISTS ledger_partitions ("
+          "month TEXT PRIMARY KEY, "
+          "path TEXT NOT NULL, "
+          "rows INTEGER NOT NULL DEFAULT 0, "
+          "compressed INTEGER NOT NULL DEFAULT 0);"
+          "CREATE TABLE IF NOT EXISTS ledger_carry ("
+          "account_number TEXT PRIMARY KEY, "
+          "archived_cents INTEGER NOT NULL, "
+          "archived_entries INTEGER NOT NULL, "
+          "deposit_cents INTEGER NOT NULL DEFAULT 0) WITHOUT ROWID;");
+
+  if (rc == SQLITE_OK && !has_column(db, "ledger_partitions", "compressed")) {
+    rc = execute_sql(db, "ALTER TABLE ledger_partitions ADD COLUMN "
+                         "compressed INTEGER NOT NULL DEFAULT 0;");
+  }
+  if (rc == SQLITE_OK && !has_column(db, "ledger_carry", "deposit_cents")) {
+    rc = execute_sql(db, "ALTER TABLE ledger_carry ADD COLUMN "
+                         "deposit_cents INTEGER NOT NULL DEFAULT 0;");
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return execute_sql(
+      db,
+      "CREATE TRIGGER IF NOT EXISTS ledger_carry_totals_ai AFTER INSERT ON "
+      "ledger_carry WHEN new.deposit_cents != 0 BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents + "
+      "new.deposit_cents WHERE account_type = (SELECT account_type "
+      "FROM accounts WHERE account_number = new.account_number); "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS ledger_carry_totals_au AFTER UPDATE OF "
+      "deposit_cents ON ledger_carry BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents + "
+      "new.deposit_cents - old.deposit_cents WHERE account_type = "
+      "(SELECT account_type FROM accounts "
+      "WHERE account_number = new.account_number); "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS ledger_carry_totals_ad AFTER DELETE ON "
+      "ledger_carry WHEN old.deposit_cents != 0 BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents - "
+      "old.deposit_cents WHERE account_type = (SELECT account_type "
+      "FROM accounts WHERE account_number = old.account_number); "
+      "END;"
+
+      "CREATE TRIGGER IF NOT EXISTS ledger_carry_deposits_type_au AFTER "
+      "UPDATE OF account_type ON accounts "
+      "WHEN old.account_type IS NOT new.account_type BEGIN "
+      "UPDATE account_type_totals SET deposit_cents = deposit_cents - "
+      "(SELECT IFNULL(SUM(deposit_cents), 0) FROM ledger_carry "
+      "WHERE account_number = old.account_number) "
+      "WHERE account_type = old.account_type; "
+      "INSERT INTO account_type_totals (account_type, deposit_cents) "
+      "SELECT new.account_type, IFNULL(SUM(deposit_cents), 0) "
+      "FROM ledger_carry WHERE account_number = new.account_number "
+      "ON CONFLICT(account_type) DO UPDATE SET "
+      "deposit_cents = deposit_cents + excluded.deposit_cents; "
+      "END;");
+}
+
+// Accept only YYYY-MM, since the month also names the attached schema
+static int valid_month(const char *month) {
+  if (month == NULL || strlen(month) != 7 || month[4] != '-') {
+    return 0;
+  }
+  for (int i = 0; i < 7; i++) {
+    if (i != 4 && (month[i] < '0' || month[i] > '9')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void schema_name(const char *month, char *schema, int size) {
+  snprintf(schema, size, "p_%.4s_%.2s", month, month + 5);
+}
+
+// Detach every partition schema and drop the view over them
+static int detach_partitions(sqlite3 *db, int *attached) {
+  sqlite3_stmt *stmt;
+  char names[128][16];
+  int count = 0;
+
+  *attached = 0;
+  int rc = execute_sql(db, "DROP VIEW IF EXISTS temp.all_transactions;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(db, "PRAGMA database_list;", -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *name = (const char *)sqlite3_column_text(stmt, 1);
+    if (strncmp(name, "p_", 2) == 0 && count < 128) {
+      snprintf(names[count++], sizeof(names[0]), "%s", name);
+    } else if (strcmp(name, "main") != 0 && strcmp(name, "temp") != 0) {
+      (*attached)++;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "DETACH DATABASE %.15s;", names[i]);
+    rc = execute_sql(db, sql);
+  }
+  return rc;
+}
+
+// Attach one partition file under its month's schema name
+static int attach_partition(sqlite3 *db, const char *month, const char *path) {
+  sqlite3_stmt *stmt;
+  char schema[16];
+  char sql[64];
+
+  schema_name(month, schema, sizeof(schema));
+  snprintf(sql, sizeof(sql), "ATTACH DATABASE ? AS %s;", schema);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Month past the attach limit, copied after the catalog has been read
+struct OverflowMonth {
+  char month[8];
+  char *path;
+};
+
+// Copy a month past the attach limit into temp.overflow_transactions,
+// attaching its file only for the copy
+static int stage_overflow_month(sqlite3 *db, const char *month,
+                                const char *path) {
+  char schema[16];
+  char sql[64];
+
+  int rc = attach_partition(db, month, path);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  schema_name(month, schema, sizeof(schema));
+  char *copy = sqlite3_mprintf(
+      "INSERT INTO temp.overflow_transactions SELECT transaction_id, "
+      "account_number, date, amount, type FROM %s.transactions;",
+      schema);
+  rc = copy == NULL ? SQLITE_NOMEM : execute_sql(db, copy);
+  sqlite3_free(copy);
+
+  snprintf(sql, sizeof(sql), "DETACH DATABASE %s;", schema);
+  int detached = execute_sql(db, sql);
+  return rc == SQLITE_OK ? detached : rc;
+}
+
+// Attach the catalogued partitions, newest first, and rebuild the
+// all_transactions view over them and the hot table. Older months that do
+// not fit under the attach limit are copied into a temporary table the
+// view also covers, and compressed months are read through the ledger
+// archive. A catalogued file that is missing fails the call and leaves no
+// view, since history read without it would be incomplete.
+int attach_partitions(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int attached;
+
+  int rc = detach_partitions(db, &attached);
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(
+        db, "CREATE TEMP TABLE IF NOT EXISTS overflow_transactions ("
+            "transaction_id TEXT, account_number TEXT, date TEXT, "
+            "amount REAL, type TEXT);"
+            "CREATE INDEX IF NOT EXISTS temp.overflow_transactions_account "
+            "ON overflow_transactions (account_number, date);"
+            "DELETE FROM temp.overflow_transactions;");
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT month, path FROM ledger_partitions WHERE compressed = 0 "
+      "ORDER BY month DESC;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  // One schema slot stays free for copying the months past the limit,
+  // which happens once the catalog query is done
+  int limit = sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1) - attached - 1;
+  struct OverflowMonth *overflow = NULL;
+  int overflow_count = 0;
+  char *view = sqlite3_mprintf(
+      "CREATE TEMP VIEW all_transactions AS SELECT transaction_id, "
+      "account_number, date, amount, type FROM main.transactions");
+
+  while (view != NULL && rc == SQLITE_OK &&
+         sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *month = (const char *)sqlite3_column_text(stmt, 0);
+    const char *path = (const char *)sqlite3_column_text(stmt, 1);
+    char schema[16];
+
+    if (!valid_month(month)) {
+      fprintf(stderr, "Ledger partition catalog names an invalid month\n");
+      rc = SQLITE_CORRUPT;
+    } else if (access(path, R_OK) != 0) {
+      fprintf(stderr, "Ledger partition for %s is missing: %s\n", month,
+              path);
+      rc = SQLITE_CANTOPEN;
+    } else if (limit <= 0) {
+      struct OverflowMonth *grown =
+          realloc(overflow, (overflow_count + 1) * sizeof(*overflow));
+      if (grown == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      overflow = grown;
+      snprintf(overflow[overflow_count].month,
+               sizeof(overflow[0].month), "%s", month);
+      overflow[overflow_count].path = sqlite3_mprintf("%s", path);
+      rc = overflow[overflow_count++].path == NULL ? SQLITE_NOMEM
+                                                   : SQLITE_OK;
+    } else if ((rc = attach_partition(db, month, path)) == SQLITE_OK) {
+      limit--;
+      schema_name(month, schema, sizeof(schema));
+      char *next = sqlite3_mprintf(
+          "%s UNION ALL SELECT transaction_id, account_number, date, "
+          "amount, type FROM %s.transactions",
+          view, schema);
+      sqlite3_free(view);
+      view = next;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  for (int i = 0; i < overflow_count; i++) {
+    if (rc == SQLITE_OK) {
+      rc = stage_overflow_month(db, overflow[i].month, overflow[i].path);
+    }
+    sqlite3_free(overflow[i].path);
+  }
+  free(overflow);
+
+  if (view != NULL && rc == SQLITE_OK && overflow_count > 0) {
+    char *next = sqlite3_mprintf(
+        "%s UNION ALL SELECT transaction_id, account_number, date, amount, "
+        "type FROM temp.overflow_transactions",
+        view);
+    sqlite3_free(view);
+    view = next;
+    fprintf(stderr,
+            "%d ledger partition(s) past the attach limit were copied into "
+            "temporary storage; compress older months to avoid this\n",
+            overflow_count);
+  }
+  if (view == NULL && rc == SQLITE_OK) {
+    rc = SQLITE_NOMEM;
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, view);
+  }
+  sqlite3_free(view);
+
+  if (rc != SQLITE_OK) {
+    detach_partitions(db, &attached);
+    history_db = NULL;
+    return rc;
+  }
+  history_db = db;
+  return SQLITE_OK;
+}
+
+// Attach db's partitions on its first history read instead of at startup.
+// Sessions that never read history don't open the month files.
+void defer_partitions(sqlite3 *db) {
+  deferred_db = db;
+}
+
+// Attach db's deferred partitions if its view is not current, before a
+// history read. A failed attach is returned to the reader and tried again
+// on the next read.
+int open_ledger_history(sqlite3 *db) {
+  if (db != deferred_db || db == history_db) {
+    return SQLITE_OK;
+  }
+  return attach_partitions(db);
+}
+
+// Table or view holding an account's full history on this connection
+const char *ledger_history_source(sqlite3 *db) {
+  return db == history_db ? "all_transactions" : "transactions";
+}
+
+static int query_month(sqlite3 *db, const char *sql, char *month, int size) {
+  sqlite3_stmt *stmt;
+
+  month[0] = '\0';
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW &&
+      sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    snprintf(month, size, "%s", sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  return SQLITE_OK;
+}
+
+// Latest archived month, or an empty string if nothing was archived
+int archived_through_month(sqlite3 *db, char *month, int size) {
+  return query_month(db, "SELECT MAX(month) FROM ledger_partitions;", month,
+                     size);
+}
+
+// Earliest compressed month, or an empty string if none is compressed
+int first_compressed_month(sqlite3 *db, char *month, int size) {
+  return query_month(
+      db, "SELECT MIN(month) FROM ledger_partitions WHERE compressed = 1;",
+      month, size);
+}
+
+// Latest compressed month, or an empty string if none is compressed
+int last_compressed_month(sqlite3 *db, char *month, int size) {
+  return query_month(
+      db, "SELECT MAX(month) FROM ledger_partitions WHERE compressed = 1;",
+      month, size);
+}
+
+static int64_t query_int64(sqlite3 *db, const char *sql, int64_t fallback) {
+  sqlite3_stmt *stmt;
+  int64_t value = fallback;
+
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    return fallback;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW &&
+      sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+    value = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+// Highest rowid that may be archived. Rows the last reconciliation has not
+// yet seen stay hot, so its incremental runs still find every new entry,
+// including rowids a purge let SQLite hand out again and a restored ledger,
+// and so does the newest row, so rowids are never handed out again.
+static int64_t archive_rowid_bound(sqlite3 *db) {
+  int64_t bound = query_int64(db, "SELECT MAX(rowid) FROM transactions;", 0);
+  int64_t reconciled = query_int64(
+      db,
+      "SELECT last_transaction_rowid FROM reconciliation_runs "
+      "ORDER BY snapshot_id DESC LIMIT 1;",
+      -1);
+  int64_t reissued = query_int64(
+      db, "SELECT reissued_above FROM ledger_high_water;", INT64_MAX);
+
+  bound--;
+  if (reconciled >= 0 && reconciled < bound) {
+    bound = reconciled;
+  }
+  if (reissued < bound) {
+    bound = reissued;
+  }
+  return bound;
+}
+
+// Create the partition file for a month and add it to the catalog. Runs
+// outside the batch transaction, since ATTACH can't run inside one.
+static int open_partition(sqlite3 *db, const char *dir, const char *month) {
+  sqlite3_stmt *stmt;
+  char path[1024];
+  char schema[16];
+  char sql[512];
+
+  snprintf(path, sizeof(path), "%s/transactions-%s.db", dir, month);
+  int rc = attach_partition(db, month, path);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  schema_name(month, schema, sizeof(schema));
+  snprintf(sql, sizeof(sql),
+           "CREATE TABLE IF NOT EXISTS %s.transactions ("
+           "transaction_id TEXT PRIMARY KEY, "
+           "account_number TEXT, "
+           "date TEXT, "
+           "amount REAL, "
+           "type TEXT);"
+           "CREATE INDEX IF NOT EXISTS %s.idx_transactions_account "
+           "ON transactions(account_number, date);",
+           schema, schema);
+  rc = execute_sql(db, sql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "INSERT OR IGNORE INTO ledger_partitions "
+                          "(month, path) VALUES (?, ?);",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, month, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Move one batch of the selected rows into its month's partition
+static int move_month(sqlite3 *db, const char *month, int64_t *moved) {
+  sqlite3_stmt *stmt;
+  char schema[16];
+  char sql[512];
+
+  schema_name(month, schema, sizeof(schema));
+  snprintf(sql, sizeof(sql),
+           "INSERT OR IGNORE INTO %s.transactions (transaction_id, "
+           "account_number, date, amount, type) "
+           "SELECT t.transaction_id, t.account_number, t.date, t.amount, "
+           "t.type FROM temp.partition_batch b "
+           "JOIN main.transactions t ON t.rowid = b.id WHERE b.month = ?;",
+           schema);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_text(stmt, 1, month, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  int changes = sqlite3_changes(db);
+  *moved += changes;
+
+  rc = sqlite3_prepare_v2(
+      db, "UPDATE ledger_partitions SET rows = rows + ? WHERE month = ?;", -1,
+      &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  sqlite3_bind_int(stmt, 1, changes);
+  sqlite3_bind_text(stmt, 2, month, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Archive one batch of hot rows above *cursor. Months that have no
+// partition attached yet are returned in missing instead, with the
+// transaction rolled back, so the caller can attach them and retry.
+static int archive_batch(sqlite3 *db, const char *cutoff_month, int64_t bound,
+                         int64_t *cursor, struct PartitionReport *report,
+                         char missing[][8], int *missing_count) {
+  sqlite3_stmt *stmt;
+  char months[PARTITION_BATCH_MONTHS][8];
+  int month_count = 0;
+  int64_t moved = 0;
+
+  *missing_count = 0;
+  int rc = execute_sql(db, "BEGIN IMMEDIATE;"
+                           "DELETE FROM temp.partition_batch;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "INSERT INTO temp.partition_batch (id, month) "
+      "SELECT rowid, CASE WHEN date GLOB '[0-9][0-9][0-9][0-9]-[0-9][0-9]*' "
+      "THEN substr(date, 1, 7) END FROM main.transactions "
+      "WHERE rowid > ? AND rowid <= ? ORDER BY rowid LIMIT ?;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+  sqlite3_bind_int64(stmt, 1, *cursor);
+  sqlite3_bind_int64(stmt, 2, bound);
+  sqlite3_bind_int(stmt, 3, PARTITION_BATCH_ROWS);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+
+  int scanned = sqlite3_changes(db);
+  if (scanned == 0) {
+    rc = SQLITE_DONE;
+    goto done;
+  }
+  int64_t next_cursor =
+      query_int64(db, "SELECT MAX(id) FROM temp.partition_batch;", *cursor);
+
+  // Months are taken in order; rows of any beyond PARTITION_BATCH_MONTHS
+  // wait for the next batch, which starts just below the first of them
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT DISTINCT month FROM temp.partition_batch WHERE month < ? "
+      "AND month NOT IN (SELECT month FROM main.ledger_partitions "
+      "WHERE compressed = 1) ORDER BY month;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+  sqlite3_bind_text(stmt, 1, cutoff_month, -1, SQLITE_STATIC);
+  int overflow = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (month_count == PARTITION_BATCH_MONTHS) {
+      overflow = 1;
+      break;
+    }
+    snprintf(months[month_count++], sizeof(months[0]), "%s",
+             sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  if (overflow) {
+    rc = sqlite3_prepare_v2(db,
+                            "SELECT MIN(id) - 1 FROM temp.partition_batch "
+                            "WHERE month > ? AND month < ?;",
+                            -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(db));
+      goto done;
+    }
+    sqlite3_bind_text(stmt, 1, months[month_count - 1], -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, cutoff_month, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      next_cursor = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  for (int i = 0; i < month_count; i++) {
+    char schema[16];
+    schema_name(months[i], schema, sizeof(schema));
+    if (sqlite3_db_filename(db, schema) == NULL) {
+      snprintf(missing[(*missing_count)++], 8, "%.7s", months[i]);
+    }
+  }
+  if (*missing_count > 0) {
+    rc = SQLITE_OK;
+    goto done;
+  }
+
+  for (int i = 0; i < month_count && rc == SQLITE_OK; i++) {
+    rc = move_month(db, months[i], &moved);
+  }
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  // Only moved rows stay in the batch for the carry totals and the delete.
+  // Rows of a month that was since compressed stay hot.
+  rc = sqlite3_prepare_v2(db,
+                          "DELETE FROM temp.partition_batch "
+                          "WHERE month IS NULL OR month >= ? OR month > ? "
+                          "OR month IN (SELECT month FROM "
+                          "main.ledger_partitions WHERE compressed = 1);",
+                          -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, cutoff_month, -1, SQLITE_STATIC);
+    if (month_count > 0) {
+      sqlite3_bind_text(stmt, 2, months[month_count - 1], -1, SQLITE_STATIC);
+    } else {
+      sqlite3_bind_text(stmt, 2, "", -1, SQLITE_STATIC);
+    }
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(
+        db, "INSERT INTO ledger_carry (account_number, archived_cents, "
+            "archived_entries, deposit_cents) "
+            "SELECT t.account_number, "
+            "SUM(CAST(round(t.amount * 100) AS INTEGER)), COUNT(*), "
+            "SUM(CASE WHEN t.type = 'deposit' "
+            "THEN CAST(round(t.amount * 100) AS INTEGER) ELSE 0 END) "
+            "FROM temp.partition_batch b, main.transactions t "
+            "WHERE t.rowid = b.id GROUP BY t.account_number "
+            "ON CONFLICT(account_number) DO UPDATE SET "
+            "archived_cents = archived_cents + excluded.archived_cents, "
+            "archived_entries = archived_entries + excluded.archived_entries, "
+            "deposit_cents = deposit_cents + excluded.deposit_cents;"
+            "DELETE FROM main.transactions "
+            "WHERE rowid IN (SELECT id FROM temp.partition_batch);");
+  } else {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  rc = execute_sql(db, "COMMIT;");
+  if (rc == SQLITE_OK) {
+    *cursor = next_cursor;
+    report->scanned += scanned;
+    report->moved += moved;
+    report->batches++;
+  }
+  return rc;
+
+done:
+  execute_sql(db, "ROLLBACK;");
+  return rc;
+}
+
+// Move every hot transaction dated before cutoff_month (YYYY-MM) into
+// <dir>/transactions-<month>.db, one short write transaction per batch, so
+// tellers keep posting while it runs. The copy, the carry totals and the
+// delete of each batch commit together. The work runs on a connection of
+// its own, so the removals stay out of the sync change capture and targets
+// keep the full history.
+int archive_transactions(sqlite3 *db, const char *dir,
+                         const char *cutoff_month,
+                         struct PartitionReport *report) {
+  sqlite3 *adb = db;
+  struct timespec start, end;
+  char missing[PARTITION_BATCH_MONTHS][8];
+  int missing_count;
+  int attached = 0;
+  int64_t cursor = 0;
+
+  memset(report, 0, sizeof(*report));
+  if (!valid_month(cutoff_month)) {
+    fprintf(stderr, "Cutoff month must be YYYY-MM\n");
+    return SQLITE_MISUSE;
+  }
+  if (mkdir(dir, 0755) != 0 && access(dir, W_OK) != 0) {
+    fprintf(stderr, "Can't use partition directory %s\n", dir);
+    return SQLITE_CANTOPEN;
+  }
+
+  int rc = create_partition_tables(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char uri[1024];
+  if (shared_database_uri(db, uri, sizeof(uri)) == SQLITE_OK) {
+    rc = open_database(uri, &adb);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(adb));
+      sqlite3_close(adb);
+      return rc;
+    }
+    sqlite3_busy_timeout(adb, 30000);
+  } else {
+    // The view on this connection is rebuilt by the caller afterwards
+    detach_partitions(db, &attached);
+    attached = 0;
+    history_db = NULL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  rc = execute_sql(adb, "CREATE TEMP TABLE IF NOT EXISTS partition_batch ("
+                        "id INTEGER PRIMARY KEY, month TEXT);");
+
+  int64_t bound = archive_rowid_bound(adb);
+  while (rc == SQLITE_OK) {
+    struct timespec held_start, held_end;
+
+    clock_gettime(CLOCK_MONOTONIC, &held_start);
+    rc = archive_batch(adb, cutoff_month, bound, &cursor, report, missing,
+                       &missing_count);
+    clock_gettime(CLOCK_MONOTONIC, &held_end);
+
+    // Partitions stay attached for later batches until the limit is
+    // reached, then the set starts over
+    if (rc == SQLITE_OK && missing_count > 0 &&
+        attached + missing_count > sqlite3_limit(adb, SQLITE_LIMIT_ATTACHED,
+                                                 -1)) {
+      rc = detach_partitions(adb, &attached);
+      attached = 0;
+    }
+    for (int i = 0; rc == SQLITE_OK && i < missing_count; i++) {
+      rc = open_partition(adb, dir, missing[i]);
+      report->partitions++;
+      attached++;
+    }
+    if (rc != SQLITE_OK || missing_count > 0) {
+      continue;
+    }
+
+    // Give waiting writers the lock for as long as the batch held it
+    long held_us = (held_end.tv_sec - held_start.tv_sec) * 1000000L +
+                   (held_end.tv_nsec - held_start.tv_nsec) / 1000;
+    usleep(held_us > 1000 ? held_us : 1000);
+  }
+  if (rc == SQLITE_DONE) {
+    rc = SQLITE_OK;
+  }
+
+  if (adb != db) {
+    sqlite3_close(adb);
+  } else {
+    execute_sql(db, "DROP TABLE IF EXISTS temp.partition_batch;");
+    detach_partitions(db, &attached);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return rc;
+}
+
+// Remove one account's entries from a partition database, copying them to
+// archived_transactions first in archive mode
+static int purge_month(sqlite3 *db, const char *month, const char *path,
+                       const char *account_number, int archive,
+                       int64_t *removed) {
+  char schema[16];
+  char sql[64];
+  int attached = 0;
+  int rc;
+
+  // A connection serving the view already has the month attached
+  schema_name(month, schema, sizeof(schema));
+  if (sqlite3_db_filename(db, schema) == NULL) {
+    rc = attach_partition(db, month, path);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    attached = 1;
+  }
+
+  char copy[512], remove[128];
+  snprintf(copy, sizeof(copy),
+           "INSERT OR IGNORE INTO main.archived_transactions (transaction_id, "
+           "account_number, date, amount, type, archived_at) "
+           "SELECT transaction_id, account_number, date, amount, type, "
+           "strftime('%%Y-%%m-%%d %%H:%%M:%%S', 'now') FROM %s.transactions "
+           "WHERE account_number = ?;",
+           schema);
+  snprintf(remove, sizeof(remove),
+           "DELETE FROM %s.transactions WHERE account_number = ?;", schema);
+  const char *steps[2] = {archive ? copy : NULL, remove};
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  for (int i = 0; i < 2 && rc == SQLITE_OK; i++) {
+    sqlite3_stmt *stmt;
+
+    if (steps[i] == NULL) {
+      continue;
+    }
+    rc = sqlite3_prepare_v2(db, steps[i], -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(db));
+      break;
+    }
+    sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+  }
+  int changes = rc == SQLITE_OK ? sqlite3_changes(db) : 0;
+  if (rc == SQLITE_OK && changes > 0) {
+    char *recount = sqlite3_mprintf(
+        "UPDATE main.ledger_partitions SET rows = MAX(rows - %d, 0) "
+        "WHERE month = %Q;",
+        changes, month);
+    rc = recount == NULL ? SQLITE_NOMEM : execute_sql(db, recount);
+    sqlite3_free(recount);
+  }
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+  } else {
+    *removed += changes;
+  }
+
+  if (attached) {
+    snprintf(sql, sizeof(sql), "DETACH DATABASE %s;", schema);
+    execute_sql(db, sql);
+  }
+  return rc;
+}
+
+// Remove a deleted account's entries from every partition database. Each
+// month commits on its own; the archive copy ignores rows it already holds,
+// so a purge resumed after a crash redoes a month safely. Compressed months
+// are handled by purge_archived_account().
+int purge_partitioned_account(sqlite3 *db, const char *account_number,
+                              int archive, int64_t *removed) {
+  sqlite3_stmt *stmt;
+  char (*months)[8] = NULL;
+  char (*paths)[1024] = NULL;
+  int count = 0, capacity = 0;
+
+  // ATTACH can't run while the catalog is being read, so list it first
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT month, path FROM ledger_partitions "
+                              "WHERE compressed = 0 ORDER BY month;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *month = (const char *)sqlite3_column_text(stmt, 0);
+    const char *path = (const char *)sqlite3_column_text(stmt, 1);
+
+    if (!valid_month(month) || access(path, F_OK) != 0) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity == 0 ? 16 : capacity * 2;
+      void *grown_months = realloc(months, capacity * sizeof(*months));
+      if (grown_months != NULL) {
+        months = grown_months;
+      }
+      void *grown_paths = realloc(paths, capacity * sizeof(*paths));
+      if (grown_paths != NULL) {
+        paths = grown_paths;
+      }
+      if (grown_months == NULL || grown_paths == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    snprintf(months[count], sizeof(months[0]), "%s", month);
+    snprintf(paths[count], sizeof(paths[0]), "%s", path);
+    count++;
+  }
+  sqlite3_finalize(stmt);
+  rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+
+  for (int i = 0; i < count && rc == SQLITE_OK; i++) {
+    rc = purge_month(db, months[i], paths[i], account_number, archive,
+                     removed);
+  }
+
+  free(months);
+  free(paths);
+  return rc;
+}
+
+// Print the partition catalog
+int print_partitions(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+
+  int rc = open_ledger_history(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT month, rows, path, compressed FROM ledger_partitions "
+      "ORDER BY month;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  int count = 0;
+  printf("Month      Rows        Attached  File\n");
+  printf("--------------------------------------------------\n");
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const char *month = (const char *)sqlite3_column_text(stmt, 0);
+    char schema[16];
+
+    schema_name(month, schema, sizeof(schema));
+    // A current view covers every month it did not attach by a copy
+    const char *state = sqlite3_column_int(stmt, 3)            ? "packed"
+                        : sqlite3_db_filename(db, schema) != NULL ? "yes"
+                        : db == history_db                        ? "copied"
+                                                                  : "no";
+    printf("%-10s %-11lld %-9s %s\n", month,
+           (long long)sqlite3_column_int64(stmt, 1), state,
+           sqlite3_column_text(stmt, 2));
+    count++;
+  }
+  if (count == 0) {
+    printf("No transactions have been archived.\n");
+  }
+
+  printf("\nHot transactions: %lld\n",
+         (long long)query_int64(db, "SELECT COUNT(*) FROM transactions;", 0));
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
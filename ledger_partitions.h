@@ -0,0 +1,42 @@
+#ifndef LEDGER_PARTITIONS_H
+#define LEDGER_PARTITIONS_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Hot-table rows read per archive batch; each batch is one short write
+// transaction
+#define PARTITION_BATCH_ROWS 2000
+#define PARTITION_DEFAULT_DIR "partitions"
+
+// Transactions from before a cutoff month move to one database file per
+// month (<dir>/transactions-YYYY-MM.db). ledger_partitions catalogs the
+// files and ledger_carry keeps each account's archived total, so ledger
+// sums stay right without opening cold files. History reads go through the
+// temporary view all_transactions, which unions the hot table with every
+// attached partition; readers call open_ledger_history() first.
+struct PartitionReport {
+  int64_t scanned;
+  int64_t moved;
+  int64_t batches;
+  int partitions; // files written to
+  double seconds;
+};
+
+int create_partition_tables(sqlite3 *db);
+int attach_partitions(sqlite3 *db);
+void defer_partitions(sqlite3 *db);
+int open_ledger_history(sqlite3 *db);
+const char *ledger_history_source(sqlite3 *db);
+int archived_through_month(sqlite3 *db, char *month, int size);
+int first_compressed_month(sqlite3 *db, char *month, int size);
+int last_compressed_month(sqlite3 *db, char *month, int size);
+int archive_transactions(sqlite3 *db, const char *dir,
+                         const char *cutoff_month,
+                         struct PartitionReport *report);
+int purge_partitioned_account(sqlite3 *db, const char *account_number,
+                              int archive, int64_t *removed);
+int print_partitions(sqlite3 *db);
+
+#endif
@@ -0,0 +1,576 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gen_account_number.h"
+#include "limits_engine.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// One slot of the open-addressing limits table
+struct LimitEntry {
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  unsigned char used;
+  unsigned char dirty; // counter changed since the last flush
+  unsigned char stale; // limits must be re-read before the next check
+  unsigned char store; // index of the connection holding the account
+  int32_t day;         // UTC day the counter belongs to
+  int64_t daily_withdrawal_cents;
+  int64_t single_withdrawal_cents;
+  int64_t overdraft_cents;
+  int64_t withdrawn_cents;
+};
+
+// A database holding accounts, with their rules and counters: the bank
+// database, then any shards
+struct LimitStore {
+  sqlite3 *db;
+  int pending_operations;
+  time_t last_flush;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  struct LimitStore stores[LIMITS_MAX_STORES];
+  int store_count;
+  struct LimitEntry *slots;
+  uint32_t capacity;
+  uint32_t count;
+} engine = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Limits of every account joined with its type's rules and saved counter,
+// all read from the database that holds the account
+static const char *limits_select =
+    "SELECT a.account_number, "
+    "CAST(round(COALESCE(l.daily_withdrawal_limit, "
+    "t.daily_withdrawal_limit) * 100) AS INTEGER), "
+    "CAST(round(t.single_withdrawal_limit * 100) AS INTEGER), "
+    "CAST(round(COALESCE(l.overdraft_limit, t.overdraft_limit, 0) * 100) "
+    "AS INTEGER), "
+    "c.day, c.withdrawn_cents "
+    "FROM accounts a "
+    "LEFT JOIN account_type_limits t ON t.account_type = a.account_type "
+    "LEFT JOIN account_limits l ON l.account_number = a.account_number "
+    "LEFT JOIN limit_counters c ON c.account_number = a.account_number";
+
+static int32_t current_day(void) { return (int32_t)(time(NULL) / 86400); }
+
+static uint32_t hash_account(const char *account_number) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)account_number; *p;
+       p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Slot holding the account, or the empty slot where it belongs
+static struct LimitEntry *find_slot(const char *account_number) {
+  uint32_t mask = engine.capacity - 1;
+  uint32_t index = hash_account(account_number) & mask;
+
+  while (engine.slots[index].used &&
+         strcmp(engine.slots[index].account_number, account_number) != 0) {
+    index = (index + 1) & mask;
+  }
+  return &engine.slots[index];
+}
+
+// Keep the table at most half full
+static int reserve_capacity(uint32_t count) {
+  uint32_t capacity = engine.capacity == 0 ? 1024 : engine.capacity;
+  while (capacity < count * 2) {
+    capacity *= 2;
+  }
+  if (capacity == engine.capacity) {
+    return SQLITE_OK;
+  }
+
+  struct LimitEntry *old_slots = engine.slots;
+  uint32_t old_capacity = engine.capacity;
+
+  engine.slots = calloc(capacity, sizeof(struct LimitEntry));
+  if (engine.slots == NULL) {
+    engine.slots = old_slots;
+    return SQLITE_NOMEM;
+  }
+  engine.capacity = capacity;
+
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old_slots[i].used) {
+      *find_slot(old_slots[i].account_number) = old_slots[i];
+    }
+  }
+  free(old_slots);
+  return SQLITE_OK;
+}
+
+static int64_t column_cents(sqlite3_stmt *stmt, int column) {
+  return sqlite3_column_type(stmt, column) == SQLITE_NULL
+             ? INT64_MAX
+             : sqlite3_column_int64(stmt, column);
+}
+
+// Store one row of limits_select read from a store. With keep_counter set,
+// the in-memory counter wins over the saved one.
+static void store_row(sqlite3_stmt *stmt, int store, int keep_counter) {
+  const char *account_number = (const char *)sqlite3_column_text(stmt, 0);
+  if (account_number == NULL) {
+    return;
+  }
+
+  struct LimitEntry *entry = find_slot(account_number);
+  if (!entry->used) {
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->account_number, sizeof(entry->account_number), "%s",
+             account_number);
+    entry->used = 1;
+    engine.count++;
+    keep_counter = 0;
+  }
+
+  entry->daily_withdrawal_cents = column_cents(stmt, 1);
+  entry->single_withdrawal_cents = column_cents(stmt, 2);
+  entry->overdraft_cents = sqlite3_column_int64(stmt, 3);
+  entry->stale = 0;
+  entry->store = (unsigned char)store;
+
+  if (!keep_counter) {
+    entry->day = sqlite3_column_int(stmt, 4);
+    entry->withdrawn_cents = sqlite3_column_int64(stmt, 5);
+  }
+}
+
+// Create limit rule and counter tables
+int create_limits_tables(sqlite3 *db) {
+  // Amounts are in currency units; NULL means no limit
+  char *sql[] = {
+      "CREATE TABLE IF NOT EXISTS account_type_limits ("
+      "account_type TEXT PRIMARY KEY, "
+      "daily_withdrawal_limit REAL, "
+      "single_withdrawal_limit REAL, "
+      "overdraft_limit REAL NOT NULL DEFAULT 0);",
+      "INSERT OR IGNORE INTO account_type_limits VALUES "
+      "('savings', 500000, NULL, 0), ('current', NULL, NULL, 0);",
+      // Per-account overrides; NULL falls back to the account type's rule
+      "CREATE TABLE IF NOT EXISTS account_limits ("
+      "account_number TEXT PRIMARY KEY, "
+      "daily_withdrawal_limit REAL, "
+      "overdraft_limit REAL);",
+      // day is days since 1970-01-01 UTC
+      "CREATE TABLE IF NOT EXISTS limit_counters ("
+      "account_number TEXT PRIMARY KEY, "
+      "day INTEGER NOT NULL, "
+      "withdrawn_cents INTEGER NOT NULL) WITHOUT ROWID;"};
+
+  for (int i = 0; i < 4; i++) {
+    int rc = execute_sql(db, sql[i]);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+// Start over with an empty table and db as the only store. Called with the
+// lock held.
+static void reset_engine(sqlite3 *db) {
+  engine.stores[0].db = db;
+  engine.stores[0].pending_operations = 0;
+  engine.stores[0].last_flush = time(NULL);
+  engine.store_count = 1;
+  engine.count = 0;
+  free(engine.slots);
+  engine.slots = NULL;
+  engine.capacity = 0;
+}
+
+// Check debits against the accounts in db but read each account's limits on
+// its first use, so startup doesn't scan every account
+int defer_account_limits(sqlite3 *db) {
+  pthread_mutex_lock(&engine.lock);
+  reset_engine(db);
+  int rc = reserve_capacity(1);
+  pthread_mutex_unlock(&engine.lock);
+  return rc;
+}
+
+// Load the limits of every account in db into memory. Debits are checked
+// whichever connection posts them; accounts of stores added later are read
+// on first use.
+int load_account_limits(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int rc;
+
+  rc = sqlite3_prepare_v2(db, limits_select, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  reset_engine(db);
+
+  int64_t accounts = 0;
+  sqlite3_stmt *count_stmt;
+  if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM accounts;", -1,
+                         &count_stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step(count_stmt) == SQLITE_ROW) {
+      accounts = sqlite3_column_int64(count_stmt, 0);
+    }
+    sqlite3_finalize(count_stmt);
+  }
+
+  rc = reserve_capacity((uint32_t)accounts + 1);
+  if (rc == SQLITE_OK) {
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (engine.count * 2 >= engine.capacity) {
+        reserve_capacity(engine.count + 1);
+      }
+      store_row(stmt, 0, 0);
+    }
+  }
+
+  pthread_mutex_unlock(&engine.lock);
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Also check debits against the accounts in db, a shard, whose rules and
+// counters live next to them
+int limits_add_store(sqlite3 *db) {
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&engine.lock);
+  if (engine.store_count == 0) {
+    rc = SQLITE_MISUSE;
+  } else if (engine.store_count == LIMITS_MAX_STORES) {
+    rc = SQLITE_FULL;
+  } else {
+    struct LimitStore *store = &engine.stores[engine.store_count++];
+    store->db = db;
+    store->pending_operations = 0;
+    store->last_flush = time(NULL);
+  }
+  pthread_mutex_unlock(&engine.lock);
+  return rc;
+}
+
+// Read one account's limits from a store. Returns 1 when the account was
+// found there. Called with the lock held.
+static int read_entry(int store, const char *account_number) {
+  sqlite3 *db = engine.stores[store].db;
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  char *sql = sqlite3_mprintf("%s WHERE a.account_number = ?;", limits_select);
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    store_row(stmt, store, 1);
+    found = 1;
+  }
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Look an account up, reading it from the store that holds it if it was
+// opened after the load or its limits changed. Called with the lock held.
+static struct LimitEntry *lookup_entry(const char *account_number) {
+  struct LimitEntry *entry = find_slot(account_number);
+  if (entry->used && !entry->stale) {
+    return entry;
+  }
+
+  if (engine.count * 2 + 2 > engine.capacity &&
+      reserve_capacity(engine.count + 1) != SQLITE_OK) {
+    return NULL;
+  }
+
+  // A stale entry is re-read from its own store first
+  int first = entry->used ? entry->store : 0;
+  if (!read_entry(first, account_number)) {
+    for (int i = 0; i < engine.store_count; i++) {
+      if (i != first && read_entry(i, account_number)) {
+        break;
+      }
+    }
+  }
+
+  entry = find_slot(account_number);
+  return entry->used ? entry : NULL;
+}
+
+// Start a new counter when the day changes. Called with the lock held.
+static void roll_day(struct LimitEntry *entry) {
+  int32_t today = current_day();
+  if (entry->day != today) {
+    entry->day = today;
+    entry->withdrawn_cents = 0;
+    entry->dirty = 1;
+  }
+}
+
+// Check a debit against the account's limits and count it towards today's
+// total, whichever connection posts it. Returns SQLITE_CONSTRAINT when a
+// limit would be exceeded.
+int limits_reserve_debit(const char *account_number, double amount) {
+  if (engine.store_count == 0) {
+    return SQLITE_OK;
+  }
+
+  int64_t cents = llround(amount * 100.0);
+  int rc = SQLITE_OK;
+
+  pthread_mutex_lock(&engine.lock);
+
+  // Unknown accounts are reported by the balance update itself
+  struct LimitEntry *entry = lookup_entry(account_number);
+  if (entry != NULL) {
+    roll_day(entry);
+
+    if (cents > entry->single_withdrawal_cents) {
+      printf("Amount exceeds the single withdrawal limit of %.2f.\n",
+             entry->single_withdrawal_cents / 100.0);
+      rc = SQLITE_CONSTRAINT;
+    } else if (entry->daily_withdrawal_cents != INT64_MAX &&
+               entry->withdrawn_cents + cents >
+                   entry->daily_withdrawal_cents) {
+      printf("Daily withdrawal limit reached, %.2f left today.\n",
+             (entry->daily_withdrawal_cents - entry->withdrawn_cents) /
+                 100.0);
+      rc = SQLITE_CONSTRAINT;
+    } else {
+      entry->withdrawn_cents += cents;
+      entry->dirty = 1;
+      engine.stores[entry->store].pending_operations++;
+    }
+  }
+
+  pthread_mutex_unlock(&engine.lock);
+  return rc;
+}
+
+// Give back a reserved debit whose posting failed
+void limits_release_debit(const char *account_number, double amount) {
+  if (engine.store_count == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  struct LimitEntry *entry = find_slot(account_number);
+  if (entry->used && entry->day == current_day()) {
+    entry->withdrawn_cents -= llround(amount * 100.0);
+    entry->dirty = 1;
+  }
+  pthread_mutex_unlock(&engine.lock);
+}
+
+// Lowest balance the account may reach: minus its overdraft limit
+double limits_balance_floor(const char *account_number) {
+  if (engine.store_count == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  struct LimitEntry *entry = lookup_entry(account_number);
+  double floor = entry != NULL ? -entry->overdraft_cents / 100.0 : 0;
+  pthread_mutex_unlock(&engine.lock);
+
+  return floor;
+}
+
+// Write changed counters of the accounts db holds back to it. Without force
+// this only happens once LIMITS_FLUSH_OPERATIONS debits or
+// LIMITS_FLUSH_SECONDS have passed; a crash loses at most that much of
+// today's usage.
+int limits_flush_counters(sqlite3 *db, int force) {
+  sqlite3_stmt *stmt;
+  int rc;
+
+  if (engine.slots == NULL) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+
+  int index = 0;
+  while (index < engine.store_count && engine.stores[index].db != db) {
+    index++;
+  }
+
+  struct LimitStore *store = &engine.stores[index];
+  if (index == engine.store_count ||
+      (!force && store->pending_operations < LIMITS_FLUSH_OPERATIONS &&
+       time(NULL) - store->last_flush < LIMITS_FLUSH_SECONDS)) {
+    pthread_mutex_unlock(&engine.lock);
+    return SQLITE_OK;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "INSERT OR REPLACE INTO limit_counters "
+                          "(account_number, day, withdrawn_cents) "
+                          "VALUES (?, ?, ?);",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    pthread_mutex_unlock(&engine.lock);
+    return rc;
+  }
+
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  for (uint32_t i = 0; rc == SQLITE_OK && i < engine.capacity; i++) {
+    struct LimitEntry *entry = &engine.slots[i];
+    if (!entry->used || !entry->dirty || entry->store != index) {
+      continue;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, entry->account_number, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, entry->day);
+    sqlite3_bind_int64(stmt, 3, entry->withdrawn_cents);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+      rc = SQLITE_ERROR;
+    }
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+
+  if (rc == SQLITE_OK) {
+    for (uint32_t i = 0; i < engine.capacity; i++) {
+      if (engine.slots[i].store == index) {
+        engine.slots[i].dirty = 0;
+      }
+    }
+    store->pending_operations = 0;
+    store->last_flush = time(NULL);
+  } else {
+    execute_sql(db, "ROLLBACK;");
+  }
+
+  pthread_mutex_unlock(&engine.lock);
+  return rc;
+}
+
+// Re-read an account's limits before its next check
+void limits_invalidate(const char *account_number) {
+  if (engine.slots == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  struct LimitEntry *entry = find_slot(account_number);
+  if (entry->used) {
+    entry->stale = 1;
+  }
+  pthread_mutex_unlock(&engine.lock);
+}
+
+// Copy an account's current limits and today's usage
+int get_account_limits(const char *account_number,
+                       struct AccountLimits *limits) {
+  if (engine.store_count == 0) {
+    return SQLITE_MISUSE;
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  struct LimitEntry *entry = lookup_entry(account_number);
+  if (entry != NULL) {
+    roll_day(entry);
+    limits->daily_withdrawal_cents = entry->daily_withdrawal_cents;
+    limits->single_withdrawal_cents = entry->single_withdrawal_cents;
+    limits->overdraft_cents = entry->overdraft_cents;
+    limits->withdrawn_today_cents = entry->withdrawn_cents;
+  }
+  pthread_mutex_unlock(&engine.lock);
+
+  return entry != NULL ? SQLITE_OK : SQLITE_NOTFOUND;
+}
+
+// Override an account's daily withdrawal and overdraft limits. A negative
+// value restores the account type's rule. The override is written to the
+// store holding the account, or to db for an account the engine can't find.
+int set_account_limits(sqlite3 *db, const char *account_number,
+                       double daily_withdrawal, double overdraft) {
+  sqlite3_stmt *stmt;
+
+  if (engine.store_count > 0) {
+    pthread_mutex_lock(&engine.lock);
+    struct LimitEntry *entry = lookup_entry(account_number);
+    if (entry != NULL) {
+      db = engine.stores[entry->store].db;
+    }
+    pthread_mutex_unlock(&engine.lock);
+  }
+
+  const char *sql = "INSERT OR REPLACE INTO account_limits "
+                    "(account_number, daily_withdrawal_limit, "
+                    "overdraft_limit) VALUES (?, ?, ?);";
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+  if (daily_withdrawal >= 0) {
+    sqlite3_bind_double(stmt, 2, daily_withdrawal);
+  }
+  if (overdraft >= 0) {
+    sqlite3_bind_double(stmt, 3, overdraft);
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+
+  limits_invalidate(account_number);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static void print_limit(const char *label, int64_t cents) {
+  if (cents == INT64_MAX) {
+    printf("%-26s none\n", label);
+  } else {
+    printf("%-26s %.2f\n", label, cents / 100.0);
+  }
+}
+
+// Print an account's limits and today's usage
+int print_account_limits(const char *account_number) {
+  struct AccountLimits limits;
+
+  int rc = get_account_limits(account_number, &limits);
+  if (rc != SQLITE_OK) {
+    printf("Account %s does not exist.\n", account_number);
+    return rc;
+  }
+
+  printf("Limits for account %s\n", account_number);
+  print_limit("Daily withdrawal limit:", limits.daily_withdrawal_cents);
+  print_limit("Single withdrawal limit:", limits.single_withdrawal_cents);
+  print_limit("Overdraft limit:", limits.overdraft_cents);
+  printf("%-26s %.2f\n", "Withdrawn today:",
+         limits.withdrawn_today_cents / 100.0);
+  return SQLITE_OK;
+}
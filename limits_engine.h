@@ -0,0 +1,40 @@
+#ifndef LIMITS_ENGINE_H
+#define LIMITS_ENGINE_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Daily counters are written back after this many debits or seconds,
+// whichever comes first
+#define LIMITS_FLUSH_OPERATIONS 256
+#define LIMITS_FLUSH_SECONDS 60
+
+// Databases holding accounts: the bank database and its shards
+#define LIMITS_MAX_STORES 32
+
+// Limits of one account, resolved from its type's rules and any per-account
+// override. Amounts are in cents; INT64_MAX means no limit.
+struct AccountLimits {
+  int64_t daily_withdrawal_cents;
+  int64_t single_withdrawal_cents;
+  int64_t overdraft_cents;
+  int64_t withdrawn_today_cents;
+};
+
+int create_limits_tables(sqlite3 *db);
+int load_account_limits(sqlite3 *db);
+int defer_account_limits(sqlite3 *db);
+int limits_add_store(sqlite3 *db);
+int limits_reserve_debit(const char *account_number, double amount);
+void limits_release_debit(const char *account_number, double amount);
+double limits_balance_floor(const char *account_number);
+int limits_flush_counters(sqlite3 *db, int force);
+void limits_invalidate(const char *account_number);
+int get_account_limits(const char *account_number,
+                       struct AccountLimits *limits);
+int set_account_limits(sqlite3 *db, const char *account_number,
+                       double daily_withdrawal, double overdraft);
+int print_account_limits(const char *account_number);
+
+#endif
@@ -2,99 +2,357 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "account_system.h"
+#include "aggregate_reports.h"
+#include "backup_system.h"
+#include "change_log.h"
+#include "columnar_export.h"
+#include "customer_deletion.h"
+#include "customer_search.h"
 #include "customer_system.h"
+#include "db_config.h"
+#include "fraud_detector.h"
 #include "gen_account_number.h"
+#include "idempotency.h"
+#include "interest_engine.h"
+#include "ledger_archive.h"
+#include "ledger_partitions.h"
+#include "limits_engine.h"
+#include "mem_pool.h"
+#include "reconciliation.h"
+#include "replica_system.h"
+#include "shard_system.h"
 #include "sqlite3.h"
+#include "statement_job.h"
+#include "sync_system.h"
+#include "transaction_system.h"
 #include "utils_functions.h"
 
+// Schema version stamped into PRAGMA user_version once every table exists.
+// Bump it whenever a create function adds or migrates schema, so existing
+// databases take the slow path once more.
+#define BANK_SCHEMA_VERSION 3
+
 /** function prototypes**/
 // Initialize database
-int initialize_database(sqlite3 **db);
+int initialize_database(sqlite3 **db, int verbose);
 // Create customer table
 int create_customers_table(sqlite3 *db);
 // Create accounts table
 int create_accounts_table(sqlite3 *db);
-// Create transactions table
-int create_transactions_table(sqlite3 *db);
+// Database tools menu
+void print_database_tools_system(sqlite3 *db);
 // Cli main event loop
 int cli_event_loop(sqlite3 *db);
+// Serve read-only queries from a replica that follows the change log
+int run_replica_mode(const char *replica_dir);
+
+// Account shards the menus post to when BANK_SHARDS is set
+static struct ShardSet shards;
+
+// Open BANK_SHARDS shard files next to the bank database, named
+// <bank>_shard_<n>.db, and route the menus to them
+static int open_configured_shards(sqlite3 *db) {
+  const char *count = getenv("BANK_SHARDS");
+  if (count == NULL || count[0] == '\0') {
+    return SQLITE_OK;
+  }
+
+  char prefix[256];
+  const char *path = sqlite3_db_filename(db, "main");
+  snprintf(prefix, sizeof(prefix), "%s", path != NULL ? path : "");
+  char *extension = strrchr(prefix, '.');
+  if (extension != NULL && strcmp(extension, ".db") == 0) {
+    *extension = '\0';
+  }
+
+  int rc = open_shards(&shards, db, prefix, atoi(count));
+  if (rc == SQLITE_OK) {
+    route_to_shards(&shards);
+  }
+  return rc;
+}
 
 int main(int argv, char **argc) {
   sqlite3 *db;
   // char *zErrMsg = 0;
 
-  initialize_database(&db);
+  // The allocator has to be in place before SQLite initializes
+  register_sqlite_allocator();
+
+  if (argv > 1 && strcmp(argc[1], "--replica") == 0) {
+    if (argv != 3) {
+      fprintf(stderr, "Usage: %s --replica <replica_dir>\n", argc[0]);
+      return 1;
+    }
+    return run_replica_mode(argc[2]);
+  }
+
+  // Publish committed changes for downstream consumers when configured
+  const char *cdc_dir = getenv("BANK_CDC_DIR");
+  if (cdc_dir != NULL && cdc_dir[0] != '\0' && cdc_open(cdc_dir) == SQLITE_OK) {
+    printf("Change log enabled in %s\n", cdc_dir);
+  }
+
+  // BANK_VERBOSE=1 reports startup progress and the open-to-ready time
+  const char *verbose = getenv("BANK_VERBOSE");
+  if (initialize_database(&db, verbose != NULL && strcmp(verbose, "1") == 0) !=
+      SQLITE_OK) {
+    return 1;
+  }
+
+  // Append changes that committed before a crash reached the change log
+  if (cdc_recover(db) != SQLITE_OK) {
+    fprintf(stderr, "Failed to recover the change log\n");
+    sqlite3_close(db);
+    return 1;
+  }
+
+  // Record changes for branch changeset sync when configured
+  const char *sync_capture = getenv("BANK_SYNC_CAPTURE");
+  if (sync_capture != NULL && strcmp(sync_capture, "1") == 0) {
+    start_change_capture(db);
+  }
+
+  if (open_configured_shards(db) != SQLITE_OK) {
+    sqlite3_close(db);
+    return 1;
+  }
+
+  // Finish customer deletions an earlier session left in progress
+  resume_customer_deletions(db);
+
   clear_screen();
   cli_event_loop(db);
 
   return 0;
 }
 
-int initialize_database(sqlite3 **db) {
-  int rc;
+// Milliseconds since start
+static double elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
 
-  rc = sqlite3_open("bank.db", db);
+// Read the schema version stamped by create_schema()
+static int read_schema_version(sqlite3 *db, int *version) {
+  sqlite3_stmt *stmt;
 
-  if (rc) {
-    fprintf(stderr, "Can't open db: %s\n", sqlite3_errmsg(*db));
+  int rc = sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
     return rc;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *version = sqlite3_column_int(stmt, 0);
+    rc = SQLITE_OK;
   } else {
-    fprintf(stdout, "Opened database successfully\n");
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
   }
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Create and migrate every table, index and trigger, then stamp the schema
+// version so later starts can skip all of it
+static int create_schema(sqlite3 *db, int verbose) {
+  char sql[64];
 
   // Create the customers table
-  rc = create_customers_table(*db);
+  int rc = create_customers_table(db);
 
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Failed to create customers table\n");
-    sqlite3_close(*db);
     return rc;
   }
 
-  printf("Customers table created successfully\n");
+  if (verbose) {
+    printf("Customers table created successfully\n");
+  }
+
+  // Create the customer search index
+  rc = create_customer_search_index(db);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to create customer search index\n");
+    return rc;
+  }
 
   // Create the accounts table
-  rc = create_accounts_table(*db);
+  rc = create_accounts_table(db);
 
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Failed to create accounts table\n");
-    sqlite3_close(*db);
     return rc;
   }
 
-  printf("Accounts table created successfully\n");
+  if (verbose) {
+    printf("Accounts table created successfully\n");
+  }
 
   // Create the transactions table
-  rc = create_transactions_table(*db);
+  rc = create_transactions_table(db);
 
   if (rc != SQLITE_OK) {
     fprintf(stderr, "Failed to create transactions table\n");
-    sqlite3_close(*db);
     return rc;
   }
 
-  printf("Transactions table created successfully\n");
+  if (verbose) {
+    printf("Transactions table created successfully\n");
+  }
+
+  // Create the incrementally maintained report tables
+  rc = create_aggregate_tables(db);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to create aggregate tables\n");
+    return rc;
+  }
+
+  // Tables behind the idempotency keys, limits, fraud alerts, ledger
+  // partitions and customer deletions
+  rc = create_idempotency_table(db);
+  if (rc == SQLITE_OK) {
+    rc = create_limits_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_fraud_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_partition_tables(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_deletion_tables(db);
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to create bank tables\n");
+    return rc;
+  }
+
+  snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;",
+           BANK_SCHEMA_VERSION);
+  return execute_sql(db, sql);
 }
 
-int create_transactions_table(sqlite3 *db) {
-  char *sql;
+int initialize_database(sqlite3 **db, int verbose) {
+  int rc;
+  struct DbConfig config;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rc = open_database(database_uri_from_env(), db);
+
+  if (rc) {
+    fprintf(stderr, "Can't open db: %s\n", sqlite3_errmsg(*db));
+    return rc;
+  } else if (verbose) {
+    fprintf(stdout, "Opened database successfully\n");
+  }
+
+  // The deletion purger writes from its own connection
+  sqlite3_busy_timeout(*db, 5000);
+
+  // An in-memory database can start from a saved image. The image brings
+  // its own pager, so this comes before the tuning pragmas.
+  const char *image = getenv("BANK_DB_IMAGE");
+  if (image != NULL && image[0] != '\0' && access(image, F_OK) == 0 &&
+      database_in_memory(*db)) {
+    rc = load_database_image(*db, image);
+
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to load database image\n");
+      sqlite3_close(*db);
+      return rc;
+    }
+
+    if (verbose) {
+      printf("Loaded database image %s\n", image);
+    }
+  }
+
+  // Apply page cache and mmap tuning
+  default_db_config(&config);
+  load_db_config_from_env(&config);
+  rc = apply_db_config(*db, &config);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to apply database configuration\n");
+    sqlite3_close(*db);
+    return rc;
+  }
+
+  double open_ms = elapsed_ms(&start);
+
+  // A database already at this schema version takes the fast path and runs
+  // no DDL at all
+  int version = 0;
+  rc = read_schema_version(*db, &version);
+  int current = rc == SQLITE_OK && version >= BANK_SCHEMA_VERSION;
+  if (rc == SQLITE_OK && !current) {
+    rc = create_schema(*db, verbose);
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_close(*db);
+    return rc;
+  }
+
+  double schema_ms = elapsed_ms(&start) - open_ms;
 
-  sql = "CREATE TABLE IF NOT EXISTS transactions ("
-        "transaction_id TEXT PRIMARY KEY, "
-        "account_number INTEGER, "
-        "date TEXT, "
-        "amount REAL, "
-        "type TEXT, "
-        "FOREIGN KEY(account_number) REFERENCES accounts(account_number)); ";
+  // Remember recent request keys so retried money movements are rejected.
+  // The keys and each account's limits are read on first use, not here.
+  defer_idempotency_keys(*db);
 
-  int rc = execute_sql(db, sql);
+  // Withdrawal and overdraft limits are checked in memory
+  rc = defer_account_limits(*db);
 
   if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to load account limits\n");
+    sqlite3_close(*db);
+    return rc;
+  }
+
+  // Watch every posting for velocity and amount anomalies. The windows are
+  // primed before the first posting.
+  struct FraudRules rules;
+  default_fraud_rules(&rules);
+  load_fraud_rules_from_env(&rules);
+  rc = start_fraud_monitoring(*db, &rules);
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to start fraud monitoring\n");
+    sqlite3_close(*db);
     return rc;
   }
 
+  // Archived months are attached on the first history read, so it still
+  // sees them
+  defer_partitions(*db);
+
+  // The schema is complete, so new rows without a parent are refused
+  rc = execute_sql(*db, "PRAGMA foreign_keys = ON;");
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to enable foreign keys\n");
+    sqlite3_close(*db);
+    return rc;
+  }
+
+  if (verbose) {
+    double ready_ms = elapsed_ms(&start);
+    printf("Ready in %.2f ms: open %.2f ms, schema %.2f ms (%s), "
+           "caches %.2f ms\n",
+           ready_ms, open_ms, schema_ms, current ? "current" : "created",
+           ready_ms - open_ms - schema_ms);
+  }
   return SQLITE_OK;
 }
 
@@ -104,11 +362,484 @@ void print_main_menu() {
   printf("1. Customer Management\n");
   printf("2. Account Management\n");
   printf("3. Transaction Management\n");
-  printf("4. Exit\n");
+  printf("4. Database Tools\n");
+  printf("5. Exit\n");
 }
 
-int cli_event_loop(sqlite3 *db) {
+// Display database tools menu
+void display_database_tools_menu() {
+  printf("   1 Page Cache Statistics\n");
+  printf("   2 Allocator Statistics\n");
+  printf("   3 Run Interest Accrual\n");
+  printf("   4 End-of-Day Reconciliation\n");
+  printf("   5 Full Reconciliation\n");
+  printf("   6 Totals by Account Type\n");
+  printf("   7 Customer Total Balance\n");
+  printf("   8 Rebuild Aggregates\n");
+  printf("   9 Online Snapshot\n");
+  printf("  10 Export Binary Dump\n");
+  printf("  11 Restore Binary Dump\n");
+  printf("  12 Export Transactions (Columnar)\n");
+  printf("  13 Sum Amounts from Columnar Export\n");
+  printf("  14 Tail Change Log\n");
+  printf("  15 Export Changeset\n");
+  printf("  16 Apply Changeset\n");
+  printf("  17 Idempotency Key Statistics\n");
+  printf("  18 Account Limits\n");
+  printf("  19 Recent Fraud Alerts\n");
+  printf("  20 Replay Fraud Rules\n");
+  printf("  21 Generate Monthly Statements\n");
+  printf("  22 Customer Deletions\n");
+  printf("  23 Archive Old Transactions\n");
+  printf("  24 Ledger Partitions\n");
+  printf("  25 Compress Archived Month\n");
+  printf("  26 Save Database Image\n");
+}
+
+// Database tools menu logic
+void print_database_tools_system(sqlite3 *db) {
+  clear_screen();
+  display_database_tools_menu();
+
   int choice;
+
+  printf("Your choice? ");
+  scanf("%d", &choice);
+  clear_input_buffer();
+
+  switch (choice) {
+  case 1:
+    clear_screen();
+    print_page_cache_stats(db);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 2:
+    clear_screen();
+    print_allocator_stats();
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 3:
+    clear_screen();
+    struct InterestJob job;
+    struct InterestReport report;
+    double rate;
+
+    default_interest_job(&job);
+    printf("Annual savings rate in percent? ");
+    if (scanf("%lf", &rate) != 1 || rate < 0) {
+      printf("Invalid input for rate.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+    job.annual_rate_bp = (int)(rate * 100 + 0.5);
+
+    if (run_interest_accrual(db, &job, &report) == SQLITE_OK) {
+      printf("Interest accrued for %s\n", job.run_date);
+      printf("Accounts credited: %lld\n", (long long)report.accounts);
+      printf("Interest paid: %.2f\n", report.interest_cents / 100.0);
+      printf("Ranges processed: %d (skipped %d already done)\n",
+             report.ranges_done, report.ranges_skipped);
+      printf("Elapsed: %.3f s (%.0f accounts/sec)\n", report.seconds,
+             report.seconds > 0 ? report.accounts / report.seconds : 0.0);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 4:
+  case 5:
+    clear_screen();
+    struct ReconciliationReport reconciliation;
+
+    if (run_end_of_day_reconciliation(db, choice == 5, &reconciliation) ==
+        SQLITE_OK) {
+      printf("\nSnapshot %lld (%s)\n", (long long)reconciliation.snapshot_id,
+             reconciliation.incremental ? "incremental" : "full");
+      printf("Accounts checked: %lld\n", (long long)reconciliation.accounts);
+      printf("Mismatches: %lld\n", (long long)reconciliation.mismatches);
+      printf("Transactions scanned: %lld\n",
+             (long long)reconciliation.transactions_scanned);
+      printf("Elapsed: %.3f s\n", reconciliation.seconds);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 6:
+    clear_screen();
+    print_account_type_totals(db);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 7:
+    clear_screen();
+    char customer_id[38];
+    printf("Customer ID? ");
+    scanf("%36s", customer_id);
+    clear_input_buffer();
+    print_customer_totals(db, customer_id);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 8:
+    clear_screen();
+    int differences;
+    if (rebuild_aggregates(db, &differences) == SQLITE_OK) {
+      printf("Aggregates rebuilt, %d row(s) differed from the maintained "
+             "totals\n",
+             differences);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 9:
+  case 10:
+  case 11:
+    clear_screen();
+    char path[256];
+    printf("File path? ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+
+    if (choice == 9) {
+      snapshot_database(db, path, 256, 10);
+    } else if (choice == 10) {
+      dump_database(db, path);
+    } else {
+      restore_database(db, path);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 12:
+    clear_screen();
+    int64_t exported;
+    printf("File path? ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+
+    if (export_transactions_columnar(db, path, &exported) == SQLITE_OK) {
+      printf("Exported %lld transactions\n", (long long)exported);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 13:
+    clear_screen();
+    struct ColumnarScanResult scan;
+    double low, high;
+    printf("File path? ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+
+    printf("Minimum and maximum amount? ");
+    if (scanf("%lf %lf", &low, &high) != 2) {
+      printf("Invalid input for amount range.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+
+    if (columnar_scan_sum(path, COLUMN_AMOUNT_CENTS, (int64_t)(low * 100),
+                          (int64_t)(high * 100), &scan) == SQLITE_OK) {
+      printf("Matching transactions: %lld of %lld\n",
+             (long long)scan.rows_matched, (long long)scan.rows_scanned);
+      printf("Sum: %.2f\n", scan.sum / 100.0);
+      printf("Blocks read: %d, skipped by statistics: %d\n",
+             scan.blocks_read, scan.blocks_skipped);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 14:
+    clear_screen();
+    unsigned long long after_seq;
+    const char *log_dir = getenv("BANK_CDC_DIR");
+    if (log_dir == NULL || log_dir[0] == '\0') {
+      printf("Change log is disabled, set BANK_CDC_DIR to enable it.\n");
+    } else {
+      printf("Show records after sequence number? ");
+      if (scanf("%llu", &after_seq) != 1) {
+        printf("Invalid input for sequence number.\n");
+        clear_input_buffer();
+        break;
+      }
+      clear_input_buffer();
+      print_change_log(log_dir, after_seq, 50);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 15:
+  case 16:
+    clear_screen();
+    struct SyncReport sync;
+    char target[256];
+    int policy = SYNC_ABORT;
+    printf("Changeset file path? ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+
+    if (choice == 15) {
+      if (export_changeset(path, &sync) == SQLITE_OK) {
+        print_sync_report("Exported", &sync);
+      }
+    } else {
+      printf("Target database path? ");
+      fgets(target, sizeof(target), stdin);
+      target[strcspn(target, "\n")] = '\0'; // Remove newline character
+
+      printf("On conflict: 1 abort, 2 changeset wins, 3 target wins? ");
+      if (scanf("%d", &policy) != 1 || policy < 1 || policy > 3) {
+        printf("Invalid input for conflict policy.\n");
+        clear_input_buffer();
+        break;
+      }
+      clear_input_buffer();
+
+      if (apply_changeset(target, path, (enum SyncConflictPolicy)(policy - 1),
+                          &sync) == SQLITE_OK) {
+        print_sync_report("Applied", &sync);
+      }
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 17:
+    clear_screen();
+    print_idempotency_stats();
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 18:
+    clear_screen();
+    char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+    double daily_limit, overdraft_limit;
+    char answer[8];
+    printf("Account Number? ");
+    if (scanf("%10s", account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+
+    if (print_account_limits(account_number) == SQLITE_OK) {
+      printf("Change limits (y/n)? ");
+      fgets(answer, sizeof(answer), stdin);
+      if (answer[0] == 'y' || answer[0] == 'Y') {
+        printf("Daily withdrawal and overdraft limit (-1 for the account "
+               "type's)? ");
+        if (scanf("%lf %lf", &daily_limit, &overdraft_limit) != 2) {
+          printf("Invalid input for limits.\n");
+          clear_input_buffer();
+          break;
+        }
+        clear_input_buffer();
+        if (set_account_limits(db, account_number, daily_limit,
+                               overdraft_limit) == SQLITE_OK) {
+          print_account_limits(account_number);
+        }
+      }
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 19:
+    clear_screen();
+    print_fraud_alerts(db, 20);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 20:
+    clear_screen();
+    struct FraudRules rules;
+    struct FraudReplayReport replay;
+    double max_total, large_amount;
+
+    default_fraud_rules(&rules);
+    load_fraud_rules_from_env(&rules);
+    printf("Window seconds, max debits, max debit total, large amount, "
+           "spike multiplier? ");
+    if (scanf("%d %d %lf %lf %d", &rules.window_seconds, &rules.max_debits,
+              &max_total, &large_amount, &rules.spike_multiplier) != 5) {
+      printf("Invalid input for rules.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+    rules.max_debit_cents = (int64_t)(max_total * 100);
+    rules.large_amount_cents = (int64_t)(large_amount * 100);
+
+    if (replay_fraud_rules(db, &rules, &replay) == SQLITE_OK) {
+      printf("\nReplayed %lld postings over %lld accounts in %.3f s "
+             "(%.0f events/sec)\n",
+             (long long)replay.events, (long long)replay.accounts,
+             replay.seconds,
+             replay.seconds > 0 ? replay.events / replay.seconds : 0.0);
+      for (int rule = 0; rule < 4; rule++) {
+        printf("%-12s %lld alert(s)\n", fraud_rule_name(rule),
+               (long long)replay.alerts[rule]);
+      }
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 21:
+    clear_screen();
+    struct StatementJob statement_job;
+    struct StatementReport statements;
+    int layout;
+
+    default_statement_job(&statement_job);
+    printf("Month (YYYY-MM, blank for %s)? ", statement_job.month);
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+    if (path[0] != '\0') {
+      snprintf(statement_job.month, sizeof(statement_job.month), "%.7s",
+               path);
+    }
+
+    printf("Output directory (blank for %s)? ", statement_job.output_dir);
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+    if (path[0] != '\0') {
+      snprintf(statement_job.output_dir, sizeof(statement_job.output_dir),
+               "%s", path);
+    }
+
+    printf("1 one file per account, 2 one combined archive? ");
+    if (scanf("%d", &layout) != 1 || layout < 1 || layout > 2) {
+      printf("Invalid input for output layout.\n");
+      clear_input_buffer();
+      break;
+    }
+    clear_input_buffer();
+    statement_job.combined = layout == 2;
+
+    if (run_statement_job(db, &statement_job, &statements) == SQLITE_OK) {
+      if (statements.resumed > 0) {
+        printf("Resumed after %lld statement(s) from an earlier run\n",
+               (long long)statements.resumed);
+      }
+      printf("Generated %lld statement(s) with %lld entries in %.3f s "
+             "(%.0f statements/sec)\n",
+             (long long)statements.statements,
+             (long long)statements.transactions, statements.seconds,
+             statements.seconds > 0
+                 ? statements.statements / statements.seconds
+                 : 0.0);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 22:
+    clear_screen();
+    print_customer_deletions(db, 20);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 23:
+    clear_screen();
+    struct PartitionReport partitions;
+    char cutoff[16];
+
+    printf("Archive transactions before month (YYYY-MM)? ");
+    fgets(cutoff, sizeof(cutoff), stdin);
+    cutoff[strcspn(cutoff, "\n")] = '\0'; // Remove newline character
+
+    printf("Partition directory (blank for %s)? ", PARTITION_DEFAULT_DIR);
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+    if (path[0] == '\0') {
+      snprintf(path, sizeof(path), "%s", PARTITION_DEFAULT_DIR);
+    }
+
+    if (archive_transactions(db, path, cutoff, &partitions) == SQLITE_OK) {
+      printf("Moved %lld of %lld scanned transaction(s) into %d partition(s) "
+             "in %lld batch(es), %.3f s\n",
+             (long long)partitions.moved, (long long)partitions.scanned,
+             partitions.partitions, (long long)partitions.batches,
+             partitions.seconds);
+    }
+    if (attach_partitions(db) != SQLITE_OK) {
+      fprintf(stderr, "Failed to attach ledger partitions\n");
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 24:
+    clear_screen();
+    print_partitions(db);
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 25:
+    clear_screen();
+    struct LedgerArchiveReport packed;
+
+    printf("Archived month to compress (YYYY-MM)? ");
+    fgets(cutoff, sizeof(cutoff), stdin);
+    cutoff[strcspn(cutoff, "\n")] = '\0'; // Remove newline character
+
+    if (compress_partition(db, cutoff, &packed) == SQLITE_OK &&
+        packed.rows > 0) {
+      printf("Packed %lld transaction(s) of %lld account(s) into %lld "
+             "block(s): %lld -> %lld bytes (%.1fx) in %.3f s\n",
+             (long long)packed.rows, (long long)packed.accounts,
+             (long long)packed.blocks, (long long)packed.source_bytes,
+             (long long)packed.archive_bytes,
+             packed.archive_bytes > 0
+                 ? (double)packed.source_bytes / packed.archive_bytes
+                 : 0.0,
+             packed.seconds);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 26:
+    clear_screen();
+    const char *default_image = getenv("BANK_DB_IMAGE");
+    sqlite3_int64 image_size;
+    struct timespec image_start, image_end;
+
+    if (default_image == NULL || default_image[0] == '\0') {
+      default_image = DEFAULT_IMAGE_PATH;
+    }
+    printf("Image file (blank for %s)? ", default_image);
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = '\0'; // Remove newline character
+    if (path[0] == '\0') {
+      snprintf(path, sizeof(path), "%s", default_image);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &image_start);
+    if (save_database_image(db, path, &image_size) == SQLITE_OK) {
+      clock_gettime(CLOCK_MONOTONIC, &image_end);
+      printf("Saved %lld bytes to %s in %.3f s\n", (long long)image_size,
+             path,
+             (image_end.tv_sec - image_start.tv_sec) +
+                 (image_end.tv_nsec - image_start.tv_nsec) / 1e9);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  }
+}
+
+// Save what is still held in memory before leaving: captured sync changes,
+// today's withdrawal counters and how far the change log got in each outbox
+static void end_session(sqlite3 *db) {
+  stop_deletion_purger();
+  stop_change_capture();
+  limits_flush_counters(db, 1);
+  cdc_checkpoint(db);
+  close_shards(&shards);
+}
+
+int cli_event_loop(sqlite3 *db) {
+  int choice = 0;
   char input[10];
 
   do {
@@ -135,17 +866,144 @@ int cli_event_loop(sqlite3 *db) {
         clear_screen();
         print_account_management_system(db);
         break;
+      case 3:
+        clear_screen();
+        print_transaction_management_system(db);
+        break;
       case 4:
+        clear_screen();
+        print_database_tools_system(db);
+        break;
+      case 5:
+        end_session(db);
         exit(0);
       default:
         printf("Invalid choice!\n");
       }
 
+      // Keep what this action captured for sync even if the process dies
+      save_change_capture();
+    } else if (feof(stdin)) {
+      // Input closed: leave as Exit would instead of spinning on EOF
+      end_session(db);
+      return 0;
     } else {
       // Handle error in reading input
       printf("Error reading input!\n");
       clearerr(stdin); // Clear the error flag on stdin
     }
 
-  } while (choice != 4);
+  } while (choice != 5);
+
+  return 0;
+}
+
+int run_replica_mode(const char *replica_dir) {
+  struct Replica replica;
+  struct DbConfig config;
+  sqlite3 *db;
+  int64_t applied;
+  int choice = 0;
+  char input[10];
+
+  const char *log_dir = getenv("BANK_CDC_DIR");
+  if (log_dir == NULL || log_dir[0] == '\0') {
+    fprintf(stderr, "Replica mode needs BANK_CDC_DIR set to the primary's "
+                    "change log directory\n");
+    return 1;
+  }
+
+  // Bootstrap from the database the primary opens, which has to be a file
+  // this process can read
+  const char *primary_uri = database_uri_from_env();
+  sqlite3 *primary;
+  int rc = sqlite3_open_v2(primary_uri, &primary,
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+  int in_memory = rc == SQLITE_OK && database_in_memory(primary);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open primary: %s\n", sqlite3_errmsg(primary));
+  }
+  sqlite3_close(primary);
+  if (rc != SQLITE_OK) {
+    return 1;
+  }
+  if (in_memory) {
+    fprintf(stderr, "Replica mode needs BANK_DB to name a database file, "
+                    "not an in-memory database\n");
+    return 1;
+  }
+
+  if (open_replica(&replica, primary_uri, log_dir, replica_dir) !=
+      SQLITE_OK) {
+    return 1;
+  }
+
+  replica_catch_up(&replica, &applied);
+  printf("Replica caught up, applied %lld change(s)\n", (long long)applied);
+  start_replica_follower(&replica);
+
+  // Queries get their own read-only connection and never touch the primary
+  if (sqlite3_open_v2(replica.replica_path, &db, SQLITE_OPEN_READONLY,
+                      NULL) != SQLITE_OK) {
+    fprintf(stderr, "Can't open replica: %s\n", sqlite3_errmsg(db));
+    close_replica(&replica);
+    return 1;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  default_db_config(&config);
+  load_db_config_from_env(&config);
+  apply_db_config(db, &config);
+
+  do {
+    clear_screen();
+    display_replica_menu();
+
+    printf("Your choice?: ");
+    if (fgets(input, sizeof(input), stdin) == NULL) {
+      break;
+    }
+    if (sscanf(input, "%d", &choice) != 1) {
+      continue;
+    }
+
+    char text[256];
+    clear_screen();
+    switch (choice) {
+    case 1:
+      select_customers_details(db);
+      break;
+    case 2:
+    case 3:
+    case 4:
+      printf(choice == 2   ? "Customer ID? "
+             : choice == 3 ? "Search for? "
+                           : "Account number? ");
+      if (fgets(text, sizeof(text), stdin) == NULL) {
+        break;
+      }
+      text[strcspn(text, "\n")] = '\0'; // Remove newline character
+
+      if (choice == 2) {
+        get_customer_details(db, text);
+      } else if (choice == 3) {
+        print_customer_search(db, text, SEARCH_PREFIX, MAX_SEARCH_RESULTS);
+      } else {
+        get_transaction_history(db, text);
+      }
+      break;
+    case 5:
+      print_replica_status(&replica);
+      break;
+    case 6:
+      continue;
+    default:
+      printf("Invalid choice!\n");
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+  } while (choice != 6);
+
+  sqlite3_close(db);
+  close_replica(&replica);
+  return 0;
 }
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem_pool.h"
+#include "sqlite3.h"
+
+// Every block carries an 8-byte header holding its usable size, which keeps
+// the payload 8-byte aligned and lets free() find the owning class
+#define POOL_HEADER_SIZE 8
+
+struct PoolClass {
+  pthread_mutex_t lock;
+  void *free_list;
+  struct PoolClassStats stats;
+};
+
+static struct PoolClass pool_classes[POOL_CLASS_COUNT];
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3_int64 large_allocs;
+static sqlite3_int64 large_frees;
+static sqlite3_int64 system_malloc_calls;
+
+// Smallest class whose blocks hold n bytes
+static int pool_class_for(int n) {
+  int index = 0;
+  int size = POOL_MIN_BLOCK;
+
+  while (size < n) {
+    size <<= 1;
+    index++;
+  }
+
+  return index;
+}
+
+// Carve a fresh slab into blocks for one class. Called with the class lock
+// held. Slabs are never returned to the system.
+static int pool_refill(struct PoolClass *pool) {
+  int stride = POOL_HEADER_SIZE + pool->stats.block_size;
+  int count = POOL_SLAB_SIZE / stride;
+  char *slab = malloc((size_t)count * stride);
+
+  if (slab == NULL) {
+    return 0;
+  }
+
+  __atomic_add_fetch(&system_malloc_calls, 1, __ATOMIC_RELAXED);
+  pool->stats.slabs++;
+
+  for (int i = count - 1; i >= 0; i--) {
+    char *block = slab + (size_t)i * stride;
+    *(sqlite3_int64 *)block = pool->stats.block_size;
+    *(void **)(block + POOL_HEADER_SIZE) = pool->free_list;
+    pool->free_list = block + POOL_HEADER_SIZE;
+  }
+
+  return 1;
+}
+
+static void *pool_malloc(int n) {
+  if (n <= 0) {
+    return NULL;
+  }
+
+  if (n > POOL_MAX_BLOCK) {
+    char *block = malloc(POOL_HEADER_SIZE + (size_t)n);
+    if (block == NULL) {
+      return NULL;
+    }
+    *(sqlite3_int64 *)block = n;
+
+    pthread_mutex_lock(&large_lock);
+    large_allocs++;
+    pthread_mutex_unlock(&large_lock);
+    __atomic_add_fetch(&system_malloc_calls, 1, __ATOMIC_RELAXED);
+
+    return block + POOL_HEADER_SIZE;
+  }
+
+  struct PoolClass *pool = &pool_classes[pool_class_for(n)];
+  void *payload = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->free_list != NULL || pool_refill(pool)) {
+    payload = pool->free_list;
+    pool->free_list = *(void **)payload;
+    pool->stats.allocs++;
+    pool->stats.in_use++;
+    if (pool->stats.in_use > pool->stats.peak_in_use) {
+      pool->stats.peak_in_use = pool->stats.in_use;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return payload;
+}
+
+static int pool_size(void *payload) {
+  if (payload == NULL) {
+    return 0;
+  }
+
+  return (int)*(sqlite3_int64 *)((char *)payload - POOL_HEADER_SIZE);
+}
+
+static void pool_free(void *payload) {
+  if (payload == NULL) {
+    return;
+  }
+
+  int size = pool_size(payload);
+
+  if (size > POOL_MAX_BLOCK) {
+    pthread_mutex_lock(&large_lock);
+    large_frees++;
+    pthread_mutex_unlock(&large_lock);
+
+    free((char *)payload - POOL_HEADER_SIZE);
+    return;
+  }
+
+  struct PoolClass *pool = &pool_classes[pool_class_for(size)];
+
+  pthread_mutex_lock(&pool->lock);
+  *(void **)payload = pool->free_list;
+  pool->free_list = payload;
+  pool->stats.frees++;
+  pool->stats.in_use--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_realloc(void *payload, int n) {
+  int old_size = pool_size(payload);
+
+  // Shrinking, or growing within the same class, keeps the block
+  if (n <= old_size && (old_size > POOL_MAX_BLOCK ||
+                        pool_class_for(n) == pool_class_for(old_size))) {
+    return payload;
+  }
+
+  void *grown = pool_malloc(n);
+  if (grown == NULL) {
+    return NULL;
+  }
+
+  memcpy(grown, payload, old_size < n ? old_size : n);
+  pool_free(payload);
+  return grown;
+}
+
+static int pool_roundup(int n) {
+  if (n > POOL_MAX_BLOCK) {
+    return (n + 7) & ~7;
+  }
+
+  return POOL_MIN_BLOCK << pool_class_for(n);
+}
+
+static int pool_init(void *app_data) {
+  (void)app_data;
+  return SQLITE_OK;
+}
+
+static void pool_shutdown(void *app_data) { (void)app_data; }
+
+static sqlite3_mem_methods pool_methods = {
+    pool_malloc, pool_free, pool_realloc, pool_size,
+    pool_roundup, pool_init, pool_shutdown, NULL};
+
+// Install the pool allocator and a lookaside-heavy configuration. Must run
+// before the first connection is opened.
+int register_sqlite_allocator(void) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    pthread_mutex_init(&pool_classes[i].lock, NULL);
+    pool_classes[i].free_list = NULL;
+    memset(&pool_classes[i].stats, 0, sizeof(pool_classes[i].stats));
+    pool_classes[i].stats.block_size = POOL_MIN_BLOCK << i;
+  }
+
+  int rc = sqlite3_config(SQLITE_CONFIG_MALLOC, &pool_methods);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to register allocator: %s\n", sqlite3_errstr(rc));
+    return rc;
+  }
+
+  // Per-connection lookaside absorbs most small parser and VDBE allocations
+  // without reaching the allocator at all
+  sqlite3_config(SQLITE_CONFIG_LOOKASIDE, 256, 512);
+
+  // Reserve a bulk page cache allocation per connection up front
+  sqlite3_config(SQLITE_CONFIG_PAGECACHE, (void *)0, 0, 1024);
+
+  return SQLITE_OK;
+}
+
+// Snapshot the per-class usage counters
+void get_allocator_stats(struct PoolStats *stats) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    pthread_mutex_lock(&pool_classes[i].lock);
+    stats->classes[i] = pool_classes[i].stats;
+    pthread_mutex_unlock(&pool_classes[i].lock);
+  }
+
+  pthread_mutex_lock(&large_lock);
+  stats->large_allocs = large_allocs;
+  stats->large_frees = large_frees;
+  pthread_mutex_unlock(&large_lock);
+
+  stats->system_malloc_calls =
+      __atomic_load_n(&system_malloc_calls, __ATOMIC_RELAXED);
+}
+
+// Print the per-class usage counters
+void print_allocator_stats(void) {
+  struct PoolStats stats;
+  sqlite3_int64 total_allocs = 0;
+
+  get_allocator_stats(&stats);
+
+  printf("Allocator Statistics\n");
+  printf("--------------------\n");
+  printf("%6s %12s %12s %10s %10s %6s\n", "Class", "Allocs", "Frees",
+         "In use", "Peak", "Slabs");
+
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    struct PoolClassStats *c = &stats.classes[i];
+    total_allocs += c->allocs;
+    printf("%6d %12lld %12lld %10lld %10lld %6lld\n", c->block_size,
+           (long long)c->allocs, (long long)c->frees, (long long)c->in_use,
+           (long long)c->peak_in_use, (long long)c->slabs);
+  }
+
+  total_allocs += stats.large_allocs;
+  printf("%6s %12lld %12lld\n", "large", (long long)stats.large_allocs,
+         (long long)stats.large_frees);
+  printf("\nSQLite allocations: %lld\n", (long long)total_allocs);
+  printf("System malloc calls: %lld\n", (long long)stats.system_malloc_calls);
+  printf("\n");
+}
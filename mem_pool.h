@@ -0,0 +1,33 @@
+#ifndef MEM_POOL_H
+#define MEM_POOL_H
+
+#include "sqlite3.h"
+
+// Power-of-two size classes from 16 to 4096 bytes; larger requests go
+// straight to the system allocator
+#define POOL_CLASS_COUNT 9
+#define POOL_MIN_BLOCK 16
+#define POOL_MAX_BLOCK 4096
+#define POOL_SLAB_SIZE (64 * 1024)
+
+struct PoolClassStats {
+  int block_size;
+  sqlite3_int64 allocs;
+  sqlite3_int64 frees;
+  sqlite3_int64 in_use;
+  sqlite3_int64 peak_in_use;
+  sqlite3_int64 slabs;
+};
+
+struct PoolStats {
+  struct PoolClassStats classes[POOL_CLASS_COUNT];
+  sqlite3_int64 large_allocs;
+  sqlite3_int64 large_frees;
+  sqlite3_int64 system_malloc_calls;
+};
+
+int register_sqlite_allocator(void);
+void get_allocator_stats(struct PoolStats *stats);
+void print_allocator_stats(void);
+
+#endif
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reconciliation.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+// One ordered input of the merge pass
+struct MergeCursor {
+  sqlite3_stmt *stmt;
+  int has_row;
+};
+
+// Create snapshot tables. Snapshots are append-only: triggers reject any
+// update or delete of a committed row. A customer purge that removes the
+// newest ledger rows lets SQLite hand their rowids out again; it records in
+// ledger_high_water the rowid above which that may have happened, and the
+// next run reads from there instead of the snapshot's mark. -1 there means
+// the ledger was replaced and the next run has to be a full one.
+int create_reconciliation_tables(sqlite3 *db) {
+  char *sql;
+
+  sql = "CREATE TABLE IF NOT EXISTS ledger_high_water ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1), "
+        "reissued_above INTEGER NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS reconciliation_runs ("
+        "snapshot_id INTEGER PRIMARY KEY, "
+        "business_date TEXT, "
+        "created_at TEXT, "
+        "last_transaction_rowid INTEGER, "
+        "accounts INTEGER, "
+        "mismatches INTEGER);"
+        "CREATE TABLE IF NOT EXISTS balance_snapshots ("
+        "snapshot_id INTEGER, "
+        "account_number TEXT, "
+        "ledger_cents INTEGER, "
+        "balance_cents INTEGER, "
+        "PRIMARY KEY(snapshot_id, account_number)) WITHOUT ROWID;"
+        "CREATE TRIGGER IF NOT EXISTS reconciliation_runs_no_update "
+        "BEFORE UPDATE ON reconciliation_runs BEGIN "
+        "SELECT RAISE(ABORT, 'reconciliation runs are immutable'); END;"
+        "CREATE TRIGGER IF NOT EXISTS reconciliation_runs_no_delete "
+        "BEFORE DELETE ON reconciliation_runs BEGIN "
+        "SELECT RAISE(ABORT, 'reconciliation runs are immutable'); END;"
+        "CREATE TRIGGER IF NOT EXISTS balance_snapshots_no_update "
+        "BEFORE UPDATE ON balance_snapshots BEGIN "
+        "SELECT RAISE(ABORT, 'balance snapshots are immutable'); END;"
+        "CREATE TRIGGER IF NOT EXISTS balance_snapshots_no_delete "
+        "BEFORE DELETE ON balance_snapshots BEGIN "
+        "SELECT RAISE(ABORT, 'balance snapshots are immutable'); END;";
+
+  int rc = execute_sql(db, sql);
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+// Make the next run a full one, for a ledger that was replaced as a whole.
+// Runs inside the caller's transaction.
+int reset_reconciliation(sqlite3 *db) {
+  int rc = create_reconciliation_tables(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return execute_sql(db, "INSERT INTO ledger_high_water (id, reissued_above) "
+                         "VALUES (1, -1) ON CONFLICT(id) DO UPDATE SET "
+                         "reissued_above = -1;");
+}
+
+static void merge_advance(struct MergeCursor *cursor) {
+  if (cursor->stmt != NULL && cursor->has_row) {
+    cursor->has_row = sqlite3_step(cursor->stmt) == SQLITE_ROW;
+  }
+}
+
+static const char *merge_key(struct MergeCursor *cursor) {
+  if (cursor->stmt == NULL || !cursor->has_row) {
+    return NULL;
+  }
+  return (const char *)sqlite3_column_text(cursor->stmt, 0);
+}
+
+// Account numbers are fixed-width digit strings, so text order matches the
+// order of both the accounts primary key and the transactions index
+static const char *merge_min(const char *a, const char *b) {
+  if (a == NULL) {
+    return b;
+  }
+  if (b == NULL) {
+    return a;
+  }
+  return strcmp(a, b) <= 0 ? a : b;
+}
+
+// Read the latest snapshot id and its transaction high-water mark, lowered
+// to where a purge since then let rowids be reused, or -1 after a restore
+static int last_snapshot(sqlite3 *db, sqlite3_int64 *snapshot_id,
+                         sqlite3_int64 *last_rowid) {
+  sqlite3_stmt *stmt;
+
+  *snapshot_id = 0;
+  *last_rowid = 0;
+
+  int rc = sqlite3_prepare_v2(
+      db,
+      "SELECT snapshot_id, MIN(last_transaction_rowid, IFNULL(("
+      "SELECT reissued_above FROM ledger_high_water), "
+      "last_transaction_rowid)) FROM reconciliation_runs "
+      "ORDER BY snapshot_id DESC LIMIT 1;",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    *snapshot_id = sqlite3_column_int64(stmt, 0);
+    *last_rowid = sqlite3_column_int64(stmt, 1);
+  }
+
+  sqlite3_finalize(stmt);
+  return SQLITE_OK;
+}
+
+// Whether an account missing from the accounts table still has ledger
+// history, hot or carried. One without any was deleted by a customer purge.
+static int has_history(sqlite3_stmt *stmt, const char *account_number) {
+  if (stmt == NULL) {
+    return 1;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_TRANSIENT);
+  return sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0);
+}
+
+// Compare every account balance with the sum of its ledger and write the
+// result as a new immutable snapshot. The first run, or a full run, streams
+// the whole transactions table grouped by the account index. Later runs
+// read only transactions above the previous snapshot's rowid high-water
+// mark and add them to that snapshot's ledger sums. Accounts, the previous
+// snapshot and the new ledger totals are all read in account order and
+// merged in one linear pass. Accounts a customer purge removed drop out of
+// the snapshot once none of their history is left.
+int run_end_of_day_reconciliation(sqlite3 *db, int full,
+                                  struct ReconciliationReport *report) {
+  struct MergeCursor accounts = {NULL, 0};
+  struct MergeCursor previous = {NULL, 0};
+  struct MergeCursor ledger = {NULL, 0};
+  struct MergeCursor carry = {NULL, 0};
+  sqlite3_stmt *insert = NULL;
+  sqlite3_stmt *history = NULL;
+  sqlite3_stmt *stmt;
+  sqlite3_int64 previous_id, previous_rowid, high_rowid = 0;
+  struct timespec start, end;
+  int reported = 0;
+  int rc;
+
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  rc = create_reconciliation_tables(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Hold the write lock so balances and ledger are read as of one instant
+  rc = execute_sql(db, "BEGIN IMMEDIATE;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = last_snapshot(db, &previous_id, &previous_rowid);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  report->incremental = !full && previous_id != 0 && previous_rowid >= 0;
+  if (!report->incremental) {
+    previous_rowid = 0;
+  }
+
+  rc = sqlite3_prepare_v2(db, "SELECT IFNULL(MAX(rowid), 0) FROM transactions;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    high_rowid = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  rc = sqlite3_prepare_v2(
+      db,
+      "SELECT account_number, CAST(round(balance * 100) AS INTEGER) "
+      "FROM accounts ORDER BY account_number;",
+      -1, &accounts.stmt, NULL);
+  if (rc == SQLITE_OK) {
+    // A full run streams the account index so grouping needs no sort; an
+    // incremental run reads only the new rowid range and sorts that
+    rc = sqlite3_prepare_v2(
+        db,
+        report->incremental
+            ? "SELECT account_number, "
+              "SUM(CAST(round(amount * 100) AS INTEGER)), COUNT(*) "
+              "FROM transactions WHERE rowid > ? AND rowid <= ? "
+              "GROUP BY account_number ORDER BY account_number;"
+            : "SELECT account_number, "
+              "SUM(CAST(round(amount * 100) AS INTEGER)), COUNT(*) "
+              "FROM transactions INDEXED BY idx_transactions_account "
+              "WHERE rowid > ? AND rowid <= ? "
+              "GROUP BY account_number ORDER BY account_number;",
+        -1, &ledger.stmt, NULL);
+  }
+  if (rc == SQLITE_OK && report->incremental) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "SELECT account_number, ledger_cents FROM balance_snapshots "
+        "WHERE snapshot_id = ? ORDER BY account_number;",
+        -1, &previous.stmt, NULL);
+  }
+  // Archived history only enters as each account's carried total. An
+  // incremental run needs none of it: the archiver leaves rows the last
+  // snapshot has not seen in the hot table.
+  if (rc == SQLITE_OK && !report->incremental &&
+      sqlite3_prepare_v2(db,
+                         "SELECT account_number, archived_cents "
+                         "FROM ledger_carry ORDER BY account_number;",
+                         -1, &carry.stmt, NULL) != SQLITE_OK) {
+    carry.stmt = NULL;
+  }
+  if (rc == SQLITE_OK && report->incremental &&
+      sqlite3_prepare_v2(
+          db,
+          "SELECT EXISTS (SELECT 1 FROM transactions "
+          "WHERE account_number = ?1) OR EXISTS (SELECT 1 FROM ledger_carry "
+          "WHERE account_number = ?1);",
+          -1, &history, NULL) != SQLITE_OK) {
+    history = NULL;
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "INSERT INTO balance_snapshots (snapshot_id, account_number, "
+        "ledger_cents, balance_cents) VALUES (?, ?, ?, ?);",
+        -1, &insert, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+
+  report->snapshot_id = previous_id + 1;
+
+  sqlite3_bind_int64(ledger.stmt, 1, previous_rowid);
+  sqlite3_bind_int64(ledger.stmt, 2, high_rowid);
+  if (previous.stmt != NULL) {
+    sqlite3_bind_int64(previous.stmt, 1, previous_id);
+    previous.has_row = 1;
+  }
+  accounts.has_row = ledger.has_row = carry.has_row = 1;
+  merge_advance(&accounts);
+  merge_advance(&ledger);
+  merge_advance(&previous);
+  merge_advance(&carry);
+
+  printf("Mismatched Accounts\n");
+  printf("-------------------\n");
+
+  for (;;) {
+    const char *key = merge_min(
+        merge_min(merge_key(&accounts), merge_key(&ledger)),
+        merge_min(merge_key(&previous), merge_key(&carry)));
+    if (key == NULL) {
+      break;
+    }
+
+    char account_number[32];
+    sqlite3_int64 ledger_cents = 0;
+    sqlite3_int64 balance_cents = 0;
+    int has_account = 0;
+    int has_entries = 0;
+
+    snprintf(account_number, sizeof(account_number), "%s", key);
+
+    if (merge_key(&accounts) != NULL &&
+        strcmp(merge_key(&accounts), account_number) == 0) {
+      has_account = 1;
+      balance_cents = sqlite3_column_int64(accounts.stmt, 1);
+      merge_advance(&accounts);
+    }
+    if (merge_key(&previous) != NULL &&
+        strcmp(merge_key(&previous), account_number) == 0) {
+      ledger_cents += sqlite3_column_int64(previous.stmt, 1);
+      merge_advance(&previous);
+    }
+    if (merge_key(&ledger) != NULL &&
+        strcmp(merge_key(&ledger), account_number) == 0) {
+      ledger_cents += sqlite3_column_int64(ledger.stmt, 1);
+      has_entries = 1;
+      report->transactions_scanned += sqlite3_column_int64(ledger.stmt, 2);
+      merge_advance(&ledger);
+    }
+    if (merge_key(&carry) != NULL &&
+        strcmp(merge_key(&carry), account_number) == 0) {
+      ledger_cents += sqlite3_column_int64(carry.stmt, 1);
+      has_entries = 1;
+      merge_advance(&carry);
+    }
+
+    // Only the previous snapshot still knows this account
+    if (!has_account && !has_entries &&
+        !has_history(history, account_number)) {
+      continue;
+    }
+
+    report->accounts += has_account;
+    if (!has_account || ledger_cents != balance_cents) {
+      report->mismatches++;
+      if (reported++ < RECONCILIATION_MAX_REPORTED) {
+        if (has_account) {
+          printf("%s  balance %.2f  ledger %.2f\n", account_number,
+                 balance_cents / 100.0, ledger_cents / 100.0);
+        } else {
+          printf("%s  no account  ledger %.2f\n", account_number,
+                 ledger_cents / 100.0);
+        }
+      }
+    }
+
+    sqlite3_reset(insert);
+    sqlite3_bind_int64(insert, 1, report->snapshot_id);
+    sqlite3_bind_text(insert, 2, account_number, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(insert, 3, ledger_cents);
+    if (has_account) {
+      sqlite3_bind_int64(insert, 4, balance_cents);
+    } else {
+      sqlite3_bind_null(insert, 4);
+    }
+    if (sqlite3_step(insert) != SQLITE_DONE) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+  }
+
+  if (report->mismatches == 0) {
+    printf("None\n");
+  }
+
+  // The run row is written once, with its totals, as the last step
+  rc = sqlite3_prepare_v2(
+      db,
+      "INSERT INTO reconciliation_runs (snapshot_id, business_date, "
+      "created_at, last_transaction_rowid, accounts, mismatches) VALUES "
+      "(?, date('now', 'localtime'), strftime('%Y-%m-%d %H:%M:%S', 'now'), "
+      "?, ?, ?);",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    goto done;
+  }
+
+  sqlite3_bind_int64(stmt, 1, report->snapshot_id);
+  sqlite3_bind_int64(stmt, 2, high_rowid);
+  sqlite3_bind_int64(stmt, 3, report->accounts);
+  sqlite3_bind_int64(stmt, 4, report->mismatches);
+  rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+
+  // The new snapshot has seen every row up to its mark
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "DELETE FROM ledger_high_water;");
+  }
+
+done:
+  sqlite3_finalize(accounts.stmt);
+  sqlite3_finalize(ledger.stmt);
+  sqlite3_finalize(previous.stmt);
+  sqlite3_finalize(carry.stmt);
+  sqlite3_finalize(insert);
+  sqlite3_finalize(history);
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    return rc;
+  }
+
+  rc = execute_sql(db, "COMMIT;");
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return rc;
+}
@@ -0,0 +1,23 @@
+#ifndef RECONCILIATION_H
+#define RECONCILIATION_H
+
+#include "sqlite3.h"
+
+// Mismatches printed by one run; the full list is in balance_snapshots
+#define RECONCILIATION_MAX_REPORTED 20
+
+struct ReconciliationReport {
+  sqlite3_int64 snapshot_id;
+  sqlite3_int64 accounts;
+  sqlite3_int64 mismatches;
+  sqlite3_int64 transactions_scanned;
+  int incremental;
+  double seconds;
+};
+
+int create_reconciliation_tables(sqlite3 *db);
+int reset_reconciliation(sqlite3 *db);
+int run_end_of_day_reconciliation(sqlite3 *db, int full,
+                                  struct ReconciliationReport *report);
+
+#endif
@@ -0,0 +1,496 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "account_system.h"
+#include "backup_system.h"
+#include "change_log.h"
+#include "customer_system.h"
+#include "replica_system.h"
+#include "sqlite3.h"
+#include "utils_functions.h"
+
+enum ReplicaStatement {
+  REPLICA_UPSERT_CUSTOMER,
+  REPLICA_DELETE_CUSTOMER,
+  REPLICA_INSERT_ACCOUNT,
+  REPLICA_INSERT_TRANSACTION,
+  REPLICA_SET_BALANCE,
+  REPLICA_SET_APPLIED_SEQ,
+  REPLICA_UPDATE_ACCOUNT,
+  REPLICA_DELETE_HISTORY,
+  REPLICA_DELETE_ACCOUNT
+};
+
+// Every statement is idempotent, so replaying records already contained in
+// the bootstrap backup leaves the replica unchanged
+static const char *replica_sql[9] = {
+    "INSERT INTO customers (customer_id, name, address, contact, contact_key) "
+    "VALUES (?, ?, ?, ?, ?) ON CONFLICT(customer_id) DO UPDATE SET "
+    "name = excluded.name, address = excluded.address, "
+    "contact = excluded.contact, contact_key = excluded.contact_key;",
+    "DELETE FROM customers WHERE customer_id = ?;",
+    "INSERT OR IGNORE INTO accounts (account_number, customer_id, "
+    "account_type, balance) VALUES (?, ?, ?, ?);",
+    "INSERT OR IGNORE INTO transactions (transaction_id, account_number, "
+    "date, amount, type) VALUES (?, ?, ?, ?, ?);",
+    "UPDATE accounts SET balance = ?1 WHERE account_number = ?2 "
+    "AND balance IS NOT ?1;",
+    "UPDATE replica_state SET applied_seq = ? WHERE id = 1;",
+    "UPDATE accounts SET account_type = ?2, closed_at = nullif(?3, '') "
+    "WHERE account_number = ?1;",
+    "DELETE FROM transactions WHERE account_number = ?;",
+    "DELETE FROM accounts WHERE account_number = ?;"};
+
+// Display replica menu
+void display_replica_menu() {
+  printf("Bank Management System (read replica)\n");
+  printf("-------------------------------------\n");
+  printf("1. View All Customers\n");
+  printf("2. View Customer Details\n");
+  printf("3. Search Customers\n");
+  printf("4. View Transaction History\n");
+  printf("5. Replication Status\n");
+  printf("6. Exit\n");
+}
+
+// Read the applied sequence number, SQLITE_NOTFOUND if never bootstrapped
+static int read_applied_seq(sqlite3 *db, uint64_t *applied_seq) {
+  sqlite3_stmt *stmt;
+
+  int rc = sqlite3_prepare_v2(
+      db, "SELECT applied_seq FROM replica_state WHERE id = 1;", -1, &stmt,
+      NULL);
+  if (rc != SQLITE_OK) {
+    return SQLITE_NOTFOUND;
+  }
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    *applied_seq = (uint64_t)sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  return rc == SQLITE_ROW ? SQLITE_OK : SQLITE_NOTFOUND;
+}
+
+// Copy the primary with the online backup API and record where in the log
+// the copy starts. The position is taken before the copy, so records that
+// commit during it are applied again afterwards, which is harmless.
+static int bootstrap_replica(struct Replica *replica) {
+  sqlite3 *primary;
+  uint64_t start_seq = cdc_last_sequence(replica->log_dir);
+
+  int rc = sqlite3_open_v2(replica->primary_path, &primary,
+                           SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open primary: %s\n", sqlite3_errmsg(primary));
+    sqlite3_close(primary);
+    return rc;
+  }
+  sqlite3_busy_timeout(primary, 5000);
+
+  printf("Bootstrapping replica from %s at log seq %llu\n",
+         replica->primary_path, (unsigned long long)start_seq);
+  rc = snapshot_database(primary, replica->replica_path, 1024, 1);
+  sqlite3_close(primary);
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_open(replica->replica_path, &replica->db);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open replica: %s\n", sqlite3_errmsg(replica->db));
+    return rc;
+  }
+
+  rc = execute_sql(replica->db,
+                   "CREATE TABLE replica_state ("
+                   "id INTEGER PRIMARY KEY CHECK (id = 1), "
+                   "applied_seq INTEGER NOT NULL);");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char sql[128];
+  snprintf(sql, sizeof(sql),
+           "INSERT INTO replica_state (id, applied_seq) VALUES (1, %llu);",
+           (unsigned long long)start_seq);
+  rc = execute_sql(replica->db, sql);
+  if (rc == SQLITE_OK) {
+    pthread_mutex_lock(&replica->lock);
+    replica->applied_seq = start_seq;
+    pthread_mutex_unlock(&replica->lock);
+  }
+
+  return rc;
+}
+
+// Configure an open replica connection and prepare the apply statements
+static int prepare_replica(struct Replica *replica) {
+  int rc;
+
+  // WAL lets report readers run while the applier writes
+  execute_sql(replica->db, "PRAGMA journal_mode=WAL;");
+  sqlite3_busy_timeout(replica->db, 5000);
+
+  // Replicas bootstrapped before accounts could be closed lack closed_at
+  rc = create_accounts_table(replica->db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  for (int i = 0; i < 9; i++) {
+    rc = sqlite3_prepare_v3(replica->db, replica_sql[i], -1,
+                            SQLITE_PREPARE_PERSISTENT, &replica->stmts[i],
+                            NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(replica->db));
+      return rc;
+    }
+  }
+
+  return SQLITE_OK;
+}
+
+// Open the replica in replica_dir, bootstrapping it from the primary if it
+// has never been initialized
+int open_replica(struct Replica *replica, const char *primary_path,
+                 const char *log_dir, const char *replica_dir) {
+  int rc;
+
+  memset(replica, 0, sizeof(*replica));
+  pthread_mutex_init(&replica->lock, NULL);
+  snprintf(replica->primary_path, sizeof(replica->primary_path), "%s",
+           primary_path);
+  snprintf(replica->log_dir, sizeof(replica->log_dir), "%s", log_dir);
+  snprintf(replica->replica_path, sizeof(replica->replica_path),
+           "%s/replica.db", replica_dir);
+
+  if (mkdir(replica_dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Can't create replica directory %s\n", replica_dir);
+    return SQLITE_CANTOPEN;
+  }
+
+  rc = sqlite3_open(replica->replica_path, &replica->db);
+  if (rc == SQLITE_OK) {
+    rc = read_applied_seq(replica->db, &replica->applied_seq);
+  }
+
+  if (rc != SQLITE_OK) {
+    sqlite3_close(replica->db);
+    replica->db = NULL;
+    rc = bootstrap_replica(replica);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to bootstrap replica\n");
+      sqlite3_close(replica->db);
+      replica->db = NULL;
+      return rc;
+    }
+  }
+
+  rc = prepare_replica(replica);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return cdc_cursor_open(&replica->cursor, log_dir, replica->applied_seq);
+}
+
+// Copy the primary again after it restored a dump, which the log carries
+// only as a marker. The copy overwrites replica.db in place, so readers
+// with their own connection see the restored data once it completes.
+static int rebootstrap_replica(struct Replica *replica) {
+  for (int i = 0; i < 9; i++) {
+    sqlite3_finalize(replica->stmts[i]);
+    replica->stmts[i] = NULL;
+  }
+  sqlite3_close(replica->db);
+  replica->db = NULL;
+
+  int rc = bootstrap_replica(replica);
+  if (rc == SQLITE_OK) {
+    rc = prepare_replica(replica);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to bootstrap replica\n");
+    for (int i = 0; i < 9; i++) {
+      sqlite3_finalize(replica->stmts[i]);
+      replica->stmts[i] = NULL;
+    }
+    sqlite3_close(replica->db);
+    replica->db = NULL;
+    return rc;
+  }
+
+  cdc_cursor_close(&replica->cursor);
+  return cdc_cursor_open(&replica->cursor, replica->log_dir,
+                         replica->applied_seq);
+}
+
+// Bind fields[first..] to parameters 1.. as text
+static void bind_fields(sqlite3_stmt *stmt, const struct CdcRecord *record,
+                        int first, int count) {
+  sqlite3_reset(stmt);
+  for (int i = 0; i < count; i++) {
+    const char *field =
+        first + i < record->field_count ? record->fields[first + i] : "";
+    sqlite3_bind_text(stmt, i + 1, field, -1, SQLITE_STATIC);
+  }
+}
+
+// Apply one change-log record to the replica
+static int apply_record(struct Replica *replica,
+                        const struct CdcRecord *record) {
+  sqlite3_stmt *stmt;
+  int rc = SQLITE_DONE;
+
+  switch (record->op) {
+  case CDC_CUSTOMER_INSERT:
+  case CDC_CUSTOMER_UPDATE: {
+    char contact_key[64];
+    stmt = replica->stmts[REPLICA_UPSERT_CUSTOMER];
+    bind_fields(stmt, record, 0, 4);
+    normalize_contact(record->field_count > 3 ? record->fields[3] : "",
+                      contact_key, sizeof(contact_key));
+    sqlite3_bind_text(stmt, 5, contact_key, -1, SQLITE_TRANSIENT);
+    rc = sqlite3_step(stmt);
+    break;
+  }
+  case CDC_CUSTOMER_DELETE:
+    stmt = replica->stmts[REPLICA_DELETE_CUSTOMER];
+    bind_fields(stmt, record, 0, 1);
+    rc = sqlite3_step(stmt);
+    break;
+  case CDC_ACCOUNT_INSERT:
+    if (record->field_count != 4) {
+      return SQLITE_CORRUPT;
+    }
+    stmt = replica->stmts[REPLICA_INSERT_ACCOUNT];
+    bind_fields(stmt, record, 0, 3);
+    sqlite3_bind_double(stmt, 4, atof(record->fields[3]));
+    rc = sqlite3_step(stmt);
+    break;
+  case CDC_TRANSACTION_POST:
+    if (record->field_count != 6) {
+      return SQLITE_CORRUPT;
+    }
+    stmt = replica->stmts[REPLICA_INSERT_TRANSACTION];
+    bind_fields(stmt, record, 0, 3);
+    sqlite3_bind_double(stmt, 4, atof(record->fields[3]));
+    sqlite3_bind_text(stmt, 5, record->fields[4], -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+      break;
+    }
+
+    // The log carries the resulting balance, so setting it is idempotent
+    stmt = replica->stmts[REPLICA_SET_BALANCE];
+    sqlite3_reset(stmt);
+    sqlite3_bind_double(stmt, 1, atof(record->fields[5]));
+    sqlite3_bind_text(stmt, 2, record->fields[1], -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    break;
+  case CDC_ACCOUNT_UPDATE:
+    if (record->field_count != 3) {
+      return SQLITE_CORRUPT;
+    }
+    stmt = replica->stmts[REPLICA_UPDATE_ACCOUNT];
+    bind_fields(stmt, record, 0, 3);
+    rc = sqlite3_step(stmt);
+    break;
+  case CDC_ACCOUNT_DELETE:
+    // The primary removes history in chunks; the replica drops it at once
+    stmt = replica->stmts[REPLICA_DELETE_HISTORY];
+    bind_fields(stmt, record, 0, 1);
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+      break;
+    }
+    stmt = replica->stmts[REPLICA_DELETE_ACCOUNT];
+    bind_fields(stmt, record, 0, 1);
+    rc = sqlite3_step(stmt);
+    break;
+  default:
+    // Unknown operations come from a newer primary; skip them
+    break;
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Failed to apply change %llu: %s\n",
+            (unsigned long long)record->seq, sqlite3_errmsg(replica->db));
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+// Apply every record available in the log, REPLICA_BATCH_SIZE per
+// transaction, advancing the stored sequence number with each batch. A
+// restore on the primary ends the batch before it and the replica is
+// bootstrapped again from there.
+int replica_catch_up(struct Replica *replica, int64_t *applied) {
+  struct CdcRecord record = {0};
+  int rc = SQLITE_OK;
+  int next = SQLITE_ROW;
+
+  *applied = 0;
+
+  // A failed re-bootstrap left nothing to apply to; copy the primary first
+  if (replica->db == NULL) {
+    rc = rebootstrap_replica(replica);
+  }
+
+  while (rc == SQLITE_OK && next == SQLITE_ROW) {
+    int batch = 0;
+    int restored = 0;
+    uint64_t batch_seq = replica->applied_seq;
+
+    // Stay on the reader side until there is something to write
+    next = cdc_cursor_next(&replica->cursor, &record);
+    if (next != SQLITE_ROW) {
+      break;
+    }
+
+    rc = execute_sql(replica->db, "BEGIN IMMEDIATE;");
+    while (rc == SQLITE_OK && next == SQLITE_ROW) {
+      if (record.op == CDC_DATABASE_RESTORE) {
+        restored = 1;
+        break;
+      }
+      rc = apply_record(replica, &record);
+      batch_seq = record.seq;
+      batch++;
+      if (rc != SQLITE_OK || batch == REPLICA_BATCH_SIZE) {
+        break;
+      }
+      next = cdc_cursor_next(&replica->cursor, &record);
+    }
+
+    if (rc == SQLITE_OK) {
+      sqlite3_stmt *stmt = replica->stmts[REPLICA_SET_APPLIED_SEQ];
+      sqlite3_reset(stmt);
+      sqlite3_bind_int64(stmt, 1, (sqlite3_int64)batch_seq);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    }
+
+    if (rc == SQLITE_OK) {
+      rc = execute_sql(replica->db, "COMMIT;");
+    }
+
+    if (rc != SQLITE_OK) {
+      execute_sql(replica->db, "ROLLBACK;");
+      // Re-read the failed batch next time
+      cdc_cursor_close(&replica->cursor);
+      cdc_cursor_open(&replica->cursor, replica->log_dir,
+                      replica->applied_seq);
+      break;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    replica->applied_seq = batch_seq;
+    replica->records_applied += batch;
+    pthread_mutex_unlock(&replica->lock);
+    *applied += batch;
+
+    if (restored) {
+      rc = rebootstrap_replica(replica);
+      next = SQLITE_ROW;
+    }
+  }
+
+  cdc_record_free(&record);
+
+  if (rc == SQLITE_OK && next == SQLITE_CORRUPT) {
+    fprintf(stderr, "Change log is corrupt after seq %llu\n",
+            (unsigned long long)replica->applied_seq);
+    rc = SQLITE_CORRUPT;
+  }
+
+  pthread_mutex_lock(&replica->lock);
+  replica->last_error = rc;
+  pthread_mutex_unlock(&replica->lock);
+  return rc;
+}
+
+// Follower thread: apply new records, polling the log once caught up
+static void *replica_follower(void *arg) {
+  struct Replica *replica = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&replica->lock);
+    int running = replica->running;
+    pthread_mutex_unlock(&replica->lock);
+    if (!running) {
+      break;
+    }
+
+    int64_t applied;
+    replica_catch_up(replica, &applied);
+    if (applied == 0) {
+      sqlite3_sleep(REPLICA_POLL_MS);
+    }
+  }
+
+  return NULL;
+}
+
+// Keep applying the log in the background
+int start_replica_follower(struct Replica *replica) {
+  replica->running = 1;
+  if (pthread_create(&replica->thread, NULL, replica_follower, replica) != 0) {
+    replica->running = 0;
+    fprintf(stderr, "Failed to start replica follower\n");
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+// Stop the follower and close the replica
+void close_replica(struct Replica *replica) {
+  pthread_mutex_lock(&replica->lock);
+  int running = replica->running;
+  replica->running = 0;
+  pthread_mutex_unlock(&replica->lock);
+
+  if (running) {
+    pthread_join(replica->thread, NULL);
+  }
+
+  cdc_cursor_close(&replica->cursor);
+  for (int i = 0; i < 9; i++) {
+    sqlite3_finalize(replica->stmts[i]);
+    replica->stmts[i] = NULL;
+  }
+  sqlite3_close(replica->db);
+  replica->db = NULL;
+  pthread_mutex_destroy(&replica->lock);
+}
+
+// Print how far the replica is behind the primary's log
+void print_replica_status(struct Replica *replica) {
+  uint64_t log_seq = cdc_last_sequence(replica->log_dir);
+
+  pthread_mutex_lock(&replica->lock);
+  uint64_t applied_seq = replica->applied_seq;
+  int64_t records_applied = replica->records_applied;
+  int last_error = replica->last_error;
+  pthread_mutex_unlock(&replica->lock);
+
+  printf("Replica: %s\n", replica->replica_path);
+  printf("Primary: %s (log %s)\n", replica->primary_path, replica->log_dir);
+  printf("Applied through seq: %llu\n", (unsigned long long)applied_seq);
+  printf("Primary log at seq: %llu\n", (unsigned long long)log_seq);
+  printf("Records behind: %llu\n",
+         (unsigned long long)(log_seq > applied_seq ? log_seq - applied_seq
+                                                    : 0));
+  printf("Applied this session: %lld\n", (long long)records_applied);
+  if (last_error != SQLITE_OK) {
+    printf("Last error: %s\n", sqlite3_errstr(last_error));
+  }
+}
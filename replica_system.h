@@ -0,0 +1,42 @@
+#ifndef REPLICA_SYSTEM_H
+#define REPLICA_SYSTEM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "change_log.h"
+#include "sqlite3.h"
+
+// Change-log records applied per replica transaction
+#define REPLICA_BATCH_SIZE 500
+// How long the applier waits for new records once caught up
+#define REPLICA_POLL_MS 200
+
+// A read replica kept in <replica_dir>/replica.db. It is bootstrapped from
+// an online backup of the primary and then follows the primary's change log,
+// storing the last applied sequence number in the same transaction as the
+// changes so it resumes exactly where it stopped.
+struct Replica {
+  char primary_path[256];
+  char log_dir[256];
+  char replica_path[300];
+  sqlite3 *db; // applier connection
+  sqlite3_stmt *stmts[9];
+  struct CdcCursor cursor;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;
+  uint64_t applied_seq;
+  int64_t records_applied;
+  int last_error;
+};
+
+int open_replica(struct Replica *replica, const char *primary_path,
+                 const char *log_dir, const char *replica_dir);
+int replica_catch_up(struct Replica *replica, int64_t *applied);
+int start_replica_follower(struct Replica *replica);
+void close_replica(struct Replica *replica);
+void print_replica_status(struct Replica *replica);
+void display_replica_menu();
+
+#endif
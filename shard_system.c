@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "account_system.h"
+#include "change_log.h"
+#include "fraud_detector.h"
+#include "gen_account_number.h"
+#include "idempotency.h"
+#include "limits_engine.h"
+#include "shard_system.h"
+#include "sqlite3.h"
+#include "transaction_system.h"
+#include "utils_functions.h"
+
+// Create the per-shard schema: the accounts and their ledger, and the
+// request keys and limits of postings made on the shard
+static int create_shard_tables(sqlite3 *db) {
+  int rc = create_accounts_table(db);
+  if (rc == SQLITE_OK) {
+    rc = create_transactions_table(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_idempotency_table(db);
+  }
+  if (rc == SQLITE_OK) {
+    rc = create_limits_tables(db);
+  }
+  return rc;
+}
+
+// Check whether the main database of a connection is in WAL mode
+static int uses_wal(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int wal = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA main.journal_mode;", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    return 0;
+  }
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    wal = sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0),
+                          "wal") == 0;
+  }
+
+  sqlite3_finalize(stmt);
+  return wal;
+}
+
+// Name of a shard's schema on the router
+static void shard_schema(int index, char *schema, size_t size) {
+  snprintf(schema, size, "shard_%d", index);
+}
+
+// Attach shard index to the router as shard_<index>
+static int attach_shard(struct ShardSet *set, int index) {
+  sqlite3_stmt *stmt;
+  char schema[16];
+
+  shard_schema(index, schema, sizeof(schema));
+
+  int rc = sqlite3_prepare_v2(set->router, "ATTACH DATABASE ? AS ?;", -1,
+                              &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n",
+            sqlite3_errmsg(set->router));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, set->paths[index], -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, schema, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Failed to attach shard: %s\n",
+            sqlite3_errmsg(set->router));
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+// Open (and create if needed) shard files named <prefix>_shard_<n>.db, and
+// the router: a second connection to the bank database with every shard
+// attached, for transfers between shards. Those commit the bank database
+// and two shards together, which SQLite only makes atomic for files that
+// use a rollback journal.
+int open_shards(struct ShardSet *set, sqlite3 *bank, const char *prefix,
+                int shard_count) {
+  int rc;
+
+  if (shard_count < 1 || shard_count > MAX_SHARDS) {
+    fprintf(stderr, "Shard count must be between 1 and %d\n", MAX_SHARDS);
+    return SQLITE_MISUSE;
+  }
+
+  const char *bank_path = sqlite3_db_filename(bank, "main");
+  if (bank_path == NULL || bank_path[0] == '\0' || uses_wal(bank)) {
+    fprintf(stderr, "Shards need a bank database file in rollback "
+                    "journal mode\n");
+    return SQLITE_MISUSE;
+  }
+
+  memset(set, 0, sizeof(*set));
+  set->bank = bank;
+
+  for (int i = 0; i < shard_count; i++) {
+    snprintf(set->paths[i], sizeof(set->paths[i]), "%s_shard_%d.db", prefix,
+             i);
+
+    rc = sqlite3_open(set->paths[i], &set->shards[i]);
+    set->shard_count = i + 1;
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Can't open shard %s: %s\n", set->paths[i],
+              sqlite3_errmsg(set->shards[i]));
+      close_shards(set);
+      return rc;
+    }
+
+    // Cross-shard commits rely on the rollback journal's super-journal,
+    // which WAL mode does not provide
+    sqlite3_busy_timeout(set->shards[i], 5000);
+    rc = execute_sql(set->shards[i], "PRAGMA journal_mode = DELETE;");
+    if (rc == SQLITE_OK) {
+      rc = create_shard_tables(set->shards[i]);
+    }
+    if (rc == SQLITE_OK) {
+      rc = cdc_recover(set->shards[i]);
+    }
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to initialize shard %s\n", set->paths[i]);
+      close_shards(set);
+      return rc;
+    }
+  }
+
+  rc = sqlite3_open(bank_path, &set->router);
+  if (rc == SQLITE_OK) {
+    sqlite3_busy_timeout(set->router, 5000);
+  }
+  for (int i = 0; rc == SQLITE_OK && i < shard_count; i++) {
+    rc = attach_shard(set, i);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open the shard router: %s\n",
+            sqlite3_errmsg(set->router));
+    close_shards(set);
+    return rc;
+  }
+
+  // Request keys, limits and fraud windows cover the shards' postings
+  for (int i = 0; rc == SQLITE_OK && i < shard_count; i++) {
+    defer_idempotency_keys(set->shards[i]);
+    rc = limits_add_store(set->shards[i]);
+    if (rc == SQLITE_OK) {
+      rc = fraud_add_ledger(set->shards[i]);
+    }
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to register shards\n");
+  }
+  return rc;
+}
+
+// Save the shards' limit counters and change-log progress and close every
+// connection. Called once, when the session ends.
+void close_shards(struct ShardSet *set) {
+  for (int i = 0; i < set->shard_count; i++) {
+    if (set->shards[i] != NULL) {
+      limits_flush_counters(set->shards[i], 1);
+      cdc_checkpoint(set->shards[i]);
+      sqlite3_close(set->shards[i]);
+      set->shards[i] = NULL;
+    }
+  }
+  set->shard_count = 0;
+
+  if (set->router != NULL) {
+    sqlite3_close(set->router);
+    set->router = NULL;
+  }
+}
+
+// FNV-1a hash of the account number picks the shard
+int shard_index_for_account(const struct ShardSet *set,
+                            const char *account_number) {
+  unsigned int hash = 2166136261u;
+
+  for (const char *p = account_number; *p != '\0'; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 16777619u;
+  }
+
+  return (int)(hash % (unsigned int)set->shard_count);
+}
+
+sqlite3 *shard_for_account(const struct ShardSet *set,
+                           const char *account_number) {
+  return set->shards[shard_index_for_account(set, account_number)];
+}
+
+// Count accounts with the given number on one connection and schema
+static int account_exists(sqlite3 *db, const char *schema,
+                          const char *account_number) {
+  sqlite3_stmt *stmt;
+  int count = -1;
+
+  char *sql = sqlite3_mprintf(
+      "SELECT COUNT(*) FROM \"%w\".accounts WHERE account_number = ?;",
+      schema);
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int(stmt, 0);
+  }
+
+  sqlite3_finalize(stmt);
+  return count;
+}
+
+// Check that a customer exists in the bank database and is not queued for
+// deletion
+static int customer_exists(sqlite3 *db, const char *customer_id) {
+  sqlite3_stmt *stmt;
+  int count = 0;
+
+  const char *sql =
+      "SELECT COUNT(*) FROM main.customers WHERE customer_id = ?1 "
+      "AND NOT EXISTS (SELECT 1 FROM main.customer_deletions "
+      "WHERE customer_id = ?1 AND completed_at IS NULL);";
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return 0;
+  }
+
+  sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int(stmt, 0);
+  }
+
+  sqlite3_finalize(stmt);
+  return count > 0;
+}
+
+// Generate an account number unique on the shard it hashes to and insert it
+// there, with its opening ledger entry and change-log record
+int shard_create_account(struct ShardSet *set, struct Account *account) {
+  if (!customer_exists(set->bank, account->customer_id)) {
+    printf("Customer %s does not exist.\n", account->customer_id);
+    return SQLITE_NOTFOUND;
+  }
+
+  for (;;) {
+    generate_account_number(set->shards[0], account->account_number);
+
+    int index = shard_index_for_account(set, account->account_number);
+    if (index == 0) {
+      break;
+    }
+
+    int count = account_exists(set->shards[index], "main",
+                               account->account_number);
+    if (count < 0) {
+      return SQLITE_ERROR;
+    }
+    if (count == 0) {
+      break;
+    }
+  }
+
+  // The shard's accounts table names a customers table only bank.db has;
+  // shard connections leave foreign keys off, and the customer was checked
+  // above instead
+  return insert_account_in(shard_for_account(set, account->account_number),
+                           "main", account);
+}
+
+// Print an account's details from its shard, through the router so the
+// customer's name comes from the bank database
+int shard_get_account_details(struct ShardSet *set,
+                              const char *account_number) {
+  char schema[16];
+
+  shard_schema(shard_index_for_account(set, account_number), schema,
+               sizeof(schema));
+  return get_account_details_in(set->router, schema, account_number);
+}
+
+// Post to one account on its shard's own connection, so postings to
+// different shards don't wait on each other
+int shard_deposit(struct ShardSet *set, const char *request_key,
+                  const char *account_number, double amount) {
+  return deposit_money_in(shard_for_account(set, account_number), "main",
+                          request_key, account_number, amount);
+}
+
+int shard_withdraw(struct ShardSet *set, const char *request_key,
+                   const char *account_number, double amount) {
+  return withdraw_money_in(shard_for_account(set, account_number), "main",
+                           request_key, account_number, amount);
+}
+
+// Transfer money between accounts that may live on different shards. A
+// transfer within one shard runs on its connection like any posting. One
+// between shards runs on the router: phase one is the posting's write locks
+// on the bank database and both shards, and the balance checks; phase two
+// applies both sides and commits, which SQLite makes atomic across the
+// files with a super-journal.
+int shard_transfer(struct ShardSet *set, const char *request_key,
+                   const char *from_account, const char *to_account,
+                   double amount) {
+  char from_schema[16];
+  char to_schema[16];
+  int from_index = shard_index_for_account(set, from_account);
+  int to_index = shard_index_for_account(set, to_account);
+
+  if (from_index == to_index) {
+    return transfer_money_in(set->shards[from_index], request_key, "main",
+                             from_account, "main", to_account, amount);
+  }
+
+  shard_schema(from_index, from_schema, sizeof(from_schema));
+  shard_schema(to_index, to_schema, sizeof(to_schema));
+  return transfer_money_in(set->router, request_key, from_schema,
+                           from_account, to_schema, to_account, amount);
+}
+
+// Scatter the lookup to every shard and gather the customer's accounts into
+// a malloc'd array the caller frees
+int shard_get_customer_accounts(struct ShardSet *set, const char *customer_id,
+                                struct Account **accounts, int *count) {
+  const char *sql = "SELECT account_number, customer_id, account_type, "
+                    "balance FROM accounts WHERE customer_id = ?;";
+  int capacity = 0;
+  int rc = SQLITE_OK;
+
+  *accounts = NULL;
+  *count = 0;
+
+  for (int i = 0; i < set->shard_count && rc == SQLITE_OK; i++) {
+    sqlite3_stmt *stmt;
+
+    rc = sqlite3_prepare_v2(set->shards[i], sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Failed to prepare statement: %s\n",
+              sqlite3_errmsg(set->shards[i]));
+      break;
+    }
+
+    sqlite3_bind_text(stmt, 1, customer_id, -1, SQLITE_STATIC);
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      if (*count == capacity) {
+        capacity = capacity == 0 ? 4 : capacity * 2;
+        struct Account *grown =
+            realloc(*accounts, capacity * sizeof(struct Account));
+        if (grown == NULL) {
+          rc = SQLITE_NOMEM;
+          break;
+        }
+        *accounts = grown;
+      }
+
+      struct Account *account = &(*accounts)[(*count)++];
+      snprintf(account->account_number, sizeof(account->account_number),
+               "%s", sqlite3_column_text(stmt, 0));
+      snprintf(account->customer_id, sizeof(account->customer_id), "%s",
+               sqlite3_column_text(stmt, 1));
+      snprintf(account->account_type, sizeof(account->account_type), "%s",
+               sqlite3_column_text(stmt, 2));
+      account->balance = sqlite3_column_double(stmt, 3);
+    }
+
+    if (rc == SQLITE_DONE) {
+      rc = SQLITE_OK;
+    } else if (rc != SQLITE_NOMEM) {
+      fprintf(stderr, "Execution failed: %s\n",
+              sqlite3_errmsg(set->shards[i]));
+    }
+
+    sqlite3_finalize(stmt);
+  }
+
+  if (rc != SQLITE_OK) {
+    free(*accounts);
+    *accounts = NULL;
+    *count = 0;
+  }
+
+  return rc;
+}
+
+// History lives entirely on the account's own shard
+int shard_get_transaction_history(struct ShardSet *set,
+                                  const char *account_number) {
+  char schema[16];
+
+  shard_schema(shard_index_for_account(set, account_number), schema,
+               sizeof(schema));
+  return get_transaction_history_in(set->router, schema, account_number);
+}
+
+// Close an account on its own shard
+int shard_close_account(struct ShardSet *set, const char *account_number) {
+  return close_account(shard_for_account(set, account_number),
+                       account_number);
+}
+
+// Change an account's type on its own shard
+int shard_change_account_type(struct ShardSet *set,
+                              const char *account_number,
+                              const char *account_type) {
+  return change_account_type(shard_for_account(set, account_number),
+                             account_number, account_type);
+}
+
+// Run a batch change on every shard over the account numbers that hash to
+// it, closing them or, given account_type, changing their type. Each shard
+// commits its part on its own, so a failure leaves the shards before it
+// changed; the report covers those.
+static int shard_account_batch(struct ShardSet *set,
+                               const char *const *account_numbers, int count,
+                               const char *account_type,
+                               struct AccountBatchReport *report) {
+  int rc = SQLITE_OK;
+
+  memset(report, 0, sizeof(*report));
+  const char **subset = malloc((count > 0 ? count : 1) * sizeof(*subset));
+  if (subset == NULL) {
+    return SQLITE_NOMEM;
+  }
+
+  for (int i = 0; i < set->shard_count && rc == SQLITE_OK; i++) {
+    struct AccountBatchReport part;
+    int subset_count = 0;
+
+    for (int j = 0; j < count; j++) {
+      if (shard_index_for_account(set, account_numbers[j]) == i) {
+        subset[subset_count++] = account_numbers[j];
+      }
+    }
+    if (subset_count == 0) {
+      continue;
+    }
+
+    rc = account_type != NULL
+             ? change_account_types(set->shards[i], subset, subset_count,
+                                    account_type, &part)
+             : close_accounts(set->shards[i], subset, subset_count, &part);
+    if (rc == SQLITE_OK) {
+      report->changed += part.changed;
+      report->skipped += part.skipped;
+      report->seconds += part.seconds;
+    }
+  }
+
+  free(subset);
+  return rc;
+}
+
+int shard_close_accounts(struct ShardSet *set,
+                         const char *const *account_numbers, int count,
+                         struct AccountBatchReport *report) {
+  return shard_account_batch(set, account_numbers, count, NULL, report);
+}
+
+int shard_change_account_types(struct ShardSet *set,
+                               const char *const *account_numbers, int count,
+                               const char *account_type,
+                               struct AccountBatchReport *report) {
+  return shard_account_batch(set, account_numbers, count, account_type,
+                             report);
+}
+
+static struct ShardSet *routed_set;
+
+// Send the menus' account and transaction work to set, or back to bank.db
+// when set is NULL
+void route_to_shards(struct ShardSet *set) { routed_set = set; }
+
+struct ShardSet *routed_shards(void) { return routed_set; }
@@ -0,0 +1,61 @@
+#ifndef SHARD_SYSTEM_H
+#define SHARD_SYSTEM_H
+
+#include "account_system.h"
+#include "sqlite3.h"
+
+// Upper bound on the number of shard files
+#define MAX_SHARDS 16
+
+// Accounts and their transactions are spread over shard_count database
+// files, picked by a hash of the account number. Customers stay in bank.db.
+// Postings to one shard run on its own connection. Transfers between shards
+// and reads that join customers run on the router, a second bank.db
+// connection with every shard attached as shard_<n>.
+struct ShardSet {
+  int shard_count;
+  sqlite3 *bank;
+  sqlite3 *router;
+  sqlite3 *shards[MAX_SHARDS];
+  char paths[MAX_SHARDS][256];
+};
+
+int open_shards(struct ShardSet *set, sqlite3 *bank, const char *prefix,
+                int shard_count);
+void close_shards(struct ShardSet *set);
+int shard_index_for_account(const struct ShardSet *set,
+                            const char *account_number);
+sqlite3 *shard_for_account(const struct ShardSet *set,
+                           const char *account_number);
+int shard_create_account(struct ShardSet *set, struct Account *account);
+int shard_get_account_details(struct ShardSet *set,
+                              const char *account_number);
+int shard_deposit(struct ShardSet *set, const char *request_key,
+                  const char *account_number, double amount);
+int shard_withdraw(struct ShardSet *set, const char *request_key,
+                   const char *account_number, double amount);
+int shard_transfer(struct ShardSet *set, const char *request_key,
+                   const char *from_account, const char *to_account,
+                   double amount);
+int shard_get_customer_accounts(struct ShardSet *set, const char *customer_id,
+                                struct Account **accounts, int *count);
+int shard_get_transaction_history(struct ShardSet *set,
+                                  const char *account_number);
+int shard_close_account(struct ShardSet *set, const char *account_number);
+int shard_change_account_type(struct ShardSet *set,
+                              const char *account_number,
+                              const char *account_type);
+int shard_close_accounts(struct ShardSet *set,
+                         const char *const *account_numbers, int count,
+                         struct AccountBatchReport *report);
+int shard_change_account_types(struct ShardSet *set,
+                               const char *const *account_numbers, int count,
+                               const char *account_type,
+                               struct AccountBatchReport *report);
+
+// The menus send account and transaction work to the routed shard set, if
+// there is one
+void route_to_shards(struct ShardSet *set);
+struct ShardSet *routed_shards(void);
+
+#endif
@@ -0,0 +1,655 @@
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gen_account_number.h"
+#include "ledger_partitions.h"
+#include "sqlite3.h"
+#include "statement_job.h"
+#include "utils_functions.h"
+
+struct StatementLine {
+  char date[20];
+  int64_t cents;
+  char type[13];
+};
+
+// One account's statement input. Batches and their line arrays are reused
+// from a fixed pool, which also bounds how far the reader runs ahead.
+struct StatementBatch {
+  int64_t seq;
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  char account_type[16];
+  char customer[160];
+  int64_t opening_cents;
+  struct StatementLine *lines;
+  int line_count;
+  int line_capacity;
+  struct StatementBatch *next_free;
+};
+
+struct StatementRun {
+  const struct StatementJob *job;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+
+  // Queue of batches waiting to be rendered; NULL tells a worker to stop
+  struct StatementBatch **queue;
+  int queue_capacity;
+  int queue_head;
+  int queue_count;
+  struct StatementBatch *free_batches;
+
+  // Statements are committed in queue order so the saved position is exact
+  int64_t next_commit;
+  char last_account[ACCOUNT_NUMBER_LENGTH + 1];
+  int64_t statements;
+  FILE *archive;
+  int64_t archive_bytes;
+  int failed;
+};
+
+// Create the progress table
+int create_statement_tables(sqlite3 *db) {
+  return execute_sql(db, "CREATE TABLE IF NOT EXISTS statement_runs ("
+                         "month TEXT, "
+                         "output_dir TEXT, "
+                         "combined INTEGER, "
+                         "last_account TEXT, "
+                         "archive_bytes INTEGER, "
+                         "statements INTEGER, "
+                         "completed INTEGER, "
+                         "PRIMARY KEY(month, output_dir, combined));");
+}
+
+void default_statement_job(struct StatementJob *job) {
+  time_t now = time(NULL);
+
+  memset(job, 0, sizeof(*job));
+  strftime(job->month, sizeof(job->month), "%Y-%m", gmtime(&now));
+  snprintf(job->output_dir, sizeof(job->output_dir), "statements");
+  job->workers = 4;
+}
+
+// Take a free batch, waiting while all of them are in flight
+static struct StatementBatch *take_batch(struct StatementRun *run) {
+  pthread_mutex_lock(&run->lock);
+  while (run->free_batches == NULL) {
+    pthread_cond_wait(&run->changed, &run->lock);
+  }
+  struct StatementBatch *batch = run->free_batches;
+  run->free_batches = batch->next_free;
+  pthread_mutex_unlock(&run->lock);
+
+  batch->line_count = 0;
+  batch->opening_cents = 0;
+  return batch;
+}
+
+static void give_back_batch(struct StatementRun *run,
+                            struct StatementBatch *batch) {
+  pthread_mutex_lock(&run->lock);
+  batch->next_free = run->free_batches;
+  run->free_batches = batch;
+  pthread_cond_broadcast(&run->changed);
+  pthread_mutex_unlock(&run->lock);
+}
+
+static void enqueue(struct StatementRun *run, struct StatementBatch *batch) {
+  pthread_mutex_lock(&run->lock);
+  run->queue[(run->queue_head + run->queue_count) % run->queue_capacity] =
+      batch;
+  run->queue_count++;
+  pthread_cond_broadcast(&run->changed);
+  pthread_mutex_unlock(&run->lock);
+}
+
+static struct StatementBatch *dequeue(struct StatementRun *run) {
+  pthread_mutex_lock(&run->lock);
+  while (run->queue_count == 0) {
+    pthread_cond_wait(&run->changed, &run->lock);
+  }
+  struct StatementBatch *batch = run->queue[run->queue_head];
+  run->queue_head = (run->queue_head + 1) % run->queue_capacity;
+  run->queue_count--;
+  pthread_mutex_unlock(&run->lock);
+  return batch;
+}
+
+// Append to a worker's output buffer, growing it as needed. The buffer is
+// kept between statements.
+static int append(char **buffer, size_t *length, size_t *capacity,
+                  const char *format, ...) {
+  va_list args;
+
+  for (;;) {
+    size_t room = *capacity - *length;
+    va_start(args, format);
+    int written = vsnprintf(*buffer + *length, room, format, args);
+    va_end(args);
+
+    if (written < 0) {
+      return SQLITE_ERROR;
+    }
+    if ((size_t)written < room) {
+      *length += written;
+      return SQLITE_OK;
+    }
+
+    size_t grown_capacity = *capacity * 2 + written;
+    char *grown = realloc(*buffer, grown_capacity);
+    if (grown == NULL) {
+      return SQLITE_NOMEM;
+    }
+    *buffer = grown;
+    *capacity = grown_capacity;
+  }
+}
+
+// Render one statement as text
+static int render_statement(const struct StatementJob *job,
+                            const struct StatementBatch *batch, char **buffer,
+                            size_t *length, size_t *capacity) {
+  int64_t balance = batch->opening_cents;
+  int64_t credits = 0, debits = 0;
+
+  *length = 0;
+  int rc = append(buffer, length, capacity,
+                  "STATEMENT %s\n"
+                  "Account:  %s (%s)\n"
+                  "Customer: %s\n"
+                  "%-20s %-13s %14s %14s\n"
+                  "%-20s %-13s %14s %14.2f\n",
+                  job->month, batch->account_number, batch->account_type,
+                  batch->customer, "Date", "Type", "Amount", "Balance",
+                  "", "opening", "", balance / 100.0);
+
+  for (int i = 0; rc == SQLITE_OK && i < batch->line_count; i++) {
+    const struct StatementLine *line = &batch->lines[i];
+    balance += line->cents;
+    if (line->cents >= 0) {
+      credits += line->cents;
+    } else {
+      debits -= line->cents;
+    }
+    rc = append(buffer, length, capacity, "%-20s %-13s %14.2f %14.2f\n",
+                line->date, line->type, line->cents / 100.0, balance / 100.0);
+  }
+
+  if (rc == SQLITE_OK) {
+    rc = append(buffer, length, capacity,
+                "%-20s %-13s %14s %14.2f\n"
+                "Credits: %.2f  Debits: %.2f  Entries: %d\n\n",
+                "", "closing", "", balance / 100.0, credits / 100.0,
+                debits / 100.0, batch->line_count);
+  }
+
+  return rc;
+}
+
+static int write_file(const char *path, const char *data, size_t length) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Can't write statement %s: %s\n", path, strerror(errno));
+    return SQLITE_CANTOPEN;
+  }
+
+  int ok = fwrite(data, 1, length, file) == length;
+  ok = fclose(file) == 0 && ok;
+  return ok ? SQLITE_OK : SQLITE_IOERR;
+}
+
+// Worker thread: render batches with one reused buffer, then commit them in
+// order
+static void *statement_worker(void *arg) {
+  struct StatementRun *run = arg;
+  const struct StatementJob *job = run->job;
+  size_t capacity = 4096, length = 0;
+  char *buffer = malloc(capacity);
+  char path[512];
+  struct StatementBatch *batch;
+
+  while ((batch = dequeue(run)) != NULL) {
+    int rc = buffer == NULL ? SQLITE_NOMEM
+                            : render_statement(job, batch, &buffer, &length,
+                                               &capacity);
+
+    // Separate files can be written in parallel
+    if (rc == SQLITE_OK && !job->combined) {
+      snprintf(path, sizeof(path), "%s/%s-%s.txt", job->output_dir,
+               batch->account_number, job->month);
+      rc = write_file(path, buffer, length);
+    }
+
+    pthread_mutex_lock(&run->lock);
+    while (batch->seq != run->next_commit) {
+      pthread_cond_wait(&run->changed, &run->lock);
+    }
+
+    if (rc == SQLITE_OK && job->combined) {
+      if (fwrite(buffer, 1, length, run->archive) == length) {
+        run->archive_bytes += length;
+      } else {
+        rc = SQLITE_IOERR;
+      }
+    }
+
+    // After a failure nothing later is marked done, so a rerun redoes it
+    if (rc != SQLITE_OK) {
+      run->failed = 1;
+    }
+    if (!run->failed) {
+      snprintf(run->last_account, sizeof(run->last_account), "%s",
+               batch->account_number);
+      run->statements++;
+    }
+    run->next_commit++;
+    batch->next_free = run->free_batches;
+    run->free_batches = batch;
+    pthread_cond_broadcast(&run->changed);
+    pthread_mutex_unlock(&run->lock);
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+// Save how far the run has got. The archive is flushed first so the saved
+// length never exceeds what is on disk.
+static int save_progress(sqlite3 *db, struct StatementRun *run,
+                         int completed) {
+  sqlite3_stmt *stmt;
+  const struct StatementJob *job = run->job;
+
+  int rc = sqlite3_prepare_v2(
+      db,
+      "INSERT OR REPLACE INTO statement_runs (month, output_dir, combined, "
+      "last_account, archive_bytes, statements, completed) "
+      "VALUES (?, ?, ?, ?, ?, ?, ?);",
+      -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  pthread_mutex_lock(&run->lock);
+  if (run->archive != NULL) {
+    fflush(run->archive);
+  }
+  sqlite3_bind_text(stmt, 1, job->month, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, job->output_dir, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 3, job->combined);
+  sqlite3_bind_text(stmt, 4, run->last_account, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt, 5, run->archive_bytes);
+  sqlite3_bind_int64(stmt, 6, run->statements);
+  sqlite3_bind_int(stmt, 7, completed && !run->failed);
+  pthread_mutex_unlock(&run->lock);
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Load a previous run of the same job. Returns SQLITE_DONE if it finished.
+static int load_progress(sqlite3 *db, struct StatementRun *run) {
+  sqlite3_stmt *stmt;
+  const struct StatementJob *job = run->job;
+
+  int rc = sqlite3_prepare_v2(db,
+                              "SELECT last_account, archive_bytes, "
+                              "statements, completed FROM statement_runs "
+                              "WHERE month = ? AND output_dir = ? AND "
+                              "combined = ?;",
+                              -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, job->month, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, job->output_dir, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 3, job->combined);
+
+  rc = SQLITE_OK;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    snprintf(run->last_account, sizeof(run->last_account), "%s",
+             sqlite3_column_text(stmt, 0));
+    run->archive_bytes = sqlite3_column_int64(stmt, 1);
+    run->statements = sqlite3_column_int64(stmt, 2);
+    if (sqlite3_column_int(stmt, 3)) {
+      rc = SQLITE_DONE;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return rc;
+}
+
+// Read an account number that may be stored as an integer, without its
+// leading zeros, by a database from before the column became TEXT
+static void column_account(sqlite3_stmt *stmt, int column, char *buffer,
+                           int size) {
+  if (sqlite3_column_type(stmt, column) == SQLITE_INTEGER) {
+    snprintf(buffer, size, "%0*lld", ACCOUNT_NUMBER_LENGTH,
+             (long long)sqlite3_column_int64(stmt, column));
+  } else {
+    snprintf(buffer, size, "%s", sqlite3_column_text(stmt, column));
+  }
+}
+
+// Fill in the statement header for an account
+static void load_account_header(sqlite3_stmt *stmt,
+                                struct StatementBatch *batch) {
+  sqlite3_reset(stmt);
+  sqlite3_bind_text(stmt, 1, batch->account_number, -1, SQLITE_STATIC);
+
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    snprintf(batch->account_type, sizeof(batch->account_type), "%s",
+             sqlite3_column_type(stmt, 0) == SQLITE_NULL
+                 ? "closed"
+                 : (const char *)sqlite3_column_text(stmt, 0));
+    snprintf(batch->customer, sizeof(batch->customer), "%s, %s",
+             sqlite3_column_type(stmt, 1) == SQLITE_NULL
+                 ? "unknown"
+                 : (const char *)sqlite3_column_text(stmt, 1),
+             sqlite3_column_type(stmt, 2) == SQLITE_NULL
+                 ? ""
+                 : (const char *)sqlite3_column_text(stmt, 2));
+  } else {
+    snprintf(batch->account_type, sizeof(batch->account_type), "closed");
+    snprintf(batch->customer, sizeof(batch->customer), "unknown");
+  }
+  sqlite3_reset(stmt);
+}
+
+// Queue a finished batch, or recycle it if the account has nothing to show
+static void submit_batch(struct StatementRun *run,
+                         struct StatementBatch *batch, int64_t *seq) {
+  if (batch->line_count == 0 && batch->opening_cents == 0) {
+    give_back_batch(run, batch);
+    return;
+  }
+  batch->seq = (*seq)++;
+  enqueue(run, batch);
+}
+
+// Generate the month's statements
+int run_statement_job(sqlite3 *db, const struct StatementJob *job,
+                      struct StatementReport *report) {
+  struct StatementRun run;
+  struct timespec start, end;
+  sqlite3_stmt *ledger = NULL, *header = NULL;
+  pthread_t threads[STATEMENT_MAX_WORKERS];
+  char month_start[32], month_end[32];
+  char path[512];
+  int year, month;
+  int rc;
+
+  memset(report, 0, sizeof(*report));
+
+  if (sscanf(job->month, "%4d-%2d", &year, &month) != 2 || month < 1 ||
+      month > 12) {
+    printf("Month must be in YYYY-MM format.\n");
+    return SQLITE_MISUSE;
+  }
+  snprintf(month_start, sizeof(month_start), "%04d-%02d-01 00:00:00", year,
+           month);
+  snprintf(month_end, sizeof(month_end), "%04d-%02d-01 00:00:00",
+           month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1);
+
+  if (mkdir(job->output_dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Can't create %s: %s\n", job->output_dir, strerror(errno));
+    return SQLITE_CANTOPEN;
+  }
+
+  rc = create_statement_tables(db);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  // Months after the last archived one are read from the hot table alone.
+  // Earlier ones need every month up to them in the view, and compressed
+  // months are not in it.
+  char archived[8], compressed[8], wanted[16];
+  rc = archived_through_month(db, archived, sizeof(archived));
+  if (rc == SQLITE_OK) {
+    rc = first_compressed_month(db, compressed, sizeof(compressed));
+  }
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  snprintf(wanted, sizeof(wanted), "%04d-%02d", year, month);
+  int from_hot = strcmp(wanted, archived) > 0;
+  if (!from_hot && (rc = open_ledger_history(db)) != SQLITE_OK) {
+    return rc;
+  }
+  if (!from_hot &&
+      ((compressed[0] != '\0' && strcmp(compressed, wanted) <= 0) ||
+       strcmp(ledger_history_source(db), "all_transactions") != 0)) {
+    fprintf(stderr, "Transactions for %s are archived and not attached\n",
+            job->month);
+    return SQLITE_ERROR;
+  }
+
+  memset(&run, 0, sizeof(run));
+  run.job = job;
+  rc = load_progress(db, &run);
+  if (rc == SQLITE_DONE) {
+    printf("Statements for %s were already generated.\n", job->month);
+    report->statements = run.statements;
+    return SQLITE_OK;
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  report->resumed = run.statements;
+
+  // A resumed archive is cut back to the last saved statement
+  if (job->combined) {
+    snprintf(path, sizeof(path), "%s/statements-%s.txt", job->output_dir,
+             job->month);
+    if (run.archive_bytes > 0 && truncate(path, run.archive_bytes) != 0) {
+      fprintf(stderr, "Can't resume archive %s\n", path);
+      return SQLITE_IOERR;
+    }
+    run.archive = fopen(path, run.archive_bytes > 0 ? "ab" : "wb");
+    if (run.archive == NULL) {
+      fprintf(stderr, "Can't open archive %s\n", path);
+      return SQLITE_CANTOPEN;
+    }
+  }
+
+  // Every account's entries in one index walk, starting after the last
+  // saved account. Archived months before this one only add to the opening
+  // balance, so they come from the carried totals, which sort first as an
+  // entry with an empty date. A month that was itself archived is read
+  // through the view over the partitions.
+  if (from_hot) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "SELECT account_number, '' AS date, archived_cents / 100.0, "
+        "'carried' FROM ledger_carry WHERE account_number > ?1 "
+        "UNION ALL "
+        "SELECT account_number, date, amount, type FROM transactions "
+        "INDEXED BY idx_transactions_account "
+        "WHERE account_number > ?1 AND date < ?2 "
+        "ORDER BY 1, 2;",
+        -1, &ledger, NULL);
+  } else {
+    rc = sqlite3_prepare_v2(
+        db,
+        "SELECT account_number, date, amount, type FROM all_transactions "
+        "WHERE account_number > ? AND date < ? "
+        "ORDER BY account_number, date;",
+        -1, &ledger, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_prepare_v2(
+        db,
+        "SELECT a.account_type, c.name, c.address FROM accounts a "
+        "LEFT JOIN customers c ON c.customer_id = a.customer_id "
+        "WHERE a.account_number = ?;",
+        -1, &header, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(ledger);
+    if (run.archive != NULL) {
+      fclose(run.archive);
+    }
+    return rc;
+  }
+
+  if (run.last_account[0] != '\0') {
+    sqlite3_bind_text(ledger, 1, run.last_account, -1, SQLITE_STATIC);
+  } else {
+    sqlite3_bind_int(ledger, 1, -1);
+  }
+  sqlite3_bind_text(ledger, 2, month_end, -1, SQLITE_STATIC);
+
+  int workers = job->workers < 1 ? 1 : job->workers;
+  if (workers > STATEMENT_MAX_WORKERS) {
+    workers = STATEMENT_MAX_WORKERS;
+  }
+
+  int batch_count = workers * 4;
+  struct StatementBatch *batches =
+      calloc(batch_count, sizeof(struct StatementBatch));
+  run.queue_capacity = batch_count + workers;
+  run.queue = calloc(run.queue_capacity, sizeof(struct StatementBatch *));
+  if (batches == NULL || run.queue == NULL) {
+    free(batches);
+    free(run.queue);
+    sqlite3_finalize(ledger);
+    sqlite3_finalize(header);
+    if (run.archive != NULL) {
+      fclose(run.archive);
+    }
+    return SQLITE_NOMEM;
+  }
+
+  for (int i = 0; i < batch_count; i++) {
+    batches[i].next_free = run.free_batches;
+    run.free_batches = &batches[i];
+  }
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.changed, NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int started = 0;
+  for (; started < workers; started++) {
+    if (pthread_create(&threads[started], NULL, statement_worker, &run) != 0) {
+      break;
+    }
+  }
+
+  struct StatementBatch *batch = NULL;
+  int64_t seq = 0;
+  int64_t queued = 0;
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+
+  while (started > 0 && (rc = sqlite3_step(ledger)) == SQLITE_ROW) {
+    column_account(ledger, 0, account_number, sizeof(account_number));
+
+    if (batch == NULL || strcmp(account_number, batch->account_number) != 0) {
+      if (batch != NULL) {
+        submit_batch(&run, batch, &seq);
+        if (++queued % STATEMENT_CHECKPOINT_INTERVAL == 0) {
+          save_progress(db, &run, 0);
+        }
+      }
+      batch = take_batch(&run);
+      snprintf(batch->account_number, sizeof(batch->account_number), "%s",
+               account_number);
+      load_account_header(header, batch);
+    }
+
+    const char *date = (const char *)sqlite3_column_text(ledger, 1);
+    int64_t cents = llround(sqlite3_column_double(ledger, 2) * 100.0);
+
+    // Earlier entries only make up the opening balance
+    if (strcmp(date, month_start) < 0) {
+      batch->opening_cents += cents;
+      continue;
+    }
+
+    if (batch->line_count == batch->line_capacity) {
+      int capacity = batch->line_capacity == 0 ? 64 : batch->line_capacity * 2;
+      struct StatementLine *lines =
+          realloc(batch->lines, capacity * sizeof(struct StatementLine));
+      if (lines == NULL) {
+        rc = SQLITE_NOMEM;
+        break;
+      }
+      batch->lines = lines;
+      batch->line_capacity = capacity;
+    }
+
+    struct StatementLine *line = &batch->lines[batch->line_count++];
+    snprintf(line->date, sizeof(line->date), "%s", date);
+    snprintf(line->type, sizeof(line->type), "%s",
+             sqlite3_column_text(ledger, 3));
+    line->cents = cents;
+    report->transactions++;
+  }
+
+  if (batch != NULL) {
+    if (rc == SQLITE_DONE) {
+      submit_batch(&run, batch, &seq);
+    } else {
+      give_back_batch(&run, batch);
+    }
+  }
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Statement run stopped: %s\n", sqlite3_errmsg(db));
+  }
+
+  for (int i = 0; i < started; i++) {
+    enqueue(&run, NULL);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report->seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  report->statements = run.statements - report->resumed;
+
+  int saved = save_progress(db, &run, rc == SQLITE_DONE && started > 0);
+
+  sqlite3_finalize(ledger);
+  sqlite3_finalize(header);
+  if (run.archive != NULL) {
+    fclose(run.archive);
+  }
+  for (int i = 0; i < batch_count; i++) {
+    free(batches[i].lines);
+  }
+  free(batches);
+  free(run.queue);
+  pthread_mutex_destroy(&run.lock);
+  pthread_cond_destroy(&run.changed);
+
+  if (started == 0) {
+    fprintf(stderr, "Failed to start statement workers\n");
+    return SQLITE_ERROR;
+  }
+  if (rc != SQLITE_DONE) {
+    return rc;
+  }
+  return run.failed ? SQLITE_IOERR : saved;
+}
@@ -0,0 +1,34 @@
+#ifndef STATEMENT_JOB_H
+#define STATEMENT_JOB_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+#define STATEMENT_MAX_WORKERS 16
+// Progress is saved after this many statements are queued
+#define STATEMENT_CHECKPOINT_INTERVAL 1000
+
+// One month's statements for every account with ledger history. The ledger
+// is read once, in (account_number, date) order; rendering runs on worker
+// threads. An interrupted run resumes after the last statement it saved.
+struct StatementJob {
+  char month[8];        // YYYY-MM
+  char output_dir[256]; // created if missing
+  int combined;         // 1: one archive file, 0: one file per account
+  int workers;
+};
+
+struct StatementReport {
+  int64_t statements;
+  int64_t transactions;
+  int64_t resumed; // statements already written by an earlier run
+  double seconds;
+};
+
+int create_statement_tables(sqlite3 *db);
+void default_statement_job(struct StatementJob *job);
+int run_statement_job(sqlite3 *db, const struct StatementJob *job,
+                      struct StatementReport *report);
+
+#endif
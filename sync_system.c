@@ -0,0 +1,389 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sqlite3.h"
+#include "sync_system.h"
+#include "utils_functions.h"
+
+static const char *sync_tables[] = {"customers", "accounts", "transactions"};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static sqlite3 *capture_db;
+static sqlite3_session *capture_session;
+
+static double elapsed_seconds(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Create a session on db watching the synced tables
+static int new_session(sqlite3 *db, sqlite3_session **session) {
+  int rc = sqlite3session_create(db, "main", session);
+
+  for (int i = 0; rc == SQLITE_OK && i < 3; i++) {
+    rc = sqlite3session_attach(*session, sync_tables[i]);
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to start change capture: %s\n",
+            sqlite3_errstr(rc));
+    sqlite3session_delete(*session);
+    *session = NULL;
+  }
+
+  return rc;
+}
+
+// Store a session's changes in sync_pending through db, a connection to the
+// same database, so they outlive the process. Called with the lock held;
+// the session is deleted.
+static int save_session(sqlite3 *db, sqlite3_session *session) {
+  sqlite3_stmt *stmt;
+  int size = 0;
+  void *changeset = NULL;
+
+  int rc = sqlite3session_changeset(session, &size, &changeset);
+  if (rc == SQLITE_OK && size > 0) {
+    rc = sqlite3_prepare_v2(db,
+                            "INSERT INTO sync_pending (changeset) VALUES (?);",
+                            -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_blob(stmt, 1, changeset, size, SQLITE_STATIC);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+      sqlite3_finalize(stmt);
+    }
+  }
+
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to save captured changes: %s\n",
+            sqlite3_errmsg(db));
+  }
+
+  sqlite3_free(changeset);
+  sqlite3session_delete(session);
+  return rc;
+}
+
+// Start recording changes made through db, the application's connection.
+// Changes not exported yet are kept in sync_pending, one changeset per
+// finished session in the order they were saved.
+int start_change_capture(sqlite3 *db) {
+  pthread_mutex_lock(&sync_lock);
+
+  int rc = SQLITE_OK;
+  if (capture_session == NULL) {
+    rc = execute_sql(db, "CREATE TABLE IF NOT EXISTS sync_pending ("
+                         "seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+                         "changeset BLOB NOT NULL);");
+    if (rc == SQLITE_OK) {
+      rc = new_session(db, &capture_session);
+    }
+    if (rc == SQLITE_OK) {
+      capture_db = db;
+    }
+  }
+
+  pthread_mutex_unlock(&sync_lock);
+  return rc;
+}
+
+// Save what the application connection captured and stop
+void stop_change_capture(void) {
+  pthread_mutex_lock(&sync_lock);
+  if (capture_session != NULL) {
+    save_session(capture_db, capture_session);
+  }
+  capture_session = NULL;
+  capture_db = NULL;
+  pthread_mutex_unlock(&sync_lock);
+}
+
+int change_capture_enabled(void) { return capture_session != NULL; }
+
+// Save the application connection's changes so far and start a new session,
+// so a crash loses at most what was captured since the last save
+int save_change_capture(void) {
+  if (!change_capture_enabled()) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&sync_lock);
+
+  int rc = SQLITE_OK;
+  if (capture_session != NULL) {
+    rc = save_session(capture_db, capture_session);
+    capture_session = NULL;
+    if (new_session(capture_db, &capture_session) != SQLITE_OK) {
+      rc = SQLITE_ERROR;
+    }
+  }
+
+  pthread_mutex_unlock(&sync_lock);
+  return rc;
+}
+
+// Capture changes on an additional connection, such as a worker thread's.
+// The application connection's changes so far are saved first, so that the
+// export keeps updates to the same row in the order they happened.
+// *session is NULL when capture is off.
+int capture_connection(sqlite3 *db, sqlite3_session **session) {
+  *session = NULL;
+  if (!change_capture_enabled()) {
+    return SQLITE_OK;
+  }
+
+  pthread_mutex_lock(&sync_lock);
+
+  int rc = SQLITE_OK;
+  if (capture_session != NULL) {
+    rc = save_session(db, capture_session);
+    capture_session = NULL;
+    if (new_session(capture_db, &capture_session) != SQLITE_OK) {
+      rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK) {
+      rc = new_session(db, session);
+    }
+  }
+
+  pthread_mutex_unlock(&sync_lock);
+  return rc;
+}
+
+// Save what a connection captured; call before closing it
+void release_connection_capture(sqlite3 *db, sqlite3_session *session) {
+  if (session == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&sync_lock);
+  save_session(db, session);
+  pthread_mutex_unlock(&sync_lock);
+}
+
+// Count the changes in a changeset
+static int64_t count_changes(int size, void *changeset) {
+  sqlite3_changeset_iter *iter;
+  int64_t changes = 0;
+
+  if (sqlite3changeset_start(&iter, size, changeset) != SQLITE_OK) {
+    return 0;
+  }
+  while (sqlite3changeset_next(iter) == SQLITE_ROW) {
+    changes++;
+  }
+  sqlite3changeset_finalize(iter);
+  return changes;
+}
+
+// Merge the saved changesets up to *last_seq, in the order they were saved,
+// into one changeset. Called with the lock held.
+static int merge_pending(sqlite3 *db, int *size, void **changeset,
+                         sqlite3_int64 *last_seq) {
+  sqlite3_changegroup *group;
+  sqlite3_stmt *stmt;
+
+  *last_seq = 0;
+  int rc = sqlite3changegroup_new(&group);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = sqlite3_prepare_v2(db,
+                          "SELECT seq, changeset FROM sync_pending "
+                          "ORDER BY seq;",
+                          -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+  }
+
+  while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+    *last_seq = sqlite3_column_int64(stmt, 0);
+    rc = sqlite3changegroup_add(group, sqlite3_column_bytes(stmt, 1),
+                                (void *)sqlite3_column_blob(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+
+  if (rc == SQLITE_OK) {
+    rc = sqlite3changegroup_output(group, size, changeset);
+  } else {
+    fprintf(stderr, "Failed to collect captured changes: %s\n",
+            sqlite3_errstr(rc));
+  }
+  sqlite3changegroup_delete(group);
+  return rc;
+}
+
+// Write every change captured since the previous export to path and start
+// a new capture window
+int export_changeset(const char *path, struct SyncReport *report) {
+  struct timespec start;
+  sqlite3_int64 last_seq = 0;
+  int size = 0;
+  void *changeset = NULL;
+
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!change_capture_enabled()) {
+    printf("Change capture is off, set BANK_SYNC_CAPTURE=1 to enable it.\n");
+    return SQLITE_MISUSE;
+  }
+
+  pthread_mutex_lock(&sync_lock);
+
+  int rc = save_session(capture_db, capture_session);
+  capture_session = NULL;
+  if (rc == SQLITE_OK) {
+    rc = merge_pending(capture_db, &size, &changeset, &last_seq);
+  }
+
+  FILE *file = NULL;
+  if (rc == SQLITE_OK) {
+    file = fopen(path, "wb");
+    if (file == NULL || fwrite(changeset, 1, size, file) != (size_t)size) {
+      fprintf(stderr, "Can't write changeset file %s\n", path);
+      rc = SQLITE_CANTOPEN;
+    }
+  }
+  if (file != NULL && fclose(file) != 0) {
+    rc = SQLITE_IOERR;
+  }
+
+  // Only a written changeset may be dropped from the pending table
+  if (rc == SQLITE_OK) {
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(capture_db,
+                            "DELETE FROM sync_pending WHERE seq <= ?;", -1,
+                            &stmt, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_int64(stmt, 1, last_seq);
+      rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+      sqlite3_finalize(stmt);
+    }
+    if (rc != SQLITE_OK) {
+      fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(capture_db));
+    }
+  }
+  new_session(capture_db, &capture_session);
+
+  pthread_mutex_unlock(&sync_lock);
+
+  if (rc == SQLITE_OK) {
+    report->changes = count_changes(size, changeset);
+    report->bytes = size;
+  }
+  report->seconds = elapsed_seconds(&start);
+
+  sqlite3_free(changeset);
+  return rc;
+}
+
+struct ConflictContext {
+  enum SyncConflictPolicy policy;
+  struct SyncReport *report;
+};
+
+// Resolve a conflict according to the chosen policy
+static int resolve_conflict(void *arg, int conflict,
+                            sqlite3_changeset_iter *iter) {
+  struct ConflictContext *context = arg;
+  const char *table;
+  int columns, op, indirect;
+
+  context->report->conflicts++;
+  sqlite3changeset_op(iter, &table, &columns, &op, &indirect);
+
+  if (context->policy == SYNC_ABORT) {
+    fprintf(stderr, "Conflict on %s, aborting\n", table);
+    return SQLITE_CHANGESET_ABORT;
+  }
+
+  // Only a differing or already present row can be overwritten; a missing
+  // row or a constraint failure can only be skipped
+  if (context->policy == SYNC_INCOMING_WINS &&
+      (conflict == SQLITE_CHANGESET_DATA ||
+       conflict == SQLITE_CHANGESET_CONFLICT)) {
+    context->report->replaced++;
+    return SQLITE_CHANGESET_REPLACE;
+  }
+
+  context->report->omitted++;
+  return SQLITE_CHANGESET_OMIT;
+}
+
+// Apply a changeset file to the database at target_path
+int apply_changeset(const char *target_path, const char *path,
+                    enum SyncConflictPolicy policy, struct SyncReport *report) {
+  struct ConflictContext context = {policy, report};
+  struct timespec start;
+  sqlite3 *target;
+
+  memset(report, 0, sizeof(*report));
+
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Can't open changeset file %s\n", path);
+    return SQLITE_CANTOPEN;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  void *changeset = malloc(size > 0 ? size : 1);
+  if (changeset == NULL ||
+      fread(changeset, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Can't read changeset file %s\n", path);
+    fclose(file);
+    free(changeset);
+    return SQLITE_IOERR;
+  }
+  fclose(file);
+
+  int rc = sqlite3_open_v2(target_path, &target, SQLITE_OPEN_READWRITE, NULL);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Can't open target database: %s\n",
+            sqlite3_errmsg(target));
+    sqlite3_close(target);
+    free(changeset);
+    return rc;
+  }
+  sqlite3_busy_timeout(target, 5000);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rc = sqlite3changeset_apply(target, (int)size, changeset, NULL,
+                              resolve_conflict, &context);
+  report->seconds = elapsed_seconds(&start);
+
+  if (rc == SQLITE_OK) {
+    report->changes = count_changes((int)size, changeset);
+    report->bytes = size;
+  } else {
+    fprintf(stderr, "Failed to apply changeset: %s\n", sqlite3_errstr(rc));
+  }
+
+  sqlite3_close(target);
+  free(changeset);
+  return rc;
+}
+
+// Print a sync summary with throughput
+void print_sync_report(const char *action, const struct SyncReport *report) {
+  double seconds = report->seconds > 0 ? report->seconds : 1e-9;
+
+  printf("%s %lld change(s), %lld bytes in %.3f s\n", action,
+         (long long)report->changes, (long long)report->bytes,
+         report->seconds);
+  printf("Throughput: %.0f changes/sec, %.2f MB/sec\n",
+         report->changes / seconds, report->bytes / seconds / 1e6);
+  if (report->conflicts > 0) {
+    printf("Conflicts: %lld (%lld replaced, %lld skipped)\n",
+           (long long)report->conflicts, (long long)report->replaced,
+           (long long)report->omitted);
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef SYNC_SYSTEM_H
+#define SYNC_SYSTEM_H
+
+#include <stdint.h>
+
+#include "sqlite3.h"
+
+// Changeset sync for branch offices. While capture is on, a session on each
+// writing connection records changes to customers, accounts and
+// transactions. Finished sessions are saved in the sync_pending table, so
+// they survive a restart. Exporting writes everything captured since the
+// previous export as one changeset file, which another database applies
+// with a conflict policy.
+
+enum SyncConflictPolicy {
+  SYNC_ABORT,          // roll the whole changeset back on any conflict
+  SYNC_INCOMING_WINS,  // overwrite local rows with the changeset's values
+  SYNC_LOCAL_WINS      // keep local rows, skip conflicting changes
+};
+
+struct SyncReport {
+  int64_t changes;
+  int64_t bytes;
+  int64_t conflicts;
+  int64_t replaced;
+  int64_t omitted;
+  double seconds;
+};
+
+int start_change_capture(sqlite3 *db);
+void stop_change_capture(void);
+int change_capture_enabled(void);
+int save_change_capture(void);
+int capture_connection(sqlite3 *db, sqlite3_session **session);
+void release_connection_capture(sqlite3 *db, sqlite3_session *session);
+int export_changeset(const char *path, struct SyncReport *report);
+int apply_changeset(const char *target_path, const char *path,
+                    enum SyncConflictPolicy policy, struct SyncReport *report);
+void print_sync_report(const char *action, const struct SyncReport *report);
+
+#endif
@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "change_log.h"
+#include "fraud_detector.h"
+#include "idempotency.h"
+#include "ledger_archive.h"
+#include "ledger_partitions.h"
+#include "limits_engine.h"
+#include "shard_system.h"
+#include "sqlite3.h"
+#include "transaction_system.h"
+#include "utils_functions.h"
+#include "uuid/uuid4.h"
+
+// Display transaction management menu
+void display_transaction_menu() {
+  printf("   1 Deposit Money\n");
+  printf("   2 Withdraw Money\n");
+  printf("   3 Transfer Money\n");
+  printf("   4 View Transaction History\n");
+}
+
+// Check whether transactions.account_number still has INTEGER affinity
+static int has_integer_account_column(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA table_info(transactions);", -1, &stmt,
+                         NULL) != SQLITE_OK) {
+    return 0;
+  }
+
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (strcmp((const char *)sqlite3_column_text(stmt, 1), "account_number") ==
+            0 &&
+        sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 2),
+                        "INTEGER") == 0) {
+      found = 1;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+  return found;
+}
+
+// Older databases declared account_number INTEGER, which stored account
+// numbers without their leading zeros and so could never match the TEXT key
+// in accounts once foreign keys are enforced. Rebuild the table with a TEXT
+// column, keeping rowids so rowid-ordered scans see the same order.
+static int migrate_account_column(sqlite3 *db) {
+  int rc = execute_sql(db, "PRAGMA legacy_alter_table = ON;");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  char sql[1024];
+  snprintf(sql, sizeof(sql),
+           "BEGIN IMMEDIATE;"
+           "CREATE TABLE transactions_migrated ("
+           "transaction_id TEXT PRIMARY KEY, "
+           "account_number TEXT, "
+           "date TEXT, "
+           "amount REAL, "
+           "type TEXT, "
+           "FOREIGN KEY(account_number) REFERENCES accounts(account_number));"
+           "INSERT INTO transactions_migrated (rowid, transaction_id, "
+           "account_number, date, amount, type) "
+           "SELECT rowid, transaction_id, "
+           "CASE WHEN typeof(account_number) = 'integer' "
+           "THEN printf('%%0%dd', account_number) ELSE account_number END, "
+           "date, amount, type FROM transactions;"
+           "DROP TABLE transactions;"
+           "ALTER TABLE transactions_migrated RENAME TO transactions;"
+           "COMMIT;",
+           ACCOUNT_NUMBER_LENGTH);
+
+  rc = execute_sql(db, sql);
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+  }
+
+  execute_sql(db, "PRAGMA legacy_alter_table = OFF;");
+  return rc;
+}
+
+// Create transactions table
+int create_transactions_table(sqlite3 *db) {
+  char *sql;
+
+  sql = "CREATE TABLE IF NOT EXISTS transactions ("
+        "transaction_id TEXT PRIMARY KEY, "
+        "account_number TEXT, "
+        "date TEXT, "
+        "amount REAL, "
+        "type TEXT, "
+        "FOREIGN KEY(account_number) REFERENCES accounts(account_number)); ";
+
+  int rc = execute_sql(db, sql);
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  if (has_integer_account_column(db)) {
+    rc = migrate_account_column(db);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  // Per-account scans (history, reconciliation) walk this index in order
+  rc = execute_sql(db, "CREATE INDEX IF NOT EXISTS idx_transactions_account "
+                       "ON transactions(account_number, date);");
+
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  return SQLITE_OK;
+}
+
+// Stage the change-log record for a ledger entry, with the balance it left
+static int stage_transaction_post(sqlite3 *db, const char *schema,
+                                  const char *transaction_id,
+                                  const char *account_number, double amount,
+                                  const char *type, const char *date) {
+  sqlite3_stmt *stmt;
+  char amount_text[32];
+  char balance_text[32] = "";
+
+  char *sql = sqlite3_mprintf(
+      "SELECT balance FROM \"%w\".accounts WHERE account_number = ?;", schema);
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    snprintf(balance_text, sizeof(balance_text), "%.2f",
+             sqlite3_column_double(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+
+  snprintf(amount_text, sizeof(amount_text), "%.2f", amount);
+
+  const char *fields[6] = {transaction_id, account_number, date,
+                           amount_text,    type,           balance_text};
+  return cdc_stage(db, CDC_TRANSACTION_POST, 6, fields);
+}
+
+// Append a ledger entry to the transactions table of the given schema:
+// "main", or an attached shard. The caller owns the surrounding transaction
+// and flushes the staged change-log record once it commits.
+int record_transaction_in(sqlite3 *db, const char *schema,
+                          const char *account_number, double amount,
+                          const char *type) {
+  sqlite3_stmt *stmt;
+  char transaction_id[UUID4_STR_BUFFER_SIZE];
+
+  char *sql = sqlite3_mprintf(
+      "INSERT INTO \"%w\".transactions (transaction_id, account_number, "
+      "date, amount, type) VALUES (?, ?, "
+      "strftime('%%Y-%%m-%%d %%H:%%M:%%S', 'now'), ?, ?) RETURNING date;",
+      schema);
+
+  generate_uuid_string(transaction_id, sizeof(transaction_id));
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, transaction_id, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, account_number, -1, SQLITE_STATIC);
+  sqlite3_bind_double(stmt, 3, amount);
+  sqlite3_bind_text(stmt, 4, type, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW && cdc_enabled()) {
+    int staged = stage_transaction_post(
+        db, schema, transaction_id, account_number, amount, type,
+        (const char *)sqlite3_column_text(stmt, 0));
+    if (staged != SQLITE_OK) {
+      sqlite3_finalize(stmt);
+      return staged;
+    }
+  }
+  if (rc == SQLITE_ROW) {
+    rc = sqlite3_step(stmt);
+  }
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Append a ledger entry to the bank database
+int record_transaction(sqlite3 *db, const char *account_number, double amount,
+                       const char *type) {
+  return record_transaction_in(db, "main", account_number, amount, type);
+}
+
+// Add a signed amount to an account balance in the given schema. A debit
+// may not take the balance below zero or, for accounts with an overdraft,
+// below minus the overdraft limit; a credit always applies, even to a
+// balance already below the floor.
+// Returns SQLITE_NOTFOUND for an unknown account and SQLITE_CONSTRAINT when
+// the account is closed or the funds are insufficient.
+int apply_balance_change_in(sqlite3 *db, const char *schema,
+                            const char *account_number, double amount) {
+  sqlite3_stmt *stmt;
+
+  char *sql = sqlite3_mprintf("UPDATE \"%w\".accounts "
+                              "SET balance = balance + ?1 "
+                              "WHERE account_number = ?2 "
+                              "AND (?1 >= 0 OR balance + ?1 >= ?3) "
+                              "AND closed_at IS NULL;",
+                              schema);
+
+  int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_double(stmt, 1, amount);
+  sqlite3_bind_text(stmt, 2, account_number, -1, SQLITE_STATIC);
+  sqlite3_bind_double(stmt, 3, limits_balance_floor(account_number));
+
+  rc = sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+    return rc;
+  }
+
+  if (sqlite3_changes(db) == 1) {
+    return SQLITE_OK;
+  }
+
+  // Nothing changed, find out whether the account exists and is open
+  char *check_sql = sqlite3_mprintf("SELECT COUNT(*), COUNT(closed_at) "
+                                    "FROM \"%w\".accounts "
+                                    "WHERE account_number = ?;",
+                                    schema);
+  rc = sqlite3_prepare_v2(db, check_sql, -1, &stmt, NULL);
+  sqlite3_free(check_sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare check statement: %s\n",
+            sqlite3_errmsg(db));
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+
+  int count = 0, closed = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int(stmt, 0);
+    closed = sqlite3_column_int(stmt, 1);
+  }
+  sqlite3_finalize(stmt);
+
+  if (count == 0) {
+    fprintf(stderr, "Account %s does not exist.\n", account_number);
+    return SQLITE_NOTFOUND;
+  }
+
+  if (closed) {
+    fprintf(stderr, "Account %s is closed.\n", account_number);
+    return SQLITE_CONSTRAINT;
+  }
+
+  fprintf(stderr, "Insufficient funds in account %s.\n", account_number);
+  return SQLITE_CONSTRAINT;
+}
+
+// Add a signed amount to an account balance in the bank database
+int apply_balance_change(sqlite3 *db, const char *account_number,
+                         double amount) {
+  return apply_balance_change_in(db, "main", account_number, amount);
+}
+
+// A posting in progress: what was claimed up front and must be given back
+// if it fails
+struct Posting {
+  const char *request_key;
+  const char *debit_account; // NULL for credits
+  double debit_amount;
+  int duplicate;
+  int entry_count; // ledger entries, passed to the fraud detector
+  const char *entry_accounts[2];
+  double entry_amounts[2];
+  const char *schemas[2]; // attached schemas written, NULL for main only
+};
+
+// Open the posting's write transaction. On a single database that is BEGIN
+// IMMEDIATE, which would lock every attached file too. A posting between
+// attached shards takes the write locks of just the files it changes, main
+// first and the shards in name order, so postings on other shards go on.
+static int begin_write(sqlite3 *db, const struct Posting *posting) {
+  const char *order[3] = {"main", posting->schemas[0], posting->schemas[1]};
+
+  if (posting->schemas[0] == NULL) {
+    return execute_sql(db, "BEGIN IMMEDIATE;");
+  }
+
+  if (order[2] != NULL && strcmp(order[1], order[2]) > 0) {
+    order[1] = posting->schemas[1];
+    order[2] = posting->schemas[0];
+  }
+
+  int rc = execute_sql(db, "BEGIN;");
+  for (int i = 0; rc == SQLITE_OK && i < 3; i++) {
+    if (order[i] == NULL || (i > 0 && strcmp(order[i], order[i - 1]) == 0)) {
+      continue;
+    }
+
+    // An update of no rows still takes the file's write lock
+    char *sql = sqlite3_mprintf(
+        "UPDATE \"%w\".accounts SET balance = balance WHERE 0;", order[i]);
+    rc = execute_sql(db, sql);
+    sqlite3_free(sql);
+  }
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+  }
+  return rc;
+}
+
+// Claim the request key and reserve the debit against the account's limits,
+// both in memory, before any SQL runs. The fraud windows are primed first if
+// this is the session's first posting.
+static int begin_posting(sqlite3 *db, struct Posting *posting) {
+  int rc;
+
+  fraud_prime_ledgers();
+
+  if (posting->request_key != NULL) {
+    rc = idempotency_claim(posting->request_key);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  rc = SQLITE_OK;
+  if (posting->debit_account != NULL) {
+    rc = limits_reserve_debit(posting->debit_account,
+                              posting->debit_amount);
+  }
+  if (rc == SQLITE_OK) {
+    rc = begin_write(db, posting);
+    if (rc != SQLITE_OK && posting->debit_account != NULL) {
+      limits_release_debit(posting->debit_account, posting->debit_amount);
+    }
+  }
+
+  if (rc != SQLITE_OK && posting->request_key != NULL) {
+    idempotency_release(posting->request_key);
+  }
+  return rc;
+}
+
+// Commit or roll back a posting opened by begin_posting(), then publish or
+// drop its change-log records. On failure the debit reservation is returned
+// and the request key released, unless the request turned out to be a
+// duplicate, so a failed request can be retried.
+static int finish_posting(sqlite3 *db, struct Posting *posting, int rc) {
+  if (rc == SQLITE_OK) {
+    rc = execute_sql(db, "COMMIT;");
+  }
+
+  if (rc != SQLITE_OK) {
+    execute_sql(db, "ROLLBACK;");
+    cdc_discard(db);
+    if (posting->debit_account != NULL) {
+      limits_release_debit(posting->debit_account, posting->debit_amount);
+    }
+    if (posting->request_key != NULL && !posting->duplicate) {
+      idempotency_release(posting->request_key);
+    }
+    return rc;
+  }
+
+  limits_flush_counters(db, 0);
+  rc = cdc_commit(db);
+
+  for (int i = 0; i < posting->entry_count; i++) {
+    fraud_observe_posting(posting->entry_accounts[i],
+                          posting->entry_amounts[i]);
+  }
+  return rc;
+}
+
+// Persist the request key with the posting; sets *duplicate when another
+// process already posted it
+static int record_request_key(sqlite3 *db, const char *request_key,
+                              int *duplicate) {
+  if (request_key == NULL) {
+    return SQLITE_OK;
+  }
+
+  int rc = idempotency_record(db, request_key);
+  *duplicate = rc == SQLITE_CONSTRAINT;
+  return rc;
+}
+
+// Apply one balance change and its ledger entry atomically. A non-NULL
+// request_key makes a retry of the same request a rejected no-op.
+static int post_single_entry(sqlite3 *db, const char *schema,
+                             const char *request_key,
+                             const char *account_number, double amount,
+                             const char *type) {
+  struct Posting posting = {request_key,
+                            amount < 0 ? account_number : NULL,
+                            -amount,
+                            0,
+                            1,
+                            {account_number},
+                            {amount},
+                            {NULL, NULL}};
+
+  int rc = begin_posting(db, &posting);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = apply_balance_change_in(db, schema, account_number, amount);
+  if (rc == SQLITE_OK) {
+    rc = record_transaction_in(db, schema, account_number, amount, type);
+  }
+  if (rc == SQLITE_OK) {
+    rc = record_request_key(db, request_key, &posting.duplicate);
+  }
+
+  return finish_posting(db, &posting, rc);
+}
+
+// Deposit money into an account held in the given schema
+int deposit_money_in(sqlite3 *db, const char *schema, const char *request_key,
+                     const char *account_number, double amount) {
+  if (amount <= 0) {
+    printf("Deposit amount must be positive.\n");
+    return SQLITE_MISUSE;
+  }
+
+  return post_single_entry(db, schema, request_key, account_number, amount,
+                           "deposit");
+}
+
+// Deposit money into an account
+int deposit_money(sqlite3 *db, const char *request_key,
+                  const char *account_number, double amount) {
+  return deposit_money_in(db, "main", request_key, account_number, amount);
+}
+
+// Withdraw money from an account held in the given schema
+int withdraw_money_in(sqlite3 *db, const char *schema,
+                      const char *request_key, const char *account_number,
+                      double amount) {
+  if (amount <= 0) {
+    printf("Withdrawal amount must be positive.\n");
+    return SQLITE_MISUSE;
+  }
+
+  return post_single_entry(db, schema, request_key, account_number, -amount,
+                           "withdrawal");
+}
+
+// Withdraw money from an account
+int withdraw_money(sqlite3 *db, const char *request_key,
+                   const char *account_number, double amount) {
+  return withdraw_money_in(db, "main", request_key, account_number, amount);
+}
+
+// Transfer money between two accounts in one transaction. Each account is
+// looked up in its own schema, so both sides of a transfer between shards
+// attached to db commit together; only main and those shards are locked.
+int transfer_money_in(sqlite3 *db, const char *request_key,
+                      const char *from_schema, const char *from_account,
+                      const char *to_schema, const char *to_account,
+                      double amount) {
+  struct Posting posting = {request_key,
+                            from_account,
+                            amount,
+                            0,
+                            2,
+                            {from_account, to_account},
+                            {-amount, amount},
+                            {NULL, NULL}};
+
+  if (amount <= 0) {
+    printf("Transfer amount must be positive.\n");
+    return SQLITE_MISUSE;
+  }
+
+  if (strcmp(from_account, to_account) == 0) {
+    printf("Cannot transfer to the same account.\n");
+    return SQLITE_MISUSE;
+  }
+
+  if (strcmp(from_schema, "main") != 0 || strcmp(to_schema, "main") != 0) {
+    posting.schemas[0] = from_schema;
+    posting.schemas[1] = to_schema;
+  }
+
+  int rc = begin_posting(db, &posting);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  rc = apply_balance_change_in(db, from_schema, from_account, -amount);
+  if (rc == SQLITE_OK) {
+    rc = apply_balance_change_in(db, to_schema, to_account, amount);
+  }
+  if (rc == SQLITE_OK) {
+    rc = record_transaction_in(db, from_schema, from_account, -amount,
+                               "transfer_out");
+  }
+  if (rc == SQLITE_OK) {
+    rc = record_transaction_in(db, to_schema, to_account, amount,
+                               "transfer_in");
+  }
+  if (rc == SQLITE_OK) {
+    rc = record_request_key(db, request_key, &posting.duplicate);
+  }
+
+  return finish_posting(db, &posting, rc);
+}
+
+// Transfer money between two accounts in one transaction
+int transfer_money(sqlite3 *db, const char *request_key,
+                   const char *from_account, const char *to_account,
+                   double amount) {
+  return transfer_money_in(db, request_key, "main", from_account, "main",
+                           to_account, amount);
+}
+
+// Print the transaction history of an account held in the given schema.
+// Only the main database archives old months: its compressed months come
+// from the ledger archive and are merged in by date.
+int get_transaction_history_in(sqlite3 *db, const char *schema,
+                               const char *account_number) {
+  sqlite3_stmt *stmt;
+  struct LedgerArchiveEntry *archived = NULL;
+  int archived_count = 0;
+  int next_archived = 0;
+  char *sql;
+  int rc = SQLITE_OK;
+
+  if (strcmp(schema, "main") == 0) {
+    rc = open_ledger_history(db);
+    if (rc == SQLITE_OK) {
+      rc = read_archived_history(db, account_number, &archived,
+                                 &archived_count);
+    }
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+
+    sql = sqlite3_mprintf("SELECT transaction_id, date, amount, type FROM %s "
+                          "WHERE account_number = ? ORDER BY date;",
+                          ledger_history_source(db));
+  } else {
+    sql = sqlite3_mprintf("SELECT transaction_id, date, amount, type "
+                          "FROM \"%w\".transactions "
+                          "WHERE account_number = ? ORDER BY date;",
+                          schema);
+  }
+
+  rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+    free(archived);
+    return rc;
+  }
+
+  sqlite3_bind_text(stmt, 1, account_number, -1, SQLITE_STATIC);
+
+  int transaction_count = 0;
+
+  printf("Transaction History for %s\n", account_number);
+  printf("-----------------------------------\n");
+
+  for (;;) {
+    const char *date = NULL;
+    if ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      date = (const char *)sqlite3_column_text(stmt, 1);
+      date = date != NULL ? date : "";
+    }
+
+    while (next_archived < archived_count &&
+           (date == NULL || strcmp(archived[next_archived].date, date) <= 0)) {
+      struct LedgerArchiveEntry *entry = &archived[next_archived++];
+      transaction_count++;
+      printf("%s  %-12s %12.2f  %s\n", entry->date, entry->type,
+             entry->cents / 100.0, entry->transaction_id);
+    }
+
+    if (date == NULL) {
+      break;
+    }
+    transaction_count++;
+    printf("%s  %-12s %12.2f  %s\n", date, sqlite3_column_text(stmt, 3),
+           sqlite3_column_double(stmt, 2), sqlite3_column_text(stmt, 0));
+  }
+
+  if (transaction_count == 0) {
+    printf("No transactions found.\n");
+  }
+
+  if (rc != SQLITE_DONE) {
+    fprintf(stderr, "Execution failed: %s\n", sqlite3_errmsg(db));
+  }
+
+  sqlite3_finalize(stmt);
+  free(archived);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+// Print the transaction history of an account, archived months included
+int get_transaction_history(sqlite3 *db, const char *account_number) {
+  return get_transaction_history_in(db, "main", account_number);
+}
+
+// Ask for an optional client reference used as the idempotency key
+static const char *read_request_reference(char *reference, int size) {
+  printf("Reference (blank for none)? ");
+  if (fgets(reference, size, stdin) == NULL) {
+    return NULL;
+  }
+  reference[strcspn(reference, "\n")] = '\0'; // Remove newline character
+  return reference[0] != '\0' ? reference : NULL;
+}
+
+// Transaction management menu logic
+void print_transaction_management_system(sqlite3 *db) {
+  clear_screen();
+  display_transaction_menu();
+
+  int choice;
+  int rc;
+  double amount;
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  char to_account[ACCOUNT_NUMBER_LENGTH + 1];
+  char reference[IDEMPOTENCY_KEY_MAX + 2];
+  const char *request_key;
+  struct ShardSet *shards = routed_shards();
+
+  printf("Your choice? ");
+  scanf("%d", &choice);
+  clear_input_buffer();
+
+  switch (choice) {
+  case 1:
+  case 2:
+    clear_screen();
+    printf("Account Number? ");
+    if (scanf("%10s", account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    printf("Amount? ");
+    if (scanf("%lf", &amount) != 1) {
+      printf("Invalid input for Amount.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    request_key = read_request_reference(reference, sizeof(reference));
+    if (shards != NULL) {
+      rc = choice == 1
+               ? shard_deposit(shards, request_key, account_number, amount)
+               : shard_withdraw(shards, request_key, account_number, amount);
+    } else {
+      rc = choice == 1
+               ? deposit_money(db, request_key, account_number, amount)
+               : withdraw_money(db, request_key, account_number, amount);
+    }
+    if (rc == SQLITE_OK) {
+      printf("Transaction completed successfully\n");
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 3:
+    clear_screen();
+    printf("From Account Number? ");
+    if (scanf("%10s", account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    printf("To Account Number? ");
+    if (scanf("%10s", to_account) != 1) {
+      printf("Invalid input for Account Number.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    printf("Amount? ");
+    if (scanf("%lf", &amount) != 1) {
+      printf("Invalid input for Amount.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    request_key = read_request_reference(reference, sizeof(reference));
+    rc = shards != NULL ? shard_transfer(shards, request_key, account_number,
+                                         to_account, amount)
+                        : transfer_money(db, request_key, account_number,
+                                         to_account, amount);
+    if (rc == SQLITE_OK) {
+      printf("Transfer completed successfully\n");
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  case 4:
+    clear_screen();
+    printf("Account Number? ");
+    if (scanf("%10s", account_number) != 1) {
+      printf("Invalid input for Account Number.\n");
+      break;
+    }
+    clear_input_buffer();
+
+    if (shards != NULL) {
+      shard_get_transaction_history(shards, account_number);
+    } else {
+      get_transaction_history(db, account_number);
+    }
+    printf("Press Enter to return to main menu...");
+    getchar(); // Wait for user to press Enter
+    break;
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef TRANSACTION_SYSTEM_H
+#define TRANSACTION_SYSTEM_H
+
+#include "gen_account_number.h"
+#include "sqlite3.h"
+
+// Ledger amounts are signed: credits are positive, debits are negative
+struct Transaction {
+  char transaction_id[38];
+  char account_number[ACCOUNT_NUMBER_LENGTH + 1];
+  char date[20];
+  double amount;
+  char type[13];
+};
+
+int create_transactions_table(sqlite3 *db);
+int record_transaction(sqlite3 *db, const char *account_number, double amount,
+                       const char *type);
+int apply_balance_change(sqlite3 *db, const char *account_number,
+                         double amount);
+int deposit_money(sqlite3 *db, const char *request_key,
+                  const char *account_number, double amount);
+int withdraw_money(sqlite3 *db, const char *request_key,
+                   const char *account_number, double amount);
+int transfer_money(sqlite3 *db, const char *request_key,
+                   const char *from_account, const char *to_account,
+                   double amount);
+
+// The same postings against accounts held in an attached schema (a shard).
+// Request keys, limits, fraud checks and change-log records still go
+// through db's main database, in the same transaction.
+int record_transaction_in(sqlite3 *db, const char *schema,
+                          const char *account_number, double amount,
+                          const char *type);
+int apply_balance_change_in(sqlite3 *db, const char *schema,
+                            const char *account_number, double amount);
+int deposit_money_in(sqlite3 *db, const char *schema, const char *request_key,
+                     const char *account_number, double amount);
+int withdraw_money_in(sqlite3 *db, const char *schema,
+                      const char *request_key, const char *account_number,
+                      double amount);
+int transfer_money_in(sqlite3 *db, const char *request_key,
+                      const char *from_schema, const char *from_account,
+                      const char *to_schema, const char *to_account,
+                      double amount);
+int get_transaction_history(sqlite3 *db, const char *account_number);
+int get_transaction_history_in(sqlite3 *db, const char *schema,
+                               const char *account_number);
+void print_transaction_management_system(sqlite3 *db);
+
+#endif
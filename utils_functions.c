@@ -49,3 +49,18 @@ int generate_uuid(struct Customer *customer) {
 
   return 1;
 }
+
+// Generate a uuid into a plain string buffer
+int generate_uuid_string(char *out, int capacity) {
+  UUID4_STATE_T state;
+  UUID4_T uuid;
+
+  uuid4_seed(&state);
+  uuid4_gen(&state, &uuid);
+
+  if (!uuid4_to_s(uuid, out, capacity)) {
+    return 0;
+  }
+
+  return 1;
+}
@@ -8,5 +8,6 @@ void clear_input_buffer();
 void clear_screen();
 int execute_sql(sqlite3 *db, char *sql);
 int generate_uuid(struct Customer *customer);
+int generate_uuid_string(char *out, int capacity);
 
 #endif
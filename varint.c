@@ -0,0 +1,34 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "varint.h"
+
+// Write value as an unsigned LEB128 varint and return the bytes used
+size_t varint_encode(uint64_t value, unsigned char *out) {
+  size_t length = 0;
+
+  while (value >= 0x80) {
+    out[length++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (unsigned char)value;
+
+  return length;
+}
+
+// Read one varint; returns the bytes consumed, or 0 if the input ends early
+// or the encoding is longer than a 64-bit value allows
+size_t varint_decode(const unsigned char *in, size_t available,
+                     uint64_t *value) {
+  uint64_t result = 0;
+
+  for (size_t i = 0; i < available && i < VARINT_MAX_BYTES; i++) {
+    result |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      *value = result;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest LEB128 encoding of a 64-bit value
+#define VARINT_MAX_BYTES 10
+
+size_t varint_encode(uint64_t value, unsigned char *out);
+size_t varint_decode(const unsigned char *in, size_t available,
+                     uint64_t *value);
+
+// Map signed values to unsigned so small magnitudes stay short
+static inline uint64_t zigzag_encode(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif